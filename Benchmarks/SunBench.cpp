@@ -0,0 +1,1391 @@
+#include "SunBench.h"
+#include "../SunScript.h"
+#include "../Sun.h"
+#include "../SunJIT.h"
+#include <string>
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <fstream>
+#include <filesystem>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <climits>
+
+using namespace SunScript;
+
+//===================
+// Allocation counting
+//===================
+
+static std::atomic<uint64_t> numAllocations;
+
+void* operator new(size_t size)
+{
+    numAllocations.fetch_add(1, std::memory_order_relaxed);
+    void* mem = std::malloc(size == 0 ? 1 : size);
+    if (!mem) { throw std::bad_alloc(); }
+    return mem;
+}
+
+void operator delete(void* mem) noexcept
+{
+    std::free(mem);
+}
+
+void operator delete(void* mem, size_t) noexcept
+{
+    std::free(mem);
+}
+
+//===================
+// Compiler benchmark
+//===================
+
+static std::string GenerateScript(int numLines, const std::string& prefix)
+{
+    std::stringstream ss;
+    int lines = 0;
+    int id = 0;
+    while (lines < numLines)
+    {
+        ss << "function " << prefix << id << "(x, y)" << std::endl;
+        ss << "{" << std::endl;
+        ss << "    var a = x + y * 2 - 1;" << std::endl;
+        ss << "    var b = 0;" << std::endl;
+        ss << "    for (var i = 0; i < 10; i++)" << std::endl;
+        ss << "    {" << std::endl;
+        ss << "        if (a > i && b < 100) { b += a; } else { b--; }" << std::endl;
+        ss << "    }" << std::endl;
+        ss << "    return b;" << std::endl;
+        ss << "}" << std::endl;
+        ss << "var r" << id << " = " << prefix << id << "(" << id << ", 2.5);" << std::endl;
+        lines += 11;
+        id++;
+    }
+    return ss.str();
+}
+
+static void BenchmarkCompile()
+{
+    const int numLines = 100000;
+    const int runCount = 5;
+    const std::string script = GenerateScript(numLines, "Func");
+
+    std::cout << "Compile benchmark: " << numLines << " lines, " << (script.size() / 1024) << "KB" << std::endl;
+
+    std::chrono::steady_clock clock;
+    std::chrono::steady_clock::duration bestTime = std::chrono::steady_clock::duration::max();
+    uint64_t allocations = 0;
+
+    for (int i = 0; i < runCount; i++)
+    {
+        unsigned char* programData = nullptr;
+        int programSize = 0;
+        std::string error;
+
+        const uint64_t startAllocations = numAllocations.load(std::memory_order_relaxed);
+        auto startTime = clock.now();
+        CompileText(script, &programData, nullptr, &programSize, nullptr, &error);
+        auto elapsedTime = clock.now() - startTime;
+        allocations = numAllocations.load(std::memory_order_relaxed) - startAllocations;
+
+        if (!programData)
+        {
+            std::cout << "Compile failed: " << error << std::endl;
+            return;
+        }
+
+        delete[] programData;
+
+        if (elapsedTime < bestTime)
+        {
+            bestTime = elapsedTime;
+        }
+    }
+
+    const double seconds = std::chrono::duration<double>(bestTime).count();
+    std::cout << "Time: " << std::chrono::duration_cast<std::chrono::microseconds>(bestTime).count() << "us" << std::endl;
+    std::cout << "Lines/sec: " << uint64_t(numLines / seconds) << std::endl;
+    std::cout << "Allocations/line: " << double(allocations) / numLines << std::endl;
+}
+
+static void BenchmarkBatchCompile()
+{
+    const int numFiles = 64;
+    const int numLines = 5000;
+
+    const std::filesystem::path dir = std::filesystem::temp_directory_path() / "SunBench";
+    std::filesystem::create_directories(dir);
+
+    std::vector<std::string> files;
+    for (int i = 0; i < numFiles; i++)
+    {
+        const std::filesystem::path path = dir / ("Module" + std::to_string(i) + ".txt");
+        std::ofstream stream(path);
+        stream << GenerateScript(numLines, "Module" + std::to_string(i) + "F");
+        files.push_back(path.string());
+    }
+
+    std::cout << "Batch compile benchmark: " << numFiles << " files, " << numLines << " lines each" << std::endl;
+
+    std::chrono::steady_clock clock;
+    const int maxThreads = std::max(1, int(std::thread::hardware_concurrency()));
+    for (int numThreads = 1; numThreads <= maxThreads; numThreads *= 2)
+    {
+        unsigned char* programData = nullptr;
+        int programSize = 0;
+        std::string error;
+
+        auto startTime = clock.now();
+        CompileFiles(files, numThreads, &programData, nullptr, &programSize, nullptr, &error);
+        auto elapsedTime = clock.now() - startTime;
+
+        if (!programData)
+        {
+            std::cout << "Compile failed: " << error << std::endl;
+            break;
+        }
+
+        delete[] programData;
+
+        std::cout << "Threads: " << numThreads << " Time: " << std::chrono::duration_cast<std::chrono::microseconds>(elapsedTime).count() << "us" << std::endl;
+    }
+
+    std::filesystem::remove_all(dir);
+}
+
+//===================
+// Hot swap benchmark
+//===================
+
+static std::string GenerateHotSwapScript(int scale)
+{
+    std::stringstream ss;
+    ss << "noinline function Scale(x)" << std::endl;
+    ss << "{" << std::endl;
+    ss << "    return x * " << scale << ";" << std::endl;
+    ss << "}" << std::endl;
+    ss << "function Work(n)" << std::endl;
+    ss << "{" << std::endl;
+    ss << "    var total = 0;" << std::endl;
+    ss << "    for (var i = 0; i < n; i++)" << std::endl;
+    ss << "    {" << std::endl;
+    ss << "        total = total + i;" << std::endl;
+    ss << "    }" << std::endl;
+    ss << "    return total;" << std::endl;
+    ss << "}" << std::endl;
+    ss << "Result(Scale(Work(1000)));" << std::endl;
+    return ss.str();
+}
+
+static int ResultHandler(VirtualMachine* vm)
+{
+    int* result = reinterpret_cast<int*>(GetUserData(vm));
+    return GetParamInt(vm, result);
+}
+
+static bool RunResultScript(VirtualMachine* vm, int runCount, int expected, std::chrono::steady_clock::duration* elapsedTime)
+{
+    std::chrono::steady_clock clock;
+    auto startTime = clock.now();
+    for (int i = 0; i < runCount; i++)
+    {
+        int* result = reinterpret_cast<int*>(GetUserData(vm));
+        *result = 0;
+        if (RunScript(vm) != VM_OK || *result != expected)
+        {
+            std::cout << "Run failed: expected " << expected << " but was " << *result << std::endl;
+            return false;
+        }
+    }
+    *elapsedTime = clock.now() - startTime;
+    return true;
+}
+
+static void BenchmarkHotSwap()
+{
+    const int runCount = 1000;
+    const int total = 999 * 1000 / 2;
+
+    unsigned char* programA = nullptr;
+    unsigned char* programB = nullptr;
+    int programSizeA = 0;
+    int programSizeB = 0;
+    std::string error;
+    CompileText(GenerateHotSwapScript(2), &programA, nullptr, &programSizeA, nullptr, &error);
+    CompileText(GenerateHotSwapScript(3), &programB, nullptr, &programSizeB, nullptr, &error);
+    if (!programA || !programB)
+    {
+        std::cout << "Compile failed: " << error << std::endl;
+        delete[] programA;
+        delete[] programB;
+        return;
+    }
+
+    std::cout << "Hot swap benchmark: " << runCount << " runs" << std::endl;
+
+    Jit jit;
+    JIT_Setup(&jit);
+
+    int result = 0;
+    std::chrono::steady_clock::duration elapsedTime;
+
+    // Warm up the original program then swap in the changed function.
+    VirtualMachine* vm = CreateVirtualMachine();
+    SetHandler(vm, ResultHandler);
+    SetUserData(vm, &result);
+    SetJIT(vm, &jit);
+    LoadProgram(vm, programA, programSizeA);
+    if (RunResultScript(vm, runCount, total * 2, &elapsedTime))
+    {
+        std::chrono::steady_clock clock;
+        int numChanged = 0;
+        auto startTime = clock.now();
+        const int status = HotSwapProgram(vm, programB, nullptr, programSizeB, &numChanged);
+        auto swapTime = clock.now() - startTime;
+
+        std::cout << "Swap: " << (status == VM_OK ? "OK" : "Error") << " Changed functions: " << numChanged
+            << " Time: " << std::chrono::duration_cast<std::chrono::microseconds>(swapTime).count() << "us" << std::endl;
+
+        if (status == VM_OK && RunResultScript(vm, runCount, total * 3, &elapsedTime))
+        {
+            std::cout << "After swap: " << std::chrono::duration_cast<std::chrono::microseconds>(elapsedTime).count() << "us" << std::endl;
+        }
+    }
+    ShutdownVirtualMachine(vm);
+
+    // Compare against loading the changed program into a fresh virtual machine.
+    vm = CreateVirtualMachine();
+    SetHandler(vm, ResultHandler);
+    SetUserData(vm, &result);
+    SetJIT(vm, &jit);
+    LoadProgram(vm, programB, programSizeB);
+    if (RunResultScript(vm, runCount, total * 3, &elapsedTime))
+    {
+        std::cout << "Fresh load: " << std::chrono::duration_cast<std::chrono::microseconds>(elapsedTime).count() << "us" << std::endl;
+    }
+    ShutdownVirtualMachine(vm);
+
+    delete[] programA;
+    delete[] programB;
+}
+
+//===================
+// Branch profile benchmark
+//===================
+
+static std::string GenerateBranchScript()
+{
+    std::stringstream ss;
+    ss << "noinline function Classify(x)" << std::endl;
+    ss << "{" << std::endl;
+    ss << "    if (x < 0)" << std::endl;
+    ss << "    {" << std::endl;
+    ss << "        var error = x * 2;" << std::endl;
+    ss << "        return error - 1;" << std::endl;
+    ss << "    }" << std::endl;
+    ss << "    if (x > 100 && x == 5)" << std::endl;
+    ss << "    {" << std::endl;
+    ss << "        return 0;" << std::endl;
+    ss << "    }" << std::endl;
+    ss << "    return x + 1;" << std::endl;
+    ss << "}" << std::endl;
+    ss << "var total = 0;" << std::endl;
+    ss << "for (var i = 0; i < 100; i++)" << std::endl;
+    ss << "{" << std::endl;
+    ss << "    total = total + Classify(i);" << std::endl;
+    ss << "}" << std::endl;
+    ss << "Result(total);" << std::endl;
+    return ss.str();
+}
+
+static void BenchmarkProfile()
+{
+    const int runCount = 1000;
+    const int total = 100 * 101 / 2;
+
+    unsigned char* program = nullptr;
+    unsigned char* debugData = nullptr;
+    int programSize = 0;
+    int debugSize = 0;
+    std::string error;
+    CompileText(GenerateBranchScript(), &program, &debugData, &programSize, &debugSize, &error);
+    if (!program)
+    {
+        std::cout << "Compile failed: " << error << std::endl;
+        return;
+    }
+
+    std::cout << "Branch profile benchmark: " << runCount << " runs" << std::endl;
+
+    int result = 0;
+    std::chrono::steady_clock::duration elapsedTime;
+    std::vector<BranchProfile> profile;
+
+    // Train on the program as compiled without a profile.
+    VirtualMachine* vm = CreateVirtualMachine();
+    SetHandler(vm, ResultHandler);
+    SetUserData(vm, &result);
+    LoadProgram(vm, program, debugData, programSize);
+    if (RunResultScript(vm, runCount, total, &elapsedTime))
+    {
+        std::cout << "Training: " << std::chrono::duration_cast<std::chrono::microseconds>(elapsedTime).count() << "us" << std::endl;
+        GetBranchProfile(vm, &profile);
+    }
+    ShutdownVirtualMachine(vm);
+
+    delete[] program;
+    delete[] debugData;
+
+    std::cout << "Branches profiled: " << profile.size() << std::endl;
+
+    // Rebuild with the profile and check the program still gives the same result.
+    SetBranchProfile(profile);
+    CompileText(GenerateBranchScript(), &program, &debugData, &programSize, &debugSize, &error);
+    SetBranchProfile(std::vector<BranchProfile>());
+    if (!program)
+    {
+        std::cout << "Compile failed: " << error << std::endl;
+        return;
+    }
+
+    vm = CreateVirtualMachine();
+    SetHandler(vm, ResultHandler);
+    SetUserData(vm, &result);
+    LoadProgram(vm, program, debugData, programSize);
+    if (RunResultScript(vm, runCount, total, &elapsedTime))
+    {
+        std::cout << "Profiled: " << std::chrono::duration_cast<std::chrono::microseconds>(elapsedTime).count() << "us" << std::endl;
+    }
+    ShutdownVirtualMachine(vm);
+
+    delete[] program;
+    delete[] debugData;
+}
+
+//===================
+// Inline benchmark
+//===================
+
+static int CountCallSites(unsigned char* programData)
+{
+    std::stringstream ss;
+    Disassemble(ss, programData, nullptr);
+
+    int count = 0;
+    std::string line;
+    while (std::getline(ss, line))
+    {
+        if (line.find("OP_CALL ") != std::string::npos) { count++; }
+    }
+    return count;
+}
+
+static void BenchmarkInline()
+{
+    const int numIterations = 10000;
+    const int runCount = 20;
+
+    std::stringstream ss;
+    ss << "function Add(a, b) { return a + b; }" << std::endl;
+    ss << "function Inc(x) { return x + 1; }" << std::endl;
+    ss << "function Twice(x) { return x * 2; }" << std::endl;
+    ss << "var total = 0;" << std::endl;
+    ss << "for (var i = 0; i < " << numIterations << "; i++)" << std::endl;
+    ss << "{" << std::endl;
+    ss << "    total = Add(total, Inc(Twice(i)));" << std::endl;
+    ss << "}" << std::endl;
+    ss << "Result(total);" << std::endl;
+
+    std::cout << "Inline benchmark: " << numIterations << " iterations, " << runCount << " runs" << std::endl;
+
+    const int threshold = GetInlineThreshold();
+    int callSites[2] = {};
+    for (int i = 0; i < 2; i++)
+    {
+        const bool inlined = i == 1;
+        SetInlineThreshold(inlined ? threshold : 0);
+
+        unsigned char* programData = nullptr;
+        int programSize = 0;
+        std::string error;
+        CompileText(ss.str(), &programData, nullptr, &programSize, nullptr, &error);
+        if (!programData)
+        {
+            std::cout << "Compile failed: " << error << std::endl;
+            break;
+        }
+
+        callSites[i] = CountCallSites(programData);
+
+        int result = 0;
+        VirtualMachine* vm = CreateVirtualMachine();
+        SetHandler(vm, ResultHandler);
+        SetUserData(vm, &result);
+        LoadProgram(vm, programData, programSize);
+
+        std::chrono::steady_clock::duration elapsedTime;
+        if (RunResultScript(vm, runCount, numIterations * numIterations, &elapsedTime))
+        {
+            std::cout << (inlined ? "Inlined: " : "Calls: ") << std::chrono::duration_cast<std::chrono::microseconds>(elapsedTime).count() << "us" << std::endl;
+        }
+
+        ShutdownVirtualMachine(vm);
+        delete[] programData;
+    }
+    SetInlineThreshold(threshold);
+
+    std::cout << "Call sites inlined: " << (callSites[0] - callSites[1])
+        << " Frames avoided/run: " << (callSites[0] - callSites[1]) * numIterations << std::endl;
+}
+
+//===================
+// Operator benchmark
+//===================
+
+static void BenchmarkOperators()
+{
+    const int numIterations = 10000;
+    const int runCount = 20;
+    const int operatorsPerIteration = 14;
+
+    // The operands change type from call to call, so every operator goes through the generic dispatch.
+    std::stringstream ss;
+    ss << "noinline function Mix(a, b) { return (a + b) * b - a / b; }" << std::endl;
+    ss << "noinline function Join(a, b) { return a + b; }" << std::endl;
+    ss << "for (var i = 0; i < " << numIterations << "; i++)" << std::endl;
+    ss << "{" << std::endl;
+    ss << "    Mix(i, 2);" << std::endl;
+    ss << "    Mix(i, 0.5);" << std::endl;
+    ss << "    Mix(0.25, 0.5);" << std::endl;
+    ss << "    Join(\"n\", i);" << std::endl;
+    ss << "    Join(0.5, \"r\");" << std::endl;
+    ss << "}" << std::endl;
+    ss << "Result(Mix(6, 2));" << std::endl;
+
+    unsigned char* programData = nullptr;
+    int programSize = 0;
+    std::string error;
+    CompileText(ss.str(), &programData, nullptr, &programSize, nullptr, &error);
+    if (!programData)
+    {
+        std::cout << "Compile failed: " << error << std::endl;
+        return;
+    }
+
+    std::cout << "Operator benchmark: " << numIterations << " iterations, " << runCount << " runs" << std::endl;
+
+    int result = 0;
+    VirtualMachine* vm = CreateVirtualMachine();
+    SetHandler(vm, ResultHandler);
+    SetUserData(vm, &result);
+    LoadProgram(vm, programData, programSize);
+
+    std::chrono::steady_clock::duration elapsedTime;
+    if (RunResultScript(vm, runCount, 13, &elapsedTime))
+    {
+        const auto us = std::chrono::duration_cast<std::chrono::microseconds>(elapsedTime).count();
+        const double numOperators = double(operatorsPerIteration) * numIterations * runCount;
+        std::cout << "Time: " << us << "us Operators/sec: " << int64_t(numOperators * 1000000.0 / std::max<int64_t>(us, 1)) << std::endl;
+    }
+
+    ShutdownVirtualMachine(vm);
+    delete[] programData;
+}
+
+//===================
+// Math benchmark
+//===================
+
+static std::string GenerateMathScript(int numIterations, bool intrinsics)
+{
+    // Host functions are capitalised so they go through the handler rather than the intrinsics.
+    const char* sqrtName = intrinsics ? "sqrt" : "Sqrt";
+    const char* absName = intrinsics ? "abs" : "Abs";
+    const char* minName = intrinsics ? "min" : "Min";
+    const char* maxName = intrinsics ? "max" : "Max";
+    const char* floorName = intrinsics ? "floor" : "Floor";
+    const char* sinName = intrinsics ? "sin" : "Sin";
+
+    std::stringstream ss;
+    ss << "var total = 0.0;" << std::endl;
+    ss << "for (var i = 0; i < " << numIterations << "; i++)" << std::endl;
+    ss << "{" << std::endl;
+    ss << "    total = total + " << sqrtName << "(i) + " << absName << "(0.5 - i) + " << minName << "(i, 50) + "
+        << maxName << "(0.25 * i, 2.0) + " << floorName << "(0.5 * i) + " << sinName << "(0.001 * i);" << std::endl;
+    ss << "}" << std::endl;
+    ss << "Result(total);" << std::endl;
+    return ss.str();
+}
+
+static bool GetParamNumber(VirtualMachine* vm, real* value, bool* isInt)
+{
+    int intValue = 0;
+    *isInt = GetParamInt(vm, &intValue) == VM_OK;
+    if (*isInt)
+    {
+        *value = intValue;
+        return true;
+    }
+    return GetParamReal(vm, value) == VM_OK;
+}
+
+static int MathHandler(VirtualMachine* vm)
+{
+    std::string name;
+    GetCallName(vm, &name);
+
+    real a = 0.0, b = 0.0;
+    bool aInt = false, bInt = false;
+    if (!GetParamNumber(vm, &a, &aInt))
+    {
+        return VM_ERROR;
+    }
+
+    if (name == "Result")
+    {
+        *reinterpret_cast<real*>(GetUserData(vm)) = a;
+    }
+    else if (name == "Sqrt") { PushReturnValue(vm, std::sqrt(a)); }
+    else if (name == "Sin") { PushReturnValue(vm, std::sin(a)); }
+    else if (name == "Abs")
+    {
+        if (aInt) { PushReturnValue(vm, int(std::abs(a))); }
+        else { PushReturnValue(vm, std::abs(a)); }
+    }
+    else if (name == "Floor")
+    {
+        if (aInt) { PushReturnValue(vm, int(a)); }
+        else { PushReturnValue(vm, std::floor(a)); }
+    }
+    else if (name == "Min" || name == "Max")
+    {
+        if (!GetParamNumber(vm, &b, &bInt))
+        {
+            return VM_ERROR;
+        }
+        const real value = name == "Min" ? std::min(a, b) : std::max(a, b);
+        if (aInt && bInt) { PushReturnValue(vm, int(value)); }
+        else { PushReturnValue(vm, value); }
+    }
+    else
+    {
+        return VM_ERROR;
+    }
+    return VM_OK;
+}
+
+static void BenchmarkMath()
+{
+    const int numIterations = 10000;
+    const int runCount = 20;
+
+    real expected = 0.0;
+    for (int i = 0; i < numIterations; i++)
+    {
+        expected = expected + std::sqrt(real(i)) + std::abs(0.5 - i) + std::min(i, 50) +
+            std::max(0.25 * i, 2.0) + std::floor(0.5 * i) + std::sin(0.001 * i);
+    }
+
+    std::cout << "Math benchmark: " << numIterations << " iterations, " << runCount << " runs" << std::endl;
+
+    Jit jit;
+    JIT_Setup(&jit);
+
+    for (int variant = 0; variant < 2; variant++)
+    {
+        const bool intrinsics = variant == 1;
+
+        unsigned char* programData = nullptr;
+        int programSize = 0;
+        std::string error;
+        CompileText(GenerateMathScript(numIterations, intrinsics), &programData, nullptr, &programSize, nullptr, &error);
+        if (!programData)
+        {
+            std::cout << "Compile failed: " << error << std::endl;
+            return;
+        }
+
+        for (int useJit = 0; useJit < 2; useJit++)
+        {
+            real result = 0.0;
+            VirtualMachine* vm = CreateVirtualMachine();
+            SetHandler(vm, MathHandler);
+            SetUserData(vm, &result);
+            if (useJit) { SetJIT(vm, &jit); }
+            LoadProgram(vm, programData, programSize);
+
+            std::chrono::steady_clock clock;
+            auto startTime = clock.now();
+            bool ok = true;
+            for (int i = 0; i < runCount && ok; i++)
+            {
+                result = 0.0;
+                ok = RunScript(vm) == VM_OK && result == expected;
+            }
+            auto elapsedTime = clock.now() - startTime;
+
+            std::cout << (intrinsics ? "Intrinsics" : "Handler") << (useJit ? " (JIT): " : " (interpreter): ");
+            if (ok)
+            {
+                std::cout << std::chrono::duration_cast<std::chrono::microseconds>(elapsedTime).count() << "us" << std::endl;
+            }
+            else
+            {
+                std::cout << "Run failed: expected " << expected << " but was " << result << std::endl;
+            }
+
+            ShutdownVirtualMachine(vm);
+        }
+
+        delete[] programData;
+    }
+}
+
+//===================
+// Code cache benchmark
+//===================
+
+static std::string GenerateCodeCacheScript(int numLoops, int iterations, int scale)
+{
+    std::stringstream ss;
+    ss << "var total = 0;" << std::endl;
+    for (int i = 0; i < numLoops; i++)
+    {
+        ss << "for (var i" << i << " = 0; i" << i << " < " << iterations << "; i" << i << "++)" << std::endl;
+        ss << "{" << std::endl;
+        ss << "    total = total + i" << i << " * " << (scale + i) << ";" << std::endl;
+        ss << "}" << std::endl;
+    }
+    ss << "Result(total);" << std::endl;
+    return ss.str();
+}
+
+static void BenchmarkCodeCache()
+{
+    const int numLoops = 8;
+    const int iterations = 3000;
+    const int numPrograms = 4;
+    const int numReloads = 50;
+
+    std::vector<unsigned char*> programs(numPrograms);
+    std::vector<int> programSizes(numPrograms);
+    std::vector<int> expected(numPrograms);
+    for (int i = 0; i < numPrograms; i++)
+    {
+        std::string error;
+        CompileText(GenerateCodeCacheScript(numLoops, iterations, i + 1), &programs[i], nullptr, &programSizes[i], nullptr, &error);
+        if (!programs[i])
+        {
+            std::cout << "Compile failed: " << error << std::endl;
+            for (auto program : programs) { delete[] program; }
+            return;
+        }
+
+        expected[i] = 0;
+        for (int j = 0; j < numLoops; j++)
+        {
+            expected[i] += (iterations - 1) * iterations / 2 * (i + 1 + j);
+        }
+    }
+
+    std::cout << "Code cache benchmark: " << numLoops << " loops, " << numReloads << " reloads" << std::endl;
+
+    Jit jit;
+    JIT_Setup(&jit);
+
+    // Each reload frees the traces of the last program, so the cache should settle rather than grow.
+    int result = 0;
+    VirtualMachine* vm = CreateVirtualMachine();
+    SetHandler(vm, ResultHandler);
+    SetUserData(vm, &result);
+    SetJIT(vm, &jit);
+
+    JitStats peak;
+    std::chrono::steady_clock clock;
+    auto startTime = clock.now();
+    bool ok = true;
+    for (int i = 0; i < numReloads && ok; i++)
+    {
+        const int index = i % numPrograms;
+        LoadProgram(vm, programs[index], programSizes[index]);
+        result = 0;
+        ok = RunScript(vm) == VM_OK && result == expected[index];
+        if (!ok)
+        {
+            std::cout << "Run failed: expected " << expected[index] << " but was " << result << std::endl;
+        }
+
+        JitStats stats;
+        if (GetJitStats(vm, &stats) == VM_OK && stats.reserved >= peak.reserved)
+        {
+            peak = stats;
+        }
+    }
+    auto elapsedTime = clock.now() - startTime;
+
+    if (ok)
+    {
+        JitStats stats;
+        GetJitStats(vm, &stats);
+        std::cout << "Time: " << std::chrono::duration_cast<std::chrono::microseconds>(elapsedTime).count() << "us" << std::endl;
+        std::cout << "Peak: " << peak.traces << " traces, " << peak.regions << " regions, "
+            << peak.reserved / 1024 << "KB reserved, " << peak.code / 1024 << "KB code, " << peak.constants << "B constants" << std::endl;
+        std::cout << "Final: " << stats.traces << " traces, " << stats.regions << " regions, "
+            << stats.reserved / 1024 << "KB reserved, " << stats.code / 1024 << "KB code, " << stats.constants << "B constants" << std::endl;
+    }
+
+    ShutdownVirtualMachine(vm);
+
+    for (auto program : programs)
+    {
+        delete[] program;
+    }
+}
+
+//===================
+// Background compile benchmark
+//===================
+
+static std::string GenerateStraightScript(int numStatements)
+{
+    std::stringstream ss;
+    ss << "var a = 0;" << std::endl;
+    ss << "var b = 0;" << std::endl;
+    for (int i = 0; i < numStatements; i++)
+    {
+        ss << "a = a + " << (i % 7 + 1) << ";" << std::endl;
+        ss << "b = b + a;" << std::endl;
+    }
+    ss << "Result(b);" << std::endl;
+    return ss.str();
+}
+
+static void BenchmarkBackgroundCompile()
+{
+    const int numStatements = 150;
+    const int runCount = 200;
+
+    int expected = 0;
+    for (int i = 0, a = 0; i < numStatements; i++)
+    {
+        a += i % 7 + 1;
+        expected += a;
+    }
+
+    unsigned char* programData = nullptr;
+    int programSize = 0;
+    std::string error;
+    CompileText(GenerateStraightScript(numStatements), &programData, nullptr, &programSize, nullptr, &error);
+    if (!programData)
+    {
+        std::cout << "Compile failed: " << error << std::endl;
+        return;
+    }
+
+    std::cout << "Background compile benchmark: " << numStatements << " statements, " << runCount << " runs" << std::endl;
+
+    Jit jit;
+    JIT_Setup(&jit);
+
+    // The slowest run is the one which compiles the script, unless compiling is left to the background.
+    // Each is repeated, keeping the best, so the slowest run isn't down to the thread being preempted.
+    const int repeatCount = 5;
+    for (int background = 0; background < 2; background++)
+    {
+        std::chrono::steady_clock::duration bestSlowest = std::chrono::steady_clock::duration::max();
+        std::chrono::steady_clock::duration bestTotal = std::chrono::steady_clock::duration::max();
+        bool ok = true;
+        for (int repeat = 0; repeat < repeatCount && ok; repeat++)
+        {
+            int result = 0;
+            VirtualMachine* vm = CreateVirtualMachine();
+            SetHandler(vm, ResultHandler);
+            SetUserData(vm, &result);
+            SetJIT(vm, &jit);
+
+            TraceTuning tuning;
+            GetTraceTuning(vm, &tuning);
+            tuning.maxPendingCompiles = background ? 4 : 0;
+            SetTraceTuning(vm, tuning);
+            LoadProgram(vm, programData, programSize);
+
+            std::chrono::steady_clock clock;
+            std::chrono::steady_clock::duration slowest = std::chrono::steady_clock::duration::zero();
+            std::chrono::steady_clock::duration total = std::chrono::steady_clock::duration::zero();
+            for (int i = 0; i < runCount && ok; i++)
+            {
+                result = 0;
+                auto startTime = clock.now();
+                ok = RunScript(vm) == VM_OK && result == expected;
+                auto elapsedTime = clock.now() - startTime;
+                slowest = std::max(slowest, elapsedTime);
+                total += elapsedTime;
+            }
+            bestSlowest = std::min(bestSlowest, slowest);
+            bestTotal = std::min(bestTotal, total);
+
+            ShutdownVirtualMachine(vm);
+            if (!ok)
+            {
+                std::cout << "Run failed: expected " << expected << " but was " << result << std::endl;
+            }
+        }
+
+        if (ok)
+        {
+            std::cout << (background ? "Background: " : "Synchronous: ")
+                << "total " << std::chrono::duration_cast<std::chrono::microseconds>(bestTotal).count() << "us"
+                << " slowest run " << std::chrono::duration_cast<std::chrono::microseconds>(bestSlowest).count() << "us" << std::endl;
+        }
+    }
+
+    delete[] programData;
+}
+
+//===================
+// Side trace benchmark
+//===================
+
+static std::string GenerateSideTraceScript(int iterations)
+{
+    std::stringstream ss;
+    ss << "var flip = 0;" << std::endl;
+    ss << "var even = 0;" << std::endl;
+    ss << "var odd = 0;" << std::endl;
+    ss << "for (var i = 0; i < " << iterations << "; i++)" << std::endl;
+    ss << "{" << std::endl;
+    ss << "    if (flip == 0)" << std::endl;
+    ss << "    {" << std::endl;
+    ss << "        even = even + 1;" << std::endl;
+    ss << "        flip = 1;" << std::endl;
+    ss << "    }" << std::endl;
+    ss << "    else" << std::endl;
+    ss << "    {" << std::endl;
+    ss << "        odd = odd + 2;" << std::endl;
+    ss << "        flip = 0;" << std::endl;
+    ss << "    }" << std::endl;
+    ss << "}" << std::endl;
+    ss << "Result(even + odd);" << std::endl;
+    return ss.str();
+}
+
+static void BenchmarkSideTrace()
+{
+    const int iterations = 20000;
+    const int runCount = 20;
+    const int expected = iterations / 2 + iterations;
+
+    unsigned char* programData = nullptr;
+    int programSize = 0;
+    std::string error;
+    CompileText(GenerateSideTraceScript(iterations), &programData, nullptr, &programSize, nullptr, &error);
+    if (!programData)
+    {
+        std::cout << "Compile failed: " << error << std::endl;
+        return;
+    }
+
+    std::cout << "Side trace benchmark: " << iterations << " iterations, " << runCount << " runs" << std::endl;
+
+    Jit jit;
+    JIT_Setup(&jit);
+
+    // Half the iterations leave the loop's trace by the same guard, unless that guard is given a side trace.
+    for (int side = 0; side < 2; side++)
+    {
+        int result = 0;
+        VirtualMachine* vm = CreateVirtualMachine();
+        SetHandler(vm, ResultHandler);
+        SetUserData(vm, &result);
+        SetJIT(vm, &jit);
+
+        TraceTuning tuning;
+        GetTraceTuning(vm, &tuning);
+        if (!side)
+        {
+            tuning.hotExits = INT_MAX;
+        }
+        SetTraceTuning(vm, tuning);
+        LoadProgram(vm, programData, programSize);
+
+        std::chrono::steady_clock::duration elapsedTime;
+        if (RunResultScript(vm, runCount, expected, &elapsedTime))
+        {
+            std::cout << (side ? "Side traces: " : "Guard exits: ")
+                << std::chrono::duration_cast<std::chrono::microseconds>(elapsedTime).count() << "us" << std::endl;
+        }
+        ShutdownVirtualMachine(vm);
+    }
+
+    delete[] programData;
+}
+
+//===================
+// Trace chaining benchmark
+//===================
+
+static std::string GenerateAdjacentLoopsScript(int numLoops, int iterations)
+{
+    std::stringstream ss;
+    ss << "var total = 0;" << std::endl;
+    for (int i = 0; i < numLoops; i++)
+    {
+        ss << "for (var i" << i << " = 0; i" << i << " < " << iterations << "; i" << i << "++)" << std::endl;
+        ss << "{" << std::endl;
+        ss << "    total = total + " << (i + 1) << ";" << std::endl;
+        ss << "}" << std::endl;
+    }
+    ss << "Result(total);" << std::endl;
+    return ss.str();
+}
+
+static void BenchmarkChain()
+{
+    const int numLoops = 16;
+    const int iterations = 20;
+    const int runCount = 20000;
+    const int expected = iterations * numLoops * (numLoops + 1) / 2;
+
+    unsigned char* programData = nullptr;
+    int programSize = 0;
+    std::string error;
+    CompileText(GenerateAdjacentLoopsScript(numLoops, iterations), &programData, nullptr, &programSize, nullptr, &error);
+    if (!programData)
+    {
+        std::cout << "Compile failed: " << error << std::endl;
+        return;
+    }
+
+    std::cout << "Trace chaining benchmark: " << numLoops << " loops, " << runCount << " runs" << std::endl;
+
+    Jit jit;
+    JIT_Setup(&jit);
+
+    // Each loop's trace either returns to the VM, which enters the next, or jumps straight into it.
+    for (int chain = 0; chain < 2; chain++)
+    {
+        int result = 0;
+        VirtualMachine* vm = CreateVirtualMachine();
+        SetHandler(vm, ResultHandler);
+        SetUserData(vm, &result);
+        SetJIT(vm, &jit);
+
+        TraceTuning tuning;
+        GetTraceTuning(vm, &tuning);
+        tuning.chainTraces = chain != 0;
+        SetTraceTuning(vm, tuning);
+        LoadProgram(vm, programData, programSize);
+
+        std::chrono::steady_clock::duration elapsedTime;
+        if (RunResultScript(vm, runCount, expected, &elapsedTime))
+        {
+            std::cout << (chain ? "Chained: " : "Through the VM: ")
+                << std::chrono::duration_cast<std::chrono::microseconds>(elapsedTime).count() << "us" << std::endl;
+        }
+        ShutdownVirtualMachine(vm);
+    }
+
+    delete[] programData;
+}
+
+//===================
+// Recursion benchmark
+//===================
+
+static void BenchmarkRecursion()
+{
+    // The same script as bench.py, to compare against Python.
+    const std::string script =
+        "function factorial(x) {\n"
+        "    if (x == 1) { return 1; }\n"
+        "    return x * factorial(x - 1);\n"
+        "}\n"
+        "var x = factorial(5);\n"
+        "x = factorial(5) + factorial(5) + factorial(5);\n"
+        "Result(x);\n";
+    const int runCount = 10000;
+
+    unsigned char* programData = nullptr;
+    int programSize = 0;
+    std::string error;
+    CompileText(script, &programData, nullptr, &programSize, nullptr, &error);
+    if (!programData)
+    {
+        std::cout << "Compile failed: " << error << std::endl;
+        return;
+    }
+
+    std::cout << "Recursion benchmark: factorial, " << runCount << " runs" << std::endl;
+
+    Jit jit;
+    JIT_Setup(&jit);
+
+    // A trace either gives up at the recursive call, or unrolls it.
+    for (int unroll = 0; unroll < 2; unroll++)
+    {
+        int result = 0;
+        VirtualMachine* vm = CreateVirtualMachine();
+        SetHandler(vm, ResultHandler);
+        SetUserData(vm, &result);
+        SetJIT(vm, &jit);
+
+        TraceTuning tuning;
+        GetTraceTuning(vm, &tuning);
+        if (!unroll)
+        {
+            tuning.maxRecursion = 1;
+        }
+        SetTraceTuning(vm, tuning);
+        LoadProgram(vm, programData, programSize);
+
+        std::chrono::steady_clock::duration elapsedTime;
+        if (RunResultScript(vm, runCount, 360, &elapsedTime))
+        {
+            std::cout << (unroll ? "Unrolled: " : "Not traced: ")
+                << std::chrono::duration_cast<std::chrono::microseconds>(elapsedTime).count() << "us ("
+                << std::chrono::duration_cast<std::chrono::nanoseconds>(elapsedTime).count() / runCount << "ns per run)" << std::endl;
+        }
+        ShutdownVirtualMachine(vm);
+    }
+
+    delete[] programData;
+}
+
+//===================
+// Nested loop benchmark
+//===================
+
+static std::string GenerateNestedLoopScript(int rows, int columns)
+{
+    std::stringstream ss;
+    ss << "var total = 0;" << std::endl;
+    ss << "for (var i = 0; i < " << rows << "; i++)" << std::endl;
+    ss << "{" << std::endl;
+    ss << "    for (var j = 0; j < " << columns << "; j++)" << std::endl;
+    ss << "    {" << std::endl;
+    ss << "        total = total + 1;" << std::endl;
+    ss << "    }" << std::endl;
+    ss << "    total = total + 2;" << std::endl;
+    ss << "}" << std::endl;
+    ss << "Result(total);" << std::endl;
+    return ss.str();
+}
+
+static void BenchmarkNestedLoop()
+{
+    const int rows = 2000;
+    const int columns = 8;
+    const int runCount = 2000;
+    const int expected = rows * (columns + 2);
+
+    unsigned char* programData = nullptr;
+    int programSize = 0;
+    std::string error;
+    CompileText(GenerateNestedLoopScript(rows, columns), &programData, nullptr, &programSize, nullptr, &error);
+    if (!programData)
+    {
+        std::cout << "Compile failed: " << error << std::endl;
+        return;
+    }
+
+    std::cout << "Nested loop benchmark: " << rows << "x" << columns << " iterations, " << runCount << " runs" << std::endl;
+
+    Jit jit;
+    JIT_Setup(&jit);
+
+    // The inner loop's trace is left once per row, unless its exit is given a side trace around the outer loop.
+    for (int side = 0; side < 2; side++)
+    {
+        int result = 0;
+        VirtualMachine* vm = CreateVirtualMachine();
+        SetHandler(vm, ResultHandler);
+        SetUserData(vm, &result);
+        SetJIT(vm, &jit);
+
+        TraceTuning tuning;
+        GetTraceTuning(vm, &tuning);
+        if (!side)
+        {
+            tuning.hotExits = INT_MAX;
+        }
+        SetTraceTuning(vm, tuning);
+        LoadProgram(vm, programData, programSize);
+
+        std::chrono::steady_clock::duration elapsedTime;
+        if (RunResultScript(vm, runCount, expected, &elapsedTime))
+        {
+            std::cout << (side ? "Outer loop linked: " : "Inner loop only: ")
+                << std::chrono::duration_cast<std::chrono::microseconds>(elapsedTime).count() << "us" << std::endl;
+        }
+        ShutdownVirtualMachine(vm);
+    }
+
+    delete[] programData;
+}
+
+//===================
+// Method benchmark
+//===================
+
+static std::string GenerateMethodScript(int numIterations)
+{
+    std::stringstream ss;
+    ss << "class Vector2" << std::endl;
+    ss << "{" << std::endl;
+    ss << "    Vector2(x, y) { self.x = x; self.y = y; }" << std::endl;
+    ss << "    function add(vec) { self.x += vec.x; self.y += vec.y; }" << std::endl;
+    ss << "}" << std::endl;
+    ss << "var pos = new Vector2(0.0, 0.0);" << std::endl;
+    ss << "var vel = new Vector2(0.5, 0.25);" << std::endl;
+    ss << "var steps = 0;" << std::endl;
+    ss << "for (var i = 0; i < " << numIterations << "; i++)" << std::endl;
+    ss << "{" << std::endl;
+    ss << "    pos.add(vel);" << std::endl;
+    ss << "    if (pos.y > 1.0) { steps = steps + 1; }" << std::endl;
+    ss << "}" << std::endl;
+    ss << "Result(steps);" << std::endl;
+    return ss.str();
+}
+
+static void BenchmarkMethod()
+{
+    const int numIterations = 5000;
+    const int runCount = 200;
+    const int expected = numIterations - 4;
+
+    unsigned char* programData = nullptr;
+    int programSize = 0;
+    std::string error;
+    CompileText(GenerateMethodScript(numIterations), &programData, nullptr, &programSize, nullptr, &error);
+    if (!programData)
+    {
+        std::cout << "Compile failed: " << error << std::endl;
+        return;
+    }
+
+    std::cout << "Method benchmark: " << numIterations << " iterations, " << runCount << " runs" << std::endl;
+
+    Jit jit;
+    JIT_Setup(&jit);
+
+    // The method called is inlined into the loop's trace.
+    for (int traced = 0; traced < 2; traced++)
+    {
+        int result = 0;
+        VirtualMachine* vm = CreateVirtualMachine();
+        SetHandler(vm, ResultHandler);
+        SetUserData(vm, &result);
+        if (traced)
+        {
+            SetJIT(vm, &jit);
+        }
+        LoadProgram(vm, programData, programSize);
+
+        std::chrono::steady_clock::duration elapsedTime;
+        if (RunResultScript(vm, runCount, expected, &elapsedTime))
+        {
+            std::cout << (traced ? "Traced: " : "Interpreted: ")
+                << std::chrono::duration_cast<std::chrono::microseconds>(elapsedTime).count() << "us" << std::endl;
+        }
+        ShutdownVirtualMachine(vm);
+    }
+
+    delete[] programData;
+}
+
+//===================
+// Optimizer benchmark
+//===================
+
+static std::string GenerateOptimizeScript(int numIterations)
+{
+    // Constants far apart in the trace, identities, values computed twice and a repeated guard.
+    std::stringstream ss;
+    ss << "var total = 0;" << std::endl;
+    ss << "for (var i = 0; i < " << numIterations << "; i++)" << std::endl;
+    ss << "{" << std::endl;
+    ss << "    var k = 4;" << std::endl;
+    ss << "    var s = 0;" << std::endl;
+    for (int i = 0; i < 24; i++)
+    {
+        ss << "    s += i * 1 + 0;" << std::endl;
+    }
+    ss << "    var a = i * 3 + k * 2;" << std::endl;
+    ss << "    var b = i * 3 + k * 2;" << std::endl;
+    ss << "    if (i < " << numIterations << ") { total = total + s + a - b - i * 24; }" << std::endl;
+    ss << "    if (i < " << numIterations << ") { total = total + k - 3; }" << std::endl;
+    ss << "}" << std::endl;
+    ss << "Result(total);" << std::endl;
+    return ss.str();
+}
+
+static void PrintOptimizerPass(const char* name, const OptimizerPass& pass)
+{
+    std::cout << "  " << name << ": " << pass.removed << " removed, "
+        << std::chrono::duration_cast<std::chrono::microseconds>(pass.time).count() << "us" << std::endl;
+}
+
+static void BenchmarkOptimize()
+{
+    const int numIterations = 5000;
+    const int runCount = 200;
+    const int expected = numIterations;
+
+    unsigned char* programData = nullptr;
+    int programSize = 0;
+    std::string error;
+    CompileText(GenerateOptimizeScript(numIterations), &programData, nullptr, &programSize, nullptr, &error);
+    if (!programData)
+    {
+        std::cout << "Compile failed: " << error << std::endl;
+        return;
+    }
+
+    std::cout << "Optimizer benchmark: " << numIterations << " iterations, " << runCount << " runs" << std::endl;
+
+    Jit jit;
+    JIT_Setup(&jit);
+
+    // The trace as recorded and as optimized as a whole.
+    for (int level = 0; level < 2; level++)
+    {
+        int result = 0;
+        VirtualMachine* vm = CreateVirtualMachine();
+        SetHandler(vm, ResultHandler);
+        SetUserData(vm, &result);
+        SetJIT(vm, &jit);
+        SetOptimizationLevel(vm, level);
+        LoadProgram(vm, programData, programSize);
+
+        std::chrono::steady_clock::duration elapsedTime;
+        if (RunResultScript(vm, runCount, expected, &elapsedTime))
+        {
+            std::cout << (level ? "Optimized: " : "Unoptimized: ")
+                << std::chrono::duration_cast<std::chrono::microseconds>(elapsedTime).count() << "us" << std::endl;
+        }
+
+        if (level)
+        {
+            OptimizerStats stats;
+            GetOptimizerStats(vm, &stats);
+            std::cout << "Traces optimized: " << stats.traces << std::endl;
+            PrintOptimizerPass("Constant folding", stats.fold);
+            PrintOptimizerPass("Simplification", stats.simplify);
+            PrintOptimizerPass("Common subexpressions", stats.cse);
+            PrintOptimizerPass("Guards", stats.guards);
+            PrintOptimizerPass("Dead code", stats.dead);
+        }
+        ShutdownVirtualMachine(vm);
+    }
+
+    delete[] programData;
+}
+
+//===================
+
+void SunScript::RunBenchmarks(const std::string& name)
+{
+    bool found = false;
+
+    if (name.empty() || name == "compile")
+    {
+        BenchmarkCompile();
+        found = true;
+    }
+
+    if (name.empty() || name == "batch")
+    {
+        BenchmarkBatchCompile();
+        found = true;
+    }
+
+    if (name.empty() || name == "inline")
+    {
+        BenchmarkInline();
+        found = true;
+    }
+
+    if (name.empty() || name == "operators")
+    {
+        BenchmarkOperators();
+        found = true;
+    }
+
+    if (name.empty() || name == "hotswap")
+    {
+        BenchmarkHotSwap();
+        found = true;
+    }
+
+    if (name.empty() || name == "profile")
+    {
+        BenchmarkProfile();
+        found = true;
+    }
+
+    if (name.empty() || name == "math")
+    {
+        BenchmarkMath();
+        found = true;
+    }
+
+    if (name.empty() || name == "codecache")
+    {
+        BenchmarkCodeCache();
+        found = true;
+    }
+
+    if (name.empty() || name == "background")
+    {
+        BenchmarkBackgroundCompile();
+        found = true;
+    }
+
+    if (name.empty() || name == "sidetrace")
+    {
+        BenchmarkSideTrace();
+        found = true;
+    }
+
+    if (name.empty() || name == "chain")
+    {
+        BenchmarkChain();
+        found = true;
+    }
+
+    if (name.empty() || name == "recursion")
+    {
+        BenchmarkRecursion();
+        found = true;
+    }
+
+    if (name.empty() || name == "nested")
+    {
+        BenchmarkNestedLoop();
+        found = true;
+    }
+
+    if (name.empty() || name == "method")
+    {
+        BenchmarkMethod();
+        found = true;
+    }
+
+    if (name.empty() || name == "optimize")
+    {
+        BenchmarkOptimize();
+        found = true;
+    }
+
+    if (!found)
+    {
+        std::cout << "Unknown benchmark '" << name << "'." << std::endl;
+    }
+}
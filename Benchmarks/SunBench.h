@@ -0,0 +1,7 @@
+#pragma once
+#include <string>
+
+namespace SunScript
+{
+    void RunBenchmarks(const std::string& name);
+}
@@ -8,6 +8,13 @@
 #include <sstream>
 #include <stack>
 #include <filesystem>
+#include <string_view>
+#include <charconv>
+#include <type_traits>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <algorithm>
 #include <assert.h>
 
 using namespace SunScript;
@@ -59,6 +66,7 @@ enum class TokenType
     CLASS,
     NEW,
     SELF,
+    NOINLINE,
 
     // Reserved keywords
 
@@ -82,29 +90,147 @@ enum class TokenType
 class Token
 {
 public:
-    Token(TokenType type, const std::string& value, int line)
+    Token(TokenType type, std::string_view value, int line)
         :
-        _type(type),
-        _value(value),
-        _line(line)
+        _text(value.data()),
+        _length((unsigned int)value.size()),
+        _line((unsigned int)line),
+        _type((unsigned int)type)
     { }
 
-    inline TokenType Type() const { return _type; }
-    inline int Line() const { return _line; }
-    inline std::string String() const { return _value; }
-#if USE_SUN_FLOAT
-    inline real Number() const { return std::strtof(_value.c_str(), 0); }
-#else
-    inline real Number() const { return std::strtod(_value.c_str(), 0); }
-#endif
-    inline int Integer() const { return std::strtol(_value.c_str(), 0, 10); }
+    inline TokenType Type() const { return TokenType(_type); }
+    inline int Line() const { return int(_line); }
+    inline std::string String() const { return std::string(_text, _length); }
+    inline std::string_view View() const { return std::string_view(_text, _length); }
+    inline real Number() const
+    {
+        real value = 0;
+        std::from_chars(_text, _text + _length, value);
+        return value;
+    }
+    inline int Integer() const
+    {
+        int value = 0;
+        std::from_chars(_text, _text + _length, value);
+        return value;
+    }
 
 private:
-    TokenType _type;
-    std::string _value;
-    int _line;
+    // Packed into 16 bytes, the text is a view into the source buffer.
+    const char* _text;
+    unsigned int _length;
+    unsigned int _line : 24;
+    unsigned int _type : 8;
+};
+
+//====================
+// Keywords
+//====================
+
+struct Keyword
+{
+    std::string_view name;
+    TokenType token;
+};
+
+static constexpr Keyword Keywords[] = {
+    { "if", TokenType::IF },
+    { "else", TokenType::ELSE },
+    { "function", TokenType::FUNCTION },
+    { "var", TokenType::VAR },
+    { "yield", TokenType::YIELD },
+    { "return", TokenType::RETURN },
+    { "while", TokenType::WHILE },
+    { "for", TokenType::FOR },
+    { "class", TokenType::CLASS },
+    { "new", TokenType::NEW },
+    { "public", TokenType::PUBLIC },
+    { "private", TokenType::PRIVATE },
+    { "protected", TokenType::PROTECTED },
+    { "internal", TokenType::INTERNAL },
+    { "self", TokenType::SELF },
+    { "noinline", TokenType::NOINLINE },
+    { "this", TokenType::THIS },
+    { "base", TokenType::BASE },
+    { "throw", TokenType::THROW },
+    { "catch", TokenType::CATCH },
+    { "try", TokenType::TRY }
+};
+
+static constexpr int KEYWORD_TABLE_SIZE = 64;
+
+// Perfect hash over the keyword set, the length and the first/last characters
+// are enough to give each keyword its own slot.
+static constexpr unsigned int KeywordHash(std::string_view word)
+{
+    return (unsigned int)(word.size() + (unsigned char)word.front() + ((unsigned char)word.back() << 2)) & (KEYWORD_TABLE_SIZE - 1);
+}
+
+struct KeywordTable
+{
+    signed char slots[KEYWORD_TABLE_SIZE];
+    bool perfect;
+
+    constexpr KeywordTable() : slots(), perfect(true)
+    {
+        for (int i = 0; i < KEYWORD_TABLE_SIZE; i++) { slots[i] = -1; }
+        for (int i = 0; i < int(std::size(Keywords)); i++)
+        {
+            const unsigned int hash = KeywordHash(Keywords[i].name);
+            if (slots[hash] != -1) { perfect = false; }
+            slots[hash] = i;
+        }
+    }
+};
+
+static constexpr KeywordTable KeywordLookup;
+static_assert(KeywordLookup.perfect, "Keyword hash has collisions.");
+
+static bool FindKeyword(std::string_view word, TokenType* token)
+{
+    const int slot = KeywordLookup.slots[KeywordHash(word)];
+    if (slot != -1 && Keywords[slot].name == word)
+    {
+        *token = Keywords[slot].token;
+        return true;
+    }
+    return false;
+}
+
+//====================
+// Intrinsics
+//====================
+
+struct Intrinsic
+{
+    std::string_view name;
+    unsigned char fn;
+};
+
+// Built-in math functions compiled to OP_MATH rather than a call.
+static constexpr Intrinsic Intrinsics[] = {
+    { "sqrt", MATH_SQRT },
+    { "sin", MATH_SIN },
+    { "cos", MATH_COS },
+    { "abs", MATH_ABS },
+    { "floor", MATH_FLOOR },
+    { "min", MATH_MIN },
+    { "max", MATH_MAX }
 };
 
+static bool FindIntrinsic(std::string_view name, int numArgs, unsigned char* fn)
+{
+    for (const Intrinsic& intrinsic : Intrinsics)
+    {
+        if (intrinsic.name == name && MathArgCount(intrinsic.fn) == numArgs)
+        {
+            *fn = intrinsic.fn;
+            return true;
+        }
+    }
+    return false;
+}
+
 //====================
 // Scanner
 //====================
@@ -113,8 +239,8 @@ class Scanner
 {
 public:
     Scanner();
-    void ScanLine(const std::string& line);
-    void AddToken(TokenType type, const std::string& value);
+    void Scan(std::string_view source);
+    void AddToken(TokenType type, std::string_view value);
     void AddToken(TokenType type);
     inline bool IsError() const { return _isError; }
     inline const std::string& Error() const { return _error; }
@@ -125,52 +251,26 @@ private:
     char PeekAhead();
     void Advance();
     void ScanWhitespace();
+    void ScanComment();
     void ScanStringLiteral();
     void ScanNumberLiteral();
     void ScanIdentifier();
     void SetError(const std::string& error);
     bool IsDigit(char ch);
-    void AddKeyword(const std::string& keyword, TokenType token);
     bool IsLetter(char ch);
 
-    std::string _line;
-    int _pos;
+    std::string_view _source;
+    size_t _pos;
     int _lineNum;
     bool _scanning;
     std::vector<Token> _tokens;
     std::string _error;
     bool _isError;
-    std::unordered_map<std::string, TokenType> _keywords;
 };
 
 Scanner::Scanner()
     : _lineNum(1), _pos(0), _scanning(false), _isError(false)
 {
-    AddKeyword("if", TokenType::IF);
-    AddKeyword("else", TokenType::ELSE);
-    AddKeyword("function", TokenType::FUNCTION);
-    AddKeyword("var", TokenType::VAR);
-    AddKeyword("yield", TokenType::YIELD);
-    AddKeyword("return", TokenType::RETURN);
-    AddKeyword("while", TokenType::WHILE);
-    AddKeyword("for", TokenType::FOR);
-    AddKeyword("class", TokenType::CLASS);
-    AddKeyword("new", TokenType::NEW);
-    AddKeyword("public", TokenType::PUBLIC);
-    AddKeyword("private", TokenType::PRIVATE);
-    AddKeyword("protected", TokenType::PROTECTED);
-    AddKeyword("internal", TokenType::INTERNAL);
-    AddKeyword("self", TokenType::SELF);
-    AddKeyword("this", TokenType::THIS);
-    AddKeyword("base", TokenType::BASE);
-    AddKeyword("throw", TokenType::THROW);
-    AddKeyword("catch", TokenType::CATCH);
-    AddKeyword("try", TokenType::TRY);
-}
-
-void Scanner::AddKeyword(const std::string& keyword, TokenType token)
-{
-    _keywords.insert(std::pair<std::string, TokenType>(keyword, token));
 }
 
 bool Scanner::IsLetter(char ch)
@@ -180,26 +280,18 @@ bool Scanner::IsLetter(char ch)
 
 void Scanner::ScanIdentifier()
 {
-    std::string identifier;
-    bool scanning = true;
-    while (scanning)
+    const size_t start = _pos;
+    while (_scanning && (IsLetter(Peek()) || IsDigit(Peek())))
     {
-        char ch = Peek();
-        if (IsLetter(ch) || IsDigit(ch))
-        {
-            identifier += ch;
-            Advance();
-        }
-        else
-        {
-            scanning = false;
-        }
+        Advance();
     }
 
-    const auto& it = _keywords.find(identifier);
-    if (it != _keywords.end())
+    const std::string_view identifier = _source.substr(start, _pos - start);
+
+    TokenType keyword;
+    if (FindKeyword(identifier, &keyword))
     {
-        AddToken(it->second);
+        AddToken(keyword);
     }
     else
     {
@@ -209,23 +301,7 @@ void Scanner::ScanIdentifier()
 
 bool Scanner::IsDigit(char ch)
 {
-    bool isDigit = false;
-    switch (ch)
-    {
-    case '0':
-    case '1':
-    case '2':
-    case '3':
-    case '4':
-    case '5':
-    case '6':
-    case '7':
-    case '8':
-    case '9':
-        isDigit = true;
-        break;
-    }
-    return isDigit;
+    return ch >= '0' && ch <= '9';
 }
 
 void Scanner::SetError(const std::string& error)
@@ -240,12 +316,13 @@ void Scanner::SetError(const std::string& error)
 
 char Scanner::Peek()
 {
-    return _line[_pos];
+    if (_pos < _source.size()) return _source[_pos];
+    else return '\0';
 }
 
 char Scanner::PeekAhead()
 {
-    if (_pos + 1 < _line.size()) return _line[_pos + 1];
+    if (_pos + 1 < _source.size()) return _source[_pos + 1];
     else return '\0';
 }
 
@@ -254,7 +331,7 @@ void Scanner::Advance()
     if (_scanning)
     {
         _pos++;
-        _scanning = _pos < _line.size();
+        _scanning = _pos < _source.size();
     }
 }
 
@@ -266,8 +343,13 @@ void Scanner::ScanWhitespace()
         char ch = Peek();
         switch (ch)
         {
+        case '\n':
+            _lineNum++;
+            Advance();
+            break;
         case ' ':
         case '\t':
+        case '\r':
             Advance();
             break;
         default:
@@ -277,50 +359,55 @@ void Scanner::ScanWhitespace()
     }
 }
 
+void Scanner::ScanComment()
+{
+    while (_scanning && Peek() != '\n')
+    {
+        Advance();
+    }
+}
+
 void Scanner::ScanStringLiteral()
 {
-    std::string str;
+    const size_t start = _pos;
     bool scanning = true;
     while (scanning)
     {
         char ch = Peek();
         if (ch == '\"')
         {
-            AddToken(TokenType::STRING, str);
+            AddToken(TokenType::STRING, _source.substr(start, _pos - start));
             Advance();
             scanning = false;
         }
+        else if (!_scanning || ch == '\n')
+        {
+            SetError("Ill formed string literal.");
+            scanning = false;
+        }
         else
         {
-            str += ch;
             Advance();
-            if (!_scanning)
-            {
-                SetError("Ill formed string literal.");
-                scanning = false;
-            }
         }
     }
 }
 
 void Scanner::ScanNumberLiteral()
 {
-    std::string str;
+    const size_t start = _pos;
     bool scanning = true;
     bool hasDot = false;
     while (scanning)
     {
         char ch = Peek();
-        if (IsDigit(ch))
+        if (_scanning && IsDigit(ch))
         {
-            str += ch;
             Advance();
         }
-        else if (ch == '.')
+        else if (_scanning && ch == '.')
         {
             if (!hasDot) {
                 hasDot = true;
-                str += ch;
                 Advance();
             }
             else
@@ -331,19 +418,19 @@ void Scanner::ScanNumberLiteral()
         }
         else
         {
-            AddToken(hasDot ? TokenType::NUMBER : TokenType::INTEGER, str);
+            AddToken(hasDot ? TokenType::NUMBER : TokenType::INTEGER, _source.substr(start, _pos - start));
             scanning = false;
         }
     }
 }
 
-void Scanner::ScanLine(const std::string& line)
+void Scanner::Scan(std::string_view source)
 {
     if (_isError) { return; }
 
     _pos = 0;
-    _line = line;
-    _scanning = true;
+    _source = source;
+    _scanning = _pos < _source.size();
 
     while (_scanning)
     {
@@ -428,7 +515,7 @@ void Scanner::ScanLine(const std::string& line)
                 break;
             case '/':
                 Advance();
-                if (Peek() == '/') { _scanning = false; } // comment
+                if (Peek() == '/') { ScanComment(); }
                 else if (Peek() == '=') { Advance(); AddToken(TokenType::SLASH_EQUALS); }
                 else { AddToken(TokenType::SLASH); }
                 break;
@@ -492,14 +579,9 @@ void Scanner::ScanLine(const std::string& line)
                 break;
         }
     }
-
-    if (!IsError())
-    {
-        _lineNum++;
-    }
 }
 
-void Scanner::AddToken(TokenType type, const std::string& value)
+void Scanner::AddToken(TokenType type, std::string_view value)
 {
     Token token(type, value, _lineNum);
     _tokens.push_back(token);
@@ -507,7 +589,7 @@ void Scanner::AddToken(TokenType type, const std::string& value)
 
 void Scanner::AddToken(TokenType type)
 {
-    Token token(type, "", _lineNum);
+    Token token(type, std::string_view(), _lineNum);
     _tokens.push_back(token);
 }
 
@@ -544,7 +626,157 @@ enum class ExprNode
     TABLE_SET,
     ARRAY,
     ARRAY_GET,
-    ARRAY_SET
+    ARRAY_SET,
+    TABLE_UPDATE
+};
+
+//===================
+// Arena
+//===================
+
+class Arena
+{
+public:
+    Arena();
+    ~Arena();
+
+    template<typename T, typename... Args>
+    T* New(Args&&... args)
+    {
+        T* obj = new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if constexpr (!std::is_trivially_destructible_v<T>)
+        {
+            AddDestructor(obj, [](void* mem) { reinterpret_cast<T*>(mem)->~T(); });
+        }
+        return obj;
+    }
+
+    void* Allocate(size_t size, size_t align);
+    void Reset();
+    inline size_t NumSegments() const { return _segments.size(); }
+    inline size_t NumAllocations() const { return _numAllocations; }
+    size_t UsedMemory() const;
+
+private:
+    struct Segment
+    {
+        unsigned char* _memory;
+        size_t _pos;
+        size_t _totalSize;
+    };
+
+    struct Destructor
+    {
+        void* _obj;
+        void (*_destroy)(void*);
+        Destructor* _next;
+    };
+
+    void AddDestructor(void* obj, void (*destroy)(void*));
+
+    std::vector<Segment> _segments;
+    Destructor* _destructors;
+    size_t _numAllocations;
+};
+
+Arena::Arena()
+    : _destructors(nullptr), _numAllocations(0)
+{
+}
+
+Arena::~Arena()
+{
+    Reset();
+
+    for (auto& sg : _segments)
+    {
+        delete[] sg._memory;
+    }
+}
+
+void* Arena::Allocate(size_t size, size_t align)
+{
+    _numAllocations++;
+
+    if (_segments.size() > 0)
+    {
+        auto& sg = _segments[_segments.size() - 1];
+        const size_t pos = (sg._pos + align - 1) & ~(align - 1);
+        if (pos + size <= sg._totalSize)
+        {
+            sg._pos = pos + size;
+            return sg._memory + pos;
+        }
+    }
+
+    // Allocate 64KB to start with, then twice the size of the last segment
+    size_t totalSize = _segments.size() == 0 ? 64 * 1024 : _segments[_segments.size() - 1]._totalSize * 2;
+    while (totalSize < size + align) { totalSize *= 2; }
+
+    auto& sg = _segments.emplace_back();
+    sg._memory = new unsigned char[totalSize];
+    sg._totalSize = totalSize;
+
+    const size_t pos = (size_t(-(intptr_t)sg._memory)) & (align - 1);
+    sg._pos = pos + size;
+    return sg._memory + pos;
+}
+
+void Arena::AddDestructor(void* obj, void (*destroy)(void*))
+{
+    Destructor* dtor = new (Allocate(sizeof(Destructor), alignof(Destructor))) Destructor();
+    dtor->_obj = obj;
+    dtor->_destroy = destroy;
+    dtor->_next = _destructors;
+    _destructors = dtor;
+}
+
+void Arena::Reset()
+{
+    // Destroy in reverse order of construction
+    while (_destructors)
+    {
+        _destructors->_destroy(_destructors->_obj);
+        _destructors = _destructors->_next;
+    }
+
+    for (auto& sg : _segments)
+    {
+        sg._pos = 0;
+    }
+    _numAllocations = 0;
+}
+
+size_t Arena::UsedMemory() const
+{
+    size_t usage = 0;
+    for (auto& sg : _segments)
+    {
+        usage += sg._pos;
+    }
+    return usage;
+}
+
+/* STL allocator which allocates from an Arena, memory is only released with the Arena. */
+template<typename T>
+class ArenaAllocator
+{
+public:
+    using value_type = T;
+
+    ArenaAllocator(Arena& arena) : _arena(&arena) {}
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : _arena(other.GetArena()) {}
+
+    inline T* allocate(size_t n) { return reinterpret_cast<T*>(_arena->Allocate(n * sizeof(T), alignof(T))); }
+    inline void deallocate(T*, size_t) {}
+    inline Arena* GetArena() const { return _arena; }
+
+    template<typename U>
+    inline bool operator==(const ArenaAllocator<U>& other) const { return _arena == other.GetArena(); }
+
+private:
+    Arena* _arena;
 };
 
 //===================
@@ -556,16 +788,16 @@ class Expr;
 class Call
 {
 public:
-    Call() : _yield(false), _discard(false) {};
+    Call(Arena& arena) : _args(ArenaAllocator<Expr*>(arena)), _yield(false), _discard(false) {};
     void PushArg(Expr* expr);
-    inline std::vector<Expr*>& Args() { return _args; }
+    inline std::vector<Expr*, ArenaAllocator<Expr*>>& Args() { return _args; }
     inline void SetYield() { _yield = true; }
     inline bool Yield() const { return _yield; }
     inline void SetDiscard() { _discard = true; }
     inline bool Discard() { return _discard; }
 
 private:
-    std::vector<Expr*> _args;
+    std::vector<Expr*, ArenaAllocator<Expr*>> _args;
     bool _yield;
     bool _discard;
 };
@@ -632,21 +864,21 @@ public:
     {
     }
 
-    Expr* Clone()
+    Expr* Clone(Arena& arena)
     {
         Expr* left = _left;
         if (left)
         {
-            left = left->Clone();
+            left = left->Clone(arena);
         }
 
         Expr* right = _right;
         if (right)
         {
-            right = right->Clone();
+            right = right->Clone(arena);
         }
 
-        return new Expr(left, right, _token, _node);
+        return arena.New<Expr>(left, right, _token, _node);
     }
 
     inline Expr* Left() { return _left; }
@@ -666,6 +898,30 @@ private:
     Fold _fold;
 };
 
+//====================
+// Branch profile
+//====================
+
+static constexpr unsigned int MIN_PROFILE_COUNT = 16;   // the fewest runs of a branch before its profile is used
+static constexpr unsigned int COLD_BRANCH_RATIO = 50;   // a condition true less than once in this many runs is cold
+
+struct SiteCount
+{
+    unsigned int trueCount;
+    unsigned int falseCount;
+};
+
+// The counts of each branch of a function by site.
+typedef std::unordered_map<int, SiteCount> SiteProfile;
+
+static std::unordered_map<std::string, SiteProfile> branchProfile;
+
+static const SiteProfile* FindProfile(const std::string& function)
+{
+    const auto& it = branchProfile.find(function);
+    return it == branchProfile.end() ? nullptr : &it->second;
+}
+
 //====================
 // FlowNode
 //====================
@@ -674,8 +930,9 @@ class FlowNode
 {
 public:
     FlowNode(int id, Expr* expr);
-    FlowNode(int id, Expr* expr, int success, int failure);
+    FlowNode(int id, Expr* expr, int success, int failure, int site);
     inline int ID() { return _id; }
+    inline int Site() { return _site; }
     inline Expr* Expression() { return _expr; }
     inline Label* GetLabel() { return &_label; }
     inline int Failure() { return _failure; }
@@ -689,6 +946,7 @@ private:
     int _success;
     int _failure;
     int _id;
+    int _site;
     int _emitted;
 };
 
@@ -698,16 +956,18 @@ FlowNode::FlowNode(int id, Expr* expr)
     _success(-1),
     _failure(-1),
     _id(id),
+    _site(-1),
     _emitted(false)
 {
 }
 
-FlowNode::FlowNode(int id, Expr* expr, int success, int failure)
+FlowNode::FlowNode(int id, Expr* expr, int success, int failure, int site)
     :
     _expr(expr),
     _success(success),
     _failure(failure),
     _id(id),
+    _site(site),
     _emitted(false)
 {
 }
@@ -719,10 +979,12 @@ FlowNode::FlowNode(int id, Expr* expr, int success, int failure)
 class FlowGraph
 {
 public:
-    FlowGraph();
+    FlowGraph(Arena& arena);
 
-    void BuildFlowGraph(Expr* expr);
+    void BuildFlowGraph(Expr* expr, int firstSite, const SiteProfile* profile);
+    bool Probability(double* probability);
 
+    inline int NumSites() { return int(_sites.size()); }
     inline Label* Failure() { return _nodes[_failure].GetLabel(); }
     inline Label* Success() { return _nodes[_success].GetLabel(); }
     inline FlowNode& Root() { return _nodes[_root]; }
@@ -732,6 +994,10 @@ private:
     int CreateNode(Expr* expr);
     int CreateNode(Expr* expr, int failure, int success);
 
+    void NumberSites(Expr* expr, int firstSite);
+    bool Probability(Expr* expr, double* probability);
+    bool Reorder(Expr* expr, bool conjunction);
+
     int EXPR(Expr* expr, int success, int failure);
     int AND(Expr* expr, int success, int failure);
     int OR(Expr* expr, int success, int failure);
@@ -739,14 +1005,20 @@ private:
     int _success;
     int _failure;
     int _root;
-    std::vector<FlowNode> _nodes;
+    Expr* _expr;
+    const SiteProfile* _profile;
+    std::unordered_map<Expr*, int> _sites;
+    std::vector<FlowNode, ArenaAllocator<FlowNode>> _nodes;
 };
 
-FlowGraph::FlowGraph()
+FlowGraph::FlowGraph(Arena& arena)
     :
+    _nodes(ArenaAllocator<FlowNode>(arena)),
     _root(-1),
     _failure(-1),
-    _success(-1)
+    _success(-1),
+    _expr(nullptr),
+    _profile(nullptr)
 {
     _failure = CreateNode(nullptr);
     _success = CreateNode(nullptr);
@@ -760,15 +1032,94 @@ int FlowGraph::CreateNode(Expr* expr)
 
 int FlowGraph::CreateNode(Expr* expr, int failure, int success)
 {
-    auto& node = _nodes.emplace_back(FlowNode(int(_nodes.size()), expr, success, failure));
+    auto& node = _nodes.emplace_back(FlowNode(int(_nodes.size()), expr, success, failure, _sites[expr]));
     return node.ID();
 }
 
-void FlowGraph::BuildFlowGraph(Expr* expr)
+void FlowGraph::BuildFlowGraph(Expr* expr, int firstSite, const SiteProfile* profile)
 {
+    _expr = expr;
+    _profile = profile;
+    NumberSites(expr, firstSite);
     _root = EXPR(expr, _success, _failure);
 }
 
+void FlowGraph::NumberSites(Expr* expr, int firstSite)
+{
+    // The comparisons are numbered in the order they are written,
+    // so the numbers don't change when the profile changes the order they are tested in.
+    switch (expr->Op().Type())
+    {
+    case TokenType::AND:
+    case TokenType::OR:
+        NumberSites(expr->Left(), firstSite);
+        NumberSites(expr->Right(), firstSite);
+        break;
+    default:
+        _sites.insert(std::pair<Expr*, int>(expr, firstSite + int(_sites.size())));
+        break;
+    }
+}
+
+bool FlowGraph::Probability(double* probability)
+{
+    return Probability(_expr, probability);
+}
+
+bool FlowGraph::Probability(Expr* expr, double* probability)
+{
+    // The chance the expression is true, if every comparison in it has been profiled.
+    double left = 0.0;
+    double right = 0.0;
+    switch (expr->Op().Type())
+    {
+    case TokenType::AND:
+        if (!Probability(expr->Left(), &left) || !Probability(expr->Right(), &right)) { return false; }
+        *probability = left * right;
+        return true;
+    case TokenType::OR:
+        if (!Probability(expr->Left(), &left) || !Probability(expr->Right(), &right)) { return false; }
+        *probability = 1.0 - (1.0 - left) * (1.0 - right);
+        return true;
+    }
+
+    if (!_profile) { return false; }
+
+    const auto& it = _profile->find(_sites[expr]);
+    if (it == _profile->end())
+    {
+        return false;
+    }
+
+    const unsigned int total = it->second.trueCount + it->second.falseCount;
+    if (total < MIN_PROFILE_COUNT)
+    {
+        return false;
+    }
+
+    *probability = double(it->second.trueCount) / total;
+    return true;
+}
+
+static bool HasCall(Expr* expr)
+{
+    return expr && (expr->GetCall() || HasCall(expr->Left()) || HasCall(expr->Right()));
+}
+
+bool FlowGraph::Reorder(Expr* expr, bool conjunction)
+{
+    // The left side is tested first if the profile shows it more often decides the result,
+    // unless either side makes calls which must then run in the usual order.
+    double left = 0.0;
+    double right = 0.0;
+    if (HasCall(expr) || !Probability(expr->Left(), &left) || !Probability(expr->Right(), &right))
+    {
+        return false;
+    }
+
+    return conjunction ? left < right : left > right;
+}
+
 int FlowGraph::EXPR(Expr* expr, int success, int failure)
 {
     switch (expr->Op().Type())
@@ -791,7 +1142,14 @@ int FlowGraph::EXPR(Expr* expr, int success, int failure)
 
 int FlowGraph::AND(Expr* expr, int success, int failure)
 {
-    // TODO: we may want to do the LEFT node first
+    // Test first the side most likely to be false.
+    if (Reorder(expr, true))
+    {
+        const int right = EXPR(expr->Right(), success, failure);
+        const int left = EXPR(expr->Left(), right, failure);
+
+        return left;
+    }
 
     const int left = EXPR(expr->Left(), success, failure);
     const int right = EXPR(expr->Right(), left, failure);
@@ -801,7 +1159,14 @@ int FlowGraph::AND(Expr* expr, int success, int failure)
 
 int FlowGraph::OR(Expr* expr, int success, int failure)
 {
-    // TODO: we may want to do the LEFT node first
+    // Test first the side most likely to be true.
+    if (Reorder(expr, false))
+    {
+        const int right = EXPR(expr->Right(), success, failure);
+        const int left = EXPR(expr->Left(), success, right);
+
+        return left;
+    }
 
     const int left = EXPR(expr->Left(), success, failure);
     const int right = EXPR(expr->Right(), success, left);
@@ -813,11 +1178,19 @@ int FlowGraph::OR(Expr* expr, int success, int failure)
 // Parser
 //====================
 
+static constexpr int DEFAULT_INLINE_THRESHOLD = 48;   // the maximum size in bytes of a function to inline
+static int inlineThreshold = DEFAULT_INLINE_THRESHOLD;
+static constexpr int MIN_SWITCH_CASES = 4;            // the fewest cases in an if-else chain to lower as a switch
+static constexpr int MAX_JUMP_TABLE = 1024;           // the most entries in a jump table
+
 class Parser
 {
 public:
-    Parser(const std::vector<Token>& tokens);
+    Parser(const std::vector<Token>& tokens, const std::string& main = "main");
+    ~Parser();
     void Parse();
+    void ParseModule();
+    static Program* Link(const std::vector<Parser*>& modules, std::string* error);
     inline bool IsError() const { return _isError; }
     inline const std::string& Error() const { return _errorText; }
     inline int ErrorLine() const { return _errorLine; }
@@ -825,17 +1198,38 @@ public:
 
 private:
 
+    // The inferred type of each local by name, TY_VOID when it is not known.
+    typedef std::unordered_map<std::string, unsigned char> TypeMap;
+
     struct Branch
     {
         FlowGraph graph;
         Label endLabel;
         Label startLabel;
+        TypeMap types;      // the types of the locals before the branch
+
+        Branch(Arena& arena) : graph(arena) {}
     };
 
     struct Function
     {
         int id;
         ProgramBlock* blk;
+        bool inlineable = false;
+    };
+
+    struct Relocation
+    {
+        ProgramBlock* blk;
+        int pos;
+        int id;
+    };
+
+    struct ColdBlock
+    {
+        Label label;                // the jumps into the block
+        ProgramBlock* code;         // the code of the block until it is placed at the end of the function
+        std::vector<int> tailJumps; // the calls to the function itself in the block
     };
 
     struct StackFrame
@@ -847,12 +1241,23 @@ private:
         std::stack<std::unordered_set<std::string>> _scope;
         std::vector<std::string> _functions;
         bool _isConstructor;
+        Label _start;       // the start of the function body
+        int _numParams;
+        TypeMap _types;
+        int _numSites;                  // the number of branches so far
+        const SiteProfile* _profile;    // the branch profile of the function, if there is one
+        std::vector<ColdBlock> _cold;   // the rarely run blocks to place at the end of the function
+        bool _outlining;                // whether a cold block is being parsed
 
         StackFrame()
             :
             _return(false),
             _block(nullptr),
-            _isConstructor(false)
+            _isConstructor(false),
+            _numParams(0),
+            _numSites(0),
+            _profile(nullptr),
+            _outlining(false)
         {
         }
     };
@@ -866,18 +1271,24 @@ private:
     void EmitExpr(Expr* expr);
     void EmitChildNodes(Expr* expr);
     void EmitTableGetNode(Expr* expr);
+    void EmitTableUpdateNode(Expr* expr);
     Expr* FoldExpr(Expr* expr);
-    void EmitFlowGraph(FlowGraph& graph, ProgramBlock* program);
-    bool EmitNode(FlowGraph& graph, FlowNode& node, ProgramBlock* program);
-    void FreeExpr(Expr* expr);
+    void BuildFlowGraph(FlowGraph& graph, Expr* expr);
+    void EmitFlowGraph(FlowGraph& graph, ProgramBlock* program, bool successNext = true);
+    bool EmitNode(FlowGraph& graph, FlowNode& node, ProgramBlock* program, bool successNext);
+    bool EndsWithReturn(int pos);
+    void ParseColdBlock(Branch& br);
+    void EmitColdBlocks();
     void ParseVar();
     void ParseWhile();
     void ParseFor();
     void ParseIfStatement();
     void ParseElse(Branch& prevBr);
+    bool ScanSwitch(int pos, std::string* name, std::vector<int>* values);
+    void ParseSwitch(const std::string& name, const std::vector<int>& values);
     void ParseAssignmentStatement();
     Expr* ParseAssignment(Expr* lhs);
-    void ParseFunction();
+    void ParseFunction(bool allowInline = true);
     void ParseConstructor(const std::string& name);
     void ParseReturn();
     void ParseYield();
@@ -903,6 +1314,17 @@ private:
     char Flip(char jump);
     int DeclareFunction(const std::string& name, ProgramBlock* blk);
     int ForwardDeclareFunction(const std::string& name);
+    void AddRelocation(ProgramBlock* blk, int id);
+    bool InlineCall(const std::string& name, int numArgs);
+    bool MathIntrinsic(Expr* expr, unsigned char* fn);
+    bool EmitTailCallExpr(Expr* expr);
+    unsigned char InferType(Expr* expr);
+    unsigned char InferTokenType(int pos, const TypeMap& types);
+    TypeMap InferLoopTypes(int start);
+    void SetType(const std::string& name, unsigned char type);
+    void MergeTypes(const TypeMap& types);
+    void ParseStatements();
+    void ReleaseBlocks();
     void PushScope();
     void PopScope();
     void PushClass(const std::string& name);
@@ -915,25 +1337,45 @@ private:
     std::string _errorText;
     int _errorLine;
     Program* _program;
+    Arena _arena;
+    std::string _main;
+    std::vector<Relocation> _relocations;
 
     std::unordered_map<std::string, Function> _functions;
     std::unordered_set<std::string> _classes;
+    std::unordered_set<std::string> _declared;
     std::stack<StackFrame> _frames;
 };
 
-Parser::Parser(const std::vector<Token>& tokens)
+Parser::Parser(const std::vector<Token>& tokens, const std::string& main)
     : _tokens(tokens),
     _scanning(false),
     _pos(0),
     _isError(false),
-    _errorLine(0)
+    _errorLine(0),
+    _main(main)
 {
     _program = CreateProgram();
     _frames.push(StackFrame());
     PushScope();
-    _frames.top()._block = CreateProgramBlock(true, "main", 0);
+    _frames.top()._block = CreateProgramBlock(true, _main, 0);
+    _frames.top()._profile = FindProfile(_main);
+
+    DeclareFunction(_main, _frames.top()._block);
+
+    // Script functions take precedence over the intrinsics they share a name with.
+    for (size_t i = 0; i + 1 < _tokens.size(); i++)
+    {
+        if (_tokens[i].Type() == TokenType::FUNCTION && _tokens[i + 1].Type() == TokenType::IDENTIFIER)
+        {
+            _declared.insert(_tokens[i + 1].String());
+        }
+    }
+}
 
-    DeclareFunction("main", _frames.top()._block);
+Parser::~Parser()
+{
+    ReleaseBlocks();
 }
 
 void Parser::PushClass(const std::string& name)
@@ -962,6 +1404,7 @@ void Parser::PopScope()
     for (auto& item : top._scope.top())
     {
         top._vars.erase(item);
+        top._types.erase(item);
     }
 
     top._scope.pop();
@@ -984,36 +1427,129 @@ int Parser::ForwardDeclareFunction(const std::string& name)
     return id;
 }
 
-int Parser::DeclareFunction(const std::string& name, ProgramBlock* blk)
+void Parser::AddRelocation(ProgramBlock* blk, int id)
+{
+    // Record where the function id was written so it can be remapped when linking
+    _relocations.push_back(Relocation{ .blk = blk, .pos = GetProgramBlockSize(blk) - int(sizeof(int)), .id = id });
+}
+
+bool Parser::InlineCall(const std::string& name, int numArgs)
 {
-    int id = 0;
     const auto& func = _functions.find(name);
-    if (func == _functions.end())
+    if (func == _functions.end() || !func->second.inlineable)
     {
-        id = CreateFunction(_program);
-        _functions.insert(std::pair<std::string, Function>(name, Function{ .id = id, .blk = blk }));
+        return false;
     }
-    else
+
+    ProgramBlock* callee = func->second.blk;
+    ProgramBlock* block = Block();
+    const int offset = GetProgramBlockSize(block);
+    if (!EmitInlineBlock(block, callee, numArgs))
     {
-        id = func->second.id;
-        
-        if (func->second.blk == nullptr)
-        {
-            func->second.blk = blk;
-        }
-        else
+        return false;
+    }
+
+    // Calls made by the function need relocating at their new position.
+    const size_t numRelocations = _relocations.size();
+    for (size_t i = 0; i < numRelocations; i++)
+    {
+        const Relocation relocation = _relocations[i];
+        if (relocation.blk == callee)
         {
-            // Otherwise the function has been declared already
-            id = -1;
+            _relocations.push_back(Relocation{ .blk = block, .pos = relocation.pos + offset, .id = relocation.id });
         }
     }
 
-    return id;
+    return true;
 }
 
-char Parser::Flip(char jump)
+bool Parser::MathIntrinsic(Expr* expr, unsigned char* fn)
 {
-    switch (jump)
+    Call* call = expr->GetCall();
+    return call && !call->Yield() && !call->Discard() &&
+        _declared.find(expr->Op().String()) == _declared.end() &&
+        FindIntrinsic(expr->Op().String(), int(call->Args().size()), fn);
+}
+
+bool Parser::EmitTailCallExpr(Expr* expr)
+{
+    Call* call = expr->GetCall();
+    unsigned char fn = 0;
+    if (expr->Node() != ExprNode::IDENTIFIER || !call || call->Yield() || MathIntrinsic(expr, &fn))
+    {
+        return false;
+    }
+
+    // Small functions are better inlined.
+    const std::string name = expr->Op().String();
+    const auto& func = _functions.find(name);
+    if (func != _functions.end() && func->second.inlineable)
+    {
+        return false;
+    }
+
+    ProgramBlock* block = Block();
+    StackFrame& frame = _frames.top();
+    auto& args = call->Args();
+
+    EmitChildNodes(expr);
+    for (int i = int(args.size()) - 1; i >= 0; i--)
+    {
+        EmitExpr(args[i]);
+    }
+
+    EmitDebug(block, expr->Op().Line());
+    if (func != _functions.end() && func->second.blk == block && int(args.size()) == frame._numParams)
+    {
+        // A call to itself jumps back to the start of the function
+        // with the new arguments, so it runs and is traced as a loop.
+        for (int i = 0; i < frame._numParams; i++)
+        {
+            EmitPop(block, i);
+        }
+        EmitJump(block, JUMP, &frame._start);
+        EmitMarkedLabel(block, &frame._start);
+    }
+    else
+    {
+        const int id = ForwardDeclareFunction(name);
+        EmitTailCall(block, id, static_cast<unsigned char>(args.size()));
+        AddRelocation(block, id);
+    }
+
+    return true;
+}
+
+int Parser::DeclareFunction(const std::string& name, ProgramBlock* blk)
+{
+    int id = 0;
+    const auto& func = _functions.find(name);
+    if (func == _functions.end())
+    {
+        id = CreateFunction(_program);
+        _functions.insert(std::pair<std::string, Function>(name, Function{ .id = id, .blk = blk }));
+    }
+    else
+    {
+        id = func->second.id;
+        
+        if (func->second.blk == nullptr)
+        {
+            func->second.blk = blk;
+        }
+        else
+        {
+            // Otherwise the function has been declared already
+            id = -1;
+        }
+    }
+
+    return id;
+}
+
+char Parser::Flip(char jump)
+{
+    switch (jump)
     {
     case JUMP_E:
         return JUMP_NE;
@@ -1032,7 +1568,7 @@ char Parser::Flip(char jump)
     return JUMP;
 }
 
-bool Parser::EmitNode(FlowGraph& graph, FlowNode& node, ProgramBlock* program)
+bool Parser::EmitNode(FlowGraph& graph, FlowNode& node, ProgramBlock* program, bool successNext)
 {
     if (node.Emitted()) { return false; }
 
@@ -1075,17 +1611,26 @@ bool Parser::EmitNode(FlowGraph& graph, FlowNode& node, ProgramBlock* program)
         if (failure.Expression())
         {
             EmitJump(program, jump, success.GetLabel());
-            result = EmitNode(graph, failure, program);
+            EmitBranchSite(program, node.Site(), true);
+            result = EmitNode(graph, failure, program, successNext);
+        }
+        else if (!successNext && !success.Expression())
+        {
+            // Falls through to the failure which follows.
+            EmitJump(program, jump, success.GetLabel());
+            EmitBranchSite(program, node.Site(), true);
+            result = true;
         }
         else
         {
             EmitJump(program, Flip(jump), failure.GetLabel());
+            EmitBranchSite(program, node.Site(), false);
             result = true;
         }
 
         if (!success.Emitted() && success.Expression())
         {
-            result = EmitNode(graph, success, program);
+            result = EmitNode(graph, success, program, successNext);
         }
     }
     else if (!success.Emitted())
@@ -1093,32 +1638,42 @@ bool Parser::EmitNode(FlowGraph& graph, FlowNode& node, ProgramBlock* program)
         if (success.Expression())
         {
             EmitJump(program, Flip(jump), failure.GetLabel());
-            result = EmitNode(graph, success, program);
+            EmitBranchSite(program, node.Site(), false);
+            result = EmitNode(graph, success, program, successNext);
         }
         else
         {
             EmitJump(program, jump, success.GetLabel());
-            result = false;
+            EmitBranchSite(program, node.Site(), true);
+            result = !successNext;
         }
 
         if (!failure.Emitted() && failure.Expression())
         {
-            result = EmitNode(graph, failure, program);
+            result = EmitNode(graph, failure, program, successNext);
         }
     }
 
     return result;
 }
 
-void Parser::EmitFlowGraph(FlowGraph& graph, ProgramBlock* program)
+void Parser::BuildFlowGraph(FlowGraph& graph, Expr* expr)
+{
+    StackFrame& frame = _frames.top();
+    graph.BuildFlowGraph(expr, frame._numSites, frame._profile);
+    frame._numSites += graph.NumSites();
+}
+
+void Parser::EmitFlowGraph(FlowGraph& graph, ProgramBlock* program, bool successNext)
 {
-    const bool result = EmitNode(graph, graph.Root(), program);
+    // The code which follows is run on success, or on failure if successNext is false.
+    const bool result = EmitNode(graph, graph.Root(), program, successNext);
     if (!result)
     {
-        EmitJump(program, JUMP, graph.Failure());
+        EmitJump(program, JUMP, successNext ? graph.Failure() : graph.Success());
     }
 
-    EmitLabel(program, graph.Success());
+    EmitLabel(program, successNext ? graph.Success() : graph.Failure());
 }
 
 Expr* Parser::FoldExpr(Expr* expr)
@@ -1230,6 +1785,262 @@ Expr* Parser::FoldExpr(Expr* expr)
     return expr;
 }
 
+static unsigned char ArithmeticType(unsigned char left, unsigned char right)
+{
+    // Mixing integers and reals promotes the result to a real.
+    return BinaryResultType(OP_SUB, left, right);
+}
+
+unsigned char Parser::InferType(Expr* expr)
+{
+    if (expr->GetFold().IsInteger())
+    {
+        return TY_INT;
+    }
+    else if (expr->GetFold().IsNumber())
+    {
+        return TY_REAL;
+    }
+
+    switch (expr->Node())
+    {
+    case ExprNode::INTEGER:
+        return TY_INT;
+    case ExprNode::NUMBER:
+        return TY_REAL;
+    case ExprNode::STRING:
+        return TY_STRING;
+    case ExprNode::IDENTIFIER:
+        if (!expr->GetCall())
+        {
+            const auto& types = _frames.top()._types;
+            const auto& it = types.find(expr->Op().String());
+            if (it != types.end())
+            {
+                return it->second;
+            }
+        }
+        else
+        {
+            unsigned char fn = 0;
+            if (MathIntrinsic(expr, &fn))
+            {
+                const auto& args = expr->GetCall()->Args();
+                return MathResultType(fn, InferType(args[0]), args.size() > 1 ? InferType(args[1]) : TY_VOID);
+            }
+        }
+        break;
+    case ExprNode::INCREMENT:
+    case ExprNode::DECREMENT:
+    {
+        const unsigned char type = InferType(expr->Left());
+        return type == TY_INT || type == TY_REAL ? type : TY_VOID;
+    }
+    case ExprNode::ADD:
+    case ExprNode::SUB:
+    case ExprNode::MUL:
+    case ExprNode::DIV:
+        if (expr->Left() && expr->Right())
+        {
+            const unsigned char op =
+                expr->Node() == ExprNode::ADD ? OP_ADD :
+                expr->Node() == ExprNode::SUB ? OP_SUB :
+                expr->Node() == ExprNode::MUL ? OP_MUL : OP_DIV;
+            return BinaryResultType(op, InferType(expr->Left()), InferType(expr->Right()));
+        }
+        else if (expr->Right())
+        {
+            // Unary minus
+            const unsigned char type = InferType(expr->Right());
+            return type == TY_INT || type == TY_REAL ? type : TY_VOID;
+        }
+        break;
+    }
+
+    return TY_VOID;
+}
+
+unsigned char Parser::InferTokenType(int pos, const TypeMap& types)
+{
+    // Infers the type of the arithmetic expression starting at the token
+    // without parsing it. Anything more than locals, literals and arithmetic
+    // is considered unknown.
+    unsigned char type = TY_VOID;
+    bool first = true;
+    int depth = 0;
+    for (; pos < int(_tokens.size()); pos++)
+    {
+        const Token& token = _tokens[pos];
+        unsigned char leaf = TY_VOID;
+        switch (token.Type())
+        {
+        case TokenType::SEMICOLON:
+            return type;
+        case TokenType::OPEN_PARAN:
+            depth++;
+            continue;
+        case TokenType::CLOSE_PARAN:
+            if (depth-- == 0)
+            {
+                return type;
+            }
+            continue;
+        case TokenType::PLUS:
+        case TokenType::MINUS:
+        case TokenType::STAR:
+        case TokenType::SLASH:
+            continue;
+        case TokenType::INTEGER:
+            leaf = TY_INT;
+            break;
+        case TokenType::NUMBER:
+            leaf = TY_REAL;
+            break;
+        case TokenType::IDENTIFIER:
+        {
+            const TokenType next = pos + 1 < int(_tokens.size()) ? _tokens[pos + 1].Type() : TokenType::SEMICOLON;
+            if (next == TokenType::OPEN_PARAN || next == TokenType::DOT || next == TokenType::OPEN_BRACKET)
+            {
+                return TY_VOID;
+            }
+
+            const auto& it = types.find(token.String());
+            if (it == types.end())
+            {
+                return TY_VOID;
+            }
+            leaf = it->second;
+        }
+            break;
+        default:
+            return TY_VOID;
+        }
+
+        type = first ? ArithmeticType(leaf, leaf) : ArithmeticType(type, leaf);
+        first = false;
+        if (type == TY_VOID)
+        {
+            return TY_VOID;
+        }
+    }
+
+    return TY_VOID;
+}
+
+Parser::TypeMap Parser::InferLoopTypes(int start)
+{
+    // The loop body is yet to be parsed, so find the types the locals have at
+    // the start of every iteration by looking for the assignments in the tokens
+    // up to the end of the body. A local keeps its type only if each assignment
+    // to it produces that type, this is repeated until nothing changes.
+    int end = _pos;
+    int depth = 1;
+    while (end < int(_tokens.size()) && depth > 0)
+    {
+        if (_tokens[end].Type() == TokenType::OPEN_BRACE) { depth++; }
+        else if (_tokens[end].Type() == TokenType::CLOSE_BRACE) { depth--; }
+        end++;
+    }
+
+    TypeMap types;
+    for (auto& var : _frames.top()._vars)
+    {
+        const auto& it = _frames.top()._types.find(var.first);
+        types.insert(std::pair<std::string, unsigned char>(var.first,
+            it != _frames.top()._types.end() ? it->second : TY_VOID));
+    }
+
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+
+        for (int i = start; i + 1 < end; i++)
+        {
+            const Token& token = _tokens[i];
+            if (token.Type() != TokenType::IDENTIFIER ||
+                (i > 0 && _tokens[i - 1].Type() == TokenType::DOT))
+            {
+                continue;
+            }
+
+            const bool declaration = i > 0 && _tokens[i - 1].Type() == TokenType::VAR;
+            const auto& it = types.find(token.String());
+            if (it == types.end() && !declaration)
+            {
+                continue;
+            }
+
+            const unsigned char cur = it != types.end() ? it->second : TY_VOID;
+
+            unsigned char type;
+            switch (_tokens[i + 1].Type())
+            {
+            case TokenType::EQUALS:
+                type = InferTokenType(i + 2, types);
+                break;
+            case TokenType::PLUS_EQUALS:
+            case TokenType::MINUS_EQUALS:
+            case TokenType::STAR_EQUALS:
+            case TokenType::SLASH_EQUALS:
+                type = ArithmeticType(cur, InferTokenType(i + 2, types));
+                break;
+            case TokenType::INCREMENT:
+            case TokenType::DECREMENT:
+                type = cur;
+                break;
+            case TokenType::SEMICOLON:
+                if (declaration)
+                {
+                    type = TY_VOID;
+                    break;
+                }
+                continue;
+            default:
+                continue;
+            }
+
+            if (it == types.end())
+            {
+                types.insert(std::pair<std::string, unsigned char>(token.String(), type));
+                changed = true;
+            }
+            else if (it->second != type && it->second != TY_VOID)
+            {
+                it->second = TY_VOID;
+                changed = true;
+            }
+        }
+    }
+
+    // Only the locals in scope carry their types into the loop.
+    TypeMap result;
+    for (auto& var : _frames.top()._vars)
+    {
+        result.insert(std::pair<std::string, unsigned char>(var.first, types[var.first]));
+    }
+
+    return result;
+}
+
+void Parser::SetType(const std::string& name, unsigned char type)
+{
+    _frames.top()._types[name] = type;
+}
+
+void Parser::MergeTypes(const TypeMap& types)
+{
+    // Where control flow joins a local only keeps a type known on all paths.
+    for (auto& type : _frames.top()._types)
+    {
+        const auto& it = types.find(type.first);
+        if (it == types.end() || it->second != type.second)
+        {
+            type.second = TY_VOID;
+        }
+    }
+}
+
 void Parser::EmitTableGetNode(Expr* expr)
 {
     ProgramBlock* block = Block();
@@ -1269,6 +2080,50 @@ void Parser::EmitTableGetNode(Expr* expr)
     EmitTableGet(block);
 }
 
+void Parser::EmitTableUpdateNode(Expr* expr)
+{
+    ProgramBlock* block = Block();
+
+    // The value is pushed first as the table and key are on top for the update.
+    if (expr->Right())
+    {
+        EmitExpr(expr->Right());
+    }
+    else
+    {
+        EmitPush(block, 1);
+    }
+
+    Expr* lhs = expr->Left();
+    EmitChildNodes(lhs);
+    if (lhs->Node() == ExprNode::TABLE_SET)
+    {
+        EmitPush(block, lhs->Op().String());
+        EmitPush(block, TY_STRING);
+    }
+    else
+    {
+        EmitPush(block, TY_INT);
+    }
+
+    unsigned char op = OP_ADD;
+    switch (expr->Op().Type())
+    {
+    case TokenType::DECREMENT:
+    case TokenType::MINUS_EQUALS:
+        op = OP_SUB;
+        break;
+    case TokenType::STAR_EQUALS:
+        op = OP_MUL;
+        break;
+    case TokenType::SLASH_EQUALS:
+        op = OP_DIV;
+        break;
+    }
+
+    EmitTableUpdate(block, op);
+}
+
 void Parser::EmitChildNodes(Expr* expr)
 {
     if (expr->Left())
@@ -1308,16 +2163,31 @@ void Parser::EmitExpr(Expr* expr)
     switch (expr->Node())
     {
     case ExprNode::EQUALS_EQUALS:
-        EmitChildNodes(expr);
-        EmitCompare(block);
-        break;
     case ExprNode::NOT_EQUALS:
+    case ExprNode::GREATER:
+    case ExprNode::LESS:
+    case ExprNode::GREATER_EQUALS:
+    case ExprNode::LESS_EQUALS:
         EmitChildNodes(expr);
-        EmitCompare(block);
+        if (InferType(expr->Left()) == TY_INT && InferType(expr->Right()) == TY_INT)
+        {
+            EmitCompareInt(block);
+        }
+        else
+        {
+            EmitCompare(block);
+        }
         break;
     case ExprNode::INCREMENT:
         EmitChildNodes(expr);
-        EmitIncrement(block);
+        if (InferType(expr->Left()) == TY_INT)
+        {
+            EmitIncrementInt(block);
+        }
+        else
+        {
+            EmitIncrement(block);
+        }
         break;
     case ExprNode::DECREMENT:
         EmitChildNodes(expr);
@@ -1325,7 +2195,25 @@ void Parser::EmitExpr(Expr* expr)
         break;
     case ExprNode::ADD:
         EmitChildNodes(expr);
-        EmitAdd(block);
+        switch (InferType(expr))
+        {
+        case TY_INT:
+            EmitAddInt(block);
+            break;
+        case TY_REAL:
+            if (InferType(expr->Left()) == TY_REAL && InferType(expr->Right()) == TY_REAL)
+            {
+                EmitAddReal(block);
+            }
+            else
+            {
+                EmitAdd(block);
+            }
+            break;
+        default:
+            EmitAdd(block);
+            break;
+        }
         break;
     case ExprNode::MUL:
         EmitChildNodes(expr);
@@ -1346,22 +2234,6 @@ void Parser::EmitExpr(Expr* expr)
         EmitChildNodes(expr);
         EmitDiv(block);
         break;
-    case ExprNode::GREATER:
-        EmitChildNodes(expr);
-        EmitCompare(block);
-        break;
-    case ExprNode::LESS:
-        EmitChildNodes(expr);
-        EmitCompare(block);
-        break;
-    case ExprNode::GREATER_EQUALS:
-        EmitChildNodes(expr);
-        EmitCompare(block);
-        break;
-    case ExprNode::LESS_EQUALS:
-        EmitChildNodes(expr);
-        EmitCompare(block);
-        break;
     case ExprNode::STRING:
         EmitChildNodes(expr);
         EmitPush(block, tok.String());
@@ -1406,6 +2278,7 @@ void Parser::EmitExpr(Expr* expr)
             const int id = ForwardDeclareFunction(ss.str());
             EmitPushLocal(block, frame._vars[""]);
             EmitCallD(block, id, int(args.size() + 1));
+            AddRelocation(block, id);
         }
         EmitPushLocal(block, frame._vars[""]);
         break;
@@ -1432,6 +2305,9 @@ void Parser::EmitExpr(Expr* expr)
         EmitPush(block, TY_STRING);
         EmitTableSet(block);
         break;
+    case ExprNode::TABLE_UPDATE:
+        EmitTableUpdateNode(expr);
+        break;
     case ExprNode::IDENTIFIER:
         EmitChildNodes(expr);
         if (expr->GetCall())
@@ -1443,22 +2319,33 @@ void Parser::EmitExpr(Expr* expr)
                 EmitExpr(args[i]);
             }
 
+            unsigned char fn = 0;
+            if (MathIntrinsic(expr, &fn))
+            {
+                EmitDebug(block, tok.Line());
+                EmitMath(block, fn);
+                break;
+            }
+
             const int id = ForwardDeclareFunction(tok.String());
 
             if (call->Yield())
             {
                 EmitDebug(block, tok.Line());
                 EmitYield(block, id, static_cast<unsigned char>(args.size()));
+                AddRelocation(block, id);
             }
             else if (call->Discard())
             {
                 EmitDebug(block, tok.Line());
                 EmitCallD(block, id, static_cast<unsigned char>(args.size()));
+                AddRelocation(block, id);
             }
-            else
+            else if (!InlineCall(tok.String(), int(args.size())))
             {
                 EmitDebug(block, tok.Line());
                 EmitCall(block, id, static_cast<unsigned char>(args.size()));
+                AddRelocation(block, id);
             }
         }
         else
@@ -1481,30 +2368,6 @@ void Parser::EmitExpr(Expr* expr)
     }
 }
 
-void Parser::FreeExpr(Expr* expr)
-{
-    if (expr)
-    {
-        if (expr->Right())
-        {
-            FreeExpr(expr->Right());
-        }
-
-        if (expr->Left())
-        {
-            FreeExpr(expr->Left());
-        }
-
-        if (expr->GetCall())
-        {
-            delete expr->GetCall();
-            expr->SetCall(nullptr);
-        }
-
-        delete expr;
-    }
-}
-
 void Parser::SetError(const std::string& text)
 {
     if (!_isError)
@@ -1548,7 +2411,6 @@ void Parser::ParseYield()
             call->SetYield();
 
             EmitExpr(expr);
-            FreeExpr(expr);
 
             if (Match(TokenType::SEMICOLON))
             {
@@ -1593,10 +2455,13 @@ void Parser::ParseReturn()
             else
             {
                 Expr* expr = ParseExprStatement();
-                if (expr)
+                if (expr && EmitTailCallExpr(expr))
+                {
+                    // The call takes the place of the return.
+                }
+                else if (expr)
                 {
                     EmitExpr(expr);
-                    FreeExpr(expr);
 
                     EmitReturn(Block());
                 }
@@ -1658,7 +2523,7 @@ Expr* Parser::ParseArray()
         {
             Advance();
 
-            return new Expr(nullptr, nullptr, tok, ExprNode::ARRAY);
+            return _arena.New<Expr>(nullptr, nullptr, tok, ExprNode::ARRAY);
         }
         else
         {
@@ -1684,15 +2549,16 @@ void Parser::ParseSelf()
                 Advance();
 
                 EmitExpr(expr);
-                EmitExpr(lhs);
+                if (expr && expr->Node() != ExprNode::TABLE_UPDATE)
+                {
+                    EmitExpr(lhs);
+                }
             }
             else
             {
                 SetError("Unexpected token.");
             }
 
-            FreeExpr(expr);
-            FreeExpr(lhs);
         }
         else
         {
@@ -1754,6 +2620,7 @@ void Parser::ParseClass()
                         {
                             const int id = _functions[token.String() + "::" + function].id;
                             EmitPushDelegate(base, id);
+                            AddRelocation(base, id);
                             EmitPushLocal(base, 0);
                             EmitPush(base, function);
                             EmitPush(base, TY_STRING);
@@ -1775,6 +2642,7 @@ void Parser::ParseClass()
                             EmitParameter(blk, "self");
                             EmitPushLocal(blk, 0);
                             EmitCallD(blk, baseId, 1);
+                            AddRelocation(blk, baseId);
                             EmitReturn(blk);
                             EmitProgramBlock(_program, blk);
                         }
@@ -1812,6 +2680,7 @@ void Parser::ParseConstructor(const std::string& name)
 
         ProgramBlock* block = nullptr;
         std::vector<std::string> params;
+        std::string function;
 
         if (identifier.String() == name)
         {
@@ -1825,7 +2694,7 @@ void Parser::ParseConstructor(const std::string& name)
 
                 std::stringstream ss;
                 ss << name << "::.ctr" << params.size();
-                const std::string function = ss.str();
+                function = ss.str();
 
                 block = CreateProgramBlock(false, function, int(params.size()));
 
@@ -1869,6 +2738,7 @@ void Parser::ParseConstructor(const std::string& name)
                     auto& top = _frames.emplace();
                     PushScope();
                     top._block = block;
+                    top._profile = FindProfile(function);
                     top._className = className;
                     top._isConstructor = true;
 
@@ -1876,6 +2746,7 @@ void Parser::ParseConstructor(const std::string& name)
                     const int baseId = ForwardDeclareFunction(className + "::.base");
                     EmitPushLocal(block, 0);
                     EmitCallD(block, baseId, 1);
+                    AddRelocation(block, baseId);
 
                     for (int i = 0; i < params.size(); i++)
                     {
@@ -1883,6 +2754,7 @@ void Parser::ParseConstructor(const std::string& name)
                         top._vars.insert(std::pair<std::string, int>(param, i));
                     }
 
+
                     while (_scanning && !Match(TokenType::CLOSE_BRACE))
                     {
                         ParseStatement();
@@ -1894,6 +2766,7 @@ void Parser::ParseConstructor(const std::string& name)
                     {
                         EmitReturn(Block());
                     }
+                    EmitColdBlocks();
 
                     EmitProgramBlock(_program, Block());
                     _frames.pop();
@@ -1913,7 +2786,7 @@ void Parser::ParseConstructor(const std::string& name)
     }
 }
 
-void Parser::ParseFunction()
+void Parser::ParseFunction(bool allowInline)
 {
     if (Match(TokenType::FUNCTION))
     {
@@ -1921,6 +2794,7 @@ void Parser::ParseFunction()
 
         ProgramBlock* block = nullptr;
         std::vector<std::string> params;
+        std::string name;
 
         if (Match(TokenType::IDENTIFIER))
         {
@@ -1931,7 +2805,7 @@ void Parser::ParseFunction()
             {
                 Advance();
 
-                std::string name = token.String();
+                name = token.String();
                 if (_frames.top()._className.size() > 0)
                 {
                     params.push_back("self");
@@ -1983,6 +2857,7 @@ void Parser::ParseFunction()
                     auto& top = _frames.emplace();
                     PushScope();
                     top._block = block;
+                    top._profile = FindProfile(name);
                     top._className = className;
 
                     for (int i = 0; i < params.size(); i++)
@@ -1991,6 +2866,9 @@ void Parser::ParseFunction()
                         top._vars.insert(std::pair<std::string, int>(param, i));
                     }
 
+                    top._numParams = int(params.size());
+                    MarkLabel(block, &top._start);
+
                     while (_scanning && !Match(TokenType::CLOSE_BRACE))
                     {
                         ParseStatement();
@@ -2005,6 +2883,13 @@ void Parser::ParseFunction()
                         {
                             EmitReturn(Block());
                         }
+                        EmitColdBlocks();
+
+                        // Small functions are substituted at the call sites which follow.
+                        if (allowInline && CanInlineBlock(block, inlineThreshold))
+                        {
+                            _functions[name].inlineable = true;
+                        }
 
                         EmitProgramBlock(_program, Block());
                         _frames.pop();
@@ -2034,11 +2919,6 @@ Expr* Parser::ParseCall()
     {
         Advance();
 
-        if (expr->GetCall())
-        {
-            delete expr->GetCall();
-        }
-
         Call* call = ParseArgument();
         expr->SetCall(call);
 
@@ -2052,7 +2932,7 @@ Expr* Parser::ParseCall()
 
 Call* Parser::ParseArgument()
 {
-    Call* call = new Call();
+    Call* call = _arena.New<Call>(_arena);
     Expr* expr = ParseExpression();
     if (expr)
     {
@@ -2072,19 +2952,19 @@ Expr* Parser::ParsePrimary()
     {
         Token str = Peek();
         Advance();
-        return new Expr(nullptr, nullptr, str, ExprNode::STRING);
+        return _arena.New<Expr>(nullptr, nullptr, str, ExprNode::STRING);
     }
     else if (Match(TokenType::NUMBER))
     {
         Token number = Peek();
         Advance();
-        return new Expr(nullptr, nullptr, number, ExprNode::NUMBER);
+        return _arena.New<Expr>(nullptr, nullptr, number, ExprNode::NUMBER);
     }
     else if (Match(TokenType::INTEGER))
     {
         Token number = Peek();
         Advance();
-        return new Expr(nullptr, nullptr, number, ExprNode::INTEGER);
+        return _arena.New<Expr>(nullptr, nullptr, number, ExprNode::INTEGER);
     }
     else if (Match(TokenType::OPEN_BRACKET))
     {
@@ -2098,8 +2978,8 @@ Expr* Parser::ParsePrimary()
         {
             Token id = Peek();
             Advance();
-            Expr* expr = new Expr(nullptr, nullptr, id, ExprNode::NEW);
-            expr->SetCall(new Call());
+            Expr* expr = _arena.New<Expr>(nullptr, nullptr, id, ExprNode::NEW);
+            expr->SetCall(_arena.New<Call>(_arena));
             return expr;
         }
         else
@@ -2112,7 +2992,7 @@ Expr* Parser::ParsePrimary()
         Token id = Peek();
         Advance();
         
-        Expr* expr = new Expr(nullptr, nullptr, id, ExprNode::IDENTIFIER);
+        Expr* expr = _arena.New<Expr>(nullptr, nullptr, id, ExprNode::IDENTIFIER);
         while (Match(TokenType::DOT) || Match(TokenType::OPEN_BRACKET))
         {
             Token token = Peek();
@@ -2120,7 +3000,7 @@ Expr* Parser::ParsePrimary()
 
             if (token.Type() == TokenType::OPEN_BRACKET)
             {
-                expr = new Expr(expr, ParseTerm(), token, ExprNode::ARRAY_GET);
+                expr = _arena.New<Expr>(expr, ParseTerm(), token, ExprNode::ARRAY_GET);
 
                 if (Match(TokenType::CLOSE_BRACKET))
                 {
@@ -2132,11 +3012,10 @@ Expr* Parser::ParsePrimary()
                 id = Peek();
                 Advance();
 
-                expr = new Expr(expr, nullptr, id, ExprNode::TABLE_GET);
+                expr = _arena.New<Expr>(expr, nullptr, id, ExprNode::TABLE_GET);
             }
             else
             {
-                FreeExpr(expr);
                 SetError("Unexpected token.");
                 break;
             }
@@ -2149,7 +3028,7 @@ Expr* Parser::ParsePrimary()
         Token self = Peek();
         Advance();
 
-        Expr* expr = new Expr(nullptr, nullptr, self, ExprNode::SELF);
+        Expr* expr = _arena.New<Expr>(nullptr, nullptr, self, ExprNode::SELF);
         while (Match(TokenType::DOT) || Match(TokenType::OPEN_BRACKET))
         {
             Token token = Peek();
@@ -2157,7 +3036,7 @@ Expr* Parser::ParsePrimary()
 
             if (token.Type() == TokenType::OPEN_BRACKET)
             {
-                expr = new Expr(expr, ParseTerm(), token, ExprNode::ARRAY_GET);
+                expr = _arena.New<Expr>(expr, ParseTerm(), token, ExprNode::ARRAY_GET);
 
                 if (Match(TokenType::CLOSE_BRACKET))
                 {
@@ -2169,11 +3048,10 @@ Expr* Parser::ParsePrimary()
                 Token id = Peek();
                 Advance();
 
-                expr = new Expr(expr, nullptr, id, ExprNode::TABLE_GET);
+                expr = _arena.New<Expr>(expr, nullptr, id, ExprNode::TABLE_GET);
             }
             else
             {
-                FreeExpr(expr);
                 SetError("Unexpected token.");
                 break;
             }
@@ -2194,7 +3072,6 @@ Expr* Parser::ParsePrimary()
         }
         else
         {
-            FreeExpr(expr);
             SetError("Unexpected token.");
         }
     }
@@ -2209,14 +3086,14 @@ Expr* Parser::ParseUnary()
         Token op = Peek();
         Advance();
         Expr* right = ParseUnary();
-        return new Expr(nullptr, right, op, ExprNode::SUB);
+        return _arena.New<Expr>(nullptr, right, op, ExprNode::SUB);
     }
     else if (Match(TokenType::NOT))
     {
         Token op = Peek();
         Advance();
         Expr* right = ParseUnary();
-        return new Expr(nullptr, right, op, ExprNode::NOT);
+        return _arena.New<Expr>(nullptr, right, op, ExprNode::NOT);
     }
 
     return ParseCall();
@@ -2230,7 +3107,7 @@ Expr* Parser::ParseFactor()
     {
         Token op = Peek();
         Advance();
-        expr = new Expr(expr, ParseUnary(), op, op.Type() == TokenType::SLASH ? ExprNode::DIV : ExprNode::MUL);
+        expr = _arena.New<Expr>(expr, ParseUnary(), op, op.Type() == TokenType::SLASH ? ExprNode::DIV : ExprNode::MUL);
     }
 
     return expr;
@@ -2244,7 +3121,7 @@ Expr* Parser::ParseTerm()
     {
         Token op = Peek();
         Advance();
-        expr = new Expr(expr, ParseFactor(), op, op.Type() == TokenType::PLUS ? ExprNode::ADD : ExprNode::SUB);
+        expr = _arena.New<Expr>(expr, ParseFactor(), op, op.Type() == TokenType::PLUS ? ExprNode::ADD : ExprNode::SUB);
     }
 
     return expr;
@@ -2258,7 +3135,7 @@ Expr* Parser::ParseLogicalAnd()
     {
         Token op = Peek();
         Advance();
-        expr = new Expr(expr, ParseEquality(), op, ExprNode::AND);
+        expr = _arena.New<Expr>(expr, ParseEquality(), op, ExprNode::AND);
     }
 
     return expr;
@@ -2272,7 +3149,7 @@ Expr* Parser::ParseLogicalOr()
     {
         Token op = Peek();
         Advance();
-        expr = new Expr(expr, ParseLogicalAnd(), op, ExprNode::OR);
+        expr = _arena.New<Expr>(expr, ParseLogicalAnd(), op, ExprNode::OR);
     }
 
     return expr;
@@ -2304,7 +3181,7 @@ Expr* Parser::ParseComparision()
             break;
         }
 
-        expr = new Expr(expr, ParseTerm(), op, node);
+        expr = _arena.New<Expr>(expr, ParseTerm(), op, node);
     }
 
     return expr;
@@ -2330,7 +3207,7 @@ Expr* Parser::ParseEquality()
         }
 
         Expr* right = ParseComparision();
-        expr = new Expr(expr, right, equals, node);
+        expr = _arena.New<Expr>(expr, right, equals, node);
     }
 
     return expr;
@@ -2343,6 +3220,14 @@ Expr* Parser::ParseExpression()
 
 void Parser::ParseIfStatement()
 {
+    std::string name;
+    std::vector<int> values;
+    if (ScanSwitch(_pos, &name, &values))
+    {
+        ParseSwitch(name, values);
+        return;
+    }
+
     Expr* expr = nullptr;
     if (Match(TokenType::OPEN_PARAN))
     {
@@ -2363,12 +3248,26 @@ void Parser::ParseIfStatement()
         {
             Advance();
 
-            Branch br;
+            Branch br(_arena);
 
-            br.graph.BuildFlowGraph(FoldExpr(expr));
-            EmitFlowGraph(br.graph, Block());
+            BuildFlowGraph(br.graph, FoldExpr(expr));
+
+            // A body which is rarely run is moved to the end of the function,
+            // which requires it to leave by returning.
+            double probability;
+            const StackFrame& frame = _frames.top();
+            const bool cold = _frames.size() > 1 && !frame._outlining &&
+                br.graph.Probability(&probability) && probability * COLD_BRANCH_RATIO < 1.0 &&
+                EndsWithReturn(_pos);
+
+            EmitFlowGraph(br.graph, Block(), !cold);
+            br.types = _frames.top()._types;
 
-            FreeExpr(expr);
+            if (cold)
+            {
+                ParseColdBlock(br);
+                return;
+            }
 
             PushScope();
             ParseStatementBlock();
@@ -2382,6 +3281,111 @@ void Parser::ParseIfStatement()
         SetError("Unexcepted token.");
     }
 }
+
+bool Parser::EndsWithReturn(int pos)
+{
+    // Looks ahead for a body whose last statement is a return and which has no ELSE clause.
+    int depth = 0;
+    int last = -1;
+    for (; pos < int(_tokens.size()); pos++)
+    {
+        const TokenType type = _tokens[pos].Type();
+        if (type == TokenType::OPEN_BRACE || type == TokenType::OPEN_PARAN) { depth++; }
+        else if (type == TokenType::CLOSE_PARAN) { depth--; }
+        else if (type == TokenType::CLOSE_BRACE)
+        {
+            if (depth == 0) { break; }
+            depth--;
+        }
+        else if (type == TokenType::RETURN && depth == 0) { last = pos; }
+        else if (type == TokenType::SEMICOLON && depth == 0 && last >= 0 && pos + 1 < int(_tokens.size()) &&
+            _tokens[pos + 1].Type() != TokenType::CLOSE_BRACE)
+        {
+            last = -1;
+        }
+    }
+
+    return last >= 0 && pos + 1 < int(_tokens.size()) && _tokens[pos + 1].Type() != TokenType::ELSE;
+}
+
+void Parser::ParseColdBlock(Branch& br)
+{
+    StackFrame& frame = _frames.top();
+    ProgramBlock* block = Block();
+    const int start = GetProgramBlockSize(block);
+
+    frame._outlining = true;
+    PushScope();
+    ParseStatementBlock();
+    PopScope();
+    frame._outlining = false;
+
+    // The body returns so the locals keep the types they had before it.
+    frame._types = br.types;
+
+    ColdBlock& cold = frame._cold.emplace_back();
+    cold.label = *br.graph.Success();
+    cold.code = CreateProgramBlock(false, "", 0);
+
+    for (auto& relocation : _relocations)
+    {
+        if (relocation.blk == block && relocation.pos >= start)
+        {
+            relocation.blk = cold.code;
+            relocation.pos -= start;
+        }
+    }
+
+    auto& jumps = frame._start.jumps;
+    for (auto it = jumps.begin(); it != jumps.end();)
+    {
+        if (*it >= start)
+        {
+            cold.tailJumps.push_back(*it - start);
+            it = jumps.erase(it);
+        }
+        else
+        {
+            it++;
+        }
+    }
+
+    MoveCode(block, start, cold.code);
+}
+
+void Parser::EmitColdBlocks()
+{
+    StackFrame& frame = _frames.top();
+    if (frame._cold.empty()) { return; }
+
+    ProgramBlock* block = Block();
+    for (ColdBlock& cold : frame._cold)
+    {
+        EmitLabel(block, &cold.label);
+
+        const int offset = GetProgramBlockSize(block);
+        for (auto& relocation : _relocations)
+        {
+            if (relocation.blk == cold.code)
+            {
+                relocation.blk = block;
+                relocation.pos += offset;
+            }
+        }
+
+        for (const int jump : cold.tailJumps)
+        {
+            frame._start.jumps.push_back(jump + offset);
+        }
+
+        MoveCode(cold.code, 0, block);
+        ReleaseProgramBlock(cold.code);
+    }
+
+    // The calls to the function itself have moved.
+    EmitMarkedLabel(block, &frame._start);
+    frame._cold.clear();
+}
  
 Expr* Parser::ParseExprStatement()
 {
@@ -2451,8 +3455,9 @@ void Parser::ParseAssignmentStatement()
                     if (lhs->Node() == ExprNode::IDENTIFIER)
                     {
                         EmitPop(Block(), var->second);
+                        SetType(identifier.String(), InferType(expr));
                     }
-                    else
+                    else if (expr && expr->Node() != ExprNode::TABLE_UPDATE)
                     {
                         EmitExpr(lhs);
                     }
@@ -2462,9 +3467,7 @@ void Parser::ParseAssignmentStatement()
                     SetError("Unexpected token.");
                 }
 
-                FreeExpr(expr);
             }
-            FreeExpr(lhs);
         }
         else
         {
@@ -2477,7 +3480,6 @@ void Parser::ParseAssignmentStatement()
                     call->SetDiscard();
 
                     EmitExpr(expr);
-                    FreeExpr(expr);
                 }
                 else
                 {
@@ -2506,7 +3508,7 @@ Expr* Parser::ParseAssignmentLhs()
 
     if (identifier.Type() == TokenType::SELF)
     {
-        expr = new Expr(nullptr, nullptr, identifier, ExprNode::SELF);
+        expr = _arena.New<Expr>(nullptr, nullptr, identifier, ExprNode::SELF);
 
         if (!Match(TokenType::DOT))
         {
@@ -2523,7 +3525,7 @@ Expr* Parser::ParseAssignmentLhs()
             return nullptr;
         }
 
-        expr = new Expr(nullptr, nullptr, identifier, ExprNode::IDENTIFIER);
+        expr = _arena.New<Expr>(nullptr, nullptr, identifier, ExprNode::IDENTIFIER);
     }
 
     if (Match(TokenType::DOT) || Match(TokenType::OPEN_BRACKET))
@@ -2545,11 +3547,11 @@ Expr* Parser::ParseAssignmentLhs()
 
                 if (Match(TokenType::DOT) || Match(TokenType::OPEN_PARAN) || Match(TokenType::OPEN_BRACKET))
                 {
-                    expr = new Expr(expr, term, token, ExprNode::ARRAY_GET);
+                    expr = _arena.New<Expr>(expr, term, token, ExprNode::ARRAY_GET);
                 }
                 else
                 {
-                    expr = new Expr(expr, term, token, ExprNode::ARRAY_SET);
+                    expr = _arena.New<Expr>(expr, term, token, ExprNode::ARRAY_SET);
                 }
             }
             else if (Match(TokenType::IDENTIFIER))
@@ -2559,11 +3561,11 @@ Expr* Parser::ParseAssignmentLhs()
 
                 if (Match(TokenType::DOT) || Match(TokenType::OPEN_PARAN) || Match(TokenType::OPEN_BRACKET))
                 {
-                    expr = new Expr(expr, nullptr, identifier, ExprNode::TABLE_GET);
+                    expr = _arena.New<Expr>(expr, nullptr, identifier, ExprNode::TABLE_GET);
                 }
                 else
                 {
-                    expr = new Expr(expr, nullptr, identifier, ExprNode::TABLE_SET);
+                    expr = _arena.New<Expr>(expr, nullptr, identifier, ExprNode::TABLE_SET);
                 }
             }
             else
@@ -2579,21 +3581,21 @@ Expr* Parser::ParseAssignmentLhs()
     return expr;
 }
 
-static Expr* Clone(Expr* lhs)
+static Expr* Clone(Arena& arena, Expr* lhs)
 {
     Expr* left = nullptr;
     if (lhs->Left())
     {
-        left = lhs->Left()->Clone();
+        left = lhs->Left()->Clone(arena);
     }
 
     Expr* right = nullptr;
     if (lhs->Right())
     {
-        right = lhs->Right()->Clone();
+        right = lhs->Right()->Clone(arena);
     }
 
-    Expr* clone = new Expr(left, right, lhs->Op(),
+    Expr* clone = arena.New<Expr>(left, right, lhs->Op(),
         lhs ->Node() == ExprNode::TABLE_SET ? ExprNode::TABLE_GET : lhs->Node());
     return clone;
 }
@@ -2607,15 +3609,32 @@ Expr* Parser::ParseAssignment(Expr* lhs)
         Advance();
         expr = ParseExpression();
     }
+    else if (lhs && (lhs->Node() == ExprNode::TABLE_SET || lhs->Node() == ExprNode::ARRAY_SET) &&
+        (Match(TokenType::INCREMENT) ||
+        Match(TokenType::DECREMENT) ||
+        Match(TokenType::PLUS_EQUALS) ||
+        Match(TokenType::MINUS_EQUALS) ||
+        Match(TokenType::STAR_EQUALS) ||
+        Match(TokenType::SLASH_EQUALS)))
+    {
+        // Updates the element in place rather than getting then setting it.
+        Advance();
+        Expr* value = nullptr;
+        if (op.Type() != TokenType::INCREMENT && op.Type() != TokenType::DECREMENT)
+        {
+            value = ParseExpression();
+        }
+        expr = _arena.New<Expr>(lhs, value, op, ExprNode::TABLE_UPDATE);
+    }
     else if (Match(TokenType::INCREMENT))
     {
         Advance();
-        expr = new Expr(Clone(lhs), nullptr, op, ExprNode::INCREMENT);
+        expr = _arena.New<Expr>(Clone(_arena, lhs), nullptr, op, ExprNode::INCREMENT);
     }
     else if (Match(TokenType::DECREMENT))
     {
         Advance();
-        expr = new Expr(Clone(lhs), nullptr, op, ExprNode::DECREMENT);
+        expr = _arena.New<Expr>(Clone(_arena, lhs), nullptr, op, ExprNode::DECREMENT);
     }
     else if (Match(TokenType::PLUS_EQUALS) ||
         Match(TokenType::MINUS_EQUALS) ||
@@ -2641,7 +3660,7 @@ Expr* Parser::ParseAssignment(Expr* lhs)
             break;
         }
 
-        expr = new Expr(Clone(lhs), ParseExpression(), op, type);
+        expr = _arena.New<Expr>(Clone(_arena, lhs), ParseExpression(), op, type);
     }
     else
     {
@@ -2678,7 +3697,7 @@ void Parser::ParseVar()
                     EmitExpr(FoldExpr(expr));
                     EmitLocal(Block(), identifier.String());
                     EmitPop(Block(), var);
-                    FreeExpr(expr);
+                    SetType(identifier.String(), InferType(expr));
 
                     Advance();
                 }
@@ -2692,79 +3711,248 @@ void Parser::ParseVar()
                 Advance();
                 EmitLocal(Block(), identifier.String());
 
-                const int var = int(top._vars.size());
+                const int var = int(top._vars.size());
+
+                StackFrame& frame = _frames.top();
+                frame._vars.insert(std::pair<std::string, int>(identifier.String(), var));
+                frame._scope.top().insert(identifier.String());
+                SetType(identifier.String(), TY_VOID);
+            }
+            else
+            {
+                SetError("Unexcepted token.");
+            }
+        }
+        else
+        {
+            SetError("Redefinition of variable " + identifier.String());
+        }
+    }
+    else
+    {
+        SetError("Unexcepted token.");
+    }
+}
+
+void Parser::ParseElse(Branch& prevBr)
+{
+    if (Match(TokenType::ELSE))
+    {
+        Advance();
+
+        // After the IF body is executed jump to the end.
+        EmitJump(Block(), JUMP, &prevBr.endLabel);
+
+        if (Match(TokenType::OPEN_BRACE))
+        {
+            Advance();
+
+            Branch br(_arena);
+            br.endLabel = prevBr.endLabel;
+
+            EmitLabel(Block(), prevBr.graph.Failure());
+
+            const TypeMap types = _frames.top()._types;
+            _frames.top()._types = prevBr.types;
+
+            PushScope();
+            ParseStatementBlock();
+            PopScope();
+
+            MergeTypes(types);
+
+            EmitLabel(Block(), br.graph.Failure());
+            EmitLabel(Block(), &br.endLabel); // end if
+        }
+        else if (Match(TokenType::IF))
+        {
+            Advance();
+
+            EmitLabel(Block(), prevBr.graph.Failure());
+            Label label = prevBr.endLabel;
+
+            const TypeMap types = _frames.top()._types;
+            _frames.top()._types = prevBr.types;
+
+            ParseIfStatement();
+
+            MergeTypes(types);
+
+            // Propagate the end labels.
+            auto& end = prevBr.endLabel;
+            end.jumps.insert(
+                end.jumps.end(),
+                label.jumps.begin(),
+                label.jumps.end());
+        }
+        else
+        {
+            SetError("Unexpected token after ELSE clause.");
+        }
+    }
+    else
+    {
+        EmitLabel(Block(), prevBr.graph.Failure());
+        EmitLabel(Block(), &prevBr.endLabel); // end if
+
+        MergeTypes(prevBr.types);
+    }
+}
+
+bool Parser::ScanSwitch(int pos, std::string* name, std::vector<int>* values)
+{
+    // Looks ahead for a chain of the form 'if (x == 1) {} else if (x == 2) {} ... else {}'
+    // where each condition compares the same local to a different integer.
+    const auto match = [this](int pos, TokenType type)
+    {
+        return pos < int(_tokens.size()) && _tokens[pos].Type() == type;
+    };
+
+    std::unordered_set<int> seen;
+    while (match(pos, TokenType::OPEN_PARAN) &&
+        match(pos + 1, TokenType::IDENTIFIER) &&
+        match(pos + 2, TokenType::EQUALS_EQUALS))
+    {
+        const std::string& identifier = _tokens[pos + 1].String();
+        if (!values->empty() && identifier != *name)
+        {
+            break;
+        }
+
+        int cur = pos + 3;
+        const bool negative = match(cur, TokenType::MINUS);
+        if (negative) { cur++; }
+        if (!match(cur, TokenType::INTEGER) ||
+            !match(cur + 1, TokenType::CLOSE_PARAN) ||
+            !match(cur + 2, TokenType::OPEN_BRACE))
+        {
+            break;
+        }
+
+        const int value = negative ? -_tokens[cur].Integer() : _tokens[cur].Integer();
+        if (!seen.insert(value).second)
+        {
+            break;
+        }
+
+        *name = identifier;
+        values->push_back(value);
+
+        // Skip over the body.
+        int depth = 1;
+        pos = cur + 3;
+        while (pos < int(_tokens.size()) && depth > 0)
+        {
+            if (_tokens[pos].Type() == TokenType::OPEN_BRACE) { depth++; }
+            else if (_tokens[pos].Type() == TokenType::CLOSE_BRACE) { depth--; }
+            pos++;
+        }
+
+        if (!match(pos, TokenType::ELSE) || !match(pos + 1, TokenType::IF))
+        {
+            break;
+        }
+        pos += 2;
+    }
+
+    return int(values->size()) >= MIN_SWITCH_CASES &&
+        _frames.top()._vars.find(*name) != _frames.top()._vars.end();
+}
+
+void Parser::ParseSwitch(const std::string& name, const std::vector<int>& values)
+{
+    // The local is read once and the matching case jumped to directly, through a table
+    // when the values are dense or otherwise a binary search, instead of testing each in turn.
+    ProgramBlock* block = Block();
+    const unsigned char local = static_cast<unsigned char>(_frames.top()._vars[name]);
+
+    std::vector<Label> labels(values.size());
+    Label defaultLabel = {};
+    Label endLabel = {};
 
-                StackFrame& frame = _frames.top();
-                frame._vars.insert(std::pair<std::string, int>(identifier.String(), var));
-                frame._scope.top().insert(identifier.String());
-            }
-            else
-            {
-                SetError("Unexcepted token.");
-            }
-        }
-        else
+    const auto minmax = std::minmax_element(values.begin(), values.end());
+    const int64_t range = int64_t(*minmax.second) - *minmax.first + 1;
+    if (range <= MAX_JUMP_TABLE && range <= int64_t(values.size()) * 2)
+    {
+        std::vector<Label*> table(size_t(range), nullptr);
+        for (size_t i = 0; i < values.size(); i++)
         {
-            SetError("Redefinition of variable " + identifier.String());
+            table[values[i] - *minmax.first] = &labels[i];
         }
+        EmitJumpTable(block, local, *minmax.first, table, &defaultLabel);
     }
     else
     {
-        SetError("Unexcepted token.");
+        std::vector<std::pair<int, Label*>> cases;
+        for (size_t i = 0; i < values.size(); i++)
+        {
+            cases.push_back(std::pair<int, Label*>(values[i], &labels[i]));
+        }
+        std::sort(cases.begin(), cases.end());
+        EmitJumpSearch(block, local, cases, &defaultLabel);
     }
-}
 
-void Parser::ParseElse(Branch& prevBr)
-{
-    if (Match(TokenType::ELSE))
+    const TypeMap types = _frames.top()._types;
+    TypeMap merged;
+    for (size_t i = 0; i < values.size() && !IsError(); i++)
     {
-        Advance();
-
-        // After the IF body is executed jump to the end.
-        EmitJump(Block(), JUMP, &prevBr.endLabel);
+        if (i > 0)
+        {
+            Advance(); // else
+            Advance(); // if
+        }
 
-        if (Match(TokenType::OPEN_BRACE))
+        // Skip the condition, it was read by the scan.
+        while (_scanning && !Match(TokenType::OPEN_BRACE))
         {
             Advance();
+        }
+        Advance();
 
-            Branch br;
-            br.endLabel = prevBr.endLabel;
+        EmitLabel(block, &labels[i]);
+        _frames.top()._types = types;
 
-            EmitLabel(Block(), prevBr.graph.Failure());
+        PushScope();
+        ParseStatementBlock();
+        PopScope();
 
-            PushScope();
-            ParseStatementBlock();
-            PopScope();
+        EmitJump(block, JUMP, &endLabel);
 
-            EmitLabel(Block(), br.graph.Failure());
-            EmitLabel(Block(), &br.endLabel); // end if
-        }
-        else if (Match(TokenType::IF))
+        if (i > 0)
         {
-            Advance();
+            MergeTypes(merged);
+        }
+        merged = _frames.top()._types;
+    }
 
-            EmitLabel(Block(), prevBr.graph.Failure());
-            Label label = prevBr.endLabel;
+    EmitLabel(block, &defaultLabel);
+    _frames.top()._types = types;
+
+    if (Match(TokenType::ELSE))
+    {
+        Advance();
 
+        if (Match(TokenType::IF))
+        {
+            Advance();
             ParseIfStatement();
+        }
+        else if (Match(TokenType::OPEN_BRACE))
+        {
+            Advance();
 
-            // Propagate the end labels.
-            auto& end = prevBr.endLabel;
-            end.jumps.insert(
-                end.jumps.end(),
-                label.jumps.begin(),
-                label.jumps.end());
+            PushScope();
+            ParseStatementBlock();
+            PopScope();
         }
         else
         {
             SetError("Unexpected token after ELSE clause.");
         }
     }
-    else
-    {
-        EmitLabel(Block(), prevBr.graph.Failure());
-        EmitLabel(Block(), &prevBr.endLabel); // end if
-    }
+
+    MergeTypes(merged);
+    EmitLabel(block, &endLabel);
 }
 
 void Parser::ParseFor()
@@ -2790,6 +3978,7 @@ void Parser::ParseFor()
             SetError("Unexpected token.");
         }
 
+        const int loopStart = _pos;
         Expr* second = ParseExpression();
 
         if (Match(TokenType::SEMICOLON))
@@ -2821,12 +4010,15 @@ void Parser::ParseFor()
 
                 // Before loop body
 
-                Branch br;
+                Branch br(_arena);
                 MarkLabel(Block(), &br.startLabel);
 
+                br.types = InferLoopTypes(loopStart);
+                _frames.top()._types = br.types;
+
                 if (second)
                 {
-                    br.graph.BuildFlowGraph(second);
+                    BuildFlowGraph(br.graph, second);
                     EmitFlowGraph(br.graph, Block());
                 }
 
@@ -2840,11 +4032,14 @@ void Parser::ParseFor()
 
                     EmitExpr(third);
                     EmitPop(Block(), frame._vars[left.String()]);
-                    FreeExpr(third);
+                    SetType(left.String(), InferType(third));
                 }
 
                 PopScope();
 
+                // The loop is left from its condition.
+                _frames.top()._types = br.types;
+
                 SunScript::ProgramBlock* prog = Block();
 
                 EmitJump(prog, JUMP, &br.startLabel);   // Unconditionally jump to start of loop.
@@ -2854,7 +4049,6 @@ void Parser::ParseFor()
                 if (second)
                 {
                     EmitLabel(prog, br.graph.Failure());
-                    FreeExpr(second);
                 }
             }
         }
@@ -2887,17 +4081,22 @@ void Parser::ParseWhile()
         {
             Advance();
 
-            Branch br;
+            Branch br(_arena);
             MarkLabel(Block(), &br.startLabel);
 
-            br.graph.BuildFlowGraph(expr);
+            br.types = InferLoopTypes(_pos);
+            _frames.top()._types = br.types;
+
+            BuildFlowGraph(br.graph, expr);
             EmitFlowGraph(br.graph, Block());
-            FreeExpr(expr);
 
             PushScope();
             ParseStatementBlock();
             PopScope();
 
+            // The loop is left from its condition.
+            _frames.top()._types = br.types;
+
             SunScript::ProgramBlock* prog = Block();
 
             EmitJump(prog, JUMP, &br.startLabel);   // Unconditionally jump to start of loop.
@@ -2949,6 +4148,17 @@ void Parser::ParseStatement()
     case TokenType::FUNCTION:
         ParseFunction();
         break;
+    case TokenType::NOINLINE:
+        Advance();
+        if (Match(TokenType::FUNCTION))
+        {
+            ParseFunction(false);
+        }
+        else
+        {
+            SetError("Unexpected token, expected function after noinline.");
+        }
+        break;
     case TokenType::RETURN:
         ParseReturn();
         break;
@@ -2970,14 +4180,19 @@ void Parser::ParseStatement()
     }
 }
 
-void Parser::Parse()
+void Parser::ParseStatements()
 {
-    _scanning = true;
+    _scanning = _tokens.size() > 0;
 
     while (_scanning)
     {
         ParseStatement();
     }
+}
+
+void Parser::Parse()
+{
+    ParseStatements();
 
     if (!_isError)
     {
@@ -3004,13 +4219,130 @@ void Parser::Parse()
         FlushBlocks(_program);
     }
 
+    ReleaseBlocks();
+}
+
+void Parser::ReleaseBlocks()
+{
     for (auto& func : _functions)
     {
         if (func.second.blk)
         {
             ReleaseProgramBlock(func.second.blk);
+            func.second.blk = nullptr;
+        }
+    }
+}
+
+void Parser::ParseModule()
+{
+    // Parses a module which is later linked with others into a single program,
+    // the top level statements are emitted as a function called by main.
+    ParseStatements();
+
+    if (!_isError)
+    {
+        EmitReturn(Block());
+        EmitProgramBlock(_program, Block());
+    }
+}
+
+Program* Parser::Link(const std::vector<Parser*>& modules, std::string* error)
+{
+    Program* program = CreateProgram();
+    std::unordered_map<std::string, Function> functions;
+
+    // Resolve the function ids across all the modules
+    for (Parser* module : modules)
+    {
+        for (auto& func : module->_functions)
+        {
+            const auto& it = functions.find(func.first);
+            if (it == functions.end())
+            {
+                functions.insert(std::pair<std::string, Function>(func.first, Function{ .id = CreateFunction(program), .blk = func.second.blk }));
+            }
+            else if (func.second.blk)
+            {
+                if (it->second.blk)
+                {
+                    if (error)
+                    {
+                        *error = "Redefinition of function " + func.first;
+                    }
+                    ReleaseProgram(program);
+                    return nullptr;
+                }
+
+                it->second.blk = func.second.blk;
+            }
+        }
+    }
+
+    // Remap the function ids referenced by each module
+    std::vector<int> remap;
+    for (Parser* module : modules)
+    {
+        remap.resize(module->_functions.size());
+        for (auto& func : module->_functions)
+        {
+            remap[func.second.id] = functions[func.first].id;
+        }
+
+        for (auto& reloc : module->_relocations)
+        {
+            PatchFunction(reloc.blk, reloc.pos, remap[reloc.id]);
+        }
+    }
+
+    // Generate main, which runs each module in turn
+    ProgramBlock* main = CreateProgramBlock(true, "main", 0);
+    const int mainId = CreateFunction(program);
+    for (Parser* module : modules)
+    {
+        EmitCallD(main, functions[module->_main].id, 0);
+    }
+    EmitDone(main);
+    EmitProgramBlock(program, main);
+    EmitInternalFunction(program, main, mainId);
+
+    for (Parser* module : modules)
+    {
+        for (auto& func : module->_functions)
+        {
+            if (func.second.blk)
+            {
+                EmitProgramBlock(program, func.second.blk);
+            }
+        }
+    }
+
+#if USE_SUN_FLOAT
+    EmitBuildFlags(program, BUILD_FLAG_SINGLE);
+#else
+    EmitBuildFlags(program, BUILD_FLAG_DOUBLE);
+#endif
+
+    for (auto& func : functions)
+    {
+        if (func.second.blk)
+        {
+            EmitInternalFunction(program, func.second.blk, func.second.id);
+        }
+        else
+        {
+            EmitExternalFunction(program, func.second.id, func.first);
         }
     }
+    FlushBlocks(program);
+
+    ReleaseProgramBlock(main);
+    for (Parser* module : modules)
+    {
+        module->ReleaseBlocks();
+    }
+
+    return program;
 }
 
 //====================
@@ -3050,6 +4382,27 @@ static SunScript::Program* Compile(Scanner& scanner, std::string* error)
     return program;
 }
 
+void SunScript::SetInlineThreshold(int size)
+{
+    inlineThreshold = size;
+}
+
+int SunScript::GetInlineThreshold()
+{
+    return inlineThreshold;
+}
+
+void SunScript::SetBranchProfile(const std::vector<BranchProfile>& profile)
+{
+    branchProfile.clear();
+    for (const BranchProfile& branch : profile)
+    {
+        SiteCount& count = branchProfile[branch.function][branch.site];
+        count.trueCount += branch.trueCount;
+        count.falseCount += branch.falseCount;
+    }
+}
+
 void SunScript::CompileText(const std::string& scriptText,
     unsigned char** programData, unsigned char** debugData,
     int* programSize, int* debugSize, std::string* error)
@@ -3057,16 +4410,7 @@ void SunScript::CompileText(const std::string& scriptText,
     SunScript::Program* program = nullptr;
 
     Scanner scanner;
-    std::stringstream ss(scriptText);
-
-    const int size = 512;
-    char line[size];
-
-    while (!ss.eof())
-    {
-        ss.getline(line, size);
-        scanner.ScanLine(line);
-    }
+    scanner.Scan(scriptText);
 
     program = Compile(scanner, error);
 
@@ -3081,24 +4425,33 @@ void SunScript::CompileText(const std::string& scriptText,
     }
 }
 
-static SunScript::Program* CompileFile2(const std::string& filepath, std::string* error)
+static bool ReadFile(const std::string& filepath, std::string& source)
 {
-    SunScript::Program* program = nullptr;
-
     std::ifstream stream;
-    stream.open(filepath);
+    stream.open(filepath, std::ios::binary | std::ios::ate);
     if (stream.good())
     {
-        const int size = 512;
-        char line[size];
+        // Read the whole file in one go, tokens are views into this buffer
+        // so it must stay alive until compilation has finished.
+        const std::streamsize size = stream.tellg();
+        source.resize(size_t(size));
+        stream.seekg(0, std::ios::beg);
+        stream.read(source.data(), size);
+        return true;
+    }
 
-        Scanner scanner;
+    return false;
+}
 
-        while (!stream.eof())
-        {
-            stream.getline(line, size);
-            scanner.ScanLine(line);
-        }
+static SunScript::Program* CompileFile2(const std::string& filepath, std::string* error)
+{
+    SunScript::Program* program = nullptr;
+
+    std::string source;
+    if (ReadFile(filepath, source))
+    {
+        Scanner scanner;
+        scanner.Scan(source);
 
         program = Compile(scanner, error);
     }
@@ -3138,6 +4491,124 @@ void SunScript::CompileFile(const std::string& filepath,
     }
 }
 
+//==========================
+// Batch compilation
+//==========================
+
+struct Module
+{
+    std::string filepath;
+    std::string source;
+    Scanner scanner;
+    std::unique_ptr<Parser> parser;
+    std::string error;
+};
+
+static void CompileModule(Module& module)
+{
+    if (!ReadFile(module.filepath, module.source))
+    {
+        module.error = module.filepath + " File not found.";
+        return;
+    }
+
+    module.scanner.Scan(module.source);
+    if (module.scanner.IsError())
+    {
+        std::stringstream ss;
+        ss << module.filepath << " Error Line: " << module.scanner.ErrorLine() << " " << module.scanner.Error();
+        module.error = ss.str();
+        return;
+    }
+
+    module.parser = std::make_unique<Parser>(module.scanner.Tokens(), module.filepath + "::.main");
+    module.parser->ParseModule();
+    if (module.parser->IsError())
+    {
+        std::stringstream ss;
+        ss << module.filepath << " Error Line: " << module.parser->ErrorLine() << " " << module.parser->Error();
+        module.error = ss.str();
+    }
+}
+
+void SunScript::CompileFiles(const std::vector<std::string>& filepaths, int numThreads,
+    unsigned char** programData, unsigned char** debugData,
+    int* programSize, int* debugSize, std::string* error)
+{
+    *programData = nullptr;
+
+    std::vector<Module> modules(filepaths.size());
+    for (size_t i = 0; i < filepaths.size(); i++)
+    {
+        modules[i].filepath = filepaths[i];
+    }
+
+    if (numThreads <= 0)
+    {
+        numThreads = std::max(1, int(std::thread::hardware_concurrency()));
+    }
+    numThreads = std::min(numThreads, int(modules.size()));
+
+    // Scan, parse and generate code for each file on the thread pool
+    std::atomic<size_t> next = 0;
+    auto worker = [&]() {
+        size_t index;
+        while ((index = next.fetch_add(1)) < modules.size())
+        {
+            CompileModule(modules[index]);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < numThreads; i++)
+    {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    std::vector<Parser*> parsers;
+    for (auto& module : modules)
+    {
+        if (module.error.size() > 0)
+        {
+            if (error)
+            {
+                *error = module.error;
+            }
+            break;
+        }
+        parsers.push_back(module.parser.get());
+    }
+
+    if (parsers.size() == modules.size())
+    {
+        Program* program = Parser::Link(parsers, error);
+        if (program)
+        {
+            *programSize = GetProgram(program, programData);
+
+            if (debugData)
+            {
+                *debugSize = GetDebugData(program, debugData);
+            }
+
+            ReleaseProgram(program);
+        }
+    }
+
+    for (auto& module : modules)
+    {
+        if (module.parser)
+        {
+            ReleaseProgram(module.parser->GetProgram());
+        }
+    }
+}
+
 //==========================
 // Sun compiler
 //==========================
@@ -3147,12 +4618,14 @@ void SunScript::CompileFile(const std::string& filepath,
 #include <cstring>
 #include "SunScriptDemo.h"
 #include "Tests/SunTest.h"
+#include "Benchmarks/SunBench.h"
     static void PrintHelp()
     {
         std::cout << "Usage:" << std::endl;
-        std::cout << "Sun build <file1> <file2>..." << std::endl;
+        std::cout << "Sun build [--profile <profile>] <file1> <file2>..." << std::endl;
         std::cout << "Sun disassemble <file1>" << std::endl;
         std::cout << "Sun demo" << std::endl;
+        std::cout << "Sun bench <name>" << std::endl;
     }
 
     static void Build(int numFiles, char** files)
@@ -3245,7 +4718,23 @@ void SunScript::CompileFile(const std::string& filepath,
             std::string cmd = args[1];
             if (cmd == "build")
             {
-                Build(numArgs - 2, args + 2);
+                if (numArgs > 3 && std::strcmp(args[2], "--profile") == 0)
+                {
+                    std::vector<BranchProfile> profile;
+                    if (LoadBranchProfile(args[3], &profile) == VM_OK)
+                    {
+                        SetBranchProfile(profile);
+                    }
+                    else
+                    {
+                        std::cout << "Failed to load profile: " << args[3] << std::endl;
+                    }
+                    Build(numArgs - 4, args + 4);
+                }
+                else
+                {
+                    Build(numArgs - 2, args + 2);
+                }
             }
             else if (cmd == "disassemble")
             {
@@ -3270,6 +4759,10 @@ void SunScript::CompileFile(const std::string& filepath,
                     RunTestSuite(args[2], opts);
                 }
             }
+            else if (cmd == "bench")
+            {
+                RunBenchmarks(numArgs <= 2 ? "" : args[2]);
+            }
             else if (cmd == "demo")
             {
                 std::cout << "Demos:" << std::endl;
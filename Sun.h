@@ -1,8 +1,14 @@
 #pragma once
 #include <string>
+#include <vector>
 
 namespace SunScript
 {
+    struct BranchProfile;
+
+    void SetInlineThreshold(int size);
+    int GetInlineThreshold();
+    void SetBranchProfile(const std::vector<BranchProfile>& profile);
     void CompileFile(const std::string& filepath, unsigned char** programData, int* programSize);
     void CompileFile(const std::string& filepath,
         unsigned char** programData, unsigned char** debugData,
@@ -10,6 +16,9 @@ namespace SunScript
     void CompileText(const std::string& scriptText,
         unsigned char** programData, unsigned char** debugData,
         int* programSize, int* debugSize, std::string* error);
+    void CompileFiles(const std::vector<std::string>& filepaths, int numThreads,
+        unsigned char** programData, unsigned char** debugData,
+        int* programSize, int* debugSize, std::string* error);
 }
 
 #ifdef _SUN_EXECUTABLE_
@@ -11,6 +11,8 @@
 #include <algorithm>
 #include <cstring>
 #include <sstream>
+#include <cmath>
+#include <mutex>
 
 #ifdef WIN32
 #define WIN32_LEAN_AND_MEAN
@@ -83,6 +85,7 @@ enum vm_sse_register
 #define VM_SSE_ARG8 (-1)
 #define VM_MAX_ARGS 4
 #define VM_MAX_SSE_ARGS 6
+#define VM_SSE_REAL_ARG2 VM_SSE_ARG2 // a real second argument after a pointer
 #else
 #define VM_ARG1 VM_REGISTER_EDI
 #define VM_ARG2 VM_REGISTER_ESI
@@ -100,6 +103,7 @@ enum vm_sse_register
 #define VM_SSE_ARG8 VM_SSE_REGISTER_XMM7
 #define VM_MAX_ARGS 6
 #define VM_MAX_SSE_ARGS 8
+#define VM_SSE_REAL_ARG2 VM_SSE_ARG1 // a real second argument after a pointer
 #endif
 
 enum vm_instruction_type
@@ -202,6 +206,9 @@ enum vm_instructions
     VMI_IDIV_SRC_REG,
     VMI_IDIV_SRC_MEM,
 
+    VMI_CMOVL64_SRC_REG_DST_REG,
+    VMI_CMOVG64_SRC_REG_DST_REG,
+
     // End of instructions
     VMI_MAX_INSTRUCTIONS
 };
@@ -234,6 +241,15 @@ enum vm_sse_instructions
 
     VMI_SSE_XORPD_SRC_REG_DST_REG,
 
+    VMI_SSE_SQRTSD_SRC_REG_DST_REG,
+    VMI_SSE_SQRTSD_SRC_MEM_DST_REG,
+
+    VMI_SSE_MINSD_SRC_REG_DST_REG,
+    VMI_SSE_MINSD_SRC_MEM_DST_REG,
+
+    VMI_SSE_MAXSD_SRC_REG_DST_REG,
+    VMI_SSE_MAXSD_SRC_MEM_DST_REG,
+
     VMI_SSE_MOVSS_SRC_REG_DST_REG,
     VMI_SSE_MOVSS_SRC_REG_DST_MEM,
     VMI_SSE_MOVSS_SRC_MEM_DST_REG,
@@ -258,6 +274,15 @@ enum vm_sse_instructions
 
     VMI_SSE_XORPS_SRC_REG_DST_REG,
 
+    VMI_SSE_SQRTSS_SRC_REG_DST_REG,
+    VMI_SSE_SQRTSS_SRC_MEM_DST_REG,
+
+    VMI_SSE_MINSS_SRC_REG_DST_REG,
+    VMI_SSE_MINSS_SRC_MEM_DST_REG,
+
+    VMI_SSE_MAXSS_SRC_REG_DST_REG,
+    VMI_SSE_MAXSS_SRC_MEM_DST_REG,
+
     // End of instructions
     VMI_SSE_MAX_INSTRUCTIONS
 };
@@ -347,6 +372,9 @@ static constexpr vm_instruction gInstructions[VMI_MAX_INSTRUCTIONS] = {
 
     INS(0x48, 0xF7, 0x7, VM_INSTRUCTION_UNARY, CODE_UR, VMI_ENC_M),     // VMI_IDIV_SRC_REG
     INS(0x48, 0xF7, 0x7, VM_INSTRUCTION_UNARY, CODE_UMO, VMI_ENC_M),     // VMI_IDIV_SRC_MEM
+
+    INS(0x48, 0x0F, 0x4C, VM_INSTRUCTION_BINARY, CODE_BRR, VMI_ENC_RM), // VMI_CMOVL64_SRC_REG_DST_REG
+    INS(0x48, 0x0F, 0x4F, VM_INSTRUCTION_BINARY, CODE_BRR, VMI_ENC_RM), // VMI_CMOVG64_SRC_REG_DST_REG
 };
 
 static constexpr vm_sse_instruction gInstructions_SSE[VMI_SSE_MAX_INSTRUCTIONS] = {
@@ -377,6 +405,15 @@ static constexpr vm_sse_instruction gInstructions_SSE[VMI_SSE_MAX_INSTRUCTIONS]
 
     SSE_INS(0x0, 0x66, 0xF, 0x57, VM_INSTRUCTION_BINARY, CODE_BRR, VMI_ENC_A), // VMI_SSE_XORPD_SRC_REG_DST_REG
 
+    SSE_INS(0x0, 0xF2, 0xF, 0x51, VM_INSTRUCTION_BINARY, CODE_BRR, VMI_ENC_A), // VMI_SSE_SQRTSD_SRC_REG_DST_REG
+    SSE_INS(0x0, 0xF2, 0xF, 0x51, VM_INSTRUCTION_BINARY, CODE_BRMO, VMI_ENC_A), // VMI_SSE_SQRTSD_SRC_MEM_DST_REG
+
+    SSE_INS(0x0, 0xF2, 0xF, 0x5D, VM_INSTRUCTION_BINARY, CODE_BRR, VMI_ENC_A), // VMI_SSE_MINSD_SRC_REG_DST_REG
+    SSE_INS(0x0, 0xF2, 0xF, 0x5D, VM_INSTRUCTION_BINARY, CODE_BRMO, VMI_ENC_A), // VMI_SSE_MINSD_SRC_MEM_DST_REG
+
+    SSE_INS(0x0, 0xF2, 0xF, 0x5F, VM_INSTRUCTION_BINARY, CODE_BRR, VMI_ENC_A), // VMI_SSE_MAXSD_SRC_REG_DST_REG
+    SSE_INS(0x0, 0xF2, 0xF, 0x5F, VM_INSTRUCTION_BINARY, CODE_BRMO, VMI_ENC_A), // VMI_SSE_MAXSD_SRC_MEM_DST_REG
+
     SSE_INS(0x0, 0xF3, 0xF, 0x10, VM_INSTRUCTION_BINARY, CODE_BRR, VMI_ENC_A), // VMI_SSE_MOVSS_SRC_REG_DST_REG
     SSE_INS(0x0, 0xF3, 0xF, 0x11, VM_INSTRUCTION_BINARY, CODE_BMRO, VMI_ENC_C), // VMI_SSE_MOVSS_SRC_REG_DST_MEM
     SSE_INS(0x0, 0xF3, 0xF, 0x10, VM_INSTRUCTION_BINARY, CODE_BRMO, VMI_ENC_A), // VMI_SSE_MOVSS_SRC_MEM_DST_REG
@@ -401,6 +438,14 @@ static constexpr vm_sse_instruction gInstructions_SSE[VMI_SSE_MAX_INSTRUCTIONS]
 
     SSE_INS(0x0, VMI_UNUSED, 0xF, 0x57, VM_INSTRUCTION_BINARY, CODE_BRR, VMI_ENC_A), // VMI_SSE_XORPS_SRC_REG_DST_REG
 
+    SSE_INS(0x0, 0xF3, 0xF, 0x51, VM_INSTRUCTION_BINARY, CODE_BRR, VMI_ENC_A), // VMI_SSE_SQRTSS_SRC_REG_DST_REG
+    SSE_INS(0x0, 0xF3, 0xF, 0x51, VM_INSTRUCTION_BINARY, CODE_BRMO, VMI_ENC_A), // VMI_SSE_SQRTSS_SRC_MEM_DST_REG
+
+    SSE_INS(0x0, 0xF3, 0xF, 0x5D, VM_INSTRUCTION_BINARY, CODE_BRR, VMI_ENC_A), // VMI_SSE_MINSS_SRC_REG_DST_REG
+    SSE_INS(0x0, 0xF3, 0xF, 0x5D, VM_INSTRUCTION_BINARY, CODE_BRMO, VMI_ENC_A), // VMI_SSE_MINSS_SRC_MEM_DST_REG
+
+    SSE_INS(0x0, 0xF3, 0xF, 0x5F, VM_INSTRUCTION_BINARY, CODE_BRR, VMI_ENC_A), // VMI_SSE_MAXSS_SRC_REG_DST_REG
+    SSE_INS(0x0, 0xF3, 0xF, 0x5F, VM_INSTRUCTION_BINARY, CODE_BRMO, VMI_ENC_A), // VMI_SSE_MAXSS_SRC_MEM_DST_REG
 };
 
 //=====================
@@ -1048,6 +1093,16 @@ inline static void vm_neg_reg_x64(unsigned char* program, int& count, int reg)
     vm_emit_ur(gInstructions[VMI_NEG64_DST_REG], program, count, reg);
 }
 
+inline static void vm_cmovl_reg_to_reg_x64(unsigned char* program, int& count, char dst, char src)
+{
+    vm_emit_brr(gInstructions[VMI_CMOVL64_SRC_REG_DST_REG], program, count, dst, src);
+}
+
+inline static void vm_cmovg_reg_to_reg_x64(unsigned char* program, int& count, char dst, char src)
+{
+    vm_emit_brr(gInstructions[VMI_CMOVG64_SRC_REG_DST_REG], program, count, dst, src);
+}
+
 inline static void vm_movsd_reg_to_reg_x64(unsigned char* program, int& count, int dst, int src)
 {
 #ifdef USE_SUN_FLOAT
@@ -1201,6 +1256,81 @@ inline static void vm_xorpd_reg_to_reg_x64(unsigned char* program, int& count, i
 #endif
 }
 
+inline static void vm_sqrtsd_reg_to_reg_x64(unsigned char* program, int& count, int dst, int src)
+{
+#ifdef USE_SUN_FLOAT
+    vm_emit_sse_brr(gInstructions_SSE[VMI_SSE_SQRTSS_SRC_REG_DST_REG], program, count, src, dst);
+#else
+    vm_emit_sse_brr(gInstructions_SSE[VMI_SSE_SQRTSD_SRC_REG_DST_REG], program, count, src, dst);
+#endif
+}
+
+inline static void vm_sqrtsd_memory_to_reg_x64(unsigned char* program, int& count, int dst, int src, int src_offset)
+{
+#ifdef USE_SUN_FLOAT
+    vm_emit_sse_brmo(gInstructions_SSE[VMI_SSE_SQRTSS_SRC_MEM_DST_REG], program, count, src, dst, src_offset);
+#else
+    vm_emit_sse_brmo(gInstructions_SSE[VMI_SSE_SQRTSD_SRC_MEM_DST_REG], program, count, src, dst, src_offset);
+#endif
+}
+
+inline static void vm_minsd_reg_to_reg_x64(unsigned char* program, int& count, int dst, int src)
+{
+#ifdef USE_SUN_FLOAT
+    vm_emit_sse_brr(gInstructions_SSE[VMI_SSE_MINSS_SRC_REG_DST_REG], program, count, src, dst);
+#else
+    vm_emit_sse_brr(gInstructions_SSE[VMI_SSE_MINSD_SRC_REG_DST_REG], program, count, src, dst);
+#endif
+}
+
+inline static void vm_minsd_memory_to_reg_x64(unsigned char* program, int& count, int dst, int src, int src_offset)
+{
+#ifdef USE_SUN_FLOAT
+    vm_emit_sse_brmo(gInstructions_SSE[VMI_SSE_MINSS_SRC_MEM_DST_REG], program, count, src, dst, src_offset);
+#else
+    vm_emit_sse_brmo(gInstructions_SSE[VMI_SSE_MINSD_SRC_MEM_DST_REG], program, count, src, dst, src_offset);
+#endif
+}
+
+inline static void vm_maxsd_reg_to_reg_x64(unsigned char* program, int& count, int dst, int src)
+{
+#ifdef USE_SUN_FLOAT
+    vm_emit_sse_brr(gInstructions_SSE[VMI_SSE_MAXSS_SRC_REG_DST_REG], program, count, src, dst);
+#else
+    vm_emit_sse_brr(gInstructions_SSE[VMI_SSE_MAXSD_SRC_REG_DST_REG], program, count, src, dst);
+#endif
+}
+
+inline static void vm_maxsd_memory_to_reg_x64(unsigned char* program, int& count, int dst, int src, int src_offset)
+{
+#ifdef USE_SUN_FLOAT
+    vm_emit_sse_brmo(gInstructions_SSE[VMI_SSE_MAXSS_SRC_MEM_DST_REG], program, count, src, dst, src_offset);
+#else
+    vm_emit_sse_brmo(gInstructions_SSE[VMI_SSE_MAXSD_SRC_MEM_DST_REG], program, count, src, dst, src_offset);
+#endif
+}
+
+inline static void vm_roundsd_reg_to_reg_x64(unsigned char* program, int& count, int dst, int src, unsigned char mode)
+{
+    // SSE4.1, the three byte opcode does not fit the instruction table.
+    program[count++] = 0x66;
+
+    unsigned char rex = 0;
+    if (src >= VM_SSE_REGISTER_XMM8) { rex |= 0x1 | (1 << 6); }
+    if (dst >= VM_SSE_REGISTER_XMM8) { rex |= 0x4 | (1 << 6); }
+    if (rex > 0) { program[count++] = rex; }
+
+    program[count++] = 0x0F;
+    program[count++] = 0x3A;
+#ifdef USE_SUN_FLOAT
+    program[count++] = 0x0A; // roundss
+#else
+    program[count++] = 0x0B; // roundsd
+#endif
+    program[count++] = (((dst % 8) & 0x7) << 3) | (0x3 << 6) | ((src % 8) & 0x7);
+    program[count++] = mode;
+}
+
 //===========================
 // Forward decl
 //===========================
@@ -2099,11 +2229,34 @@ void JIT_Analyzer::Load(unsigned char* ir, unsigned int count)
             p1 = vm_jit_read_int(ir, &pc);
             isSSE = true;
             break;
+        case IR_ABS_INT:
+            p1 = vm_jit_read_int(ir, &pc);
+            break;
+        case IR_SQRT_REAL:
+        case IR_SIN_REAL:
+        case IR_COS_REAL:
+        case IR_ABS_REAL:
+        case IR_FLOOR_REAL:
+            p1 = vm_jit_read_int(ir, &pc);
+            isSSE = true;
+            break;
+        case IR_MIN_INT:
+        case IR_MAX_INT:
+            p1 = vm_jit_read_int(ir, &pc);
+            p2 = vm_jit_read_int(ir, &pc);
+            break;
+        case IR_MIN_REAL:
+        case IR_MAX_REAL:
+            p1 = vm_jit_read_int(ir, &pc);
+            p2 = vm_jit_read_int(ir, &pc);
+            isSSE = true;
+            break;
         case IR_LOOPSTART:
             break;
         case IR_PHI:
             p1 = vm_jit_read_int(ir, &pc);
             p2 = vm_jit_read_int(ir, &pc);
+            isSSE = p1 > -1 && p1 < ref && sse[p1];
             {
                 Phi& phi = phis.emplace_back();
                 phi.left = p1;
@@ -2118,7 +2271,8 @@ void JIT_Analyzer::Load(unsigned char* ir, unsigned int count)
                 const int numSlots = ir[pc++];
                 for (int i = 0; i < numSlots; i++)
                 {
-                    const int slot = ir[pc++];
+                    const int slot = vm_jit_read_int(ir, &pc);
+                    pc++; // local
                     liveness[slot] = std::max(liveness[slot], ref - slot);
                 }
             }
@@ -2372,12 +2526,98 @@ struct JIT_Phi
     int _right;
 };
 
+struct JIT_SnapEntry
+{
+    int _ref;
+    int _local;     // the local the value is restored to
+};
+
 struct JIT_Snapshot
 {
     int _ref;
-    std::vector<int> entries;
+    std::vector<JIT_SnapEntry> entries;
+};
+
+struct JIT_Exit
+{
+    int _snap;
+    int _jump;      // offset of the jump over the link
+    int _slow;      // the jump's displacement to the exit through the VM
+    int _target;    // offset of the address of the trace the exit is linked to
+};
+
+//===================================
+// Code heap
+//===================================
+
+// Traces are carved out of large regions rather than each mapping pages of their own.
+// A region holds code at the front and the constants the code reads at the back, which keeps
+// the constants within reach of RIP-relative addressing and lets traces share their pages.
+// A trace is emitted into a buffer of its own for the place reserved for it, so it can be
+// compiled on any thread. It is copied in by the VM's thread while no trace is executing,
+// with the region writable but not executable for the copy.
+
+constexpr int JIT_REGION_CODE_SIZE = 1024 * 1024;       // bytes of code in a region
+constexpr int JIT_REGION_CONSTANT_SIZE = 1024 * 64;     // bytes of constants in a region
+constexpr int JIT_CHUNK_ALIGN = 16;
+constexpr int JIT_TRACE_RESERVE = 1024 * 64;            // the space reserved for a trace while it is emitted
+constexpr int JIT_TRACE_SLACK = 1024 * 16;              // space kept for the instruction being emitted
+
+struct JIT_Chunk
+{
+    int _offset;
+    int _size;
 };
 
+struct JIT_Region
+{
+    unsigned char* _data;
+    int _codeSize;
+    int _constantSize;
+    int _live;                              // the number of traces placed in the region
+    std::vector<JIT_Chunk> _freeCode;       // ordered by offset
+    std::vector<JIT_Chunk> _freeConstants;  // ordered by offset
+};
+
+struct JIT_Placement
+{
+    JIT_Region* _region;
+    int _code;              // offset of the code in the region
+    int _codeSize;
+    int _constants;         // offset of the constants in the region, -1 if there are none
+    int _constantSize;
+};
+
+class JIT_CodeHeap
+{
+public:
+    JIT_CodeHeap() = default;
+    JIT_CodeHeap(const JIT_CodeHeap&) = delete;
+    JIT_CodeHeap& operator=(const JIT_CodeHeap&) = delete;
+    ~JIT_CodeHeap();
+
+    void Reserve(int constantSize, JIT_Placement* placement);
+    void Trim(JIT_Placement* placement, int codeSize);
+    void Install(const JIT_Placement& placement, const unsigned char* code, const unsigned char* constants, int constantSize);
+    void Patch(const JIT_Placement& placement, int offset, const void* data, int size);
+    void Free(JIT_Placement* placement);
+    void GetStats(JitStats* stats);
+
+private:
+    JIT_Region* CreateRegion(int constantSize);
+    void ReleaseRegion(JIT_Region* region);
+    static bool Take(std::vector<JIT_Chunk>& chunks, int size, int* offset);
+    static void Give(std::vector<JIT_Chunk>& chunks, int offset, int size);
+    static int Largest(const std::vector<JIT_Chunk>& chunks);
+
+    std::vector<std::unique_ptr<JIT_Region>> _regions;
+    std::mutex _lock;       // traces are placed from the compiling thread and freed from the VM's
+};
+
+//===================================
+
+struct JIT_Manager;
+
 struct JIT_Trace
 {
     void* _jit_data;
@@ -2386,6 +2626,10 @@ struct JIT_Trace
     unsigned char* _record;
     void* _constantPage;
     int _constantSize;
+    JIT_Placement _placement;   // where the code and constants live in the code heap
+    JIT_Manager* _manager;
+    std::vector<unsigned char> _code;       // the code until it is installed
+    std::vector<unsigned char> _constants;  // the constants until they are installed
 
     int _id;
     MemoryManager _mm;
@@ -2395,10 +2639,12 @@ struct JIT_Trace
     std::vector<JIT_ExitJump> _exitJumps;
     std::vector<JIT_Phi> _phis;
     std::vector<JIT_Snapshot> _snaps;
+    std::vector<JIT_Exit> _exits;
 
     uint64_t _startTime;     // compilation start time
     uint64_t _endTime;       // compilation end time
     uint64_t _runCount;      // number of times the trace has been invoked
+    uint64_t _entered;       // the entry from the VM the trace's memory was last reset for
 };
 
 class JIT_Coroutine
@@ -2418,6 +2664,9 @@ class JIT_Manager
 public:
     MemoryManager _mm;
     JIT_Coroutine _co;
+    JIT_CodeHeap _heap;
+    int _caps;
+    uint64_t _entries;      // the number of times the VM has entered a trace
 };
 
 class Jitter
@@ -2425,7 +2674,9 @@ class Jitter
 public:
     unsigned char* program;
     unsigned char* jit;
+    unsigned char* base;    // the address the code will be executed from
     int count;
+    int capacity;
     unsigned int* pc;
     JIT_Trace* _trace;
     JIT_Manager* _manager;
@@ -2441,7 +2692,9 @@ public:
     Jitter() :
         program(nullptr),
         jit(nullptr),
+        base(nullptr),
         count(0),
+        capacity(0),
         pc(nullptr),
         running(true),
         error(false),
@@ -2555,14 +2808,231 @@ void vm_free(void* data, int size)
 
 void vm_begin_patch(void* data, int size)
 {
+    mprotect(data, size, PROT_READ | PROT_WRITE);
 }
 
 void vm_commit_patch(void* data, int size)
 {
-
+    mprotect(data, size, PROT_EXEC | PROT_READ);
 }
 #endif
 
+//===================================
+
+static int vm_align(int size, int alignment)
+{
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+JIT_CodeHeap::~JIT_CodeHeap()
+{
+    for (auto& region : _regions)
+    {
+        vm_free(region->_data, region->_codeSize + region->_constantSize);
+    }
+}
+
+JIT_Region* JIT_CodeHeap::CreateRegion(int constantSize)
+{
+    // Constants which outgrow the usual area get a region sized for them.
+    const int pageSize = 1024 * 4;
+    auto& region = _regions.emplace_back(std::make_unique<JIT_Region>());
+    region->_codeSize = JIT_REGION_CODE_SIZE;
+    region->_constantSize = std::max(JIT_REGION_CONSTANT_SIZE, vm_align(constantSize, pageSize));
+    region->_live = 0;
+    region->_data = reinterpret_cast<unsigned char*>(vm_allocate(region->_codeSize + region->_constantSize));
+    region->_freeCode.push_back({ 0, region->_codeSize });
+    region->_freeConstants.push_back({ region->_codeSize, region->_constantSize });
+
+    vm_initialize(region->_data, region->_codeSize);
+    vm_readonly(region->_data + region->_codeSize, region->_constantSize);
+    return region.get();
+}
+
+void JIT_CodeHeap::ReleaseRegion(JIT_Region* region)
+{
+    for (size_t i = 0; i < _regions.size(); i++)
+    {
+        if (_regions[i].get() == region)
+        {
+            vm_free(region->_data, region->_codeSize + region->_constantSize);
+            _regions.erase(_regions.begin() + i);
+            break;
+        }
+    }
+}
+
+bool JIT_CodeHeap::Take(std::vector<JIT_Chunk>& chunks, int size, int* offset)
+{
+    // First fit, the remainder of the chunk stays free.
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+        auto& chunk = chunks[i];
+        if (chunk._size >= size)
+        {
+            *offset = chunk._offset;
+            chunk._offset += size;
+            chunk._size -= size;
+            if (chunk._size == 0)
+            {
+                chunks.erase(chunks.begin() + i);
+            }
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void JIT_CodeHeap::Give(std::vector<JIT_Chunk>& chunks, int offset, int size)
+{
+    // Coalesce with the neighbouring free chunks so space left by dead traces is reused whole.
+    if (size <= 0)
+    {
+        return;
+    }
+
+    auto it = std::lower_bound(chunks.begin(), chunks.end(), offset,
+        [](const JIT_Chunk& chunk, int offset) { return chunk._offset < offset; });
+    it = chunks.insert(it, { offset, size });
+
+    auto next = it + 1;
+    if (next != chunks.end() && it->_offset + it->_size == next->_offset)
+    {
+        it->_size += next->_size;
+        chunks.erase(next);
+    }
+
+    if (it != chunks.begin())
+    {
+        auto prev = it - 1;
+        if (prev->_offset + prev->_size == it->_offset)
+        {
+            prev->_size += it->_size;
+            chunks.erase(it);
+        }
+    }
+}
+
+int JIT_CodeHeap::Largest(const std::vector<JIT_Chunk>& chunks)
+{
+    int largest = 0;
+    for (auto& chunk : chunks)
+    {
+        largest = std::max(largest, chunk._size);
+    }
+    return largest;
+}
+
+void JIT_CodeHeap::Reserve(int constantSize, JIT_Placement* placement)
+{
+    // The trace's size isn't known until it has been emitted, so it is given space for
+    // the largest trace which Trim gives back once the trace is emitted.
+    std::lock_guard<std::mutex> lock(_lock);
+    const int constantsNeeded = vm_align(constantSize, JIT_CHUNK_ALIGN);
+
+    JIT_Region* region = nullptr;
+    for (auto& candidate : _regions)
+    {
+        if (Largest(candidate->_freeCode) >= JIT_TRACE_RESERVE &&
+            Largest(candidate->_freeConstants) >= constantsNeeded)
+        {
+            region = candidate.get();
+            break;
+        }
+    }
+
+    if (!region)
+    {
+        region = CreateRegion(constantsNeeded);
+    }
+
+    placement->_region = region;
+    placement->_constants = -1;
+    placement->_constantSize = constantsNeeded;
+    if (constantsNeeded > 0)
+    {
+        Take(region->_freeConstants, constantsNeeded, &placement->_constants);
+    }
+
+    placement->_codeSize = JIT_TRACE_RESERVE;
+    Take(region->_freeCode, placement->_codeSize, &placement->_code);
+    region->_live++;
+}
+
+void JIT_CodeHeap::Trim(JIT_Placement* placement, int codeSize)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    JIT_Region* region = placement->_region;
+    const int used = vm_align(codeSize, JIT_CHUNK_ALIGN);
+    Give(region->_freeCode, placement->_code + used, placement->_codeSize - used);
+    placement->_codeSize = used;
+}
+
+void JIT_CodeHeap::Install(const JIT_Placement& placement, const unsigned char* code, const unsigned char* constants, int constantSize)
+{
+    // Traces elsewhere in the region can't be executed during the copy.
+    std::lock_guard<std::mutex> lock(_lock);
+    JIT_Region* region = placement._region;
+    if (constantSize > 0)
+    {
+        unsigned char* data = region->_data + region->_codeSize;
+        vm_begin_patch(data, region->_constantSize);
+        std::memcpy(region->_data + placement._constants, constants, constantSize);
+        vm_readonly(data, region->_constantSize);
+    }
+
+    vm_begin_patch(region->_data, region->_codeSize);
+    std::memcpy(region->_data + placement._code, code, placement._codeSize);
+    vm_commit_patch(region->_data, region->_codeSize);
+}
+
+void JIT_CodeHeap::Patch(const JIT_Placement& placement, int offset, const void* data, int size)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    JIT_Region* region = placement._region;
+    vm_begin_patch(region->_data, region->_codeSize);
+    std::memcpy(region->_data + placement._code + offset, data, size);
+    vm_commit_patch(region->_data, region->_codeSize);
+}
+
+void JIT_CodeHeap::Free(JIT_Placement* placement)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    JIT_Region* region = placement->_region;
+    Give(region->_freeCode, placement->_code, placement->_codeSize);
+    if (placement->_constants != -1)
+    {
+        Give(region->_freeConstants, placement->_constants, placement->_constantSize);
+    }
+
+    // An empty region is unmapped, keeping one around for the next trace.
+    if (--region->_live == 0 && _regions.size() > 1)
+    {
+        ReleaseRegion(region);
+    }
+    placement->_region = nullptr;
+}
+
+void JIT_CodeHeap::GetStats(JitStats* stats)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    *stats = JitStats();
+    for (auto& region : _regions)
+    {
+        size_t freeCode = 0;
+        for (auto& chunk : region->_freeCode) { freeCode += chunk._size; }
+        size_t freeConstants = 0;
+        for (auto& chunk : region->_freeConstants) { freeConstants += chunk._size; }
+
+        stats->regions++;
+        stats->reserved += size_t(region->_codeSize) + region->_constantSize;
+        stats->code += region->_codeSize - freeCode;
+        stats->constants += region->_constantSize - freeConstants;
+        stats->traces += region->_live;
+    }
+}
+
 extern "C"
 {
     static int vm_pop_int_stub(VirtualMachine* vm)
@@ -2613,6 +3083,21 @@ extern "C"
         return size;
     }
 
+    static void* vm_link_trace(VirtualMachine* vm, JIT_Trace* trace, unsigned char* record)
+    {
+        // The linked trace carries on with the locals the exit stored in the record.
+        // Its memory is reset the first time it is entered since the VM entered a trace.
+        if (trace->_entered != trace->_manager->_entries)
+        {
+            trace->_mm.Reset();
+            trace->_entered = trace->_manager->_entries;
+        }
+        trace->_record = record;
+        trace->_runCount++;
+        EnterTrace(vm, trace->_id);
+        return trace->_jit_data;
+    }
+
     static void* vm_box_int(MemoryManager* mm, int value)
     {
         int* integer = reinterpret_cast<int*>(mm->New(sizeof(int), TY_INT));
@@ -2728,6 +3213,21 @@ extern "C"
     {
         SetTableHash(table, key, value);
     }
+
+    static real vm_math_sin(real value)
+    {
+        return std::sin(value);
+    }
+
+    static real vm_math_cos(real value)
+    {
+        return std::cos(value);
+    }
+
+    static real vm_math_floor(real value)
+    {
+        return std::floor(value);
+    }
 }
 
 // =================================
@@ -3001,6 +3501,30 @@ static void vm_jit_guard(Jitter* jitter)
     jitter->_trace->_forwardJumps.push_back(jump);
 }
 
+static void vm_jit_move_phi(Jitter* jitter, const JIT_Allocation& src, const JIT_Allocation& phi)
+{
+    if (phi.isSSE)
+    {
+        const int dst = vm_jit_decode_dst_sse(phi);
+        vm_jit_mov_sse(jitter, src, dst);
+
+        if (phi.type == ST_STACK)
+        {
+            vm_movsd_reg_to_memory_x64(jitter->jit, jitter->count, phi.reg, dst, phi.pos);
+        }
+    }
+    else
+    {
+        const int dst = vm_jit_decode_dst(phi);
+        vm_jit_mov(jitter, src, dst);
+
+        if (phi.type == ST_STACK)
+        {
+            vm_mov_reg_to_memory_x64(jitter->jit, jitter->count, phi.reg, phi.pos, dst);
+        }
+    }
+}
+
 static void vm_jit_loopback(Jitter* jitter)
 {
     const int type = jitter->program[*jitter->pc];
@@ -3025,13 +3549,7 @@ static void vm_jit_loopback(Jitter* jitter)
             JIT_Allocation a1 = jitter->analyzer.GetAllocation(phi._right);
             JIT_Allocation a2 = jitter->analyzer.GetAllocation(phi._pos);
 
-            const int dst = vm_jit_decode_dst(a2);
-            vm_jit_mov(jitter, a1, dst);
-
-            if (a2.type == ST_STACK)
-            {
-                vm_mov_reg_to_memory_x64(jitter->jit, jitter->count, a2.reg, a2.pos, dst);
-            }
+            vm_jit_move_phi(jitter, a1, a2);
         }
     }
 
@@ -3077,9 +3595,14 @@ static void vm_jit_append_string_int(Jitter* jitter)
 
     vm_jit_call_internal_x64(jitter, (void*)vm_append_string_int);
     
-    if (a3.reg != VM_REGISTER_EAX)
+    switch (a3.type)
     {
-        vm_mov_reg_to_reg_x64(jitter->jit, jitter->count, a3.reg, VM_REGISTER_EAX);
+        case ST_REG:
+            vm_mov_reg_to_reg_x64(jitter->jit, jitter->count, a3.reg, VM_REGISTER_EAX);
+            break;
+        case ST_STACK:
+            vm_mov_reg_to_memory_x64(jitter->jit, jitter->count, a3.reg, a3.pos, VM_REGISTER_EAX);
+            break;
     }
 }
 
@@ -3098,9 +3621,14 @@ static void vm_jit_append_int_string(Jitter* jitter)
 
     vm_jit_call_internal_x64(jitter, (void*)vm_append_int_string);
 
-    if (a3.reg != VM_REGISTER_EAX)
+    switch (a3.type)
     {
-        vm_mov_reg_to_reg_x64(jitter->jit, jitter->count, a3.reg, VM_REGISTER_EAX);
+        case ST_REG:
+            vm_mov_reg_to_reg_x64(jitter->jit, jitter->count, a3.reg, VM_REGISTER_EAX);
+            break;
+        case ST_STACK:
+            vm_mov_reg_to_memory_x64(jitter->jit, jitter->count, a3.reg, a3.pos, VM_REGISTER_EAX);
+            break;
     }
 }
 
@@ -3119,9 +3647,14 @@ static void vm_jit_append_string_string(Jitter* jitter)
 
     vm_jit_call_internal_x64(jitter, (void*)vm_append_string_string);
 
-    if (a3.reg != VM_REGISTER_EAX)
+    switch (a3.type)
     {
-        vm_mov_reg_to_reg_x64(jitter->jit, jitter->count, a3.reg, VM_REGISTER_EAX);
+        case ST_REG:
+            vm_mov_reg_to_reg_x64(jitter->jit, jitter->count, a3.reg, VM_REGISTER_EAX);
+            break;
+        case ST_STACK:
+            vm_mov_reg_to_memory_x64(jitter->jit, jitter->count, a3.reg, a3.pos, VM_REGISTER_EAX);
+            break;
     }
 }
 
@@ -3140,9 +3673,14 @@ static void vm_jit_append_string_real(Jitter* jitter)
 
     vm_jit_call_internal_x64(jitter, (void*)vm_append_string_real);
 
-    if (a3.reg != VM_REGISTER_EAX)
+    switch (a3.type)
     {
-        vm_mov_reg_to_reg_x64(jitter->jit, jitter->count, a3.reg, VM_REGISTER_EAX);
+        case ST_REG:
+            vm_mov_reg_to_reg_x64(jitter->jit, jitter->count, a3.reg, VM_REGISTER_EAX);
+            break;
+        case ST_STACK:
+            vm_mov_reg_to_memory_x64(jitter->jit, jitter->count, a3.reg, a3.pos, VM_REGISTER_EAX);
+            break;
     }
 }
 
@@ -3161,9 +3699,14 @@ static void vm_jit_append_real_string(Jitter* jitter)
 
     vm_jit_call_internal_x64(jitter, (void*)vm_append_real_string);
 
-    if (a3.reg != VM_REGISTER_EAX)
+    switch (a3.type)
     {
-        vm_mov_reg_to_reg_x64(jitter->jit, jitter->count, a3.reg, VM_REGISTER_EAX);
+        case ST_REG:
+            vm_mov_reg_to_reg_x64(jitter->jit, jitter->count, a3.reg, VM_REGISTER_EAX);
+            break;
+        case ST_STACK:
+            vm_mov_reg_to_memory_x64(jitter->jit, jitter->count, a3.reg, a3.pos, VM_REGISTER_EAX);
+            break;
     }
 }
 
@@ -3190,7 +3733,7 @@ static void vm_jit_add_real(Jitter* jitter)
 
     if (a3.type == ST_STACK)
     {
-        vm_movsd_reg_to_memory_x64(jitter->jit, jitter->count, a3.reg, a3.pos, dst);
+        vm_movsd_reg_to_memory_x64(jitter->jit, jitter->count, a3.reg, dst, a3.pos);
     }
 }
 
@@ -3205,19 +3748,19 @@ static void vm_jit_sub_real(Jitter* jitter)
     const int dst = vm_jit_decode_dst_sse(a3);
     vm_jit_mov_sse(jitter, a2, dst);
 
-    switch (a2.type)
+    switch (a1.type)
     {
         case ST_REG:
-            vm_subsd_reg_to_reg_x64(jitter->jit, jitter->count, a3.reg, a1.reg);
+            vm_subsd_reg_to_reg_x64(jitter->jit, jitter->count, dst, a1.reg);
             break;
         case ST_STACK:
-            vm_subsd_memory_to_reg_x64(jitter->jit, jitter->count, a3.reg, a1.reg, a1.pos);
+            vm_subsd_memory_to_reg_x64(jitter->jit, jitter->count, dst, a1.reg, a1.pos);
             break;
     }
 
     if (a3.type == ST_STACK)
     {
-        vm_movsd_reg_to_memory_x64(jitter->jit, jitter->count, a3.reg, a3.pos, dst);
+        vm_movsd_reg_to_memory_x64(jitter->jit, jitter->count, a3.reg, dst, a3.pos);
     }
 }
 
@@ -3244,7 +3787,7 @@ static void vm_jit_mul_real(Jitter* jitter)
 
     if (a3.type == ST_STACK)
     {
-        vm_movsd_reg_to_memory_x64(jitter->jit, jitter->count, a3.reg, a3.pos, dst);
+        vm_movsd_reg_to_memory_x64(jitter->jit, jitter->count, a3.reg, dst, a3.pos);
     }
 }
 
@@ -3259,19 +3802,19 @@ static void vm_jit_div_real(Jitter* jitter)
     const int dst = vm_jit_decode_dst_sse(a3);
     vm_jit_mov_sse(jitter, a2, dst);
 
-    switch (a2.type)
+    switch (a1.type)
     {
         case ST_REG:
-            vm_divsd_reg_to_reg_x64(jitter->jit, jitter->count, a3.reg, a1.reg);
+            vm_divsd_reg_to_reg_x64(jitter->jit, jitter->count, dst, a1.reg);
             break;
         case ST_STACK:
-            vm_divsd_memory_to_reg_x64(jitter->jit, jitter->count, a3.reg, a1.reg, a1.pos);
+            vm_divsd_memory_to_reg_x64(jitter->jit, jitter->count, dst, a1.reg, a1.pos);
             break;
     }
 
     if (a3.type == ST_STACK)
     {
-        vm_movsd_reg_to_memory_x64(jitter->jit, jitter->count, a3.reg, a3.pos, dst);
+        vm_movsd_reg_to_memory_x64(jitter->jit, jitter->count, a3.reg, dst, a3.pos);
     }
 }
 
@@ -3316,10 +3859,10 @@ static void vm_jit_sub_int(Jitter* jitter)
     switch (a1.type)
     {
         case ST_REG:
-            vm_sub_reg_to_reg_x64(jitter->jit, jitter->count, a3.reg, a1.reg);
+            vm_sub_reg_to_reg_x64(jitter->jit, jitter->count, dst, a1.reg);
             break;
         case ST_STACK:
-            vm_sub_memory_to_reg_x64(jitter->jit, jitter->count, a3.reg, a1.reg, a1.pos);
+            vm_sub_memory_to_reg_x64(jitter->jit, jitter->count, dst, a1.reg, a1.pos);
             break;
     }
 
@@ -3444,14 +3987,217 @@ static void vm_jit_neg_real(Jitter* jitter)
     const JIT_Allocation a1 = jitter->analyzer.GetAllocation(ref);
     const JIT_Allocation a2 = jitter->analyzer.GetAllocation(jitter->refIndex);
 
+    // Negate in a scratch register so the operand may share the destination
+    const int tmp = VM_SSE_REGISTER_XMM1;
+    vm_xorpd_reg_to_reg_x64(jitter->jit, jitter->count, tmp, tmp);
+
+    switch (a1.type)
+    {
+        case ST_REG:
+            vm_subsd_reg_to_reg_x64(jitter->jit, jitter->count, tmp, a1.reg);
+            break;
+        case ST_STACK:
+            vm_subsd_memory_to_reg_x64(jitter->jit, jitter->count, tmp, a1.reg, a1.pos);
+            break;
+    }
+
+    switch (a2.type)
+    {
+        case ST_REG:
+            vm_movsd_reg_to_reg_x64(jitter->jit, jitter->count, a2.reg, tmp);
+            break;
+        case ST_STACK:
+            vm_movsd_reg_to_memory_x64(jitter->jit, jitter->count, a2.reg, tmp, a2.pos);
+            break;
+    }
+}
+
+static void vm_jit_sqrt_real(Jitter* jitter)
+{
+    const int ref = vm_jit_read_int(jitter->program, jitter->pc);
+    const JIT_Allocation a1 = jitter->analyzer.GetAllocation(ref);
+    const JIT_Allocation a2 = jitter->analyzer.GetAllocation(jitter->refIndex);
+
+    const int dst = vm_jit_decode_dst_sse(a2);
+
+    switch (a1.type)
+    {
+        case ST_REG:
+            vm_sqrtsd_reg_to_reg_x64(jitter->jit, jitter->count, dst, a1.reg);
+            break;
+        case ST_STACK:
+            vm_sqrtsd_memory_to_reg_x64(jitter->jit, jitter->count, dst, a1.reg, a1.pos);
+            break;
+    }
+
+    if (a2.type == ST_STACK)
+    {
+        vm_movsd_reg_to_memory_x64(jitter->jit, jitter->count, a2.reg, dst, a2.pos);
+    }
+}
+
+static void vm_jit_abs_real(Jitter* jitter)
+{
+    const int ref = vm_jit_read_int(jitter->program, jitter->pc);
+    const JIT_Allocation a1 = jitter->analyzer.GetAllocation(ref);
+    const JIT_Allocation a2 = jitter->analyzer.GetAllocation(jitter->refIndex);
+
+    const int dst = vm_jit_decode_dst_sse(a2);
+    vm_jit_mov_sse(jitter, a1, dst);
+
+    // max(x, 0 - x) using xmm1 as scratch, it is reserved for arguments.
+    vm_xorpd_reg_to_reg_x64(jitter->jit, jitter->count, VM_SSE_REGISTER_XMM1, VM_SSE_REGISTER_XMM1);
+    vm_subsd_reg_to_reg_x64(jitter->jit, jitter->count, VM_SSE_REGISTER_XMM1, dst);
+    vm_maxsd_reg_to_reg_x64(jitter->jit, jitter->count, dst, VM_SSE_REGISTER_XMM1);
+
+    if (a2.type == ST_STACK)
+    {
+        vm_movsd_reg_to_memory_x64(jitter->jit, jitter->count, a2.reg, dst, a2.pos);
+    }
+}
+
+static int vm_jit_save_sse(Jitter* jitter)
+{
+#ifndef WIN32
+    // The allocatable xmm registers are not preserved across calls on System V.
+    vm_sub_imm_to_reg_x64(jitter->jit, jitter->count, VM_REGISTER_ESP, 8 * 8);
+    for (int i = 0; i < 8; i++)
+    {
+        vm_movsd_reg_to_memory_x64(jitter->jit, jitter->count, VM_REGISTER_ESP, VM_SSE_REGISTER_XMM8 + i, i * 8);
+    }
+    return 8 * 8; // the stack grows by this much, which moves the stack allocations
+#else
+    return 0;
+#endif
+}
+
+static void vm_jit_restore_sse(Jitter* jitter)
+{
+#ifndef WIN32
+    for (int i = 0; i < 8; i++)
+    {
+        vm_movsd_memory_to_reg_x64(jitter->jit, jitter->count, VM_SSE_REGISTER_XMM8 + i, VM_REGISTER_ESP, i * 8);
+    }
+    vm_add_imm_to_reg_x64(jitter->jit, jitter->count, VM_REGISTER_ESP, 8 * 8);
+#endif
+}
+
+static void vm_jit_call_math(Jitter* jitter, void* address)
+{
+    // Calls a libm function taking and returning a real in xmm0.
+    const int ref = vm_jit_read_int(jitter->program, jitter->pc);
+    const JIT_Allocation a1 = jitter->analyzer.GetAllocation(ref);
+    const JIT_Allocation a2 = jitter->analyzer.GetAllocation(jitter->refIndex);
+
+    vm_jit_mov_sse(jitter, a1, VM_SSE_ARG1);
+
+    vm_jit_save_sse(jitter);
+    vm_jit_call_internal_x64(jitter, address);
+    vm_jit_restore_sse(jitter);
+
+    const int dst = vm_jit_decode_dst_sse(a2);
+    if (dst != VM_SSE_ARG1)
+    {
+        vm_movsd_reg_to_reg_x64(jitter->jit, jitter->count, dst, VM_SSE_ARG1);
+    }
+
+    if (a2.type == ST_STACK)
+    {
+        vm_movsd_reg_to_memory_x64(jitter->jit, jitter->count, a2.reg, dst, a2.pos);
+    }
+}
+
+static void vm_jit_floor_real(Jitter* jitter)
+{
+    if ((jitter->_manager->_caps & SUN_CAPS_SSE4_1) == 0)
+    {
+        vm_jit_call_math(jitter, (void*)vm_math_floor);
+        return;
+    }
+
+    const int ref = vm_jit_read_int(jitter->program, jitter->pc);
+    const JIT_Allocation a1 = jitter->analyzer.GetAllocation(ref);
+    const JIT_Allocation a2 = jitter->analyzer.GetAllocation(jitter->refIndex);
+
+    const int dst = vm_jit_decode_dst_sse(a2);
+    vm_jit_mov_sse(jitter, a1, dst);
+
+    vm_roundsd_reg_to_reg_x64(jitter->jit, jitter->count, dst, dst, 0x1); // round down
+
+    if (a2.type == ST_STACK)
+    {
+        vm_movsd_reg_to_memory_x64(jitter->jit, jitter->count, a2.reg, dst, a2.pos);
+    }
+}
+
+static void vm_jit_min_max_real(Jitter* jitter, bool min)
+{
+    const int ref1 = vm_jit_read_int(jitter->program, jitter->pc);
+    const int ref2 = vm_jit_read_int(jitter->program, jitter->pc);
+    const JIT_Allocation a1 = jitter->analyzer.GetAllocation(ref1);
+    const JIT_Allocation a2 = jitter->analyzer.GetAllocation(ref2);
+    const JIT_Allocation a3 = jitter->analyzer.GetAllocation(jitter->refIndex);
+
+    const int dst = vm_jit_decode_dst_sse(a3);
+    vm_jit_mov_sse(jitter, a1, dst);
+
+    switch (a2.type)
+    {
+        case ST_REG:
+            if (min) { vm_minsd_reg_to_reg_x64(jitter->jit, jitter->count, dst, a2.reg); }
+            else { vm_maxsd_reg_to_reg_x64(jitter->jit, jitter->count, dst, a2.reg); }
+            break;
+        case ST_STACK:
+            if (min) { vm_minsd_memory_to_reg_x64(jitter->jit, jitter->count, dst, a2.reg, a2.pos); }
+            else { vm_maxsd_memory_to_reg_x64(jitter->jit, jitter->count, dst, a2.reg, a2.pos); }
+            break;
+    }
+
+    if (a3.type == ST_STACK)
+    {
+        vm_movsd_reg_to_memory_x64(jitter->jit, jitter->count, a3.reg, dst, a3.pos);
+    }
+}
+
+static void vm_jit_abs_int(Jitter* jitter)
+{
+    const int ref = vm_jit_read_int(jitter->program, jitter->pc);
+    const JIT_Allocation a1 = jitter->analyzer.GetAllocation(ref);
+    const JIT_Allocation a2 = jitter->analyzer.GetAllocation(jitter->refIndex);
+
     const int dst = vm_jit_decode_dst(a2);
+    vm_jit_mov(jitter, a1, dst);
 
-    vm_xorpd_reg_to_reg_x64(jitter->jit, jitter->count, dst, dst);
-    vm_subsd_reg_to_reg_x64(jitter->jit, jitter->count, dst, a1.reg);
+    // Negating sets the flags as 0 - x, so take the negation when 0 > x.
+    vm_mov_reg_to_reg_x64(jitter->jit, jitter->count, VM_REGISTER_R10, dst);
+    vm_neg_reg_x64(jitter->jit, jitter->count, VM_REGISTER_R10);
+    vm_cmovg_reg_to_reg_x64(jitter->jit, jitter->count, dst, VM_REGISTER_R10);
 
     if (a2.type == ST_STACK)
     {
-        vm_movsd_reg_to_memory_x64(jitter->jit, jitter->count, a2.reg, a2.pos, dst);
+        vm_mov_reg_to_memory_x64(jitter->jit, jitter->count, a2.reg, a2.pos, dst);
+    }
+}
+
+static void vm_jit_min_max_int(Jitter* jitter, bool min)
+{
+    const int ref1 = vm_jit_read_int(jitter->program, jitter->pc);
+    const int ref2 = vm_jit_read_int(jitter->program, jitter->pc);
+    const JIT_Allocation a1 = jitter->analyzer.GetAllocation(ref1);
+    const JIT_Allocation a2 = jitter->analyzer.GetAllocation(ref2);
+    const JIT_Allocation a3 = jitter->analyzer.GetAllocation(jitter->refIndex);
+
+    const int dst = vm_jit_decode_dst(a3);
+    vm_jit_mov(jitter, a2, VM_REGISTER_R10);
+    vm_jit_mov(jitter, a1, dst);
+
+    vm_cmp_reg_to_reg_x64(jitter->jit, jitter->count, dst, VM_REGISTER_R10);
+    if (min) { vm_cmovg_reg_to_reg_x64(jitter->jit, jitter->count, dst, VM_REGISTER_R10); }
+    else { vm_cmovl_reg_to_reg_x64(jitter->jit, jitter->count, dst, VM_REGISTER_R10); }
+
+    if (a3.type == ST_STACK)
+    {
+        vm_mov_reg_to_memory_x64(jitter->jit, jitter->count, a3.reg, a3.pos, dst);
     }
 }
 
@@ -3459,7 +4205,7 @@ static void vm_jit_load_real(Jitter* jitter)
 {
     const int offset = vm_jit_read_int(jitter->program, jitter->pc);
     const JIT_Allocation a = jitter->analyzer.GetAllocation(jitter->refIndex);
-    unsigned char* src = jitter->jit + jitter->count;
+    unsigned char* src = jitter->base + jitter->count;
     src += 8; // size of instruction
     if (a.reg >= VM_SSE_REGISTER_XMM8)
     {
@@ -3479,13 +4225,22 @@ static void vm_jit_load_string(Jitter* jitter)
 
     const JIT_Allocation a = jitter->analyzer.GetAllocation(jitter->refIndex);
 
-    vm_mov_imm_to_reg_x64(jitter->jit, jitter->count, a.reg, (long long)data);
+    switch (a.type)
+    {
+    case ST_REG:
+        vm_mov_imm_to_reg_x64(jitter->jit, jitter->count, a.reg, (long long)data);
+        break;
+    case ST_STACK:
+        vm_mov_imm_to_reg_x64(jitter->jit, jitter->count, VM_REGISTER_EAX, (long long)data);
+        vm_mov_reg_to_memory_x64(jitter->jit, jitter->count, a.reg, a.pos, VM_REGISTER_EAX);
+        break;
+    }
 }
 
 static void vm_jit_load_int(Jitter* jitter)
 {
     const int offset = vm_jit_read_int(jitter->program, jitter->pc);
-    const int value = *reinterpret_cast<int*>(reinterpret_cast<unsigned char*>(jitter->_trace->_constantPage) + offset);
+    const int value = *reinterpret_cast<int*>(jitter->_trace->_constants.data() + offset);
 
     const JIT_Allocation al = jitter->analyzer.GetAllocation(jitter->refIndex);
 
@@ -3501,19 +4256,20 @@ static void vm_jit_load_int(Jitter* jitter)
     }
 }
 
-static void vm_jit_call_push_stub(Jitter* jitter, VirtualMachine* vm, unsigned char* jit, int& count)
+static void vm_jit_call_push_stub(Jitter* jitter, VirtualMachine* vm, unsigned char* jit, int& count, int stackOffset)
 {
     const int type = jitter->program[*jitter->pc];
     (*jitter->pc)++;
     const int ref = vm_jit_read_int(jitter->program, jitter->pc);
-    const JIT_Allocation al = jitter->analyzer.GetAllocation(ref);
+    JIT_Allocation al = jitter->analyzer.GetAllocation(ref);
+    al.pos += stackOffset;
 
     switch (al.type)
     {
     case ST_REG:
         if (al.isSSE)
         {
-            vm_movsd_reg_to_reg_x64(jit, count, VM_SSE_ARG2, al.reg);
+            vm_movsd_reg_to_reg_x64(jit, count, VM_SSE_REAL_ARG2, al.reg);
         }
         else
         {
@@ -3523,7 +4279,7 @@ static void vm_jit_call_push_stub(Jitter* jitter, VirtualMachine* vm, unsigned c
     case ST_STACK:
         if (al.isSSE)
         {
-            vm_movsd_memory_to_reg_x64(jit, count, VM_SSE_ARG2, al.reg);
+            vm_movsd_memory_to_reg_x64(jit, count, VM_SSE_REAL_ARG2, al.reg, al.pos);
         }
         else
         {
@@ -3561,9 +4317,11 @@ static void vm_jit_call_x64(VirtualMachine* vm, Jitter* jitter, int numParams, c
     // ARG1 - VM ADDR
     // ARG2 - PARAMETER
 
+    const int stackOffset = vm_jit_save_sse(jitter);
+
     for (int i = 0; i < numParams; i++)
     {
-        vm_jit_call_push_stub(jitter, vm, jitter->jit, jitter->count);
+        vm_jit_call_push_stub(jitter, vm, jitter->jit, jitter->count, stackOffset);
     }
 
     // Store the VM pointer in ARG1.
@@ -3574,6 +4332,8 @@ static void vm_jit_call_x64(VirtualMachine* vm, Jitter* jitter, int numParams, c
     vm_mov_imm_to_reg_x64(jitter->jit, jitter->count, VM_ARG4, numParams);
     vm_mov_imm_to_reg_x64(jitter->jit, jitter->count, VM_REGISTER_EAX, (long long)vm_call_stub);
     vm_call_absolute(jitter->jit, jitter->count, VM_REGISTER_EAX);
+
+    vm_jit_restore_sse(jitter);
 }
 
 static void vm_jit_call(VirtualMachine* vm, Jitter* jitter)
@@ -3650,29 +4410,29 @@ static void vm_jit_box(VirtualMachine* vm, Jitter* jitter)
         vm_jit_mov(jitter, a1, dst);
     }
 
-    // Box
+    // Box, the value is stored where the VM reads it so it is allocated by the VM.
 
     switch (type)
     {
     case TY_INT:
-        vm_mov_imm_to_reg_x64(jitter->jit, jitter->count, VM_ARG1, (long long)&jitter->_manager->_mm);
+        vm_mov_imm_to_reg_x64(jitter->jit, jitter->count, VM_ARG1, (long long)GetMemoryManager(vm));
         vm_mov_reg_to_reg_x64(jitter->jit, jitter->count, VM_ARG2, dst);
         vm_jit_call_internal_x64(jitter, (void*)vm_box_int);
         break;
     case TY_FUNC:
-        vm_mov_imm_to_reg_x64(jitter->jit, jitter->count, VM_ARG1, (long long)&jitter->_manager->_mm);
+        vm_mov_imm_to_reg_x64(jitter->jit, jitter->count, VM_ARG1, (long long)GetMemoryManager(vm));
         vm_mov_reg_to_reg_x64(jitter->jit, jitter->count, VM_ARG2, dst);
         vm_jit_call_internal_x64(jitter, (void*)vm_box_func);
         break;
     case TY_REAL:
-        vm_mov_imm_to_reg_x64(jitter->jit, jitter->count, VM_ARG1, (long long)&jitter->_manager->_mm);
+        vm_mov_imm_to_reg_x64(jitter->jit, jitter->count, VM_ARG1, (long long)GetMemoryManager(vm));
         if (a1.type == ST_REG)
         {
-            vm_movsd_reg_to_reg_x64(jitter->jit, jitter->count, VM_SSE_ARG2, a1.reg);
+            vm_movsd_reg_to_reg_x64(jitter->jit, jitter->count, VM_SSE_REAL_ARG2, a1.reg);
         }
         else
         {
-            vm_movsd_memory_to_reg_x64(jitter->jit, jitter->count, VM_SSE_ARG2, a1.reg, a1.pos);
+            vm_movsd_memory_to_reg_x64(jitter->jit, jitter->count, VM_SSE_REAL_ARG2, a1.reg, a1.pos);
         }
         vm_jit_call_internal_x64(jitter, (void*)vm_box_real);
         break;
@@ -3681,7 +4441,7 @@ static void vm_jit_box(VirtualMachine* vm, Jitter* jitter)
         // Duplicate the string, since if the string is a constant it doesn't exist in the memory manager.
         // Therefore, when it is unboxed it fails because we unable ascertain the type.
 
-        vm_mov_imm_to_reg_x64(jitter->jit, jitter->count, VM_ARG1, (long long)&jitter->_manager->_mm);
+        vm_mov_imm_to_reg_x64(jitter->jit, jitter->count, VM_ARG1, (long long)GetMemoryManager(vm));
         vm_mov_reg_to_reg_x64(jitter->jit, jitter->count, VM_ARG2, dst);
         vm_jit_call_internal_x64(jitter, (void*)vm_duplicate_string);
         break;
@@ -3702,6 +4462,13 @@ static void vm_jit_box(VirtualMachine* vm, Jitter* jitter)
             vm_mov_reg_to_memory_x64(jitter->jit, jitter->count, a2.reg, a2.pos, VM_REGISTER_EAX);
         }
         break;
+    default:
+        // Already a reference, so the value is the box.
+        if (a2.type == ST_STACK)
+        {
+            vm_mov_reg_to_memory_x64(jitter->jit, jitter->count, a2.reg, a2.pos, dst);
+        }
+        break;
     }
 }
 
@@ -3716,7 +4483,7 @@ static void vm_jit_unbox(VirtualMachine* vm, Jitter* jitter)
     (*jitter->pc)++;
 
     vm_mov_imm_to_reg_x64(jitter->jit, jitter->count, VM_ARG1, (long long)&jitter->_manager->_mm);
-    vm_mov_reg_to_reg_x64(jitter->jit, jitter->count, VM_ARG2, VM_REGISTER_EAX);
+    vm_jit_mov(jitter, al, VM_ARG2);
     vm_mov_imm_to_reg_x64(jitter->jit, jitter->count, VM_ARG3, type);
     vm_jit_call_internal_x64(jitter, (void*)vm_check_type);
 
@@ -3765,7 +4532,7 @@ static void vm_jit_unbox(VirtualMachine* vm, Jitter* jitter)
         switch (al2.type)
         {
         case ST_STACK:
-            vm_mov_reg_to_memory_x64(jitter->jit, jitter->count, al2.reg, al2.pos, dst);
+            vm_movsd_reg_to_memory_x64(jitter->jit, jitter->count, al2.reg, dst, al2.pos);
             break;
         case ST_REG:
             //vm_mov_reg_to_reg_x64(jitter->jit, jitter->count, al.reg, VM_REGISTER_EAX);
@@ -3775,6 +4542,11 @@ static void vm_jit_unbox(VirtualMachine* vm, Jitter* jitter)
     default:
         dst = vm_jit_decode_dst(al2);
         vm_jit_mov(jitter, al, dst);
+
+        if (al2.type == ST_STACK)
+        {
+            vm_mov_reg_to_memory_x64(jitter->jit, jitter->count, al2.reg, al2.pos, dst);
+        }
         break;
     }
 }
@@ -3805,7 +4577,7 @@ static void vm_jit_conv_int_to_real(Jitter* jitter)
 
     if (a2.type == ST_STACK)
     {
-        vm_jit_mov_sse(jitter, a2, dst);
+        vm_movsd_reg_to_memory_x64(jitter->jit, jitter->count, a2.reg, dst, a2.pos);
     }
 }
 
@@ -3823,13 +4595,7 @@ static void vm_jit_phi(VirtualMachine* vm, Jitter* jitter)
     JIT_Allocation a1 = jitter->analyzer.GetAllocation(ref1);
     JIT_Allocation a2 = jitter->analyzer.GetAllocation(jitter->refIndex);
 
-    const int dst = vm_jit_decode_dst(a2);
-    vm_jit_mov(jitter, a1, dst);
-
-    if (a2.type == ST_STACK)
-    {
-        vm_mov_reg_to_memory_x64(jitter->jit, jitter->count, a2.reg, a2.pos, dst);
-    }
+    vm_jit_move_phi(jitter, a1, a2);
 }
 
 static void vm_jit_snap(VirtualMachine* vm, Jitter* jitter)
@@ -3846,7 +4612,9 @@ static void vm_jit_snap(VirtualMachine* vm, Jitter* jitter)
 
     for (int i = 0; i < numSlots; i++)
     {
-        snap.entries.push_back(jitter->program[*jitter->pc]);
+        auto& entry = snap.entries.emplace_back();
+        entry._ref = vm_jit_read_int(jitter->program, jitter->pc);
+        entry._local = jitter->program[*jitter->pc];
 
         (*jitter->pc)++;
     }
@@ -3908,10 +4676,79 @@ static void vm_jit_store_snapshot(VirtualMachine* vm, Jitter* jitter, const int
     // We will do a jump after this which will use the argument(s)
 }
 
+static void vm_jit_link_exit(VirtualMachine* vm, Jitter* jitter, const int stacksize, const int snap)
+{
+    /* Link stub
+       An exit starts with a jump over the code which enters another trace, so the exit goes
+       through the VM until it is linked. Linking the exit sets the trace to enter and clears
+       the jump, the locals in the snapshot are then stored to the record and the trace entered.
+    */
+
+    auto& exit = jitter->_trace->_exits.emplace_back();
+    exit._snap = snap;
+    exit._jump = jitter->count;
+    vm_jit_jump(jitter, JUMP, jitter->count, 0); // to be patched
+
+    const auto& snapshot = jitter->_trace->_snaps[snap];
+
+    std::vector<JIT_LiveValue> live;
+    jitter->analyzer.GetLiveValues(snapshot._ref, live);
+
+    vm_mov_imm_to_reg_x64(jitter->jit, jitter->count, VM_ARG1, (long long)&jitter->_trace->_record);
+    vm_mov_memory_to_reg_x64(jitter->jit, jitter->count, VM_ARG1, VM_ARG1, 0);
+
+    for (const auto& entry : snapshot.entries)
+    {
+        const auto& it = std::find_if(live.begin(), live.end(),
+            [&entry](const JIT_LiveValue& value) { return int(value.ref) == entry._ref; });
+        if (it == live.end())
+        {
+            continue;
+        }
+
+        const int offset = entry._local * 16 + 8;
+        if (it->al.isSSE)
+        {
+            const int src = vm_jit_decode_dst_sse(it->al);
+            vm_jit_mov_sse(jitter, it->al, src);
+            vm_movsd_reg_to_memory_x64(jitter->jit, jitter->count, VM_ARG1, src, offset);
+        }
+        else
+        {
+            const int src = vm_jit_decode_dst(it->al);
+            vm_jit_mov(jitter, it->al, src);
+            vm_mov_reg_to_memory_x64(jitter->jit, jitter->count, VM_ARG1, offset, src);
+        }
+    }
+
+    // ARG1 = vm
+    // ARG2 = trace
+    // ARG3 = record
+    vm_mov_reg_to_reg_x64(jitter->jit, jitter->count, VM_ARG3, VM_ARG1);
+    vm_mov_imm_to_reg_x64(jitter->jit, jitter->count, VM_ARG1, (long long)vm);
+    exit._target = jitter->count + 2; // skip the REX prefix and opcode
+    vm_mov_imm_to_reg_x64(jitter->jit, jitter->count, VM_ARG2, 0);
+
+    const int register_homes = 8 * 4; // 4 register homes 8 bytes each
+    vm_sub_imm_to_reg_x64(jitter->jit, jitter->count, VM_REGISTER_ESP, register_homes);
+    vm_mov_imm_to_reg_x64(jitter->jit, jitter->count, VM_REGISTER_EAX, (long long)vm_link_trace);
+    vm_call_absolute(jitter->jit, jitter->count, VM_REGISTER_EAX);
+    vm_add_imm_to_reg_x64(jitter->jit, jitter->count, VM_REGISTER_ESP, register_homes);
+
+    // The return value is the code of the trace
+    vm_jit_epilog(jitter, stacksize);
+    vm_jump_absolute(jitter->jit, jitter->count, VM_REGISTER_EAX);
+
+    int pos = exit._jump;
+    exit._slow = jitter->count - (exit._jump + 5 /*Length of jump instruction*/);
+    vm_jit_jump(jitter, JUMP, pos, exit._slow);
+}
+
 static void vm_jit_exit_trace(VirtualMachine* vm, Jitter* jitter, const int stacksize)
 {
     // Standard exit
 
+    vm_jit_link_exit(vm, jitter, stacksize, jitter->snapshot);
     vm_jit_store_snapshot(vm, jitter, jitter->snapRef, jitter->snapshot);
     vm_mov_imm_to_reg_x64(jitter->jit, jitter->count, VM_ARG1, (long long)vm);
     vm_mov_reg_to_reg_x64(jitter->jit, jitter->count, VM_ARG2, VM_REGISTER_ESP);
@@ -3950,9 +4787,15 @@ static void vm_jit_exit_trace(VirtualMachine* vm, Jitter* jitter, const int stac
         for (size_t i = 0; i < jitter->_trace->_forwardJumps.size(); i++)
         {
             auto& guard = jitter->_trace->_forwardJumps[i];
+            if (jitter->count > jitter->capacity - JIT_TRACE_SLACK)
+            {
+                jitter->SetError();
+                return;
+            }
 
             vm_jit_patch_jump(jitter, guard);
 
+            vm_jit_link_exit(vm, jitter, stacksize, guard._snap);
             vm_jit_store_snapshot(vm, jitter, guard._ref, guard._snap);
 
             // The last guard handler can fall through to the epilog
@@ -4020,6 +4863,11 @@ static void vm_jit_load_string_local(VirtualMachine* vm, Jitter* jitter)
 
     const int dst = vm_jit_decode_dst(allocation);
     vm_mov_memory_to_reg_x64(jitter->jit, jitter->count, dst, VM_ARG1, id * 16 + 8);
+
+    if (allocation.type == ST_STACK)
+    {
+        vm_mov_reg_to_memory_x64(jitter->jit, jitter->count, allocation.reg, allocation.pos, dst);
+    }
 }
 
 static void vm_jit_load_int_local(VirtualMachine* vm, Jitter* jitter)
@@ -4034,6 +4882,11 @@ static void vm_jit_load_int_local(VirtualMachine* vm, Jitter* jitter)
 
     const int dst = vm_jit_decode_dst(allocation);
     vm_mov_memory_to_reg_x64(jitter->jit, jitter->count, dst, VM_ARG1, id * 16 + 8);
+
+    if (allocation.type == ST_STACK)
+    {
+        vm_mov_reg_to_memory_x64(jitter->jit, jitter->count, allocation.reg, allocation.pos, dst);
+    }
 }
 
 static void vm_jit_load_real_local(VirtualMachine* vm, Jitter* jitter)
@@ -4048,6 +4901,11 @@ static void vm_jit_load_real_local(VirtualMachine* vm, Jitter* jitter)
 
     const int dst = vm_jit_decode_dst_sse(allocation);
     vm_movsd_memory_to_reg_x64(jitter->jit, jitter->count, dst, VM_ARG1, id * 16 + 8);
+
+    if (allocation.type == ST_STACK)
+    {
+        vm_movsd_reg_to_memory_x64(jitter->jit, jitter->count, allocation.reg, dst, allocation.pos);
+    }
 }
 
 static void vm_jit_load_table_local(VirtualMachine* vm, Jitter* jitter)
@@ -4062,15 +4920,20 @@ static void vm_jit_load_table_local(VirtualMachine* vm, Jitter* jitter)
 
     const int dst = vm_jit_decode_dst(allocation);
     vm_mov_memory_to_reg_x64(jitter->jit, jitter->count, dst, VM_ARG1, id * 16 + 8);
+
+    if (allocation.type == ST_STACK)
+    {
+        vm_mov_reg_to_memory_x64(jitter->jit, jitter->count, allocation.reg, allocation.pos, dst);
+    }
 }
 
 static void vm_jit_table_new(VirtualMachine* vm, Jitter* jitter)
 {
     JIT_Allocation allocation = jitter->analyzer.GetAllocation(jitter->refIndex);
 
-    // Emit a call to the table allocation function
+    // Emit a call to the table allocation function, the table outlives the trace so it is allocated by the VM.
 
-    vm_mov_imm_to_reg_x64(jitter->jit, jitter->count, VM_ARG1, (long long)&jitter->_trace->_mm);
+    vm_mov_imm_to_reg_x64(jitter->jit, jitter->count, VM_ARG1, (long long)GetMemoryManager(vm));
     vm_jit_call_internal_x64(jitter, (void*)vm_table_new);
 
     switch (allocation.type)
@@ -4095,8 +4958,8 @@ static void vm_jit_table_hget(VirtualMachine* vm, Jitter* jitter)
  
     // Emit a call to the table hashmap get function
 
-    vm_mov_reg_to_reg_x64(jitter->jit, jitter->count, VM_ARG1, a2.reg);
-    vm_mov_reg_to_reg_x64(jitter->jit, jitter->count, VM_ARG2, a1.reg);
+    vm_jit_mov(jitter, a2, VM_ARG1);
+    vm_jit_mov(jitter, a1, VM_ARG2);
     vm_jit_call_internal_x64(jitter, (void*)vm_table_hget);
 
     switch (allocation.type)
@@ -4121,8 +4984,8 @@ static void vm_jit_table_aget(VirtualMachine* vm, Jitter* jitter)
 
     // Emit a call to the table array get function
 
-    vm_mov_reg_to_reg_x64(jitter->jit, jitter->count, VM_ARG1, a2.reg);
-    vm_mov_reg_to_reg_x64(jitter->jit, jitter->count, VM_ARG2, a1.reg);
+    vm_jit_mov(jitter, a2, VM_ARG1);
+    vm_jit_mov(jitter, a1, VM_ARG2);
     vm_jit_call_internal_x64(jitter, (void*)vm_table_aget);
 
     switch (allocation.type)
@@ -4147,7 +5010,7 @@ static void vm_jit_table_hset(VirtualMachine* vm, Jitter* jitter)
 
     // Emit a call to the table hashmap set function
 
-    vm_mov_reg_to_reg_x64(jitter->jit, jitter->count, VM_ARG3, a2.reg);
+    vm_jit_mov(jitter, a2, VM_ARG3);
     vm_jit_call_internal_x64(jitter, (void*)vm_table_hset);
 }
 
@@ -4162,7 +5025,7 @@ static void vm_jit_table_aset(VirtualMachine* vm, Jitter* jitter)
 
     // Emit a call to the table array set function
 
-    vm_mov_reg_to_reg_x64(jitter->jit, jitter->count, VM_ARG3, a2.reg);
+    vm_jit_mov(jitter, a2, VM_ARG3);
     vm_jit_call_internal_x64(jitter, (void*)vm_table_aset);
 }
 
@@ -4177,8 +5040,8 @@ static void vm_jit_table_href(VirtualMachine* vm, Jitter* jitter)
 
     // Emit a call to the table hashmap set function
 
-    vm_mov_reg_to_reg_x64(jitter->jit, jitter->count, VM_ARG1, a2.reg);
-    vm_mov_reg_to_reg_x64(jitter->jit, jitter->count, VM_ARG2, a1.reg);
+    vm_jit_mov(jitter, a2, VM_ARG1);
+    vm_jit_mov(jitter, a1, VM_ARG2);
 }
 
 static void vm_jit_table_aref(VirtualMachine* vm, Jitter* jitter)
@@ -4192,8 +5055,8 @@ static void vm_jit_table_aref(VirtualMachine* vm, Jitter* jitter)
 
     // Emit a call to the table array set function
 
-    vm_mov_reg_to_reg_x64(jitter->jit, jitter->count, VM_ARG1, a2.reg);
-    vm_mov_reg_to_reg_x64(jitter->jit, jitter->count, VM_ARG2, a1.reg);
+    vm_jit_mov(jitter, a2, VM_ARG1);
+    vm_jit_mov(jitter, a1, VM_ARG2);
 }
 
 static void vm_jit_generate_trace(VirtualMachine* vm, Jitter* jitter)
@@ -4356,14 +5219,53 @@ static void vm_jit_generate_trace(VirtualMachine* vm, Jitter* jitter)
         case IR_TABLE_HREF:
             vm_jit_table_href(vm, jitter);
             break;
+        case IR_SQRT_REAL:
+            vm_jit_sqrt_real(jitter);
+            break;
+        case IR_SIN_REAL:
+            vm_jit_call_math(jitter, (void*)vm_math_sin);
+            break;
+        case IR_COS_REAL:
+            vm_jit_call_math(jitter, (void*)vm_math_cos);
+            break;
+        case IR_ABS_INT:
+            vm_jit_abs_int(jitter);
+            break;
+        case IR_ABS_REAL:
+            vm_jit_abs_real(jitter);
+            break;
+        case IR_FLOOR_REAL:
+            vm_jit_floor_real(jitter);
+            break;
+        case IR_MIN_INT:
+            vm_jit_min_max_int(jitter, true);
+            break;
+        case IR_MAX_INT:
+            vm_jit_min_max_int(jitter, false);
+            break;
+        case IR_MIN_REAL:
+            vm_jit_min_max_real(jitter, true);
+            break;
+        case IR_MAX_REAL:
+            vm_jit_min_max_real(jitter, false);
+            break;
         default:
             abort();
         }
 
         jitter->refIndex++;
+
+        if (jitter->count > jitter->capacity - JIT_TRACE_SLACK)
+        {
+            // The trace doesn't fit in the space it was given.
+            jitter->SetError();
+        }
     }
 
-    vm_jit_exit_trace(vm, jitter, stacksize);
+    if (!jitter->error)
+    {
+        vm_jit_exit_trace(vm, jitter, stacksize);
+    }
 }
 
 static void vm_jit_push_registers(unsigned char* jit, int& count)
@@ -4600,11 +5502,17 @@ void SunScript::JIT_Setup(Jit* jit)
     jit->jit_execute = SunScript::JIT_ExecuteTrace;
     jit->jit_resume = SunScript::JIT_Resume;
     jit->jit_shutdown = SunScript::JIT_Shutdown;
+    jit->jit_free = SunScript::JIT_Free;
+    jit->jit_install = SunScript::JIT_Install;
+    jit->jit_link = SunScript::JIT_Link;
+    jit->jit_stats = SunScript::JIT_Stats;
 }
 
 void* SunScript::JIT_Initialize()
 {
     JIT_Manager* manager = new JIT_Manager();
+    char vendor[13];
+    manager->_caps = JIT_Capabilities(vendor);
     vm_jit_entry_stub(manager); // must generate stub before suspend
     vm_jit_yielded(manager);    // must generate yielded before suspend
     vm_jit_suspend(manager);
@@ -4616,6 +5524,7 @@ int SunScript::JIT_ExecuteTrace(void* instance, void* data, unsigned char* recor
     JIT_Manager* mm = reinterpret_cast<JIT_Manager*>(instance);
     JIT_Trace* trace = reinterpret_cast<JIT_Trace*>(data);
     trace->_mm.Reset();
+    trace->_entered = ++mm->_entries;
     trace->_record = record;
     trace->_runCount++;
 
@@ -4636,7 +5545,38 @@ void SunScript::JIT_Free(void* data)
 {
     JIT_Trace* trace = reinterpret_cast<JIT_Trace*>(data);
 
-    vm_free(trace->_jit_data, trace->_size);
+    trace->_manager->_heap.Free(&trace->_placement);
+    delete trace;
+}
+
+void SunScript::JIT_Install(void* instance, void* data)
+{
+    JIT_Trace* trace = reinterpret_cast<JIT_Trace*>(data);
+
+    trace->_manager->_heap.Install(trace->_placement, trace->_code.data(), trace->_constants.data(), trace->_constantSize);
+    std::vector<unsigned char>().swap(trace->_code);
+    std::vector<unsigned char>().swap(trace->_constants);
+}
+
+void SunScript::JIT_Link(void* instance, void* data, int snap, void* target)
+{
+    // Enter the target from the trace's exits for the snapshot, or exit through the VM if there is none.
+    JIT_Trace* trace = reinterpret_cast<JIT_Trace*>(data);
+    for (const auto& exit : trace->_exits)
+    {
+        if (exit._snap == snap)
+        {
+            const int imm = target ? 0 : exit._slow;
+            trace->_manager->_heap.Patch(trace->_placement, exit._target, &target, sizeof(void*));
+            trace->_manager->_heap.Patch(trace->_placement, exit._jump + 1, &imm, sizeof(int));
+        }
+    }
+}
+
+void SunScript::JIT_Stats(void* instance, JitStats* stats)
+{
+    JIT_Manager* mm = reinterpret_cast<JIT_Manager*>(instance);
+    mm->_heap.GetStats(stats);
 }
 
 /*
@@ -4852,7 +5792,8 @@ void SunScript::JIT_DumpTrace(unsigned char* trace, unsigned int size)
             {
                 for (int i = 0; i < op2; i++)
                 {
-                    std::cout << " " << int(trace[pc++]);
+                    const int slot = vm_jit_read_int(trace, &pc);
+                    std::cout << " " << int(trace[pc++]) << ":" << slot;
                 }
             }
             std::cout << " ]" << std::endl;
@@ -4916,6 +5857,44 @@ void SunScript::JIT_DumpTrace(unsigned char* trace, unsigned int size)
             op2 = vm_jit_read_int(trace, &pc);
             std::cout << " IR_TABLE_AREF " << op1 << " " << op2 << std::endl;
             break;
+        case IR_SQRT_REAL:
+            std::cout << " IR_SQRT_REAL " << vm_jit_read_int(trace, &pc) << std::endl;
+            break;
+        case IR_SIN_REAL:
+            std::cout << " IR_SIN_REAL " << vm_jit_read_int(trace, &pc) << std::endl;
+            break;
+        case IR_COS_REAL:
+            std::cout << " IR_COS_REAL " << vm_jit_read_int(trace, &pc) << std::endl;
+            break;
+        case IR_ABS_INT:
+            std::cout << " IR_ABS_INT " << vm_jit_read_int(trace, &pc) << std::endl;
+            break;
+        case IR_ABS_REAL:
+            std::cout << " IR_ABS_REAL " << vm_jit_read_int(trace, &pc) << std::endl;
+            break;
+        case IR_FLOOR_REAL:
+            std::cout << " IR_FLOOR_REAL " << vm_jit_read_int(trace, &pc) << std::endl;
+            break;
+        case IR_MIN_INT:
+            op1 = vm_jit_read_int(trace, &pc);
+            op2 = vm_jit_read_int(trace, &pc);
+            std::cout << " IR_MIN_INT " << op1 << " " << op2 << std::endl;
+            break;
+        case IR_MAX_INT:
+            op1 = vm_jit_read_int(trace, &pc);
+            op2 = vm_jit_read_int(trace, &pc);
+            std::cout << " IR_MAX_INT " << op1 << " " << op2 << std::endl;
+            break;
+        case IR_MIN_REAL:
+            op1 = vm_jit_read_int(trace, &pc);
+            op2 = vm_jit_read_int(trace, &pc);
+            std::cout << " IR_MIN_REAL " << op1 << " " << op2 << std::endl;
+            break;
+        case IR_MAX_REAL:
+            op1 = vm_jit_read_int(trace, &pc);
+            op2 = vm_jit_read_int(trace, &pc);
+            std::cout << " IR_MAX_REAL " << op1 << " " << op2 << std::endl;
+            break;
         default:
             std::cout << " UNKNOWN" << std::endl;
         }
@@ -4960,28 +5939,41 @@ void* SunScript::JIT_CompileTrace(void* instance, VirtualMachine* vm, unsigned c
     //==============================
     jitter->_trace->_startTime = clock.now().time_since_epoch().count();
 
-    const int jitDataSize = 1024 * 5;
     unsigned int pc = 0;
 
     jitter->program = trace;
     jitter->pc = &pc;
     jitter->size = size;
-    jitter->_trace->_jit_data = vm_allocate(jitDataSize);
-    jitter->jit = reinterpret_cast<unsigned char*>(jitter->_trace->_jit_data);
     jitter->_manager = reinterpret_cast<JIT_Manager*>(instance);
+    jitter->_trace->_manager = jitter->_manager;
 
-    // Create readonly constant data pages.
+    // Reserve space for the code and constants in the code heap, the trace is emitted
+    // for that address and copied there by JIT_Install.
     const int constantSize = vm_jit_read_int(trace, &pc);
-    jitter->_trace->_constantPage = vm_allocate(constantSize);
-    std::memcpy(jitter->_trace->_constantPage, &trace[pc], constantSize);
-    vm_readonly(jitter->_trace->_constantPage, constantSize);
+    JIT_Placement& placement = jitter->_trace->_placement;
+    jitter->_manager->_heap.Reserve(constantSize, &placement);
+    jitter->_trace->_constants.assign(trace + pc, trace + pc + constantSize);
+    jitter->_trace->_constantPage = placement._constants == -1 ? nullptr : placement._region->_data + placement._constants;
+    jitter->_trace->_constantSize = constantSize;
+    jitter->_trace->_jit_data = placement._region->_data + placement._code;
+    jitter->_trace->_code.resize(placement._codeSize);
+    jitter->jit = jitter->_trace->_code.data();
+    jitter->base = reinterpret_cast<unsigned char*>(jitter->_trace->_jit_data);
+    jitter->capacity = placement._codeSize;
     pc += constantSize;
 
     jitter->analyzer.Load(trace, size);
     //jitter->analyzer.Dump();
 
     vm_jit_generate_trace(vm, jitter.get());
-    vm_initialize(jitter->_trace->_jit_data, jitter->count);
+    if (jitter->error)
+    {
+        jitter->_manager->_heap.Free(&placement);
+        delete jitter->_trace;
+        return nullptr;
+    }
+    jitter->_manager->_heap.Trim(&placement, jitter->count);
+    jitter->_trace->_code.resize(placement._codeSize);
 
     /*for (auto& stub : jitter->_method->_stubs)
     {
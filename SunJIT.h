@@ -8,6 +8,7 @@ namespace SunScript
 {
     struct VirtualMachine;
     struct Jit;
+    struct JitStats;
 
     constexpr int SUN_CAPS_NONE = 0x0;
     constexpr int SUN_CAPS_SSE3 = 0x1;
@@ -23,5 +24,8 @@ namespace SunScript
     int JIT_ExecuteTrace(void* instance, void* data, unsigned char* record);
     int JIT_Resume(void* instance);
     void JIT_Free(void* data);
+    void JIT_Install(void* instance, void* data);
+    void JIT_Link(void* instance, void* data, int snap, void* target);
+    void JIT_Stats(void* instance, JitStats* stats);
     void JIT_Shutdown(void* instance);
 }
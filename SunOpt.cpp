@@ -1,6 +1,10 @@
 #include "SunOpt.h"
 #include "SunScript.h"
 #include <cstring>
+#include <climits>
+#include <cmath>
+#include <algorithm>
+#include <unordered_map>
 
 using namespace SunScript;
 
@@ -25,329 +29,607 @@ inline static void Trace_Constant(std::vector<unsigned char>& constants, real va
 }
 
 //================
-// IR Buffer
+// SSA form
 //================
 
-IRBuffer::IRBuffer() : _head(0), _tail(0)
+void SunScript::Opt_Build(Optimizer& opt, const std::vector<TraceNode*>& nodes)
 {
-    std::memset(_buffer, 0, sizeof(_buffer));
-    std::memset(_buffer_left, 0, sizeof(_buffer_left));
-    std::memset(_buffer_right, 0, sizeof(_buffer_right));
+    opt.ins.resize(nodes.size());
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        const TraceNode* node = nodes[i];
+        OptIns& ins = opt.ins[i];
+        ins.data = node->data;
+        ins.left = node->left ? node->left->ref : -1;
+        ins.right = node->right ? node->right->ref : -1;
+        ins.type = node->type;
+        ins.captures = 0;
+        ins.replacement = -1;
+
+        if (ins.data.id == IR_LOOPSTART && opt.loopStart == -1)
+        {
+            opt.loopStart = int(i);
+        }
+    }
+
+    // The use lists, a PHI uses the value from the end of the loop before it is defined.
+    for (size_t i = 0; i < opt.ins.size(); i++)
+    {
+        const OptIns& ins = opt.ins[i];
+        if (ins.left != -1) { opt.ins[ins.left].uses.push_back(int(i)); }
+        if (ins.right != -1) { opt.ins[ins.right].uses.push_back(int(i)); }
+    }
 }
 
-void IRBuffer::write(const InsData& data, int left, int right)
+void SunScript::Opt_Capture(Optimizer& opt, int ref)
 {
-    const int pos = _head % BUFFER_SIZE;
-    _buffer[pos] = data;
-    _buffer_left[pos] = left;
-    _buffer_right[pos] = right;
-    _head++;
+    opt.ins[ref].captures++;
 }
 
-void IRBuffer::at(int ref, InsData* data, int* left, int* right)
+int SunScript::Opt_Resolve(const Optimizer& opt, int ref)
 {
-    const int pos = ref % BUFFER_SIZE;
-    *data = _buffer[pos];
-    *left = _buffer_left[pos];
-    *right = _buffer_right[pos];
+    while (opt.ins[ref].replacement != -1)
+    {
+        ref = opt.ins[ref].replacement;
+    }
+    return ref;
 }
 
-void IRBuffer::read(InsData* data, int* left, int* right)
+static void Opt_Unuse(Optimizer& opt, int ref, int user)
 {
-    const int pos = _tail % BUFFER_SIZE;
-    *data = _buffer[pos];
-    *left = _buffer_left[pos];
-    *right = _buffer_right[pos];
-    _tail++;
+    auto& uses = opt.ins[ref].uses;
+    const auto& it = std::find(uses.begin(), uses.end(), user);
+    if (it != uses.end())
+    {
+        uses.erase(it);
+    }
 }
 
-//============================
-// TRACING OPTIMIZER
-//============================
+static void Opt_Detach(Optimizer& opt, int ref)
+{
+    OptIns& ins = opt.ins[ref];
+    if (ins.left != -1) { Opt_Unuse(opt, ins.left, ref); }
+    if (ins.right != -1) { Opt_Unuse(opt, ins.right, ref); }
+    ins.left = -1;
+    ins.right = -1;
+}
 
-static void Opt_ConstantFold_Filter(OptFilter& filter, std::vector<unsigned char>& constants)
+static void Opt_Remove(Optimizer& opt, int ref)
 {
-    InsData data;
-    int left;
-    int right;
+    // The ref keeps its position so the refs after it are unchanged.
+    Opt_Detach(opt, ref);
+    opt.ins[ref].data = { .id = IR_NOP };
+}
+
+static void Opt_LoadInt(Optimizer& opt, std::vector<unsigned char>& constants, int ref, int val)
+{
+    Opt_Detach(opt, ref);
+    opt.ins[ref].data = { .id = IR_LOAD_INT, .constant = int(constants.size()) };
+    Trace_Constant(constants, val);
+}
+
+static void Opt_LoadReal(Optimizer& opt, std::vector<unsigned char>& constants, int ref, real val)
+{
+    Opt_Detach(opt, ref);
+    opt.ins[ref].data = { .id = IR_LOAD_REAL, .constant = int(constants.size()) };
+    Trace_Constant(constants, val);
+}
 
-    // Read next instruction
-    if (filter._input.empty())
+static bool Opt_Replace(Optimizer& opt, int ref, int value)
+{
+    // A value from before the loop is only kept alive to the last use the JIT compiler
+    // sees, not round the loop, so uses aren't moved between the loop and the code before it.
+    // The values a PHI takes are kept where they are for the same reason.
+    const bool loop = opt.loopStart != -1 && ref > opt.loopStart;
+    if (loop != (opt.loopStart != -1 && value > opt.loopStart) || opt.ins[ref].type != opt.ins[value].type)
+    {
+        return false;
+    }
+
+    OptIns& ins = opt.ins[ref];
+    if (std::any_of(ins.uses.begin(), ins.uses.end(), [&opt](int user) { return opt.ins[user].data.id == IR_PHI; }))
     {
-        return;
+        return false;
     }
 
-    // The output cannot be written to at this time
-    if (filter._output.full())
+    for (int user : ins.uses)
     {
-        return;
+        OptIns& use = opt.ins[user];
+        if (use.left == ref) { use.left = value; opt.ins[value].uses.push_back(user); }
+        if (use.right == ref) { use.right = value; opt.ins[value].uses.push_back(user); }
     }
+    ins.uses.clear();
+
+    opt.ins[value].captures += ins.captures;
+    ins.captures = 0;
+    ins.replacement = value;
+    Opt_Remove(opt, ref);
+    return true;
+}
+
+static bool Opt_IsInt(const Optimizer& opt, int ref)
+{
+    return ref != -1 && opt.ins[ref].data.id == IR_LOAD_INT;
+}
+
+static bool Opt_IsReal(const Optimizer& opt, int ref)
+{
+    return ref != -1 && opt.ins[ref].data.id == IR_LOAD_REAL;
+}
 
-    filter._input.read(&data, &left, &right);
+static int Opt_Int(const Optimizer& opt, const std::vector<unsigned char>& constants, int ref)
+{
+    int val;
+    std::memcpy(&val, constants.data() + opt.ins[ref].data.constant, sizeof(int));
+    return val;
+}
+
+static real Opt_Real(const Optimizer& opt, const std::vector<unsigned char>& constants, int ref)
+{
+    real val;
+    std::memcpy(&val, constants.data() + opt.ins[ref].data.constant, sizeof(real));
+    return val;
+}
+
+static bool Opt_IsInt(const Optimizer& opt, const std::vector<unsigned char>& constants, int ref, int val)
+{
+    return Opt_IsInt(opt, ref) && Opt_Int(opt, constants, ref) == val;
+}
 
-    // If the buffer is full then flush to the output
-    if (filter._buffer.full())
+static bool Opt_IsReal(const Optimizer& opt, const std::vector<unsigned char>& constants, int ref, real val)
+{
+    // Compared bitwise so a negative zero isn't taken for a zero.
+    if (!Opt_IsReal(opt, ref))
     {
-        InsData data;
-        int left;
-        int right;
-        filter._buffer.read(&data, &left, &right);
-        filter._output.write(data, left, right);
+        return false;
     }
 
-    switch (data.id)
+    const real constant = Opt_Real(opt, constants, ref);
+    return std::memcmp(&constant, &val, sizeof(real)) == 0;
+}
+
+//============================
+// Constant folding
+//============================
+
+static bool Opt_FoldInt(unsigned char id, int lhs, int rhs, int* result)
+{
+    // Wraps on overflow as the compiled code does.
+    const unsigned int a = static_cast<unsigned int>(lhs);
+    const unsigned int b = static_cast<unsigned int>(rhs);
+
+    switch (id)
     {
     case IR_ADD_INT:
+        *result = static_cast<int>(a + b);
+        return true;
     case IR_SUB_INT:
+        *result = static_cast<int>(a - b);
+        return true;
     case IR_MUL_INT:
-    case IR_DIV_INT: {
-        InsData lData; int ll; int lr;
-        filter._buffer.at(left, &lData, &ll, &lr);
-
-        InsData rData; int rl; int rr;
-        filter._buffer.at(right, &rData, &rl, &rr);
-
-        if (filter._buffer.exists(left) && filter._buffer.exists(right) &&
-            lData.id == IR_LOAD_INT && rData.id == IR_LOAD_INT)
+        *result = static_cast<int>(a * b);
+        return true;
+    case IR_DIV_INT:
+        // The division which faults is left to happen at runtime.
+        if (rhs == 0 || (lhs == INT_MIN && rhs == -1))
         {
-            int* valLeft = reinterpret_cast<int*>(&constants.data()[lData.constant]);
-            int* valRight = reinterpret_cast<int*>(&constants.data()[rData.constant]);
+            return false;
+        }
+        *result = lhs / rhs;
+        return true;
+    }
 
-            int result = 0;
+    return false;
+}
 
-            switch (data.id)
+static real Opt_FoldReal(unsigned char id, real lhs, real rhs)
+{
+    switch (id)
+    {
+    case IR_ADD_REAL:
+        return lhs + rhs;
+    case IR_SUB_REAL:
+        return lhs - rhs;
+    case IR_MUL_REAL:
+        return lhs * rhs;
+    default:
+        return lhs / rhs;
+    }
+}
+
+static int Opt_ConstantFold(Optimizer& opt, std::vector<unsigned char>& constants)
+{
+    // The trace is in order, so a value folded to a constant is seen as one by its uses.
+    // The right operand of an arithmetic instruction is its first.
+    int removed = 0;
+    for (int ref = 0; ref < int(opt.ins.size()); ref++)
+    {
+        const OptIns& ins = opt.ins[ref];
+        switch (ins.data.id)
+        {
+        case IR_ADD_INT:
+        case IR_SUB_INT:
+        case IR_MUL_INT:
+        case IR_DIV_INT:
+            if (Opt_IsInt(opt, ins.left) && Opt_IsInt(opt, ins.right))
             {
-            case IR_ADD_INT:
-                result = *valRight + *valLeft;
-                break;
-            case IR_SUB_INT:
-                result = *valRight - *valLeft;
-                break;
-            case IR_MUL_INT:
-                result = *valRight * *valLeft;
-                break;
-            case IR_DIV_INT:
-                result = *valRight / *valLeft;
-                break;
+                int result;
+                if (Opt_FoldInt(ins.data.id, Opt_Int(opt, constants, ins.right), Opt_Int(opt, constants, ins.left), &result))
+                {
+                    Opt_LoadInt(opt, constants, ref, result);
+                    removed++;
+                }
             }
+            break;
+        case IR_ADD_REAL:
+        case IR_SUB_REAL:
+        case IR_MUL_REAL:
+        case IR_DIV_REAL:
+            if (Opt_IsReal(opt, ins.left) && Opt_IsReal(opt, ins.right))
+            {
+                Opt_LoadReal(opt, constants, ref,
+                    Opt_FoldReal(ins.data.id, Opt_Real(opt, constants, ins.right), Opt_Real(opt, constants, ins.left)));
+                removed++;
+            }
+            break;
+        case IR_INCREMENT_INT:
+        case IR_DECREMENT_INT:
+        case IR_UNARY_MINUS_INT:
+            if (Opt_IsInt(opt, ins.left))
+            {
+                const unsigned int val = static_cast<unsigned int>(Opt_Int(opt, constants, ins.left));
+                const unsigned int result = ins.data.id == IR_INCREMENT_INT ? val + 1 :
+                    ins.data.id == IR_DECREMENT_INT ? val - 1 : 0 - val;
+                Opt_LoadInt(opt, constants, ref, static_cast<int>(result));
+                removed++;
+            }
+            break;
+        case IR_UNARY_MINUS_REAL:
+            if (Opt_IsReal(opt, ins.left))
+            {
+                Opt_LoadReal(opt, constants, ref, -Opt_Real(opt, constants, ins.left));
+                removed++;
+            }
+            break;
+        case IR_CONV_INT_TO_REAL:
+            if (Opt_IsInt(opt, ins.left))
+            {
+                Opt_LoadReal(opt, constants, ref, real(Opt_Int(opt, constants, ins.left)));
+                removed++;
+            }
+            break;
+        }
+    }
+
+    return removed;
+}
 
-            InsData ins = { .id = IR_LOAD_INT, .constant = int(constants.size()) };
-            filter._buffer.write(ins, 0, 0);
+//============================
+// Algebraic simplification
+//============================
 
-            Trace_Constant(constants, result);
+static int Opt_Simplify(Optimizer& opt, std::vector<unsigned char>& constants)
+{
+    // Identities which leave one of the operands, or a constant, as the result.
+    int removed = 0;
+    for (int ref = 0; ref < int(opt.ins.size()); ref++)
+    {
+        const OptIns& ins = opt.ins[ref];
+        const int left = ins.left;
+        const int right = ins.right;
+        bool done = false;
+        switch (ins.data.id)
+        {
+        case IR_ADD_INT:
+            done = (Opt_IsInt(opt, constants, left, 0) && Opt_Replace(opt, ref, right)) ||
+                (Opt_IsInt(opt, constants, right, 0) && Opt_Replace(opt, ref, left));
+            break;
+        case IR_SUB_INT:
+            if (left == right)
+            {
+                Opt_LoadInt(opt, constants, ref, 0);
+                done = true;
+            }
+            else
+            {
+                done = Opt_IsInt(opt, constants, left, 0) && Opt_Replace(opt, ref, right);
+            }
+            break;
+        case IR_MUL_INT:
+            if (Opt_IsInt(opt, constants, left, 0) || Opt_IsInt(opt, constants, right, 0))
+            {
+                Opt_LoadInt(opt, constants, ref, 0);
+                done = true;
+            }
+            else
+            {
+                done = (Opt_IsInt(opt, constants, left, 1) && Opt_Replace(opt, ref, right)) ||
+                    (Opt_IsInt(opt, constants, right, 1) && Opt_Replace(opt, ref, left));
+            }
+            break;
+        case IR_DIV_INT:
+            done = Opt_IsInt(opt, constants, left, 1) && Opt_Replace(opt, ref, right);
+            break;
+        case IR_SUB_REAL:
+            done = Opt_IsReal(opt, constants, left, real(0)) && Opt_Replace(opt, ref, right);
+            break;
+        case IR_MUL_REAL:
+            done = (Opt_IsReal(opt, constants, left, real(1)) && Opt_Replace(opt, ref, right)) ||
+                (Opt_IsReal(opt, constants, right, real(1)) && Opt_Replace(opt, ref, left));
+            break;
+        case IR_DIV_REAL:
+            done = Opt_IsReal(opt, constants, left, real(1)) && Opt_Replace(opt, ref, right);
+            break;
+        case IR_UNARY_MINUS_INT:
+        case IR_UNARY_MINUS_REAL:
+            done = left != -1 && opt.ins[left].data.id == ins.data.id && Opt_Replace(opt, ref, opt.ins[left].left);
+            break;
         }
-        else
+
+        if (done)
         {
-            filter._buffer.write(data, left, right);
+            removed++;
         }
     }
-        break;
+
+    return removed;
+}
+
+//============================
+// Common subexpression elimination
+//============================
+
+struct OptKey
+{
+    unsigned char id;
+    unsigned char type;
+    int left;
+    int right;
+    long long value;
+
+    bool operator==(const OptKey& other) const
+    {
+        return id == other.id && type == other.type && left == other.left &&
+            right == other.right && value == other.value;
+    }
+};
+
+struct OptKeyHash
+{
+    size_t operator()(const OptKey& key) const
+    {
+        size_t hash = std::hash<long long>()(key.value);
+        hash = hash * 31 + key.id;
+        hash = hash * 31 + key.type;
+        hash = hash * 31 + std::hash<int>()(key.left);
+        hash = hash * 31 + std::hash<int>()(key.right);
+        return hash;
+    }
+};
+
+static bool Opt_Key(const Optimizer& opt, const std::vector<unsigned char>& constants, int ref, OptKey* key)
+{
+    // Only instructions which compute the same value from the same operands are keyed.
+    const OptIns& ins = opt.ins[ref];
+    *key = { .id = ins.data.id, .type = 0, .left = ins.left, .right = ins.right, .value = 0 };
+    switch (ins.data.id)
+    {
+    case IR_LOAD_INT:
+        key->value = Opt_Int(opt, constants, ref);
+        return true;
+    case IR_LOAD_REAL:
+    {
+        const real val = Opt_Real(opt, constants, ref);
+        std::memcpy(&key->value, &val, sizeof(real));
+        return true;
+    }
+    case IR_LOAD_STRING:
+        key->value = ins.data.constant;
+        return true;
+    case IR_ADD_INT:
+    case IR_MUL_INT:
     case IR_ADD_REAL:
-    case IR_SUB_REAL:
     case IR_MUL_REAL:
-    case IR_DIV_REAL: {
-        InsData lData; int ll; int lr;
-        filter._buffer.at(left, &lData, &ll, &lr);
+    case IR_MIN_INT:
+    case IR_MAX_INT:
+        if (key->left > key->right) { std::swap(key->left, key->right); }
+        return true;
+    case IR_SUB_INT:
+    case IR_DIV_INT:
+    case IR_SUB_REAL:
+    case IR_DIV_REAL:
+    case IR_MIN_REAL:
+    case IR_MAX_REAL:
+    case IR_UNARY_MINUS_INT:
+    case IR_UNARY_MINUS_REAL:
+    case IR_INCREMENT_INT:
+    case IR_DECREMENT_INT:
+    case IR_CONV_INT_TO_REAL:
+    case IR_ABS_INT:
+    case IR_ABS_REAL:
+    case IR_SQRT_REAL:
+    case IR_SIN_REAL:
+    case IR_COS_REAL:
+    case IR_FLOOR_REAL:
+        return true;
+    }
 
-        InsData rData; int rl; int rr;
-        filter._buffer.at(right, &rData, &rl, &rr);
+    return false;
+}
 
-        if (filter._buffer.exists(left) && filter._buffer.exists(right) &&
-            lData.id == IR_LOAD_INT && rData.id == IR_LOAD_INT)
+static int Opt_CSE(Optimizer& opt, std::vector<unsigned char>& constants)
+{
+    // Each value is hash-consed, an instruction which has been seen is replaced by the first.
+    // The loop's body starts again, as values from before the loop aren't reused in it.
+    int removed = 0;
+    std::unordered_map<OptKey, int, OptKeyHash> values;
+    for (int ref = 0; ref < int(opt.ins.size()); ref++)
+    {
+        if (ref == opt.loopStart)
         {
-            real* valLeft = reinterpret_cast<real*>(&constants.data()[lData.constant]);
-            real* valRight = reinterpret_cast<real*>(&constants.data()[rData.constant]);
-
-            real result = 0;
-
-            switch (data.id)
-            {
-            case IR_ADD_REAL:
-                result = *valRight + *valLeft;
-                break;
-            case IR_SUB_REAL:
-                result = *valRight - *valLeft;
-                break;
-            case IR_MUL_REAL:
-                result = *valRight * *valLeft;
-                break;
-            case IR_DIV_REAL:
-                result = *valRight / *valLeft;
-                break;
-            }
+            values.clear();
+            continue;
+        }
 
-            InsData ins = { .id = IR_LOAD_INT, .constant = int(constants.size()) };
-            filter._buffer.write(ins, 0, 0);
+        OptKey key;
+        if (!Opt_Key(opt, constants, ref, &key))
+        {
+            continue;
+        }
 
-            Trace_Constant(constants, result);
+        const auto& it = values.find(key);
+        if (it == values.end())
+        {
+            values.insert(std::make_pair(key, ref));
         }
-        else
+        else if (Opt_Replace(opt, ref, it->second))
         {
-            filter._buffer.write(data, left, right);
+            removed++;
         }
     }
-        break;
-    default:
-        filter._buffer.write(data, left, right);
-        break;
-    }
+
+    return removed;
 }
 
-//static void Opt_Guard_Filter(Optimizer& opt, std::vector<unsigned char>& constants)
-//{
-//    auto& filter = opt.guard;
-//
-//    switch (data.id)
-//    {
-//    case IR_CMP_INT:
-//    case IR_CMP_REAL:
-//    case IR_CMP_STRING: {
-//        bool found = false;
-//        for (int i = 0; i < Optimizer::BUFFER_SIZE; i++)
-//        {
-//            if (opt._buffer_left[i] == left &&
-//                opt._buffer_right[i] == right)
-//            {
-//                found = true;
-//                break;
-//            }
-//        }
-//
-//        if (!found)
-//        {
-//            opt._buffer[opt._pos] = data;
-//            opt._buffer_left[opt._pos] = left;
-//            opt._buffer_right[opt._pos] = right;
-//
-//            opt._pos = (opt._pos + 1) % Optimizer::BUFFER_SIZE;
-//        }
-//    }
-//        break;
-//    case IR_GUARD: {
-//        bool found = false;
-//        for (int i = 0; i < Optimizer::BUFFER_SIZE; i++)
-//        {
-//            if (opt._buffer[i].jump == data.jump)
-//            {
-//                found = true;
-//                break;
-//            }
-//        }
-//
-//        if (!found)
-//        {
-//            opt._buffer[opt._pos] = data;
-//            opt._buffer_left[opt._pos] = -1;
-//            opt._buffer_right[opt._pos] = -1;
-//
-//            opt._pos = (opt._pos + 1) % Optimizer::BUFFER_SIZE;
-//        }
-//    }
-//        break;
-//    }
-//}
-
-void SunScript::Opt_Optimize_Forward(Optimizer& opt, std::vector<unsigned char>& constants, TraceNode* node)
+//============================
+// Guard elimination
+//============================
+
+static int Opt_GuardElim(Optimizer& opt, std::vector<unsigned char>& constants)
 {
-    opt._buffer.write(node->data, node->left ? node->left->ref : 0, node->right ? node->right->ref : 0);
+    // A guard is removed, with its comparison, if it can't fail: the comparison is of constants
+    // or was made and guarded the same way earlier in the trace. The values from before the loop
+    // don't change in it, so its guards hold in the loop too.
+    int removed = 0;
+    std::unordered_map<OptKey, int, OptKeyHash> seen;
+    for (int ref = 0; ref < int(opt.ins.size()); ref++)
+    {
+        const OptIns& guard = opt.ins[ref];
+        if (guard.data.id != IR_GUARD)
+        {
+            continue;
+        }
 
-    InsData data;
-    int left;
-    int right;
+        int cmp = ref - 1;
+        while (cmp >= 0 && (opt.ins[cmp].data.id == IR_SNAP || opt.ins[cmp].data.id == IR_NOP))
+        {
+            cmp--;
+        }
 
-    //if (opt.guard._enabled)
-    //{
-    //    Opt_Guard_Filter(opt, constants);
-    //}
+        if (cmp < 0)
+        {
+            continue;
+        }
 
-    if (opt.fold._enabled)
-    {
-        opt._buffer.read(&data, &left, &right);
-        opt.fold._input.write(data, left, right);
-        Opt_ConstantFold_Filter(opt.fold, constants);
-        if (!opt.fold._output.empty())
+        const OptIns& comparison = opt.ins[cmp];
+        if (comparison.data.id != IR_CMP_INT && comparison.data.id != IR_CMP_REAL &&
+            comparison.data.id != IR_CMP_STRING && comparison.data.id != IR_CMP_TABLE)
         {
-            opt.fold._output.read(&data, &left, &right);
-            opt.output.write(data, left, right);
+            continue;
+        }
 
-            if (data.id == IR_PHI)
-            {
-                opt.dead._used.insert(left);
-                opt.dead._used.insert(right);
-            }
+        bool holds = false;
+        if (comparison.data.id == IR_CMP_INT && Opt_IsInt(opt, comparison.left) && Opt_IsInt(opt, comparison.right) &&
+            (guard.data.jump == JUMP_E || guard.data.jump == JUMP_NE))
+        {
+            // The guard leaves the trace if the comparison is as it names.
+            const bool equal = Opt_Int(opt, constants, comparison.left) == Opt_Int(opt, constants, comparison.right);
+            holds = equal == (guard.data.jump == JUMP_NE);
+        }
+        else
+        {
+            const OptKey key = { .id = comparison.data.id, .type = guard.data.jump,
+                .left = comparison.left, .right = comparison.right, .value = 0 };
+            holds = !seen.insert(std::make_pair(key, ref)).second;
         }
-    }
-    else
-    {
-        opt._buffer.read(&data, &left, &right);
-        opt.output.write(data, left, right);
 
-        if (data.id == IR_PHI)
+        if (holds)
         {
-            opt.dead._used.insert(left);
-            opt.dead._used.insert(right);
+            Opt_Remove(opt, ref);
+            Opt_Remove(opt, cmp);
+            removed += 2;
         }
     }
+
+    return removed;
 }
 
-void SunScript::Opt_Optimize_Backward(Optimizer& opt, std::vector<unsigned char>& constants, TraceNode* node)
-{
-    // TODO: snapshots if we remove the code which sets a variable.
-    // When we restore a snapshot, this variable won't have a value?
-    // Will this cause a problem?
+//============================
+// Dead code elimination
+//============================
 
-    switch (node->data.id)
+static bool Opt_Pure(unsigned char id)
+{
+    switch (id)
     {
     case IR_LOAD_INT:
+    case IR_LOAD_REAL:
+    case IR_LOAD_STRING:
     case IR_ADD_INT:
     case IR_SUB_INT:
     case IR_MUL_INT:
     case IR_DIV_INT:
-    case IR_LOAD_REAL:
     case IR_ADD_REAL:
     case IR_SUB_REAL:
     case IR_MUL_REAL:
     case IR_DIV_REAL:
-        if (opt.dead._used.find(node->ref) == opt.dead._used.end())
-        {
-            // Instruction never used, output an IR_NOP
-            InsData data = { .id = IR_NOP };
-            opt.output.write(data, -1, -1);
-        }
-        else
-        {
-            if (node->left) { opt.dead._used.insert(node->left->ref); }
-            if (node->right) { opt.dead._used.insert(node->right->ref); }
-            opt.output.write(node->data, node->left ? node->left->ref : -1, node->right ? node->right->ref : -1);
-        }
-        break;
-    default:
-        if (node->left) { opt.dead._used.insert(node->left->ref); }
-        if (node->right) { opt.dead._used.insert(node->right->ref); }
-        opt.output.write(node->data, node->left ? node->left->ref : -1, node->right ? node->right->ref : -1);
-        break;
+    case IR_UNARY_MINUS_INT:
+    case IR_UNARY_MINUS_REAL:
+    case IR_INCREMENT_INT:
+    case IR_DECREMENT_INT:
+    case IR_CONV_INT_TO_REAL:
+    case IR_SQRT_REAL:
+    case IR_SIN_REAL:
+    case IR_COS_REAL:
+    case IR_ABS_INT:
+    case IR_ABS_REAL:
+    case IR_FLOOR_REAL:
+    case IR_MIN_INT:
+    case IR_MAX_INT:
+    case IR_MIN_REAL:
+    case IR_MAX_REAL:
+        return true;
     }
+
+    return false;
 }
 
-void SunScript::Opt_Drain(Optimizer& opt, std::vector<unsigned char>& constants)
+static int Opt_DeadCodeElim(Optimizer& opt, std::vector<unsigned char>& constants)
 {
-    while (!opt.fold._buffer.empty() && !opt.fold._output.full())
-    {
-        InsData data; int left; int right;
-        opt.fold._buffer.read(&data, &left, &right);
-        opt.fold._output.write(data, left, right);
-    }
-
-    while (!opt.output.full() && !opt.fold._output.empty())
+    // Walked backwards, so removing an instruction can leave its operands unused in turn.
+    // Values captured by snapshots are restored on exit, so they are kept alive.
+    int removed = 0;
+    for (int ref = int(opt.ins.size()) - 1; ref >= 0; ref--)
     {
-        InsData data; int left; int right;
-        opt.fold._output.read(&data, &left, &right);
-        opt.output.write(data, left, right);
-
-        if (data.id == IR_PHI)
+        const OptIns& ins = opt.ins[ref];
+        if (Opt_Pure(ins.data.id) && ins.uses.empty() && ins.captures == 0)
         {
-            opt.dead._used.insert(left);
-            opt.dead._used.insert(right);
+            Opt_Remove(opt, ref);
+            removed++;
         }
     }
+
+    return removed;
+}
+
+//============================
+// TRACING OPTIMIZER
+//============================
+
+static void Opt_Pass(OptimizerPass& pass, Optimizer& opt, std::vector<unsigned char>& constants,
+    int (*run)(Optimizer& opt, std::vector<unsigned char>& constants))
+{
+    const auto start = std::chrono::steady_clock::now();
+    pass.removed += run(opt, constants);
+    pass.time += std::chrono::steady_clock::now() - start;
+}
+
+void SunScript::Opt_Optimize(Optimizer& opt, std::vector<unsigned char>& constants, OptimizerStats& stats)
+{
+    Opt_Pass(stats.fold, opt, constants, Opt_ConstantFold);
+    Opt_Pass(stats.simplify, opt, constants, Opt_Simplify);
+    Opt_Pass(stats.cse, opt, constants, Opt_CSE);
+    Opt_Pass(stats.guards, opt, constants, Opt_GuardElim);
+    Opt_Pass(stats.dead, opt, constants, Opt_DeadCodeElim);
+    stats.traces++;
 }
@@ -1,6 +1,5 @@
 #pragma once
 #include <vector>
-#include <unordered_set>
 
 namespace SunScript
 {
@@ -38,58 +37,30 @@ namespace SunScript
         int pc;
     };
 
-    class IRBuffer
-    {
-    public:
-        static const int BUFFER_SIZE = 64;
-
-        IRBuffer();
-        void write(const InsData& data, int left, int right);
-        void at(int ref, InsData* data, int* left, int* right);
-        inline bool empty() { return _head == _tail; }
-        inline bool full() { return _head - _tail >= BUFFER_SIZE; }
-        inline bool exists(int pos) { return pos >= _tail && pos < _head; }
-        void read(InsData* data, int* left, int* right);
-
-    private:
-        int _head;
-        int _tail;
-        InsData _buffer[BUFFER_SIZE];
-        int _buffer_left[BUFFER_SIZE];
-        int _buffer_right[BUFFER_SIZE];
-    };
-
-    struct OptFilter
-    {
-        bool _enabled;
-        IRBuffer _input;
-        IRBuffer _buffer;
-        IRBuffer _output;
-    };
+    struct OptimizerStats;
 
-    struct OptDeadCodeElim
+    struct OptIns
     {
-        std::unordered_set<int> _used;
-        OptFilter _filter;
+        InsData data;
+        int left;               // the ref of the left operand, or -1
+        int right;              // the ref of the right operand, or -1
+        int type;               // the type of the result
+        int captures;           // the number of snapshot entries which restore the result
+        int replacement;        // the ref which computes the same value, or -1
+        std::vector<int> uses;  // the refs of the instructions which use the result
     };
 
     struct Optimizer
     {
-        IRBuffer _buffer;
-        IRBuffer output;
-        OptFilter guard;
-        OptFilter fold;
-        OptDeadCodeElim dead;
+        std::vector<OptIns> ins;    // the trace in SSA form, indexed by ref
+        int loopStart;              // the ref of the loop's header, or -1
 
-        Optimizer() {
-            fold._enabled = true;
-            guard._enabled = true;
-        }
+        Optimizer() : loopStart(-1) {}
     };
 
-    void Opt_Optimize_Forward(Optimizer& opt, std::vector<unsigned char>& constants, TraceNode* node);
-    void Opt_Optimize_Backward(Optimizer& opt, std::vector<unsigned char>& constants, TraceNode* node);
-    void Opt_Drain(Optimizer& opt, std::vector<unsigned char>& constants);
+    void Opt_Build(Optimizer& opt, const std::vector<TraceNode*>& nodes);
+    void Opt_Capture(Optimizer& opt, int ref);
+    void Opt_Optimize(Optimizer& opt, std::vector<unsigned char>& constants, OptimizerStats& stats);
+    int Opt_Resolve(const Optimizer& opt, int ref);
 
 }
-
@@ -9,8 +9,16 @@
 #include <cstring>
 #include <assert.h>
 #include <array>
+#include <utility>
 #include <cmath>
 #include <algorithm>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
 
 using namespace SunScript;
 
@@ -22,7 +30,11 @@ namespace SunScript
 // MemoryManager
 //===================
 
-    MemoryManager::MemoryManager() {}
+    MemoryManager::MemoryManager()
+        :
+        _pinnedSegments(0),
+        _pinnedPos(0)
+    {}
 
     void* MemoryManager::New(uint64_t size, char type)
     {
@@ -135,12 +147,25 @@ namespace SunScript
 
     void MemoryManager::Reset()
     {
-        for (auto& seg : _segments)
+        // Pinned memory survives the reset.
+        for (size_t i = _pinnedSegments > 0 ? _pinnedSegments - 1 : 0; i < _segments.size(); i++)
         {
-            seg._pos = 0;
+            _segments[i]._pos = i + 1 == _pinnedSegments ? _pinnedPos : 0;
         }
     }
 
+    void MemoryManager::Pin()
+    {
+        _pinnedSegments = _segments.size();
+        _pinnedPos = _segments.empty() ? 0 : _segments.back()._pos;
+    }
+
+    void MemoryManager::Unpin()
+    {
+        _pinnedSegments = 0;
+        _pinnedPos = 0;
+    }
+
     uint64_t MemoryManager::TotalMemory()
     {
         uint64_t usage = 0;
@@ -212,7 +237,8 @@ namespace SunScript
         switch (type)
         {
         case TY_INT:
-            *(int64_t*)(_buffer + pos + 8) = *(int64_t*)data;
+            // Integers are boxed in four bytes; widen so the trace can load the full slot
+            *(int64_t*)(_buffer + pos + 8) = *(int*)data;
             break;
         case TY_STRING:
             *(char**)(_buffer + pos + 8) = (char*)data;
@@ -220,6 +246,9 @@ namespace SunScript
         case TY_TABLE:
             *(int64_t*)(_buffer + pos + 8) = (int64_t)data;
             break;
+        case TY_REAL:
+            *(real*)(_buffer + pos + 8) = *(real*)data;
+            break;
         }
     }
 //============================
@@ -233,6 +262,7 @@ namespace SunScript
         inline void* pop();
         inline size_t size() { return _pos; }
         inline void* top() { return _array[_pos - 1]; }
+        inline void* peek(size_t depth) { return _array[_pos - 1 - depth]; }
         inline bool empty() { return _pos == 0; }
 
     private:
@@ -259,12 +289,6 @@ namespace SunScript
 
 //===========================
 
-    struct LoopStat
-    {
-        unsigned int pc;
-        int offset;
-    };
-
     struct ReturnStat
     {
         unsigned int pc;
@@ -272,21 +296,23 @@ namespace SunScript
         unsigned int count;
     };
 
-    struct BranchStat
-    {
-        unsigned int pc;
-        unsigned int trueCount;
-        unsigned int falseCount;
-    };
-
     struct Statistics
     {
         unsigned int retCount;
-        unsigned int branchCount;
-        unsigned int loopCount;
         ReturnStat retStats[8];
-        BranchStat branchStats[8];
-        LoopStat loopStats[8];
+    };
+
+    struct BranchCount
+    {
+        unsigned int taken;
+        unsigned int notTaken;
+    };
+
+    struct BranchSite
+    {
+        int pc;             // the position of the conditional jump
+        int site;           // the branch in its function, numbered by the compiler
+        bool sense;         // whether the jump is taken when the condition holds
     };
 
     struct FunctionInfo
@@ -294,7 +320,10 @@ namespace SunScript
         unsigned int pc;
         unsigned int size;
         unsigned int counter;
+        unsigned int calls;                 // calls during the current run
         unsigned int depth;
+        uint64_t hash;                      // hash of the function contents
+        bool returnsValue;                  // every return leaves a value, found by the verifier
         Statistics stats;
         std::string name;
         std::vector<std::string> parameters;
@@ -305,11 +334,13 @@ namespace SunScript
 //============================
 
     constexpr unsigned int SN_NEEDED = 0x1; // snapshot needed
-    constexpr unsigned int MAX_TRACES = 32;
-    
-    constexpr int HOT_COUNT = 100;          // the number of invokes of script to consider the script 'hot'
-    constexpr int MIN_TRACE_SIZE = 12;      // the minimum size of a trace to compile it
-    constexpr int MAX_TRACE_SIZE = 200;     // the maximum size of a trace
+
+    constexpr unsigned char QK_NONE = 0x0;          // the instruction hasn't been run
+    constexpr unsigned char QK_GENERIC = 0x1;       // the operand types vary, use the generic handler
+    constexpr unsigned char QK_INT_INT = 0x2;
+    constexpr unsigned char QK_REAL_REAL = 0x3;
+    constexpr unsigned char QK_ARRAY = 0x4;         // table access with an integer key
+    constexpr unsigned char QK_HASH = 0x5;          // table access with a string key
 
     struct StackFrame
     {
@@ -398,10 +429,19 @@ namespace SunScript
         unsigned int pc;
         std::vector<StackFrame> frames;
         std::vector<Local> locals;
+        std::vector<TraceNode*> stack;      // the values pushed to the stack since the trace started
+        int stackBounds;                    // the stack bounds of the frame the snapshot is in
+        bool discard;                       // whether the frame the snapshot is in discards its return
+        unsigned int exits;                 // the number of times the trace was left here
+        int side;                           // the slot of the side trace entered from here, or -1
 
         TraceSnapshot()
             :
-            pc(0)
+            pc(0),
+            stackBounds(0),
+            discard(false),
+            exits(0),
+            side(-1)
         {}
     };
 
@@ -413,12 +453,26 @@ namespace SunScript
         std::vector<TraceNode*> refs;       // stack of refs
         std::vector<TraceSnapshot> snaps;
         std::vector<unsigned char> trace;   // completed trace
+        std::vector<FunctionInfo*> functions; // functions covered by the trace
         TraceLoop loop;                     // current loop
         int ref;                            // current ref index
         int flags;
         int pc;                             // the pc point where
                                             // the trace starts
-        int id;                             // trace id
+        int depth;                          // the number of frames when the trace started
+        int localBounds;                    // the local bounds when the trace started
+        int stackSize;                      // the size of the stack when the trace started
+        int id;                             // trace id, the slot in the trace tree
+        unsigned char op;                   // the instruction at pc before it was marked
+        unsigned int lastUsed;              // the tree's clock when the trace was last entered
+        unsigned int serial;                // tells the trace apart from others which used its slot
+        bool compiling;                     // whether the trace has been handed to the compiler
+        bool looping;                       // whether the trace runs a loop from its header
+        int parent;                         // the slot of the trace a side trace is entered from, or -1
+        unsigned int parentSerial;          // the serial of the parent when the side trace started
+        int exit;                           // the snapshot of the parent the side trace starts at
+        int outer;                          // the header of the enclosing loop a side trace goes around, or -1
+        int next;                           // the slot of the trace its end jumps to, or -1
         void* jit_trace;
 
         Trace()
@@ -426,27 +480,92 @@ namespace SunScript
             ref(0),
             flags(0),
             pc(0),
+            depth(0),
+            localBounds(0),
+            stackSize(0),
             id(0),
+            op(0),
+            lastUsed(0),
+            serial(0),
+            compiling(false),
+            looping(false),
+            parent(-1),
+            parentSerial(0),
+            exit(-1),
+            outer(-1),
+            next(-1),
             jit_trace(nullptr)
         {}
 
         void Reset()
         {
+            const int slot = id;
             mm.Reset();
             *this = Trace();
+            id = slot;
         }
     };
 
     struct TraceTree
     {
-        std::array<Trace, MAX_TRACES> traces;
-        int numTraces;
+        std::vector<std::unique_ptr<Trace>> traces; // slots, a trace keeps its address while live
+        std::vector<int> free;                      // slots released by aborted or evicted traces
+        std::vector<int> entries;                   // program pc -> slot of the trace entered there
+        int numTraces;                              // the number of live traces
+        int entry;                                  // the slot of the trace covering the whole script
+        unsigned int clock;                         // ticks each time a trace is entered
+        unsigned int serials;                       // the serial given to the last trace started
         Trace* curTrace;
+        unsigned char* record;                      // the locals of the trace executing
+        int recordSize;                             // the number of locals in the record
+        int sideExit;                               // the snapshot to record a side trace from, or -1
+        bool linked;                                // whether the trace executing was entered from another
 
         TraceTree()
             :
             numTraces(0),
-            curTrace(nullptr)
+            entry(-1),
+            clock(0),
+            serials(0),
+            curTrace(nullptr),
+            record(nullptr),
+            recordSize(0),
+            sideExit(-1),
+            linked(false)
+        {}
+    };
+
+    struct CompileJob
+    {
+        int id;                             // the slot of the trace
+        unsigned int serial;                // the trace's serial when it was queued
+        std::vector<unsigned char> trace;   // a copy of the trace, the slot may be reused meanwhile
+        void* jit_trace;                    // the compiled trace, or nullptr if it failed to compile
+    };
+
+    struct TraceCompiler
+    {
+        std::thread worker;
+        std::mutex lock;
+        std::condition_variable wake;       // wakes the worker when a job is queued or it should stop
+        std::condition_variable idle;       // wakes the VM's thread when the worker finishes a job
+        std::deque<CompileJob> queued;
+        std::vector<CompileJob> done;       // compiled jobs waiting to be installed
+        std::atomic<bool> ready;            // whether done has any jobs
+        bool busy;                          // whether the worker is compiling a job
+        bool stop;
+
+        // Only used by the VM's thread.
+        std::vector<CompileJob> deferred;   // compiled jobs which must wait for the start of a run
+        std::deque<CompileJob> waiting;     // traces waiting for room in the queue, not yet copied
+        int pending;                        // jobs queued, compiling or waiting to be installed
+
+        TraceCompiler()
+            :
+            ready(false),
+            busy(false),
+            stop(false),
+            pending(0)
         {}
     };
 
@@ -469,6 +588,7 @@ namespace SunScript
         bool tracingPaused;
         bool hot;
         int optimizationLevel;
+        OptimizerStats optimizerStats;
         int statusCode;
         int errorCode;
         int resumeCode;
@@ -491,8 +611,22 @@ namespace SunScript
         std::vector<Block> blocks;
         std::vector<Function> functions;
         std::vector<void*> locals;
+        std::vector<unsigned char> quickened;   // the specialised form of each instruction by pc
+        std::vector<void*> constants;           // the constant pool, boxed once when the program is loaded
+        unsigned int constantsOffset;           // offset in program data where the constant pool starts
         std::vector<unsigned char> traceConstants;
+        std::vector<int> traceConstantOffsets;  // where each pool constant is in traceConstants, or -1
+        std::vector<int> stackDepths;           // the least stack depth proven at each pc
+        std::vector<BranchCount> branchCounts;  // how often the jump at each pc was taken
+        std::vector<BranchSite> branchSites;    // the source branch of each conditional jump, from the debug data
+        bool verified;                          // whether every block passed the stack depth checks
+        TraceTuning tuning;
+        std::unordered_map<unsigned int, unsigned int> loopCounters; // back edges taken this run by loop header pc
+        std::unordered_set<unsigned int> coldLoops;  // loop headers which failed to trace mid-run
+        int loopHeader;                         // the header of the last loop to jump back in main, or -1
+        int loopTrace;                          // the header a loop is traced from mid-run, or -1
         TraceTree tt;
+        std::unique_ptr<TraceCompiler> compiler;   // started by the first trace compiled in the background
         int (*handler)(VirtualMachine* vm);
         Jit jit;
         void* jit_instance;
@@ -509,16 +643,22 @@ namespace SunScript
         std::string name;
         std::vector<std::string> args;
         std::vector<std::string> fields;
+        std::vector<std::string> constants;     // the encoded type and value of each constant
+        std::unordered_map<std::string, int> constantIds;
         std::vector<unsigned char> debug;
+        std::vector<BranchSite> branches;
         std::vector<unsigned char> data;
     };
 
     struct Program
     {
         std::vector<unsigned char> debug;
+        std::vector<BranchSite> branches;
         std::vector<unsigned char> data;
         std::vector<unsigned char> functions;
         std::vector<unsigned char> entries;
+        std::vector<unsigned char> constants;
+        std::unordered_map<std::string, int> constantIds;
         std::vector<ProgramBlock*> blocks;
         int numFunctions;
         int numLines;
@@ -528,62 +668,6 @@ namespace SunScript
 
 //===================
 
-inline static void RecordLoop(FunctionInfo* info, unsigned int pc, int offset)
-{
-    const unsigned int numCount = sizeof(info->stats.loopStats) / sizeof(LoopStat);
-    for (unsigned int i = 0; i < numCount; i++)
-    {
-        auto& loop = info->stats.loopStats[i];
-        if (i < info->stats.loopCount)
-        {
-            if (loop.pc == pc)
-            {
-                loop.offset = offset;
-                break;
-            }
-        }
-        else
-        {
-            loop.pc = pc;
-            loop.offset = offset;
-            info->stats.loopCount++;
-            break;
-        }
-    }
-}
-
-inline static void RecordBranch(FunctionInfo* info, unsigned int pc, bool branchDirection)
-{
-    const unsigned int numCount = sizeof(info->stats.branchStats) / sizeof(BranchStat);
-    for (unsigned int i = 0; i < numCount; i++)
-    {
-        auto& branch = info->stats.branchStats[i];
-        if (i < info->stats.branchCount)
-        {
-            if (branch.pc == pc)
-            {
-                if (branchDirection)
-                {
-                    branch.trueCount++;
-                }
-                else
-                {
-                    branch.falseCount++;
-                }
-                break;
-            }
-        }
-        else
-        {
-            branch.pc = pc;
-            branch.falseCount = branchDirection ? 0 : 1;
-            branch.trueCount = branchDirection ? 1 : 0;
-            info->stats.branchCount++;
-            break;
-        }
-    }
-}
-
 inline static void RecordReturn(FunctionInfo* info, unsigned int pc, char type)
 {
     const unsigned int numCount = sizeof(info->stats.retStats) / sizeof(ReturnStat);
@@ -681,7 +765,17 @@ static std::vector<Code> Instructions = {
     Code({ IR_TABLE_HSET, INS_LEFT | INS_RIGHT }),
     Code({ IR_TABLE_ASET, INS_LEFT | INS_RIGHT }),
     Code({ IR_TABLE_AREF, INS_LEFT | INS_RIGHT }),
-    Code({ IR_TABLE_HREF, INS_LEFT | INS_RIGHT })
+    Code({ IR_TABLE_HREF, INS_LEFT | INS_RIGHT }),
+    Code({ IR_SQRT_REAL, INS_LEFT }),
+    Code({ IR_SIN_REAL, INS_LEFT }),
+    Code({ IR_COS_REAL, INS_LEFT }),
+    Code({ IR_ABS_INT, INS_LEFT }),
+    Code({ IR_ABS_REAL, INS_LEFT }),
+    Code({ IR_FLOOR_REAL, INS_LEFT }),
+    Code({ IR_MIN_INT, INS_LEFT | INS_RIGHT }),
+    Code({ IR_MAX_INT, INS_LEFT | INS_RIGHT }),
+    Code({ IR_MIN_REAL, INS_LEFT | INS_RIGHT }),
+    Code({ IR_MAX_REAL, INS_LEFT | INS_RIGHT })
 };
 
 inline static void Trace_Constant(std::vector<unsigned char>& constants, int val)
@@ -735,21 +829,157 @@ inline static void Trace_Suspend(VirtualMachine* vm)
     vm->tracingPaused = true;
 }
 
+inline static void Trace_Function(VirtualMachine* vm, FunctionInfo* func)
+{
+    auto& functions = vm->tt.curTrace->functions;
+    if (std::find(functions.begin(), functions.end(), func) == functions.end())
+    {
+        functions.push_back(func);
+    }
+}
+
+inline static void Trace_Release(VirtualMachine* vm, Trace* trace)
+{
+    // Frees the trace's code, restores the instruction which entered it and returns its slot.
+    auto& tt = vm->tt;
+    if (trace->pc == -1)
+    {
+        return;
+    }
+
+    if (trace->parent != -1)
+    {
+        // The parent exits through the VM again.
+        Trace* parent = tt.traces[trace->parent].get();
+        if (parent->serial == trace->parentSerial && parent->snaps[trace->exit].side == trace->id)
+        {
+            parent->snaps[trace->exit].side = -1;
+            vm->jit.jit_link(vm->jit_instance, parent->jit_trace, trace->exit, nullptr);
+        }
+    }
+
+    for (auto& slot : tt.traces)
+    {
+        // Traces which end where it starts exit through the VM again.
+        Trace* prev = slot.get();
+        if (prev->next == trace->id)
+        {
+            prev->next = -1;
+            vm->jit.jit_link(vm->jit_instance, prev->jit_trace, int(prev->snaps.size()) - 1, nullptr);
+        }
+    }
+
+    for (auto& snap : trace->snaps)
+    {
+        // Side traces are only entered from the trace and link back to it.
+        if (snap.side != -1)
+        {
+            Trace* side = tt.traces[snap.side].get();
+            snap.side = -1;
+            Trace_Release(vm, side);
+        }
+    }
+
+    if (trace->jit_trace)
+    {
+        if (vm->jit.jit_free)
+        {
+            vm->jit.jit_free(trace->jit_trace);
+        }
+
+        if (trace->pc < int(tt.entries.size()) && tt.entries[trace->pc] == trace->id)
+        {
+            vm->program[trace->pc] = trace->op;
+            tt.entries[trace->pc] = -1;
+        }
+    }
+
+    if (tt.entry == trace->id)
+    {
+        tt.entry = -1;
+    }
+
+    trace->Reset();
+    trace->pc = -1;
+    tt.free.push_back(trace->id);
+    tt.numTraces--;
+}
+
+inline static void Trace_Evict(VirtualMachine* vm)
+{
+    // Evict the compiled trace entered least recently, traces still being recorded are kept.
+    // Side traces go with the trace they are entered from.
+    Trace* victim = nullptr;
+    for (auto& slot : vm->tt.traces)
+    {
+        Trace* trace = slot.get();
+        if (trace->jit_trace && trace->parent == -1 && (!victim || trace->lastUsed < victim->lastUsed))
+        {
+            victim = trace;
+        }
+    }
+
+    if (victim)
+    {
+        Trace_Release(vm, victim);
+    }
+}
+
+inline static Trace* Trace_Alloc(VirtualMachine* vm)
+{
+    auto& tt = vm->tt;
+    if (tt.numTraces >= vm->tuning.maxTraces)
+    {
+        Trace_Evict(vm);
+    }
+
+    Trace* trace;
+    if (tt.free.empty())
+    {
+        trace = tt.traces.emplace_back(std::make_unique<Trace>()).get();
+        trace->id = int(tt.traces.size()) - 1;
+    }
+    else
+    {
+        trace = tt.traces[tt.free.back()].get();
+        tt.free.pop_back();
+    }
+
+    tt.numTraces++;
+    return trace;
+}
+
+inline static void Trace_ReleaseAll(VirtualMachine* vm)
+{
+    for (auto& slot : vm->tt.traces)
+    {
+        Trace_Release(vm, slot.get());
+    }
+
+    vm->tt.curTrace = nullptr;
+}
+
 inline static void Trace_Start(VirtualMachine* vm)
 {
-    vm->tt.curTrace = &vm->tt.traces[vm->tt.numTraces++];
+    vm->tt.curTrace = Trace_Alloc(vm);
+    vm->tt.curTrace->serial = ++vm->tt.serials;
     vm->tt.curTrace->ref = 0;
     vm->tt.curTrace->flags = SN_NEEDED;
     vm->tt.curTrace->pc = vm->programInstruction;
+    vm->tt.curTrace->depth = int(vm->frames.size());
+    vm->tt.curTrace->localBounds = vm->localBounds;
+    vm->tt.curTrace->stackSize = int(vm->stack.size());
     vm->tt.curTrace->refs.clear();
     vm->tt.curTrace->locals.resize(vm->locals.size());
     vm->tt.curTrace->snaps.clear();
     vm->tt.curTrace->nodes.clear();
-    vm->tt.curTrace->id = vm->tt.numTraces - 1;
+    vm->tt.curTrace->functions.clear();
+    Trace_Function(vm, vm->frames.empty() ? vm->main : vm->frames.back().func);
 
     vm->tracing = true;
     vm->tracingPaused = false;
     vm->traceConstants.clear();
+    vm->traceConstantOffsets.assign(vm->constants.size(), -1);
     
     // Setup locals for the new trace.
     for (size_t i = 0; i < vm->locals.size(); i++)
@@ -788,10 +1018,7 @@ inline static void Trace_Abort(VirtualMachine* vm)
 {
     vm->tracing = false;
 
-    Trace* trace = vm->tt.curTrace;
-    trace->Reset();
-
-    vm->tt.numTraces--;
+    Trace_Release(vm, vm->tt.curTrace);
 }
 
 inline static void Trace_Restore(VirtualMachine* vm, Trace* trace)
@@ -912,9 +1139,17 @@ static void Trace_Node(VirtualMachine* vm, TraceNode* node)
         vm->tt.curTrace->trace.push_back(ins.snapId);
         vm->tt.curTrace->trace.push_back(ins.snapCount);
 
-        for (auto& local : vm->tt.curTrace->snaps[ins.snapId].locals)
+        auto& snap = vm->tt.curTrace->snaps[ins.snapId];
+        for (auto& local : snap.locals)
+        {
+            Trace_Int(vm, local.ref->ref);
+            vm->tt.curTrace->trace.push_back(static_cast<unsigned char>(local.index));
+        }
+        for (TraceNode* value : snap.stack)
         {
-            vm->tt.curTrace->trace.push_back(static_cast<unsigned char>(local.ref->ref));
+            // Not restored to a local, these are never stored to the record by a linked exit.
+            Trace_Int(vm, value->ref);
+            vm->tt.curTrace->trace.push_back(std::numeric_limits<unsigned char>::max());
         }
     }
 }
@@ -946,13 +1181,43 @@ inline static void Trace_LoadC_String(VirtualMachine* vm, const char* str)
     Trace_Constant(vm, str);
 }
 
+inline static void Trace_LoadC_Pool(VirtualMachine* vm, int index)
+{
+    // Each constant from the pool is only copied into the trace once.
+    void* value = vm->constants[index];
+    const unsigned char type = vm->mm.GetType(value);
+    int& offset = vm->traceConstantOffsets[index];
+    if (offset == -1)
+    {
+        offset = int(vm->traceConstants.size());
+        switch (type)
+        {
+        case TY_INT:
+            Trace_Constant(vm, *reinterpret_cast<int*>(value));
+            break;
+        case TY_REAL:
+            Trace_Constant(vm, *reinterpret_cast<real*>(value));
+            break;
+        case TY_STRING:
+            Trace_Constant(vm, reinterpret_cast<const char*>(value));
+            break;
+        }
+    }
+
+    const unsigned char id = type == TY_INT ? IR_LOAD_INT : type == TY_REAL ? IR_LOAD_REAL : IR_LOAD_STRING;
+    TraceNode* node = Trace_Instruction(vm, type, { .id = id, .constant = offset });
+    TPUSH(vm, node);
+    TINC(vm);
+}
+
 inline static void Trace_Conv_Int_To_Real(VirtualMachine* vm, int index)
 {
+    // Replaces the ref at the index from the top of the stack with its conversion.
+    auto& refs = vm->tt.curTrace->refs;
     TraceNode* node = Trace_Instruction(vm, TY_REAL, { .id = IR_CONV_INT_TO_REAL });
-    node->left = vm->tt.curTrace->refs.at(vm->tt.curTrace->refs.size() + index);
-    
-    TPOP(vm);
-    TPUSH(vm, node);
+    node->left = refs.at(refs.size() + index);
+    refs.at(refs.size() + index) = node;
+
     TINC(vm);
 }
 
@@ -1283,6 +1548,25 @@ inline static void Trace_Unary_Minus_Int(VirtualMachine* vm)
     TINC(vm);
 }
 
+inline static void Trace_Math(VirtualMachine* vm, unsigned char type, unsigned char ir, int numArgs)
+{
+    TraceNode* node = Trace_Instruction(vm, type, { .id = ir });
+    node->left = TTOP(vm);
+
+    if (numArgs == 2)
+    {
+        node->right = TNEXT(vm);
+        TPOP2(vm);
+    }
+    else
+    {
+        TPOP(vm);
+    }
+
+    TPUSH(vm, node);
+    TINC(vm);
+}
+
 inline static void Trace_Done(VirtualMachine* vm)
 {
     // Take a snapshot:
@@ -1314,13 +1598,19 @@ inline static void Trace_Snap(VirtualMachine* vm)
         // We need to record all variables as we don't know
         // which ones we need down a different branch.
 
+        // The frames of the calls made since the trace started.
         TraceSnapshot& snap = vm->tt.curTrace->snaps.emplace_back();
         snap.pc = vm->programInstruction;
-        for (auto& frame : vm->frames)
+        for (size_t i = vm->tt.curTrace->depth; i < vm->frames.size(); i++)
         {
-            snap.frames.emplace_back(frame);
+            snap.frames.emplace_back(vm->frames[i]);
         }
 
+        // The partly evaluated expressions are restored to the stack, as are the frame's bounds if it was called in the trace.
+        snap.stack = vm->tt.curTrace->refs;
+        snap.stackBounds = vm->stackBounds;
+        snap.discard = vm->discard;
+
         //std::vector<bool> usedRefs;
         // usedRefs.resize(vm->tt.curTrace->ref);
 
@@ -1340,7 +1630,7 @@ inline static void Trace_Snap(VirtualMachine* vm)
         TraceNode* node = Trace_Instruction(vm, TY_VOID,
             {
                 .id = IR_SNAP,
-                .snapCount = static_cast<unsigned char>(snap.locals.size()),
+                .snapCount = static_cast<unsigned char>(snap.locals.size() + snap.stack.size()),
                 .snapId = char(vm->tt.curTrace->snaps.size() - 1)
             } );
 
@@ -1348,6 +1638,28 @@ inline static void Trace_Snap(VirtualMachine* vm)
     }
 }
 
+inline static void Trace_Switch(VirtualMachine* vm, int local, int bound, char exit)
+{
+    // A single guard keeps the trace on the case taken.
+    Trace_Push_Local(vm, local);
+    Trace_LoadC_Int(vm, bound);
+    Trace_Cmp_Int(vm);
+    Trace_Snap(vm);
+    Trace_Guard(vm, exit);
+}
+
+inline static void Trace_Callee(VirtualMachine* vm, int id)
+{
+    // The body of the function called is inlined, so leave the trace
+    // before the call if the value called is another function.
+    TPUSH(vm, TTOP(vm));
+    Trace_LoadC_Int(vm, id);
+    Trace_Cmp_Int(vm);
+    vm->tt.curTrace->flags |= SN_NEEDED;
+    Trace_Snap(vm);
+    Trace_Guard(vm, JUMP_NE);
+}
+
 inline static void Trace_Unbox(VirtualMachine* vm, int type)
 {
     TraceNode* left = vm->tt.curTrace->nodes[vm->tt.curTrace->nodes.size() - 1];
@@ -1382,15 +1694,21 @@ inline static void Trace_TableNew(VirtualMachine* vm)
 
 inline static void Trace_TableHGet(VirtualMachine* vm, unsigned char type)
 {
-    TPOP(vm); // type
+    TraceNode* key = TTOP(vm); // type
+    TPOP(vm);
 
     TraceNode* get = Trace_Instruction(vm, TY_OBJECT, { .id = IR_TABLE_HGET });
     get->left = TTOP(vm); // identifier
     get->right = TNEXT(vm); // table
-    TPOP2(vm);
     TINC(vm);
 
+    // The guard on the type of the element runs the instruction again,
+    // so the snapshot is taken with its operands on the stack.
+    TPUSH(vm, key);
+    vm->tt.curTrace->flags |= SN_NEEDED;
     Trace_Snap(vm);
+    TPOP(vm);
+    TPOP2(vm);
 
     TraceNode* unbox = Trace_Instruction(vm, type, { .id = IR_UNBOX, .type = type });
     unbox->left = get;
@@ -1421,19 +1739,28 @@ inline static void Trace_TableHSet(VirtualMachine* vm, unsigned char type)
     set->left = ref; // memory reference
     set->right = box; // value
     TINC(vm);
+
+    // The store isn't undone, so a later exit resumes after it.
+    vm->tt.curTrace->flags |= SN_NEEDED;
 }
 
 inline static void Trace_TableAGet(VirtualMachine* vm, unsigned char type)
 {
-    TPOP(vm); // type
+    TraceNode* key = TTOP(vm); // type
+    TPOP(vm);
 
     TraceNode* get = Trace_Instruction(vm, TY_OBJECT, { .id = IR_TABLE_AGET });
     get->left = TTOP(vm); // identifier
     get->right = TNEXT(vm); // table
-    TPOP2(vm);
     TINC(vm);
 
+    // The guard on the type of the element runs the instruction again,
+    // so the snapshot is taken with its operands on the stack.
+    TPUSH(vm, key);
+    vm->tt.curTrace->flags |= SN_NEEDED;
     Trace_Snap(vm);
+    TPOP(vm);
+    TPOP2(vm);
 
     TraceNode* unbox = Trace_Instruction(vm, type, { .id = IR_UNBOX, .type = type });
     unbox->left = get;
@@ -1464,74 +1791,69 @@ inline static void Trace_TableASet(VirtualMachine* vm, unsigned char type)
     set->left = ref; // memory reference
     set->right = box; // value
     TINC(vm);
+
+    // The store isn't undone, so a later exit resumes after it.
+    vm->tt.curTrace->flags |= SN_NEEDED;
+}
+
+inline static void Trace_TableRef(VirtualMachine* vm, TraceNode* table, TraceNode* id)
+{
+    // The type is not read by the table instructions, so the identifier stands in for it.
+    TPUSH(vm, table);
+    TPUSH(vm, id);
+    TPUSH(vm, id);
 }
 
 static void Trace_Finalize(VirtualMachine* vm)
 {
+    // Snapshots are numbered, and their values counted and indexed, by a byte.
+    // A longer trace (such as deep recursion unrolled) can't be compiled.
+    const auto& snaps = vm->tt.curTrace->snaps;
+    const size_t maxSlots = std::numeric_limits<unsigned char>::max();
+    if (snaps.size() > size_t(std::numeric_limits<signed char>::max()) + 1 ||
+        std::any_of(snaps.begin(), snaps.end(), [maxSlots](const TraceSnapshot& snap)
+            { return snap.locals.size() + snap.stack.size() > maxSlots ||
+                (!snap.locals.empty() && size_t(snap.locals.back().index) >= maxSlots); }))
+    {
+        Trace_Abort(vm);
+        return;
+    }
+
     //
     // Process the nodes and copy the data over to a new buffer.
-    // The nodes may have be rearranged and thus the data need reordering.
+    // The optimizer keeps each instruction at its ref, so the snapshots still refer to them.
 
     if (vm->optimizationLevel >= 1)
     {
-        std::vector<TraceNode> nodes;
-        nodes.reserve(vm->tt.curTrace->nodes.size());
-
-        std::vector<TraceNode> backward;
-        backward.reserve(vm->tt.curTrace->nodes.size());
-
         Optimizer opt;
+        Opt_Build(opt, vm->tt.curTrace->nodes);
 
-        //==================
-        // Forward pass
-        //==================
-
-        for (TraceNode* node : vm->tt.curTrace->nodes)
+        // Values captured by snapshots are restored on exit, so keep them alive
+        for (auto& snap : vm->tt.curTrace->snaps)
         {
-            Opt_Optimize_Forward(opt, vm->traceConstants, node);
-
-            if (!opt.output.empty())
+            for (auto& local : snap.locals)
             {
-                int left = -1;
-                int right = -1;
-                TraceNode n = {};
-                opt.output.read(&n.data, &left, &right);
-                n.ref = int(backward.size());
-                n.left = left == -1 ? nullptr : vm->tt.curTrace->nodes[left];
-                n.right = right == -1 ? nullptr : vm->tt.curTrace->nodes[right];
-                backward.push_back(n);
+                Opt_Capture(opt, local.ref->ref);
+            }
+            for (TraceNode* value : snap.stack)
+            {
+                Opt_Capture(opt, value->ref);
             }
         }
 
-        Opt_Drain(opt, vm->traceConstants);
-
-        while (!opt.output.empty())
-        {
-            TraceNode n = {};
-            int left = -1;
-            int right = -1;
-            opt.output.read(&n.data, &left, &right);
-            n.left = left == -1 ? nullptr : vm->tt.curTrace->nodes[left];
-            n.right = right == -1 ? nullptr : vm->tt.curTrace->nodes[right];
-            n.ref = int(backward.size());
-            backward.push_back(n);
-        }
-
-        //==================
-        // Backward pass
-        //==================
+        Opt_Optimize(opt, vm->traceConstants, vm->optimizerStats);
 
-        for (int i = int(backward.size()) - 1; i >= 0; i--)
+        // The snapshots restore the value which replaced the one they captured.
+        const auto& nodes = vm->tt.curTrace->nodes;
+        for (auto& snap : vm->tt.curTrace->snaps)
         {
-            Opt_Optimize_Backward(opt, vm->traceConstants, &backward[i]);
-
-            if (!opt.output.empty())
+            for (auto& local : snap.locals)
             {
-                TraceNode n = {}; int left; int right;
-                opt.output.read(&n.data, &left, &right);
-                n.left = left == -1 ? nullptr : vm->tt.curTrace->nodes[left];
-                n.right = right == -1 ? nullptr : vm->tt.curTrace->nodes[right];
-                nodes.push_back(n);
+                local.ref = nodes[Opt_Resolve(opt, local.ref->ref)];
+            }
+            for (TraceNode*& value : snap.stack)
+            {
+                value = nodes[Opt_Resolve(opt, value->ref)];
             }
         }
 
@@ -1550,9 +1872,13 @@ static void Trace_Finalize(VirtualMachine* vm)
         std::memcpy(vm->tt.curTrace->trace.data() + pos, vm->traceConstants.data(), constantSize);
         pos += constantSize;
 
-        for (int i = int(nodes.size()) - 1; i >= 0; i--)
+        for (const OptIns& ins : opt.ins)
         {
-            Trace_Node(vm, &nodes[i]);
+            TraceNode n = {};
+            n.data = ins.data;
+            n.left = ins.left == -1 ? nullptr : nodes[ins.left];
+            n.right = ins.right == -1 ? nullptr : nodes[ins.right];
+            Trace_Node(vm, &n);
         }
     }
     else
@@ -1575,1425 +1901,2677 @@ static void Trace_Finalize(VirtualMachine* vm)
     }
 }
 
-static void Trace_Compile(VirtualMachine* vm)
+static void Trace_Mark(VirtualMachine* vm, Trace* trace)
 {
-    for (size_t i = 0; i < vm->tt.numTraces; i++)
+    // Set the instruction to trigger executing the trace.
+    trace->op = vm->program[trace->pc];
+    vm->program[trace->pc] = (~MK_LOOPSTART & trace->op) | MK_TRACESTART;
+    vm->tt.entries[trace->pc] = trace->id;
+}
+
+static bool Trace_Linkable(const TraceSnapshot& snap, const Trace* target)
+{
+    // The target loads the locals with the types they had when it was recorded.
+    for (const TraceNode* node : target->nodes)
     {
-        Trace* trace = &vm->tt.traces[i];
-        if (trace->nodes.size() >= MIN_TRACE_SIZE)
+        if (node->data.id < IR_LOAD_INT_LOCAL || node->data.id > IR_LOAD_TABLE_LOCAL)
         {
-            trace->jit_trace = vm->jit.jit_compile_trace(
-                vm->jit_instance,
-                vm,
-                trace->trace.data(),
-                int(trace->trace.size()),
-                int(i)
-            );
+            continue;
+        }
 
-            // Set the instruction to trigger executing the trace.
-            vm->program[trace->pc] = (~MK_LOOPSTART & vm->program[trace->pc]) | MK_TRACESTART;
+        for (const auto& local : snap.locals)
+        {
+            if (local.index == node->data.local && local.ref->type != node->type)
+            {
+                return false;
+            }
         }
     }
-}
 
-//===================
+    return true;
+}
 
-Callstack* SunScript::GetCallStack(VirtualMachine* vm)
+static void Trace_Link(VirtualMachine* vm, Trace* trace)
 {
-    Callstack* stack = new Callstack();
-    Callstack* tail = stack;
-    
-    size_t id = vm->frames.size();
-    int pc = vm->programCounter;
-    int debugLine = vm->debugLine;
-    while (id > 0)
+    // Enter the side trace from the guard it starts at, and the loop header from its end.
+    Trace* parent = vm->tt.traces[trace->parent].get();
+    if (parent->serial != trace->parentSerial || !parent->jit_trace ||
+        parent->snaps[trace->exit].side != -1 ||
+        (trace->exit == int(parent->snaps.size()) - 1 && parent->next != -1) ||
+        !Trace_Linkable(parent->snaps[trace->exit], trace))
     {
-        auto& frame = vm->frames[id-1];
-        tail->functionName = frame.functionName;
-        tail->numArgs = int(frame.func->parameters.size());
-        tail->debugLine = debugLine;
-        tail->programCounter = pc;
-        
-        id--;
-        debugLine = frame.debugLine;
-        pc = frame.returnAddress;
-        tail->next = new Callstack();
-        tail = tail->next;
+        Trace_Release(vm, trace);
+        return;
     }
 
-    tail->functionName = "main";
-    tail->numArgs = 0;
-    tail->debugLine = debugLine;
-    tail->programCounter = pc;
+    if (vm->jit.jit_install)
+    {
+        vm->jit.jit_install(vm->jit_instance, trace->jit_trace);
+    }
 
-    return stack;
-}
+    parent->snaps[trace->exit].side = trace->id;
+    vm->jit.jit_link(vm->jit_instance, parent->jit_trace, trace->exit, trace->jit_trace);
 
-void SunScript::DestroyCallstack(Callstack* stack)
-{
-    while (stack)
+    const int last = int(trace->snaps.size()) - 1;
+    if (Trace_Linkable(trace->snaps[last], parent))
     {
-        Callstack* next = stack->next;
-        delete stack;
-        stack = next;
+        vm->jit.jit_link(vm->jit_instance, trace->jit_trace, last, parent->jit_trace);
     }
 }
 
-VirtualMachine* SunScript::CreateVirtualMachine()
-{
-    VirtualMachine* vm = new VirtualMachine();
-    vm->handler = nullptr;
-    vm->_userData = nullptr;
-    vm->program = nullptr;
-    vm->debugLines = nullptr;
-    vm->comparer = 0;
-    vm->optimizationLevel = 0;
-    std::memset(&vm->jit, 0, sizeof(vm->jit));
-    return vm;
-}
-
-void SunScript::ShutdownVirtualMachine(VirtualMachine* vm)
+static bool Trace_Chainable(VirtualMachine* vm, const Trace* trace, const Trace* target)
 {
-    if (vm->jit.jit_shutdown)
+    // The end of a trace can jump into a trace entered by the VM where the trace ends,
+    // started in the same frame with the locals of the types it leaves them.
+    if (trace == target || trace->parent != -1 || target->parent != -1 ||
+        !trace->jit_trace || !target->jit_trace || trace->next != -1 ||
+        trace->depth != target->depth || trace->localBounds != target->localBounds ||
+        trace->stackSize != target->stackSize || trace->snaps.empty())
     {
-        vm->jit.jit_shutdown(vm->jit_instance);
+        return false;
     }
 
-    delete[] vm->program;
-    delete vm;
-}
+    const auto& snap = trace->snaps.back();
+    if (snap.pc != unsigned(target->pc) || !snap.frames.empty() || !snap.stack.empty() ||
+        snap.side != -1 || vm->tt.entries[target->pc] != target->id)
+    {
+        return false;
+    }
 
-void SunScript::SetOptimizationLevel(VirtualMachine* vm, int level)
-{
-    vm->optimizationLevel = level;
-}
+    // A yield inside a chain would return to the VM with locals still in the record.
+    const auto yields = [](const Trace* t)
+    {
+        return std::any_of(t->nodes.begin(), t->nodes.end(),
+            [](TraceNode* node) { return node->data.id == IR_YIELD; });
+    };
 
-void SunScript::SetHandler(VirtualMachine* vm, int handler(VirtualMachine* vm))
-{
-    vm->handler = handler;
+    return !yields(trace) && !yields(target) && Trace_Linkable(snap, target);
 }
 
-void SunScript::SetJIT(VirtualMachine* vm, Jit* jit)
+static void Trace_Chain(VirtualMachine* vm, Trace* trace)
 {
-    vm->jit = *jit;
-
-    if (vm->jit.jit_initialize)
+    // Jump from the end of the traces which stop where the trace starts into it, and from
+    // its end into the trace it stops at, so a run of traces doesn't return to the VM between them.
+    if (!vm->jit.jit_link || !vm->tuning.chainTraces)
     {
-        vm->jit_instance = vm->jit.jit_initialize();
+        return;
     }
-}
-
-void* SunScript::GetUserData(VirtualMachine* vm)
-{
-    return vm->_userData;
-}
-
-void SunScript::SetUserData(VirtualMachine* vm, void* userData)
-{
-    vm->_userData = userData;
-}
 
-int SunScript::LoadScript(const std::string& filepath, unsigned char** program)
-{
-    std::ifstream stream(filepath, std::iostream::binary);
-    if (stream.good())
+    for (auto& slot : vm->tt.traces)
     {
-        int version;
-        stream.read((char*)&version, sizeof(int));
-        if (version == 0)
+        Trace* prev = slot.get();
+        if (prev->pc != -1 && Trace_Chainable(vm, prev, trace))
         {
-            int size;
-            stream.read((char*)&size, sizeof(int));
-            *program = new unsigned char[size];
-            stream.read((char*)*program, size);
-            return 1;
+            prev->next = trace->id;
+            vm->jit.jit_link(vm->jit_instance, prev->jit_trace, int(prev->snaps.size()) - 1, trace->jit_trace);
         }
     }
 
-    return 0;
-}
-
-static short Read_Short(unsigned char* program, unsigned int* pc)
-{
-    int a = program[*pc];
-    int b = program[(*pc) + 1];
+    if (trace->snaps.empty() || trace->snaps.back().pc >= vm->tt.entries.size())
+    {
+        return;
+    }
 
-    *pc += 2;
-    return a | (b << 8);
+    const int slot = vm->tt.entries[trace->snaps.back().pc];
+    if (slot != -1 && Trace_Chainable(vm, trace, vm->tt.traces[slot].get()))
+    {
+        trace->next = slot;
+        vm->jit.jit_link(vm->jit_instance, trace->jit_trace, int(trace->snaps.size()) - 1, vm->tt.traces[slot]->jit_trace);
+    }
 }
 
-inline static unsigned char Read_Byte(unsigned char* program, unsigned int* pc)
+static void Trace_Install(VirtualMachine* vm, Trace* trace, void* jit_trace)
 {
-    unsigned char byte = program[*pc];
-    (*pc)++;
-    return byte;
-}
+    trace->jit_trace = jit_trace;
+    if (trace->parent != -1)
+    {
+        Trace_Link(vm, trace);
+        return;
+    }
 
-static int Read_Int(unsigned char* program, unsigned int* pc)
-{
-    int a = program[*pc];
-    int b = program[(*pc) + 1];
-    int c = program[(*pc) + 2];
-    int d = program[(*pc) + 3];
+    if (vm->tt.entries[trace->pc] != -1)
+    {
+        // Another trace is entered from there already.
+        Trace_Release(vm, trace);
+        return;
+    }
 
-    *pc += 4;
-    return a | (b << 8) | (c << 16) | (d << 24);
+    if (vm->jit.jit_install)
+    {
+        vm->jit.jit_install(vm->jit_instance, jit_trace);
+    }
+    Trace_Mark(vm, trace);
+    Trace_Chain(vm, trace);
 }
 
-static real Read_Real(unsigned char* program, unsigned int* pc)
-{
-    real* value = reinterpret_cast<real*>(&program[*pc]);
-    *pc += SUN_REAL_SIZE;
-    return *value;
-}
+//===================
+// Background compilation
+//===================
 
-//static std::string Read_String(unsigned char* program, unsigned int* pc)
-//{
-//    std::string str;
-//    int index = 0;
-//    char ch = (char)program[*pc];
-//    (*pc)++;
-//    while (ch != 0)
-//    {
-//        str = str.append(1, ch);
-//        ch = (char)program[*pc];
-//        (*pc)++;
-//    }
-//    return str;
-//}
+// Traces are compiled on a worker thread from a copy of the trace, so the run which
+// recorded them isn't held up. A compiled trace is installed by the VM's thread at a
+// safepoint, where no trace is executing, and entered from then on.
 
-static char* Read_String(unsigned char* program, unsigned int* pc)
+static void Compiler_Worker(VirtualMachine* vm, TraceCompiler* compiler)
 {
-    char* str = (char*)&program[*pc];
-    const size_t len = strlen(str) + 1;
-    *pc += static_cast<unsigned int>(len);
-    return str;
-}
+    std::unique_lock<std::mutex> lock(compiler->lock);
+    while (true)
+    {
+        compiler->wake.wait(lock, [compiler] { return compiler->stop || !compiler->queued.empty(); });
+        if (compiler->stop)
+        {
+            break;
+        }
 
-static void Push_Real(VirtualMachine* vm, real val)
-{
-    assert(vm->statusCode == VM_OK);
+        CompileJob job = std::move(compiler->queued.front());
+        compiler->queued.pop_front();
+        compiler->busy = true;
+        lock.unlock();
 
-    real* data = reinterpret_cast<real*>(vm->mm.New(sizeof(real), TY_REAL));
-    *data = val;
-    vm->stack.push(data);
+        job.jit_trace = vm->jit.jit_compile_trace(
+            vm->jit_instance,
+            vm,
+            job.trace.data(),
+            int(job.trace.size()),
+            job.id
+        );
+
+        lock.lock();
+        compiler->busy = false;
+        compiler->done.push_back(std::move(job));
+        compiler->ready.store(true, std::memory_order_release);
+        compiler->idle.notify_all();
+    }
 }
 
-static void Push_Int(VirtualMachine* vm, int val)
+static void Compiler_Submit(VirtualMachine* vm)
 {
-    assert(vm->statusCode == VM_OK);
+    // Queue the traces waiting for room, skipping those released while they waited.
+    TraceCompiler* compiler = vm->compiler.get();
+    while (!compiler->waiting.empty() && compiler->pending < vm->tuning.maxPendingCompiles)
+    {
+        CompileJob job = std::move(compiler->waiting.front());
+        compiler->waiting.pop_front();
 
-    int* data = reinterpret_cast<int*>(vm->mm.New(sizeof(int), TY_INT));
-    *data = val;
-    vm->stack.push(data);
+        Trace* trace = vm->tt.traces[job.id].get();
+        if (trace->serial != job.serial || !trace->compiling)
+        {
+            continue;
+        }
+
+        job.trace = trace->trace;
+        {
+            std::lock_guard<std::mutex> lock(compiler->lock);
+            compiler->queued.push_back(std::move(job));
+        }
+        compiler->pending++;
+        compiler->wake.notify_one();
+    }
 }
 
-static void Push_String(VirtualMachine* vm, const char* str)
+static void Compiler_Queue(VirtualMachine* vm, Trace* trace)
 {
-    assert(vm->statusCode == VM_OK);
+    if (!vm->compiler)
+    {
+        vm->compiler = std::make_unique<TraceCompiler>();
+        vm->compiler->worker = std::thread(Compiler_Worker, vm, vm->compiler.get());
+    }
 
-    char* data = reinterpret_cast<char*>(vm->mm.New(strlen(str) + 1, TY_STRING));
-    std::memcpy(data, str, strlen(str) + 1);
-    vm->stack.push(data);
+    trace->compiling = true;
+    vm->compiler->waiting.push_back({ trace->id, trace->serial, {}, nullptr });
+    Compiler_Submit(vm);
 }
 
-static void Op_Set(VirtualMachine* vm)
+static void Compiler_Install(VirtualMachine* vm, bool startOfRun)
 {
-    unsigned char type = vm->program[vm->programCounter++];
-    const int id = Read_Byte(vm->program, &vm->programCounter) + vm->localBounds;
-    auto& local = vm->locals[id];
-
-    //if (vm->tracing)
-    //{
-    //    vm->trace.push_back(OP_SET);
-    //    vm->trace.push_back(static_cast<unsigned char>(id & 0xFF));
-    //}
-
-    switch (type)
-    {
-    case TY_VOID:
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
-        break;
-    case TY_INT:
+    TraceCompiler* compiler = vm->compiler.get();
+    if (!compiler)
     {
-        assert (vm->statusCode == VM_OK);
-        
-        int* data = reinterpret_cast<int*>(vm->mm.New(sizeof(int), TY_INT));
-        *data = Read_Int(vm->program, &vm->programCounter);
-        vm->stack.push(data);
-        if (vm->tracing) { Trace_Int(vm, *data); }
+        return;
     }
-        break;
-    case TY_STRING:
+
+    std::vector<CompileJob> done;
+    if (startOfRun)
     {
-        assert (vm->statusCode == VM_OK);
-        
-        char* str = Read_String(vm->program, &vm->programCounter);
-        char* data = reinterpret_cast<char*>(vm->mm.New(sizeof(int), TY_INT));
-        std::memcpy(data, str, strlen(str) + 1);
-        vm->stack.push(data);
-        if (vm->tracing) { Trace_String(vm, str); }
+        done.swap(compiler->deferred);
     }
-    break;
-    default:
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
-        break;
-    }
-}
 
-static void Op_Push_Local(VirtualMachine* vm)
-{
-    const int id = Read_Byte(vm->program, &vm->programCounter) + vm->localBounds;
+    if (compiler->ready.load(std::memory_order_acquire))
+    {
+        std::lock_guard<std::mutex> lock(compiler->lock);
+        std::move(compiler->done.begin(), compiler->done.end(), std::back_inserter(done));
+        compiler->done.clear();
+        compiler->ready.store(false, std::memory_order_relaxed);
+    }
 
-    if (vm->statusCode == VM_OK)
+    for (auto& job : done)
     {
-        if (vm->locals.size() > id)
+        Trace* trace = vm->tt.traces[job.id].get();
+        if (trace->serial != job.serial || !trace->compiling)
         {
-            vm->stack.push(vm->locals[id]);
-
-            if (vm->tracing)
+            // The trace was released while it compiled.
+            compiler->pending--;
+            if (job.jit_trace && vm->jit.jit_free)
             {
-                Trace_Push_Local(vm, id);
+                vm->jit.jit_free(job.jit_trace);
             }
         }
+        else if (!startOfRun && job.id == vm->tt.entry)
+        {
+            // The trace of the whole script is only entered from the start of a run.
+            compiler->deferred.push_back(std::move(job));
+        }
         else
         {
-            vm->statusCode = VM_ERROR;
-            vm->running = false;
+            compiler->pending--;
+            trace->compiling = false;
+            if (job.jit_trace)
+            {
+                Trace_Install(vm, trace, job.jit_trace);
+            }
+            else
+            {
+                // The JIT compiler couldn't fit the trace, keep interpreting.
+                Trace_Release(vm, trace);
+            }
         }
     }
+
+    Compiler_Submit(vm);
 }
 
-static void Op_Push(VirtualMachine* vm)
+static void Compiler_Drain(VirtualMachine* vm)
 {
-    unsigned char type = vm->program[vm->programCounter++];
-
-    switch (type)
-    {
-    case TY_INT:
+    // Drop the traces yet to be installed, waiting for the one being compiled.
+    TraceCompiler* compiler = vm->compiler.get();
+    if (!compiler)
     {
-        const int val = Read_Int(vm->program, &vm->programCounter);
-        Push_Int(vm, val);
-        if (vm->tracing) { Trace_LoadC_Int(vm, val); }
+        return;
     }
-        break;
-    case TY_STRING:
+
+    std::vector<CompileJob> done;
+    done.swap(compiler->deferred);
     {
-         const char* str = Read_String(vm->program, &vm->programCounter);
-         Push_String(vm, str);
-         if (vm->tracing) { Trace_LoadC_String(vm, str); }
+        std::unique_lock<std::mutex> lock(compiler->lock);
+        compiler->queued.clear();
+        compiler->idle.wait(lock, [compiler] { return !compiler->busy; });
+        std::move(compiler->done.begin(), compiler->done.end(), std::back_inserter(done));
+        compiler->done.clear();
+        compiler->ready.store(false, std::memory_order_relaxed);
     }
-        break;
-    case TY_REAL:
+
+    for (auto& job : done)
     {
-        const real val = Read_Real(vm->program, &vm->programCounter);
-        Push_Real(vm, val);
-        if (vm->tracing) { Trace_LoadC_Real(vm, val); }
-    }
-        break;
+        if (job.jit_trace && vm->jit.jit_free)
+        {
+            vm->jit.jit_free(job.jit_trace);
+        }
     }
-}
+    compiler->waiting.clear();
+    compiler->pending = 0;
 
-static void Discard(VirtualMachine* vm)
-{
-    if (vm->discard && vm->stack.size() > vm->stackBounds)
+    for (auto& slot : vm->tt.traces)
     {
-        if (vm->stack.size() == 0)
-        {
-            vm->statusCode = VM_ERROR;
-            vm->running = false;
-        }
-        else
+        if (slot->compiling)
         {
-            vm->stack.pop();
-
-            if (vm->tracing) { Trace_Pop_Discard(vm); }
+            Trace_Release(vm, slot.get());
         }
     }
 }
 
-static void Op_Return(VirtualMachine* vm)
+static void Compiler_Stop(VirtualMachine* vm)
 {
-    assert(vm->statusCode == VM_OK);
-
-    if (vm->frames.size() == 0)
+    TraceCompiler* compiler = vm->compiler.get();
+    if (!compiler)
     {
-        vm->statusCode = VM_ERROR;
-        vm->running = false;
         return;
     }
 
-    Discard(vm);
-
-    StackFrame& frame = vm->frames[vm->frames.size() - 1];
-
-#if DEBUG
-    // Record stats
-    if (vm->stack.size() > 0)
-    {
-        void* retVal = vm->stack.top();
-        const char type = vm->mm.GetType(retVal);
-        RecordReturn(frame.func, vm->programCounter, type);
-    }
-    else
+    Compiler_Drain(vm);
     {
-        // TY_VOID
-        RecordReturn(frame.func, vm->programCounter, TY_VOID);
+        std::lock_guard<std::mutex> lock(compiler->lock);
+        compiler->stop = true;
     }
-#endif
-
-    frame.func->depth--;
-
-    vm->locals.resize(vm->localBounds);
-    vm->stackBounds = frame.stackBounds;
-    vm->localBounds = frame.localBounds;
-    vm->frames.resize(vm->frames.size() - 1);
-    vm->programCounter = frame.returnAddress;
-    vm->discard = frame.discard;
+    compiler->wake.notify_one();
+    compiler->worker.join();
+    vm->compiler.reset();
 }
 
-static void CreateStackFrame(VirtualMachine* vm, StackFrame& frame, int numArguments, int numLocals)
-{
-    frame.returnAddress = vm->programCounter;
-    frame.localBounds = vm->localBounds;
-    frame.stackBounds = vm->stackBounds;
-
-    vm->stackBounds = int(vm->stack.size()) - numArguments;
-    vm->localBounds = int(vm->locals.size());
-    vm->locals.resize(numArguments + numLocals + vm->locals.size());
-
-    // TODO: we may need to reverse the stack?
-}
+//===================
 
-static void Op_Call(VirtualMachine* vm, bool discard)
+static bool Trace_Bridges(VirtualMachine* vm, const Trace* trace)
 {
-    assert (vm->statusCode == VM_OK);
-    
-    const unsigned char numArgs = Read_Byte(vm->program, &vm->programCounter);
-    const int id = Read_Int(vm->program, &vm->programCounter);
-    auto& func = vm->functions[id];
-    vm->callName = func.name;
-    vm->callNumArgs = numArgs;
+    // A short trace between two others is worth entering if they can be chained through it.
+    if (!vm->jit.jit_link || !vm->tuning.chainTraces || trace->snaps.empty())
+    {
+        return false;
+    }
 
-    if (func.blk != -1)
+    bool from = false;
+    bool to = false;
+    for (auto& slot : vm->tt.traces)
     {
-        auto& blk = vm->blocks[func.blk];
-        if (blk.numArgs == numArgs)
+        const Trace* other = slot.get();
+        if (other == trace || other->pc == -1 || other->parent != -1 || other->snaps.empty())
         {
-            const int address = blk.info.pc + vm->programOffset;
-            StackFrame& frame = vm->frames.emplace_back();
-            frame.functionName = vm->callName;
-            frame.debugLine = vm->debugLine;
-            frame.func = &blk.info;
-            CreateStackFrame(vm, frame, numArgs, int(blk.info.locals.size()));
-            vm->programCounter = address;
-            vm->discard = discard;
+            continue;
+        }
 
-            if (vm->tracing)
-            {
-                vm->tt.curTrace->locals.resize(vm->locals.size());
-                vm->tt.curTrace->flags |= SN_NEEDED; // we need a new snapshot to reflect the change in frames
+        from = from || other->snaps.back().pc == unsigned(trace->pc);
+        to = to || unsigned(other->pc) == trace->snaps.back().pc;
+    }
 
-                if (blk.info.depth >= 1)
-                {
-                    // Recursive functions don't work for now.. abort the trace
-                    Trace_Abort(vm);
-                }
-            }
+    return from && to;
+}
 
-            blk.info.counter++;
-            blk.info.depth++;
+static void Trace_Compile(VirtualMachine* vm)
+{
+    for (auto& slot : vm->tt.traces)
+    {
+        Trace* trace = slot.get();
+        if (trace->pc == -1 || trace->jit_trace || trace->compiling)
+        {
+            continue;
         }
-        else
+
+        if (int(trace->nodes.size()) < vm->tuning.minTraceSize && trace->parent == -1 && !Trace_Bridges(vm, trace))
         {
-            vm->running = false;
-            vm->statusCode = VM_ERROR;
+            // Too short to be worth entering, give the slot back.
+            Trace_Release(vm, trace);
+            continue;
         }
-    }
-    else
-    {
-        if (vm->handler)
+
+        if (vm->tuning.maxPendingCompiles > 0)
         {
-            if (vm->tracing)
-            {
-                Trace_Call(vm, id, numArgs);
-            }
+            Compiler_Queue(vm, trace);
+            continue;
+        }
 
-            // Calls out to a handler
-            // parameters can be accessed via GetParamInt() etc
-            vm->statusCode = vm->handler(vm);
-            vm->running = vm->statusCode == VM_OK;
+        void* jit_trace = vm->jit.jit_compile_trace(
+            vm->jit_instance,
+            vm,
+            trace->trace.data(),
+            int(trace->trace.size()),
+            trace->id
+        );
 
-            Discard(vm);
-        }
-        else
+        if (!jit_trace)
         {
-            // no handler defined
-            vm->running = false;
-            vm->statusCode = VM_ERROR;
+            // The JIT compiler couldn't fit the trace, keep interpreting.
+            Trace_Release(vm, trace);
+            continue;
         }
+
+        Trace_Install(vm, trace, jit_trace);
     }
 }
 
-static void OP_CallD(VirtualMachine* vm)
+static bool HasEntryTrace(VirtualMachine* vm)
 {
-    Op_Call(vm, true);
+    // Whether the whole script was traced, rather than only loops within it.
+    return vm->tt.entry != -1 && vm->tt.traces[vm->tt.entry]->jit_trace;
 }
 
-static void OP_CallO(VirtualMachine* vm, bool discard)
+//===================
+// Hot counters
+//===================
+
+// Loops in the main body are counted during each run, so a loop which is hot within
+// a single run is traced from its header without waiting for the script to be run again.
+
+inline static void HotLoopArm(VirtualMachine* vm, unsigned int header)
 {
-    if (vm->stack.size() < 1)
+    // The trace is started by the loop start variant of the header instruction and
+    // later entered by its trace start variant, so the header needs both.
+    const unsigned char op = vm->program[header];
+    const unsigned char base = op & ~MK_LOOPSTART;
+    if ((op & MK_LOOPSTART) &&
+        (base == OP_PUSH || base == OP_PUSH_LOCAL || base == OP_PUSH_CONST) &&
+        !HasEntryTrace(vm) &&
+        vm->coldLoops.find(header) == vm->coldLoops.end())
     {
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
-        return;
+        vm->loopTrace = int(header);
     }
+}
 
-    void* const value = vm->stack.top();
-    vm->stack.pop();
-
-    if (vm->mm.GetType(value) != TY_FUNC)
+inline static void HotLoopCool(VirtualMachine* vm, int header)
+{
+    // Stop tracing for the rest of the run, a loop left without a trace isn't tried again.
+    if (!(vm->program[header] & MK_TRACESTART))
     {
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
-        return;
+        vm->coldLoops.insert(header);
     }
 
-    const unsigned char numArgs = Read_Byte(vm->program, &vm->programCounter);
-    auto& func = vm->functions[*(int*)value];
-    
-    vm->callName = func.name;
-    vm->callNumArgs = numArgs;
-
-    if (func.blk != -1)
-    {
-        auto& blk = vm->blocks[func.blk];
-        if (blk.numArgs == numArgs)
-        {
-            const int address = blk.info.pc + vm->programOffset;
-            StackFrame& frame = vm->frames.emplace_back();
-            frame.functionName = vm->callName;
-            frame.debugLine = vm->debugLine;
-            frame.func = &blk.info;
-            CreateStackFrame(vm, frame, numArgs, int(blk.info.locals.size()));
-            vm->programCounter = address;
-            vm->discard = discard;
+    vm->hot = false;
+    vm->tracing = false;
+    vm->tracingPaused = false;
+    vm->loopTrace = -1;
+}
 
-            if (vm->tracing)
-            {
-                TPOP(vm); // Pop the function code
-                vm->tt.curTrace->locals.resize(vm->locals.size());
-                vm->tt.curTrace->flags |= SN_NEEDED; // we need a new snapshot to reflect the change in frames
-            }
+inline static void HotBackEdge(VirtualMachine* vm, unsigned int header)
+{
+    vm->loopHeader = int(header);
 
-            blk.info.counter++;
-            blk.info.depth++;
-        }
-        else
-        {
-            vm->running = false;
-            vm->statusCode = VM_ERROR;
-        }
+    if (vm->compiler && vm->compiler->ready.load(std::memory_order_acquire))
+    {
+        // A loop compiled in the background is entered from its next iteration.
+        Compiler_Install(vm, false);
     }
-    else
+
+    const unsigned int count = ++vm->loopCounters[header];
+    if (count == unsigned(vm->tuning.hotLoops))
     {
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
+        HotLoopArm(vm, header);
     }
 }
 
-static void Op_Yield(VirtualMachine* vm)
+inline static void HotCall(VirtualMachine* vm, FunctionInfo& info)
 {
-    if (vm->handler)
+    // A function called often from a loop in the main body makes the loop hot.
+    if (++info.calls == unsigned(vm->tuning.hotCalls) && vm->frames.size() == 1 && vm->loopHeader != -1)
     {
-        unsigned char numArgs = Read_Byte(vm->program, &vm->programCounter);
-        // Calls out to a handler
-        // parameters can be accessed via GetParamInt() etc
-        const int id = Read_Int(vm->program, &vm->programCounter);
+        HotLoopArm(vm, vm->loopHeader);
+    }
+}
 
-        if (vm->tracing)
-        {
-            Trace_Yield(vm, id, numArgs);
-        }
+//===================
+// Side traces
+//===================
 
-        vm->callName = vm->functions[id].name;
-        vm->callNumArgs = numArgs;
+// A guard which often leaves a loop's trace is given a trace of its own, recorded from
+// where the guard exits until the loop jumps back to its header. The guard is linked to
+// the side trace and the side trace back to the loop's trace, so the path runs as code.
 
-        if (vm->handler(vm) == VM_ERROR)
-        {
-            vm->running = false;
-            vm->statusCode = VM_ERROR;
-        }
-        else
-        {
-            vm->running = false;
-            vm->statusCode = VM_YIELDED;
-        }
-    }
-    else
-    {
-        // this is an error
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
-    }
+inline static bool SideTracing(VirtualMachine* vm)
+{
+    return vm->tracing && vm->tt.curTrace->parent != -1;
 }
 
-static void Op_Pop(VirtualMachine* vm)
+static void SideTraceAbort(VirtualMachine* vm)
 {
-    assert(vm->statusCode == VM_OK);
-    
-    const int id = Read_Byte(vm->program, &vm->programCounter) + vm->localBounds;
+    Trace_Abort(vm);
+    vm->hot = false;
+    vm->tracingPaused = false;
+}
+
+static void SideTraceStart(VirtualMachine* vm)
+{
+    Trace* parent = vm->tt.curTrace;
+    const int id = parent->id;
+    const unsigned int serial = parent->serial;
+    const int exit = vm->tt.sideExit;
+    vm->tt.sideExit = -1;
 
-    if (!vm->stack.empty())
+    vm->programInstruction = vm->programCounter;
+    vm->hot = true;
+    Trace_Start(vm);
+    if (!vm->tracing || parent->serial != serial)
     {
-        vm->locals[id] = vm->stack.top();
+        // The locals can't be traced or the parent was evicted to make room.
+        SideTraceAbort(vm);
+        return;
+    }
 
-        if (vm->tracing)
-        {
-            Trace_Pop(vm, id);
-        }
+    vm->tt.curTrace->parent = id;
+    vm->tt.curTrace->parentSerial = serial;
+    vm->tt.curTrace->exit = exit;
+}
 
-        vm->stack.pop();
+static void SideTraceClose(VirtualMachine* vm)
+{
+    // The side trace ends as the path gets back to the loop's header.
+    Trace* trace = vm->tt.curTrace;
+    const Trace* parent = vm->tt.traces[trace->parent].get();
+    const bool yields = std::any_of(trace->nodes.begin(), trace->nodes.end(),
+        [](TraceNode* node) { return node->data.id == IR_YIELD; });
+
+    if (parent->serial == trace->parentSerial &&
+        parent->jit_trace &&
+        int(vm->programInstruction) == parent->pc &&
+        vm->frames.empty() &&
+        !yields)
+    {
+        trace->flags = SN_NEEDED;
+        Trace_Snap(vm);
+        Trace_Finalize(vm);
+        Trace_Compile(vm);
     }
-    else
+
+    if (!trace->jit_trace && !trace->compiling)
     {
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
+        Trace_Abort(vm);
     }
+
+    vm->tracing = false;
+    vm->tracingPaused = false;
+    vm->hot = false;
 }
 
-static void Add_String(VirtualMachine* vm, char* v1, void* v2)
+//===================
+
+Callstack* SunScript::GetCallStack(VirtualMachine* vm)
 {
-    std::stringstream result;
-    char type = vm->mm.GetType(v2);
-    switch (type)
-    {
-    case TY_STRING:
-        result << reinterpret_cast<char*>(v2);
-        if (vm->tracing) { Trace_App_String_String(vm); }
-        break;
-    case TY_INT:
-        result << *reinterpret_cast<int*>(v2);
-        if (vm->tracing) { Trace_App_Int_String(vm); }
-        break;
-    case TY_REAL:
-        result << *reinterpret_cast<real*>(v2);
-        if (vm->tracing) { Trace_App_Real_String(vm); }
-        break;
-    default:
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
-        break;
+    Callstack* stack = new Callstack();
+    Callstack* tail = stack;
+    
+    size_t id = vm->frames.size();
+    int pc = vm->programCounter;
+    int debugLine = vm->debugLine;
+    while (id > 0)
+    {
+        auto& frame = vm->frames[id-1];
+        tail->functionName = frame.functionName;
+        tail->numArgs = int(frame.func->parameters.size());
+        tail->debugLine = debugLine;
+        tail->programCounter = pc;
+        
+        id--;
+        debugLine = frame.debugLine;
+        pc = frame.returnAddress;
+        tail->next = new Callstack();
+        tail = tail->next;
     }
 
-    result << v1;
+    tail->functionName = "main";
+    tail->numArgs = 0;
+    tail->debugLine = debugLine;
+    tail->programCounter = pc;
 
-    if (vm->statusCode == VM_OK)
-    {
-        Push_String(vm, result.str().c_str());
-    }
+    return stack;
 }
 
-static void Add_Real(VirtualMachine* vm, real* v1, void* v2)
+void SunScript::DestroyCallstack(Callstack* stack)
 {
-    real result = *v1;
-    const char type = vm->mm.GetType(v2);
-
-    switch (type)
-    {
-    case TY_REAL:
-        result += *reinterpret_cast<real*>(v2);
-        if (vm->tracing) { Trace_Add_Real(vm); }
-        Push_Real(vm, result);
-        break;
-    case TY_INT:
-        result += real(*reinterpret_cast<int*>(v2));
-        if (vm->tracing) { Trace_Conv_Int_To_Real(vm, -2); Trace_Add_Real(vm); }
-        Push_Real(vm, result);
-        break;
-    case TY_STRING:
+    while (stack)
     {
-        std::stringstream ss;
-        ss << reinterpret_cast<char*>(v2);
-        ss << result;
-        if (vm->tracing) { Trace_App_String_Real(vm); }
-        Push_String(vm, ss.str().c_str());
-    }
-        break;
-    default:
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
-        break;
+        Callstack* next = stack->next;
+        delete stack;
+        stack = next;
     }
 }
 
-static void Add_Int(VirtualMachine* vm, int* v1, void* v2)
+VirtualMachine* SunScript::CreateVirtualMachine()
 {
-    int result = *v1;
-    const char type = vm->mm.GetType(v2);
-
-    switch (type)
-    {
-    case TY_INT:
-        result += *reinterpret_cast<int*>(v2);
-        if (vm->tracing) { Trace_Add_Int(vm); }
-        Push_Int(vm, result);
-        break;
-    case TY_STRING:
-    {
-        std::stringstream ss;
-        ss << reinterpret_cast<char*>(v2);
-        ss << result;
-        if (vm->tracing) { Trace_App_String_Int(vm); }
-        Push_String(vm, ss.str().c_str());
-    }
-        break;
-    case TY_REAL:
-    {
-        real res = real(result) + *reinterpret_cast<real*>(v2);
-        if (vm->tracing) { Trace_Conv_Int_To_Real(vm, -1); Trace_Add_Real(vm); }
-        Push_Real(vm, res);
-    }
-        break;
-    default:
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
-        break;
-    }
+    VirtualMachine* vm = new VirtualMachine();
+    vm->handler = nullptr;
+    vm->_userData = nullptr;
+    vm->program = nullptr;
+    vm->debugLines = nullptr;
+    vm->constantsOffset = 0;
+    vm->verified = false;
+    vm->comparer = 0;
+    vm->optimizationLevel = 0;
+    vm->loopHeader = -1;
+    vm->loopTrace = -1;
+    std::memset(&vm->jit, 0, sizeof(vm->jit));
+    return vm;
 }
 
-static void Sub_Real(VirtualMachine* vm, real* v1, void* v2)
+void SunScript::ShutdownVirtualMachine(VirtualMachine* vm)
 {
-    real result = *v1;
-    const char type = vm->mm.GetType(v2);
+    Compiler_Stop(vm);
+    Trace_ReleaseAll(vm);
 
-    if (type == TY_REAL)
+    if (vm->jit.jit_shutdown)
     {
-        result = *reinterpret_cast<real*>(v2) - result;
-
-        if (vm->tracing) { Trace_Sub_Real(vm); }
+        vm->jit.jit_shutdown(vm->jit_instance);
     }
-    else if (type == TY_INT)
-    {
-        result = *reinterpret_cast<int*>(v2) - result;
 
-        if (vm->tracing) { Trace_Conv_Int_To_Real(vm, -2); Trace_Sub_Real(vm); }
-    }
-    else
-    {
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
-    }
+    delete[] vm->program;
+    delete vm;
+}
 
-    if (vm->statusCode == VM_OK)
-    {
-        Push_Real(vm, result);
-    }
+void SunScript::SetOptimizationLevel(VirtualMachine* vm, int level)
+{
+    vm->optimizationLevel = level;
 }
 
-static void Sub_Int(VirtualMachine* vm, int* v1, void* v2)
+void SunScript::GetOptimizerStats(VirtualMachine* vm, OptimizerStats* stats)
 {
-    int result = *v1;
-    const char type = vm->mm.GetType(v2);
+    *stats = vm->optimizerStats;
+}
 
-    if (type == TY_INT)
-    {
-        Push_Int(vm, result = *reinterpret_cast<int*>(v2) - result);
+void SunScript::SetTraceTuning(VirtualMachine* vm, const TraceTuning& tuning)
+{
+    vm->tuning = tuning;
+}
 
-        if (vm->tracing) { Trace_Sub_Int(vm); }
-    }
-    else if (type == TY_REAL)
-    {
-        Push_Real(vm, *reinterpret_cast<real*>(v2) - result);
+void SunScript::GetTraceTuning(VirtualMachine* vm, TraceTuning* tuning)
+{
+    *tuning = vm->tuning;
+}
 
-        if (vm->tracing) { Trace_Conv_Int_To_Real(vm, -1); Trace_Sub_Real(vm); }
-    }
-    else
+int SunScript::GetJitStats(VirtualMachine* vm, JitStats* stats)
+{
+    if (!vm->jit_instance || !vm->jit.jit_stats)
     {
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
+        return VM_ERROR;
     }
+
+    vm->jit.jit_stats(vm->jit_instance, stats);
+    return VM_OK;
 }
 
-static void Mul_Real(VirtualMachine* vm, real* v1, void* v2)
+void SunScript::SetHandler(VirtualMachine* vm, int handler(VirtualMachine* vm))
 {
-    real result = *v1;
-    const char type = vm->mm.GetType(v2);
-
-    if (type == TY_REAL)
-    {
-        result *= *reinterpret_cast<real*>(v2);
+    vm->handler = handler;
+}
 
-        if (vm->tracing) { Trace_Mul_Real(vm); }
-    }
-    else if (type == TY_INT)
-    {
-        result *= *reinterpret_cast<int*>(v2);
+void SunScript::SetJIT(VirtualMachine* vm, Jit* jit)
+{
+    vm->jit = *jit;
 
-        if (vm->tracing) { Trace_Conv_Int_To_Real(vm, -2); Trace_Mul_Real(vm); }
-    }
-    else
+    if (vm->jit.jit_initialize)
     {
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
+        vm->jit_instance = vm->jit.jit_initialize();
     }
+}
 
-    if (vm->statusCode == VM_OK)
-    {
-        Push_Real(vm, result);
-    }
+void* SunScript::GetUserData(VirtualMachine* vm)
+{
+    return vm->_userData;
 }
 
-static void Mul_Int(VirtualMachine* vm, int* v1, void* v2)
+void SunScript::SetUserData(VirtualMachine* vm, void* userData)
 {
-    int result = *v1;
-    const char type = vm->mm.GetType(v2);
+    vm->_userData = userData;
+}
 
-    if (type == TY_INT)
+int SunScript::LoadScript(const std::string& filepath, unsigned char** program)
+{
+    std::ifstream stream(filepath, std::iostream::binary);
+    if (stream.good())
     {
-        Push_Int(vm, result * *reinterpret_cast<int*>(v2));
-
-        if (vm->tracing) { Trace_Mul_Int(vm); }
+        int version;
+        stream.read((char*)&version, sizeof(int));
+        if (version == 0)
+        {
+            int size;
+            stream.read((char*)&size, sizeof(int));
+            *program = new unsigned char[size];
+            stream.read((char*)*program, size);
+            return 1;
+        }
     }
-    else if (type == TY_REAL)
-    {
-        Push_Real(vm, result * *reinterpret_cast<real*>(v2));
 
-        if (vm->tracing) { Trace_Conv_Int_To_Real(vm, -1); Trace_Mul_Real(vm); }
-    }
-    else
-    {
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
-    }
+    return 0;
 }
 
-static void Div_Real(VirtualMachine* vm, real* v1, void* v2)
+static short Read_Short(unsigned char* program, unsigned int* pc)
 {
-    real result = *v1;
-    const char type = vm->mm.GetType(v2);
+    int a = program[*pc];
+    int b = program[(*pc) + 1];
 
-    if (type == TY_REAL)
-    {
-        result = *reinterpret_cast<real*>(v2) / result;
+    *pc += 2;
+    return a | (b << 8);
+}
 
-        if (vm->tracing) { Trace_Div_Real(vm); }
-    }
-    else if (type == TY_INT)
-    {
-        result = *reinterpret_cast<int*>(v2) / result;
+inline static unsigned char Read_Byte(unsigned char* program, unsigned int* pc)
+{
+    unsigned char byte = program[*pc];
+    (*pc)++;
+    return byte;
+}
 
-        if (vm->tracing) { Trace_Conv_Int_To_Real(vm, -2); Trace_Div_Real(vm); }
-    }
-    else
-    {
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
-    }
+static int Read_Int(unsigned char* program, unsigned int* pc)
+{
+    int a = program[*pc];
+    int b = program[(*pc) + 1];
+    int c = program[(*pc) + 2];
+    int d = program[(*pc) + 3];
 
-    if (vm->statusCode == VM_OK)
-    {
-        Push_Real(vm, result);
-    }
+    *pc += 4;
+    return a | (b << 8) | (c << 16) | (d << 24);
 }
 
-static void Div_Int(VirtualMachine* vm, int* v1, void* v2)
+static real Read_Real(unsigned char* program, unsigned int* pc)
 {
-    int result = *v1;
-    const char type = vm->mm.GetType(v2);
-
-    if (type == TY_INT)
-    {
-        Push_Int(vm, *reinterpret_cast<int*>(v2) / result);
+    real* value = reinterpret_cast<real*>(&program[*pc]);
+    *pc += SUN_REAL_SIZE;
+    return *value;
+}
 
-        if (vm->tracing) { Trace_Div_Int(vm); }
-    }
-    else if (type == TY_REAL)
-    {
-        Push_Real(vm, *reinterpret_cast<real*>(v2) / result);
+//static std::string Read_String(unsigned char* program, unsigned int* pc)
+//{
+//    std::string str;
+//    int index = 0;
+//    char ch = (char)program[*pc];
+//    (*pc)++;
+//    while (ch != 0)
+//    {
+//        str = str.append(1, ch);
+//        ch = (char)program[*pc];
+//        (*pc)++;
+//    }
+//    return str;
+//}
 
-        if (vm->tracing) { Trace_Conv_Int_To_Real(vm, -1); Trace_Div_Real(vm); }
-    }
-    else
-    {
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
-    }
+static char* Read_String(unsigned char* program, unsigned int* pc)
+{
+    char* str = (char*)&program[*pc];
+    const size_t len = strlen(str) + 1;
+    *pc += static_cast<unsigned int>(len);
+    return str;
 }
 
-static void Op_Unary_Minus(VirtualMachine* vm)
+static void Push_Real(VirtualMachine* vm, real val)
 {
-    assert (vm->statusCode == VM_OK);
+    assert(vm->statusCode == VM_OK);
 
-    if (vm->stack.size() < 1)
-    {
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
-        return;
-    }
+    real* data = reinterpret_cast<real*>(vm->mm.New(sizeof(real), TY_REAL));
+    *data = val;
+    vm->stack.push(data);
+}
 
-    void* var1 = vm->stack.top();
-    vm->stack.pop();
+static void Push_Int(VirtualMachine* vm, int val)
+{
+    assert(vm->statusCode == VM_OK);
 
-    if (vm->mm.GetType(var1) == TY_INT)
+    int* data = reinterpret_cast<int*>(vm->mm.New(sizeof(int), TY_INT));
+    *data = val;
+    vm->stack.push(data);
+}
+
+static void Push_String(VirtualMachine* vm, const char* str)
+{
+    assert(vm->statusCode == VM_OK);
+
+    char* data = reinterpret_cast<char*>(vm->mm.New(strlen(str) + 1, TY_STRING));
+    std::memcpy(data, str, strlen(str) + 1);
+    vm->stack.push(data);
+}
+
+static void Op_Set(VirtualMachine* vm)
+{
+    unsigned char type = vm->program[vm->programCounter++];
+    const int id = Read_Byte(vm->program, &vm->programCounter) + vm->localBounds;
+    auto& local = vm->locals[id];
+
+    //if (vm->tracing)
+    //{
+    //    vm->trace.push_back(OP_SET);
+    //    vm->trace.push_back(static_cast<unsigned char>(id & 0xFF));
+    //}
+
+    switch (type)
     {
-        Push_Int(vm, -*reinterpret_cast<int*>(var1));
+    case TY_VOID:
+        vm->running = false;
+        vm->statusCode = VM_ERROR;
+        break;
+    case TY_INT:
+    {
+        assert (vm->statusCode == VM_OK);
         
-        if (vm->tracing) { Trace_Unary_Minus_Int(vm); }
+        int* data = reinterpret_cast<int*>(vm->mm.New(sizeof(int), TY_INT));
+        *data = Read_Int(vm->program, &vm->programCounter);
+        vm->stack.push(data);
+        if (vm->tracing) { Trace_Int(vm, *data); }
     }
-    else if (vm->mm.GetType(var1) == TY_REAL)
+        break;
+    case TY_STRING:
     {
-        Push_Real(vm, -*reinterpret_cast<real*>(var1));
-
-        if (vm->tracing) { Trace_Unary_Minus_Real(vm); }
+        assert (vm->statusCode == VM_OK);
+        
+        char* str = Read_String(vm->program, &vm->programCounter);
+        char* data = reinterpret_cast<char*>(vm->mm.New(sizeof(int), TY_INT));
+        std::memcpy(data, str, strlen(str) + 1);
+        vm->stack.push(data);
+        if (vm->tracing) { Trace_String(vm, str); }
     }
-    else
-    {
+    break;
+    default:
         vm->running = false;
         vm->statusCode = VM_ERROR;
+        break;
     }
 }
 
-static void Op_Operator(unsigned char op, VirtualMachine* vm)
+// Handlers are instantiated twice, once for code the verifier has proven the stack depth and indices of
+// where those checks are left out, and once with them for when it couldn't.
+template<bool Verified>
+inline static bool CheckStack(VirtualMachine* vm, size_t count)
 {
-    assert(vm->statusCode == VM_OK);
-
-    if (vm->stack.size() < 2)
-    {
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
-        return;
-    }
-
-    void* var1 = vm->stack.top();
-    vm->stack.pop();
-    void* var2 = vm->stack.top();
-    vm->stack.pop();
-
-    if (op == OP_ADD)
+    if constexpr (!Verified)
     {
-        switch (vm->mm.GetType(var1))
+        if (vm->stack.size() < count)
         {
-        case TY_STRING:
-            Add_String(vm, reinterpret_cast<char*>(var1), var2);
-            break;
-        case TY_INT:
-            Add_Int(vm, reinterpret_cast<int*>(var1), var2);
-            break;
-        case TY_REAL:
-            Add_Real(vm, reinterpret_cast<real*>(var1), var2);
-            break;
-        default:
             vm->running = false;
             vm->statusCode = VM_ERROR;
-            break;
+            return false;
         }
     }
-    else if (op == OP_SUB)
+
+    return true;
+}
+
+template<bool Verified>
+static void Op_Push_Local(VirtualMachine* vm)
+{
+    const int id = Read_Byte(vm->program, &vm->programCounter) + vm->localBounds;
+
+    if (vm->statusCode == VM_OK)
     {
-        switch (vm->mm.GetType(var1))
+        if (Verified || vm->locals.size() > id)
         {
-        case TY_INT:
-            Sub_Int(vm, reinterpret_cast<int*>(var1), var2);
-            break;
-        case TY_REAL:
-            Sub_Real(vm, reinterpret_cast<real*>(var1), var2);
-            break;
-        default:
-            vm->running = false;
-            vm->statusCode = VM_ERROR;
-            break;
+            vm->stack.push(vm->locals[id]);
+
+            if (vm->tracing)
+            {
+                Trace_Push_Local(vm, id);
+            }
         }
-    }
-    else if (op == OP_MUL)
-    {
-        switch (vm->mm.GetType(var1))
+        else
         {
-        case TY_INT:
-            Mul_Int(vm, reinterpret_cast<int*>(var1), var2);
-            break;
-        case TY_REAL:
-            Mul_Real(vm, reinterpret_cast<real*>(var1), var2);
-            break;
-        default:
-            vm->running = false;
             vm->statusCode = VM_ERROR;
-            break;
-        }
-    }
-    else if (op == OP_DIV)
-    {
-        switch (vm->mm.GetType(var1))
-        {
-        case TY_INT:
-            Div_Int(vm, reinterpret_cast<int*>(var1), var2);
-            break;
-        case TY_REAL:
-            Div_Real(vm, reinterpret_cast<real*>(var1), var2);
-            break;
-        default:
             vm->running = false;
-            vm->statusCode = VM_ERROR;
-            break;
         }
     }
 }
 
-//static void Op_Format(VirtualMachine* vm)
-//{
-//    if (vm->statusCode == VM_OK)
-//    {
-//        void* formatVal = vm->stack.top();
-//        if (vm->mm.GetType(formatVal) != TY_STRING)
-//        {
-//            vm->statusCode = VM_ERROR;
-//            vm->running = false;
-//            return;
-//        }
-//
-//        const std::string format = std::string(reinterpret_cast<char*>(formatVal));
-//        vm->stack.pop();
-//
-//        std::stringstream formatted;
-//
-//        size_t offset = 0;
-//        while (offset < format.size())
-//        {
-//            size_t pos = format.find('{', offset);
-//            formatted << format.substr(offset, pos - offset);
-//            if (pos == std::string::npos) { break; }
-//            size_t end = format.find('}', pos);
-//
-//            std::string name = format.substr(pos + 1, end - pos - 1);
-//            void* local = //vm->locals[name];
-//            switch (vm->mm.GetType(local))
-//            {
-//            case TY_INT:
-//                formatted << *reinterpret_cast<int*>(local);
-//                break;
-//            case TY_STRING:
-//                formatted << reinterpret_cast<char*>(local);
-//                break;
-//            default:
-//                vm->statusCode = VM_ERROR;
-//                vm->running = false;
-//                break;
-//            }
-//
-//            offset = end + 1;
-//        }
-//
-//        Push_String(vm, formatted.str());
-//    }
-//}
-
-static void Op_Increment(VirtualMachine* vm)
+static void Op_Push(VirtualMachine* vm)
 {
-    assert(vm->statusCode == VM_OK);
-    
-    if (vm->stack.size() == 0)
-    {
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
-        return;
-    }
+    unsigned char type = vm->program[vm->programCounter++];
 
-    void* value = vm->stack.top();
-        
-    if (vm->mm.GetType(value) == TY_INT)
+    switch (type)
     {
-        (*reinterpret_cast<int*>(value))++;
-    
-        if (vm->tracing) { Trace_Increment_Int(vm); }
+    case TY_INT:
+    {
+        const int val = Read_Int(vm->program, &vm->programCounter);
+        Push_Int(vm, val);
+        if (vm->tracing) { Trace_LoadC_Int(vm, val); }
     }
-    else if (vm->mm.GetType(value) == TY_REAL)
+        break;
+    case TY_STRING:
     {
-        (*reinterpret_cast<real*>(value))++;
-
-        if (vm->tracing) { Trace_LoadC_Real(vm, 1.0); Trace_Add_Real(vm); }
+         const char* str = Read_String(vm->program, &vm->programCounter);
+         Push_String(vm, str);
+         if (vm->tracing) { Trace_LoadC_String(vm, str); }
     }
-    else
+        break;
+    case TY_REAL:
     {
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
+        const real val = Read_Real(vm->program, &vm->programCounter);
+        Push_Real(vm, val);
+        if (vm->tracing) { Trace_LoadC_Real(vm, val); }
+    }
+        break;
     }
 }
 
-static void Op_Decrement(VirtualMachine* vm)
+template<bool Verified>
+static void Op_Push_Const(VirtualMachine* vm)
 {
-    assert(vm->statusCode == VM_OK);
-    
-    if (vm->stack.size() == 0)
+    const int index = Read_Int(vm->program, &vm->programCounter);
+
+    if (!Verified && (index < 0 || index >= int(vm->constants.size())))
     {
         vm->running = false;
         vm->statusCode = VM_ERROR;
         return;
     }
 
-    
-    void* value = vm->stack.top();
+    vm->stack.push(vm->constants[index]);
 
-    if (vm->mm.GetType(value) == TY_INT)
-    {
-        (*reinterpret_cast<int*>(value))--;
-    
-        if (vm->tracing) { Trace_Decrement_Int(vm); }
-    }
-    else if (vm->mm.GetType(value) == TY_REAL)
-    {
-        (*reinterpret_cast<real*>(value))--;
+    if (vm->tracing) { Trace_LoadC_Pool(vm, index); }
+}
 
-        if (vm->tracing) { Trace_LoadC_Real(vm, 1.0); Trace_Sub_Real(vm); }
-    }
-    else
+static void Discard(VirtualMachine* vm)
+{
+    if (vm->discard && vm->stack.size() > vm->stackBounds)
     {
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
+        if (vm->stack.size() == 0)
+        {
+            vm->statusCode = VM_ERROR;
+            vm->running = false;
+        }
+        else
+        {
+            vm->stack.pop();
+
+            if (vm->tracing) { Trace_Pop_Discard(vm); }
+        }
     }
 }
 
-static char Flip(char jump)
+static void Op_Return(VirtualMachine* vm)
 {
-    switch (jump)
+    assert(vm->statusCode == VM_OK);
+
+    if (vm->frames.size() == 0)
     {
-    case JUMP_E:
-        return JUMP_NE;
-    case JUMP_NE:
-        return JUMP_E;
-    case JUMP_G:
-        return JUMP_LE;
-    case JUMP_GE:
-        return JUMP_L;
-    case JUMP_L:
-        return JUMP_GE;
-    case JUMP_LE:
-        return JUMP_G;
+        vm->statusCode = VM_ERROR;
+        vm->running = false;
+        return;
     }
 
-    return JUMP;
+    if ((vm->tracing || vm->tracingPaused) && int(vm->frames.size()) <= vm->tt.curTrace->depth)
+    {
+        // The trace started within this function and doesn't know the state of the
+        // caller, so it can't follow the return. End the trace here instead.
+        // A loop left by returning has no exit the trace can represent.
+        if (vm->tt.curTrace->loop.active)
+        {
+            Trace_Abort(vm);
+            vm->tracingPaused = false;
+        }
+        else if (vm->tracing)
+        {
+            vm->tt.curTrace->flags |= SN_NEEDED;
+            Trace_Snap(vm);
+            Trace_Finalize(vm);
+            vm->tracing = false;
+            vm->tracingPaused = false;
+        }
+    }
+
+    Discard(vm);
+
+    StackFrame& frame = vm->frames[vm->frames.size() - 1];
+
+#if DEBUG
+    // Record stats
+    if (vm->stack.size() > 0)
+    {
+        void* retVal = vm->stack.top();
+        const char type = vm->mm.GetType(retVal);
+        RecordReturn(frame.func, vm->programCounter, type);
+    }
+    else
+    {
+        // TY_VOID
+        RecordReturn(frame.func, vm->programCounter, TY_VOID);
+    }
+#endif
+
+    frame.func->depth--;
+
+    vm->locals.resize(vm->localBounds);
+    vm->stackBounds = frame.stackBounds;
+    vm->localBounds = frame.localBounds;
+    vm->frames.resize(vm->frames.size() - 1);
+    vm->programCounter = frame.returnAddress;
+    vm->discard = frame.discard;
+
+    if (vm->tracing)
+    {
+        Trace_Function(vm, vm->frames.empty() ? vm->main : vm->frames.back().func);
+    }
 }
 
-static void ComputePhis(VirtualMachine* vm, TraceLoop& loop)
+static void CreateStackFrame(VirtualMachine* vm, StackFrame& frame, int numArguments, int numLocals)
 {
-   // Find variables modified by the loop.
+    frame.returnAddress = vm->programCounter;
+    frame.localBounds = vm->localBounds;
+    frame.stackBounds = vm->stackBounds;
+
+    vm->stackBounds = int(vm->stack.size()) - numArguments;
+    vm->localBounds = int(vm->locals.size());
+    vm->locals.resize(numArguments + numLocals + vm->locals.size());
+
+    // TODO: we may need to reverse the stack?
+}
+
+template<bool Verified>
+static void Op_Call(VirtualMachine* vm, bool discard)
+{
+    assert (vm->statusCode == VM_OK);
     
-    int numNodes = 0;
-    for (size_t i = 0; i < loop.locals.size(); i++)
+    const unsigned char numArgs = Read_Byte(vm->program, &vm->programCounter);
+    const int id = Read_Int(vm->program, &vm->programCounter);
+    auto& func = vm->functions[id];
+    vm->callName = func.name;
+    vm->callNumArgs = numArgs;
+
+    if (func.blk != -1)
     {
-        auto& local = loop.locals[i];
-        if (local.minRef && local.maxRef && local.minRef->ref < local.maxRef->ref)
+        auto& blk = vm->blocks[func.blk];
+        if (Verified || blk.numArgs == numArgs)
         {
-            numNodes++;
+            const int address = blk.info.pc + vm->programOffset;
+            StackFrame& frame = vm->frames.emplace_back();
+            frame.functionName = vm->callName;
+            frame.debugLine = vm->debugLine;
+            frame.func = &blk.info;
+            CreateStackFrame(vm, frame, numArgs, int(blk.info.locals.size()));
+            vm->programCounter = address;
+            vm->discard = discard;
+
+            if (vm->tracing)
+            {
+                vm->tt.curTrace->locals.resize(vm->locals.size());
+                vm->tt.curTrace->flags |= SN_NEEDED; // we need a new snapshot to reflect the change in frames
+                Trace_Function(vm, &blk.info);
+
+                if (blk.info.depth >= unsigned(vm->tuning.maxRecursion))
+                {
+                    // Recursion is unrolled into the trace, too deep and it would never fit.
+                    Trace_Abort(vm);
+                }
+            }
+            else if (!vm->hot && vm->jit_instance)
+            {
+                HotCall(vm, blk.info);
+            }
+
+            blk.info.counter++;
+            blk.info.depth++;
+        }
+        else
+        {
+            vm->running = false;
+            vm->statusCode = VM_ERROR;
         }
     }
-
-    if (numNodes > 0)
+    else
     {
-        int numPhiNodesInserted = 0;
-        for (size_t i = 0; i < loop.locals.size(); i++)
+        if (vm->handler)
         {
-            auto& local = loop.locals[i];
-            if (local.minRef && local.maxRef && local.minRef->ref < local.maxRef->ref)
+            if (vm->tracing)
             {
-                // Generate a Phi node
-                TraceNode* phi = reinterpret_cast<TraceNode*>(vm->tt.curTrace->mm.New(sizeof(TraceNode), TY_OBJECT));
-                phi->data.id = IR_PHI;
-                phi->left = local.minRef;
-                phi->right = local.maxRef;
-                phi->ref = loop.startRef->ref + numPhiNodesInserted;
-                phi->flags = 0;
-                phi->pc = vm->programCounter;
-                phi->type = TY_VOID;
-                vm->tt.curTrace->nodes.insert(vm->tt.curTrace->nodes.begin() + loop.startRef->ref + numPhiNodesInserted, phi);
+                Trace_Call(vm, id, numArgs);
+            }
 
-                vm->tt.curTrace->ref++;
+            // Calls out to a handler
+            // parameters can be accessed via GetParamInt() etc
+            const int base = int(vm->stack.size()) - numArgs;
+            vm->statusCode = vm->handler(vm);
+            vm->running = vm->statusCode == VM_OK;
 
-                numPhiNodesInserted++;
+            // The verifier assumes the handler takes no more than its arguments and returns a value.
+            if (int(vm->stack.size()) < base || (!discard && int(vm->stack.size()) == base))
+            {
+                vm->running = false;
+                vm->statusCode = VM_ERROR;
             }
+            else if (discard && int(vm->stack.size()) > base)
+            {
+                vm->stack.pop();
+
+                if (vm->tracing) { Trace_Pop_Discard(vm); }
+            }
+        }
+        else
+        {
+            // no handler defined
+            vm->running = false;
+            vm->statusCode = VM_ERROR;
         }
+    }
+}
 
-        // Update the nodes after the PHI nodes were inserted at
-        for (size_t i = loop.startRef->ref + numNodes; i < vm->tt.curTrace->nodes.size(); i++)
+template<bool Verified>
+static void Op_TailCall(VirtualMachine* vm)
+{
+    assert(vm->statusCode == VM_OK);
+
+    const unsigned int pc = vm->programCounter;
+    const unsigned char numArgs = Read_Byte(vm->program, &vm->programCounter);
+    const int id = Read_Int(vm->program, &vm->programCounter);
+    auto& func = vm->functions[id];
+
+    if (func.blk == -1 || vm->frames.size() == 0)
+    {
+        // Handlers return straight away so this is a call followed by a return.
+        vm->programCounter = pc;
+        Op_Call<Verified>(vm, false);
+        if (vm->running)
         {
-            TraceNode* node = vm->tt.curTrace->nodes[i];
-            node->ref += numNodes;
+            Op_Return(vm);
         }
+        return;
+    }
 
-        for (size_t i = loop.startRef->ref - numNodes; i < loop.startRef->ref; i++) // loop over the PHI nodes
+    auto& blk = vm->blocks[func.blk];
+    if (!Verified && blk.numArgs != numArgs)
+    {
+        vm->running = false;
+        vm->statusCode = VM_ERROR;
+        return;
+    }
+
+    vm->callName = func.name;
+    vm->callNumArgs = numArgs;
+
+    // Reuse the current frame, the return goes straight back to our caller.
+    StackFrame& frame = vm->frames[vm->frames.size() - 1];
+    frame.func->depth--;
+    frame.func = &blk.info;
+    frame.functionName = vm->callName;
+
+    vm->locals.resize(vm->localBounds);
+    vm->locals.resize(vm->localBounds + numArgs + blk.info.locals.size());
+    vm->stackBounds = int(vm->stack.size()) - numArgs;
+    vm->programCounter = blk.info.pc + vm->programOffset;
+
+    if (vm->tracing)
+    {
+        // Traces can't represent a frame being replaced yet.
+        Trace_Abort(vm);
+    }
+
+    blk.info.counter++;
+    blk.info.depth++;
+}
+
+template<bool Verified>
+static void OP_CallD(VirtualMachine* vm)
+{
+    Op_Call<Verified>(vm, true);
+}
+
+template<bool Verified>
+static void OP_CallO(VirtualMachine* vm, bool discard)
+{
+    if (!CheckStack<Verified>(vm, 1))
+    {
+        return;
+    }
+
+    void* const value = vm->stack.top();
+    vm->stack.pop();
+
+    if (vm->mm.GetType(value) != TY_FUNC)
+    {
+        vm->running = false;
+        vm->statusCode = VM_ERROR;
+        return;
+    }
+
+    const unsigned char numArgs = Read_Byte(vm->program, &vm->programCounter);
+    auto& func = vm->functions[*(int*)value];
+    
+    vm->callName = func.name;
+    vm->callNumArgs = numArgs;
+
+    if (func.blk != -1)
+    {
+        auto& blk = vm->blocks[func.blk];
+        if (blk.numArgs == numArgs)
         {
-            TraceNode* phi = vm->tt.curTrace->nodes[i];
+            if (vm->tracing)
+            {
+                Trace_Callee(vm, *reinterpret_cast<int*>(value));
+            }
 
-            // We need to update the nodes left/right so we are inserted between
-            for (size_t j = loop.startRef->ref; j < vm->tt.curTrace->nodes.size(); j++) // nodes from after the PHI nodes to the end
+            const int address = blk.info.pc + vm->programOffset;
+            StackFrame& frame = vm->frames.emplace_back();
+            frame.functionName = vm->callName;
+            frame.debugLine = vm->debugLine;
+            frame.func = &blk.info;
+            CreateStackFrame(vm, frame, numArgs, int(blk.info.locals.size()));
+            vm->programCounter = address;
+            vm->discard = discard;
+
+            if (vm->tracing)
             {
-                TraceNode* node = vm->tt.curTrace->nodes[j];
-                if (node->left == phi->left || node->left == phi->right)
-                {
-                    node->left = phi;
-                }
-                else if (node->right == phi->left || node->right == phi->right)
+                TPOP(vm); // Pop the function code
+                vm->tt.curTrace->locals.resize(vm->locals.size());
+                vm->tt.curTrace->flags |= SN_NEEDED; // we need a new snapshot to reflect the change in frames
+                Trace_Function(vm, &blk.info);
+
+                if (blk.info.depth >= unsigned(vm->tuning.maxRecursion))
                 {
-                    node->right = phi;
+                    // Recursion is unrolled into the trace, too deep and it would never fit.
+                    Trace_Abort(vm);
                 }
             }
-        }
+            else if (!vm->hot && vm->jit_instance)
+            {
+                HotCall(vm, blk.info);
+            }
+
+            blk.info.counter++;
+            blk.info.depth++;
+        }
+        else
+        {
+            vm->running = false;
+            vm->statusCode = VM_ERROR;
+        }
+    }
+    else
+    {
+        vm->running = false;
+        vm->statusCode = VM_ERROR;
+    }
+}
+
+static void Op_Yield(VirtualMachine* vm)
+{
+    if (vm->handler)
+    {
+        unsigned char numArgs = Read_Byte(vm->program, &vm->programCounter);
+        // Calls out to a handler
+        // parameters can be accessed via GetParamInt() etc
+        const int id = Read_Int(vm->program, &vm->programCounter);
+
+        if (vm->tracing)
+        {
+            Trace_Yield(vm, id, numArgs);
+        }
+
+        vm->callName = vm->functions[id].name;
+        vm->callNumArgs = numArgs;
+
+        const int base = int(vm->stack.size()) - numArgs;
+        if (vm->handler(vm) == VM_ERROR || int(vm->stack.size()) < base)
+        {
+            vm->running = false;
+            vm->statusCode = VM_ERROR;
+        }
+        else
+        {
+            vm->running = false;
+            vm->statusCode = VM_YIELDED;
+        }
+    }
+    else
+    {
+        // this is an error
+        vm->running = false;
+        vm->statusCode = VM_ERROR;
+    }
+}
+
+template<bool Verified>
+static void Op_Pop(VirtualMachine* vm)
+{
+    assert(vm->statusCode == VM_OK);
+    
+    const int id = Read_Byte(vm->program, &vm->programCounter) + vm->localBounds;
+
+    if (Verified || !vm->stack.empty())
+    {
+        vm->locals[id] = vm->stack.top();
+
+        if (vm->tracing)
+        {
+            Trace_Pop(vm, id);
+        }
+
+        vm->stack.pop();
+    }
+    else
+    {
+        vm->running = false;
+        vm->statusCode = VM_ERROR;
+    }
+}
+
+//===================
+// Binary operators
+//===================
+
+// The handler for each operator and pair of operand types is instantiated from one template,
+// which picks the result type with BinaryResultType and the IR to trace from the operator.
+// The interpreter then dispatches through a table indexed by [operator][left type][right type].
+
+struct Add_Op
+{
+    static constexpr unsigned char op = OP_ADD;
+    static constexpr unsigned char irInt = IR_ADD_INT;
+    static constexpr unsigned char irReal = IR_ADD_REAL;
+    template<typename T> static T Apply(T left, T right) { return left + right; }
+};
+
+struct Sub_Op
+{
+    static constexpr unsigned char op = OP_SUB;
+    static constexpr unsigned char irInt = IR_SUB_INT;
+    static constexpr unsigned char irReal = IR_SUB_REAL;
+    template<typename T> static T Apply(T left, T right) { return left - right; }
+};
+
+struct Mul_Op
+{
+    static constexpr unsigned char op = OP_MUL;
+    static constexpr unsigned char irInt = IR_MUL_INT;
+    static constexpr unsigned char irReal = IR_MUL_REAL;
+    template<typename T> static T Apply(T left, T right) { return left * right; }
+};
+
+struct Div_Op
+{
+    static constexpr unsigned char op = OP_DIV;
+    static constexpr unsigned char irInt = IR_DIV_INT;
+    static constexpr unsigned char irReal = IR_DIV_REAL;
+    template<typename T> static T Apply(T left, T right) { return left / right; }
+};
+
+constexpr unsigned char AppendIR(unsigned char left, unsigned char right)
+{
+    if (left == TY_STRING)
+    {
+        return right == TY_INT ? IR_APP_STRING_INT :
+            right == TY_REAL ? IR_APP_STRING_REAL : IR_APP_STRING_STRING;
+    }
+
+    return left == TY_INT ? IR_APP_INT_STRING : IR_APP_REAL_STRING;
+}
+
+inline static void Trace_Binary(VirtualMachine* vm, unsigned char type, unsigned char ir)
+{
+    TraceNode* node = Trace_Instruction(vm, type, { .id = ir });
+    node->left = TTOP(vm);
+    node->right = TNEXT(vm);
+
+    TPOP2(vm);
+    TPUSH(vm, node);
+    TINC(vm);
+}
+
+inline static void Trace_Append(VirtualMachine* vm, unsigned char ir)
+{
+    TraceNode* node = Trace_Instruction(vm, TY_STRING, { .id = ir });
+    node->left = TNEXT(vm);
+    node->right = TTOP(vm);
+
+    TPOP2(vm);
+    TPUSH(vm, node);
+    TINC(vm);
+}
+
+template<unsigned char Type>
+static real Binary_Number(void* data)
+{
+    if constexpr (Type == TY_INT)
+    {
+        return real(*reinterpret_cast<int*>(data));
+    }
+    else
+    {
+        return *reinterpret_cast<real*>(data);
+    }
+}
+
+template<unsigned char Type>
+static void Binary_Print(std::stringstream& ss, void* data)
+{
+    if constexpr (Type == TY_INT)
+    {
+        ss << *reinterpret_cast<int*>(data);
+    }
+    else if constexpr (Type == TY_REAL)
+    {
+        ss << *reinterpret_cast<real*>(data);
+    }
+    else
+    {
+        ss << reinterpret_cast<char*>(data);
+    }
+}
+
+template<typename Op, unsigned char Left, unsigned char Right>
+static void Binary(VirtualMachine* vm, void* left, void* right)
+{
+    constexpr unsigned char result = BinaryResultType(Op::op, Left, Right);
+
+    if constexpr (result == TY_INT)
+    {
+        if (vm->tracing) { Trace_Binary(vm, TY_INT, Op::irInt); }
+        Push_Int(vm, Op::Apply(*reinterpret_cast<int*>(left), *reinterpret_cast<int*>(right)));
+    }
+    else if constexpr (result == TY_REAL)
+    {
+        if (vm->tracing)
+        {
+            if constexpr (Left == TY_INT) { Trace_Conv_Int_To_Real(vm, -2); }
+            if constexpr (Right == TY_INT) { Trace_Conv_Int_To_Real(vm, -1); }
+            Trace_Binary(vm, TY_REAL, Op::irReal);
+        }
+        Push_Real(vm, Op::Apply(Binary_Number<Left>(left), Binary_Number<Right>(right)));
+    }
+    else if constexpr (result == TY_STRING)
+    {
+        std::stringstream ss;
+        Binary_Print<Left>(ss, left);
+        Binary_Print<Right>(ss, right);
+        if (vm->tracing) { Trace_Append(vm, AppendIR(Left, Right)); }
+        Push_String(vm, ss.str().c_str());
+    }
+    else
+    {
+        vm->running = false;
+        vm->statusCode = VM_ERROR;
+    }
+}
+
+typedef void (*BinaryHandler)(VirtualMachine* vm, void* left, void* right);
+
+constexpr int NUM_OPERAND_TYPES = TY_TABLE + 1;
+constexpr int NUM_BINARY_HANDLERS = NUM_OPERAND_TYPES * NUM_OPERAND_TYPES;
+
+template<typename Op, size_t... Index>
+constexpr std::array<BinaryHandler, NUM_BINARY_HANDLERS> MakeBinaryHandlers(std::index_sequence<Index...>)
+{
+    return { &Binary<Op, Index / NUM_OPERAND_TYPES, Index % NUM_OPERAND_TYPES>... };
+}
+
+template<typename Op>
+constexpr std::array<BinaryHandler, NUM_BINARY_HANDLERS> MakeBinaryHandlers()
+{
+    return MakeBinaryHandlers<Op>(std::make_index_sequence<NUM_BINARY_HANDLERS>());
+}
+
+static constexpr std::array<std::array<BinaryHandler, NUM_BINARY_HANDLERS>, 4> binaryHandlers =
+{
+    MakeBinaryHandlers<Add_Op>(),
+    MakeBinaryHandlers<Sub_Op>(),
+    MakeBinaryHandlers<Mul_Op>(),
+    MakeBinaryHandlers<Div_Op>()
+};
+
+constexpr int BinaryOperatorIndex(unsigned char op)
+{
+    // OP_SUB, OP_MUL and OP_DIV are contiguous.
+    return op == OP_ADD ? 0 : op - OP_SUB + 1;
+}
+
+static_assert(BinaryOperatorIndex(OP_DIV) == 3);
+
+template<bool Verified>
+static void Op_Unary_Minus(VirtualMachine* vm)
+{
+    assert (vm->statusCode == VM_OK);
+
+    if (!CheckStack<Verified>(vm, 1))
+    {
+        return;
+    }
+
+    void* var1 = vm->stack.top();
+    vm->stack.pop();
+
+    if (vm->mm.GetType(var1) == TY_INT)
+    {
+        Push_Int(vm, -*reinterpret_cast<int*>(var1));
+        
+        if (vm->tracing) { Trace_Unary_Minus_Int(vm); }
+    }
+    else if (vm->mm.GetType(var1) == TY_REAL)
+    {
+        Push_Real(vm, -*reinterpret_cast<real*>(var1));
+
+        if (vm->tracing) { Trace_Unary_Minus_Real(vm); }
+    }
+    else
+    {
+        vm->running = false;
+        vm->statusCode = VM_ERROR;
+    }
+}
+
+template<bool Verified>
+static void Op_Operator(unsigned char op, VirtualMachine* vm)
+{
+    assert(vm->statusCode == VM_OK);
+
+    if (!CheckStack<Verified>(vm, 2))
+    {
+        return;
+    }
+
+    void* var1 = vm->stack.top();
+    vm->stack.pop();
+    void* var2 = vm->stack.top();
+    vm->stack.pop();
+
+    const unsigned char left = vm->mm.GetType(var2);
+    const unsigned char right = vm->mm.GetType(var1);
+    if (left >= NUM_OPERAND_TYPES || right >= NUM_OPERAND_TYPES)
+    {
+        vm->running = false;
+        vm->statusCode = VM_ERROR;
+        return;
+    }
+
+    binaryHandlers[BinaryOperatorIndex(op)][left * NUM_OPERAND_TYPES + right](vm, var2, var1);
+}
+
+//===================
+// Typed operators
+//===================
+
+// The compiler only emits these when it has proven the types of the operands,
+// so unlike the generic operators they don't need to check them.
+
+static void Op_Add_II(VirtualMachine* vm)
+{
+    void* var1 = vm->stack.top();
+    vm->stack.pop();
+    void* var2 = vm->stack.top();
+    vm->stack.pop();
+
+    Binary<Add_Op, TY_INT, TY_INT>(vm, var2, var1);
+}
+
+static void Op_Add_RR(VirtualMachine* vm)
+{
+    void* var1 = vm->stack.top();
+    vm->stack.pop();
+    void* var2 = vm->stack.top();
+    vm->stack.pop();
+
+    Binary<Add_Op, TY_REAL, TY_REAL>(vm, var2, var1);
+}
+
+static void Op_Compare_II(VirtualMachine* vm)
+{
+    int* item1 = reinterpret_cast<int*>(vm->stack.top());
+    vm->stack.pop();
+    int* item2 = reinterpret_cast<int*>(vm->stack.top());
+    vm->stack.pop();
+
+    vm->comparer = *item2 - *item1;
+
+    if (vm->tracing) { Trace_Cmp_Int(vm); }
+}
+
+static void Op_Increment_I(VirtualMachine* vm)
+{
+    const int value = *reinterpret_cast<int*>(vm->stack.top());
+    vm->stack.pop();
+    Push_Int(vm, value + 1);
+
+    if (vm->tracing) { Trace_Increment_Int(vm); }
+}
+
+//static void Op_Format(VirtualMachine* vm)
+//{
+//    if (vm->statusCode == VM_OK)
+//    {
+//        void* formatVal = vm->stack.top();
+//        if (vm->mm.GetType(formatVal) != TY_STRING)
+//        {
+//            vm->statusCode = VM_ERROR;
+//            vm->running = false;
+//            return;
+//        }
+//
+//        const std::string format = std::string(reinterpret_cast<char*>(formatVal));
+//        vm->stack.pop();
+//
+//        std::stringstream formatted;
+//
+//        size_t offset = 0;
+//        while (offset < format.size())
+//        {
+//            size_t pos = format.find('{', offset);
+//            formatted << format.substr(offset, pos - offset);
+//            if (pos == std::string::npos) { break; }
+//            size_t end = format.find('}', pos);
+//
+//            std::string name = format.substr(pos + 1, end - pos - 1);
+//            void* local = //vm->locals[name];
+//            switch (vm->mm.GetType(local))
+//            {
+//            case TY_INT:
+//                formatted << *reinterpret_cast<int*>(local);
+//                break;
+//            case TY_STRING:
+//                formatted << reinterpret_cast<char*>(local);
+//                break;
+//            default:
+//                vm->statusCode = VM_ERROR;
+//                vm->running = false;
+//                break;
+//            }
+//
+//            offset = end + 1;
+//        }
+//
+//        Push_String(vm, formatted.str());
+//    }
+//}
+
+template<bool Verified>
+static void Op_Increment(VirtualMachine* vm)
+{
+    assert(vm->statusCode == VM_OK);
+    
+    if (!CheckStack<Verified>(vm, 1))
+    {
+        return;
+    }
+
+    // The value may be shared (e.g. a constant) so a new one is pushed rather than modifying it.
+    void* value = vm->stack.top();
+        
+    if (vm->mm.GetType(value) == TY_INT)
+    {
+        vm->stack.pop();
+        Push_Int(vm, *reinterpret_cast<int*>(value) + 1);
+    
+        if (vm->tracing) { Trace_Increment_Int(vm); }
+    }
+    else if (vm->mm.GetType(value) == TY_REAL)
+    {
+        vm->stack.pop();
+        Push_Real(vm, *reinterpret_cast<real*>(value) + 1);
+
+        if (vm->tracing) { Trace_LoadC_Real(vm, 1.0); Trace_Add_Real(vm); }
+    }
+    else
+    {
+        vm->running = false;
+        vm->statusCode = VM_ERROR;
+    }
+}
+
+template<bool Verified>
+static void Op_Decrement(VirtualMachine* vm)
+{
+    assert(vm->statusCode == VM_OK);
+    
+    if (!CheckStack<Verified>(vm, 1))
+    {
+        return;
+    }
+
+    
+    void* value = vm->stack.top();
+
+    if (vm->mm.GetType(value) == TY_INT)
+    {
+        vm->stack.pop();
+        Push_Int(vm, *reinterpret_cast<int*>(value) - 1);
+    
+        if (vm->tracing) { Trace_Decrement_Int(vm); }
+    }
+    else if (vm->mm.GetType(value) == TY_REAL)
+    {
+        vm->stack.pop();
+        Push_Real(vm, *reinterpret_cast<real*>(value) - 1);
+
+        if (vm->tracing) { Trace_LoadC_Real(vm, 1.0); Trace_Sub_Real(vm); }
+    }
+    else
+    {
+        vm->running = false;
+        vm->statusCode = VM_ERROR;
+    }
+}
+
+static char Flip(char jump)
+{
+    switch (jump)
+    {
+    case JUMP_E:
+        return JUMP_NE;
+    case JUMP_NE:
+        return JUMP_E;
+    case JUMP_G:
+        return JUMP_LE;
+    case JUMP_GE:
+        return JUMP_L;
+    case JUMP_L:
+        return JUMP_GE;
+    case JUMP_LE:
+        return JUMP_G;
+    }
+
+    return JUMP;
+}
+
+static void ComputePhis(VirtualMachine* vm, TraceLoop& loop)
+{
+   // Find variables modified by the loop.
+    
+    int numNodes = 0;
+    for (size_t i = 0; i < loop.locals.size(); i++)
+    {
+        auto& local = loop.locals[i];
+        if (local.minRef && local.maxRef && local.minRef->ref < local.maxRef->ref)
+        {
+            numNodes++;
+        }
+    }
+
+    if (numNodes > 0)
+    {
+        int numPhiNodesInserted = 0;
+        for (size_t i = 0; i < loop.locals.size(); i++)
+        {
+            auto& local = loop.locals[i];
+            if (local.minRef && local.maxRef && local.minRef->ref < local.maxRef->ref)
+            {
+                // Generate a Phi node
+                TraceNode* phi = reinterpret_cast<TraceNode*>(vm->tt.curTrace->mm.New(sizeof(TraceNode), TY_OBJECT));
+                phi->data.id = IR_PHI;
+                phi->left = local.minRef;
+                phi->right = local.maxRef;
+                phi->ref = loop.startRef->ref + numPhiNodesInserted;
+                phi->flags = 0;
+                phi->pc = vm->programCounter;
+                phi->type = local.minRef->type;
+                vm->tt.curTrace->nodes.insert(vm->tt.curTrace->nodes.begin() + loop.startRef->ref + numPhiNodesInserted, phi);
+
+                vm->tt.curTrace->ref++;
+
+                numPhiNodesInserted++;
+            }
+        }
+
+        // Update the nodes after the PHI nodes were inserted at
+        for (size_t i = loop.startRef->ref + numNodes; i < vm->tt.curTrace->nodes.size(); i++)
+        {
+            TraceNode* node = vm->tt.curTrace->nodes[i];
+            node->ref += numNodes;
+        }
+
+        for (size_t i = loop.startRef->ref - numNodes; i < loop.startRef->ref; i++) // loop over the PHI nodes
+        {
+            TraceNode* phi = vm->tt.curTrace->nodes[i];
+
+            // We need to update the nodes left/right so we are inserted between.
+            // Uses of the value computed by this iteration come after it and keep it.
+            for (size_t j = loop.startRef->ref; j < vm->tt.curTrace->nodes.size(); j++) // nodes from after the PHI nodes to the end
+            {
+                TraceNode* node = vm->tt.curTrace->nodes[j];
+                if (node->left == phi->left)
+                {
+                    node->left = phi;
+                }
+                if (node->right == phi->left)
+                {
+                    node->right = phi;
+                }
+            }
+        }
+
+        // A guard in the loop exits with the values carried around it, not those it was entered with.
+        for (size_t i = loop.startRef->ref; i < vm->tt.curTrace->nodes.size(); i++)
+        {
+            TraceNode* node = vm->tt.curTrace->nodes[i];
+            if (node->data.id != IR_SNAP)
+            {
+                continue;
+            }
+
+            auto& snap = vm->tt.curTrace->snaps[node->data.snapId];
+            for (auto& local : snap.locals)
+            {
+                for (size_t j = loop.startRef->ref - numNodes; j < loop.startRef->ref; j++)
+                {
+                    TraceNode* phi = vm->tt.curTrace->nodes[j];
+                    if (local.ref == phi->left)
+                    {
+                        local.ref = phi;
+                        break;
+                    }
+                }
+            }
+            for (auto& value : snap.stack)
+            {
+                for (size_t j = loop.startRef->ref - numNodes; j < loop.startRef->ref; j++)
+                {
+                    TraceNode* phi = vm->tt.curTrace->nodes[j];
+                    if (value == phi->left)
+                    {
+                        value = phi;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+}
+
+inline static void MarkLoopStart(VirtualMachine* vm, unsigned int pc)
+{
+    // Only instructions with a loop start variant can be marked.
+    switch (vm->program[pc])
+    {
+    case OP_PUSH:
+    case OP_POP:
+    case OP_CALL:
+    case OP_YIELD:
+    case OP_SET:
+    case OP_PUSH_LOCAL:
+    case OP_PUSH_CONST:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+        vm->program[pc] |= MK_LOOPSTART;
+        break;
+    }
+}
+
+static bool LoopTypesStable(VirtualMachine* vm, const TraceLoop& loop)
+{
+    // A phi can't join values of different types, so a local which changes
+    // type over an iteration can't be carried around the loop.
+    for (size_t i = 0; i < loop.locals.size(); i++)
+    {
+        const TraceNode* before = loop.locals[i].minRef;
+        const TraceNode* after = vm->tt.curTrace->locals[i];
+        if (before && after && before->type != after->type)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void Trace_LoopExit(VirtualMachine* vm, TraceNode* guardNode, unsigned int exitPc)
+{
+    // Promote the guard to a loop exit and complete the trace where the loop is left.
+    auto& loop = vm->tt.curTrace->loop;
+    loop.active = false;
+    vm->tt.curTrace->looping = true;
+
+    const int exitRef = loop.endRef->ref + 1;
+    Trace_PromoteGuard(vm, guardNode, vm->tt.curTrace->nodes[exitRef]);
+    vm->tt.curTrace->flags = SN_NEEDED;
+
+    vm->programInstruction = exitPc;
+    Trace_Snap(vm);
+
+    // The loop is left before the values of the iteration are computed, which may not
+    // have happened at all since the trace was entered, so exit with the carried values.
+    auto& snap = vm->tt.curTrace->snaps.back();
+    for (TraceNode* node : vm->tt.curTrace->nodes)
+    {
+        if (node->data.id != IR_PHI)
+        {
+            continue;
+        }
+
+        for (auto& local : snap.locals)
+        {
+            if (local.ref == node->right)
+            {
+                local.ref = node;
+            }
+        }
+    }
+
+    Trace_Finalize(vm);
+}
+
+static void CompileLoop(VirtualMachine* vm)
+{
+    // The loop became hot during this run, so rather than waiting for it to exit the
+    // guard which leaves the loop is promoted now and the remaining iterations run
+    // from the trace.
+    Trace* trace = vm->tt.curTrace;
+    const int header = trace->pc;
+    const auto& loop = trace->loop;
+
+    TraceNode* exitGuard = nullptr;
+    unsigned int exitPc = 0;
+    for (const auto& guard : loop.guards)
+    {
+        unsigned int pc = guard.pc;
+        const unsigned char type = Read_Byte(vm->program, &pc);
+        const short offset = Read_Short(vm->program, &pc);
+        if (guard.node->data.jump == type && int(pc) + offset > int(loop.end))
+        {
+            // The jump wasn't taken while tracing and taking it leaves the loop.
+            exitGuard = guard.node;
+            exitPc = pc + offset;
+            break;
+        }
+    }
+
+    const bool yields = std::any_of(trace->nodes.begin(), trace->nodes.end(),
+        [](TraceNode* node) { return node->data.id == IR_YIELD; });
+
+    if (exitGuard && !yields && int(vm->programCounter) == header)
+    {
+        Trace_LoopExit(vm, exitGuard, exitPc);
+        Trace_Compile(vm);
+    }
+
+    if (!trace->jit_trace && !trace->compiling)
+    {
+        Trace_Abort(vm);
+    }
+
+    HotLoopCool(vm, header);
+}
+
+static void HotLoop(VirtualMachine* vm, int type, int pc, int offset, bool branchDir)
+{
+    if (vm->loopTrace != -1 && !vm->tracing && !vm->tracingPaused)
+    {
+        // The trace of the hot loop was aborted.
+        HotLoopCool(vm, vm->loopTrace);
+        return;
+    }
+
+    if (SideTracing(vm))
+    {
+        Trace* trace = vm->tt.curTrace;
+        const Trace* parent = vm->tt.traces[trace->parent].get();
+        if (offset < 0 && int(vm->programCounter) == parent->pc)
+        {
+            vm->programInstruction = vm->programCounter;
+            SideTraceClose(vm);
+            return;
+        }
+
+        if (offset < 0 && trace->outer == -1 && int(vm->programCounter) < parent->pc)
+        {
+            // The path left the loop and goes around the loop enclosing it, it comes
+            // back to the loop's header as the next iteration of the enclosing loop starts.
+            trace->outer = int(vm->programCounter);
+        }
+        else if (offset < 0 ||
+            parent->serial != trace->parentSerial ||
+            int(trace->nodes.size()) > vm->tuning.maxTraceSize)
+        {
+            // The path goes around another loop or is too long to be worth linking.
+            SideTraceAbort(vm);
+            return;
+        }
+    }
+
+    if (vm->tracing)
+    {
+        if (offset < 0 && !SideTracing(vm))
+        {
+            auto& loop = vm->tt.curTrace->loop;
+            if (loop.active && LoopTypesStable(vm, loop) && int(vm->tt.curTrace->nodes.size()) <= vm->tuning.maxTraceSize)
+            {
+                loop.endRef = vm->tt.curTrace->nodes[vm->tt.curTrace->ref - 1];
+                loop.end = pc;
+
+                Trace_LoopBack(vm, type, loop.startRef->ref - vm->tt.curTrace->ref);
+
+                // Record the last used instance of variables.
+                for (size_t i = 0; i < loop.locals.size(); i++)
+                {
+                    loop.locals[i].maxRef = vm->tt.curTrace->locals[i];
+                }
+
+                ComputePhis(vm, loop);
+
+                // Pause the tracing for the duration of the loop.
+                vm->tracing = false;
+                vm->tracingPaused = true;
+
+                if (vm->loopTrace != -1)
+                {
+                    CompileLoop(vm);
+                }
+            }
+            else
+            {
+                Trace_Abort(vm);
+
+            }
+        }
+        else if (type != JUMP)
+        {
+            // The guard resumes the way the branch wasn't taken, as the comparison
+            // made by the trace isn't restored.
+            const unsigned int instruction = vm->programInstruction;
+            vm->programInstruction = branchDir ? pc + 3 : pc + 3 + offset;
+            vm->tt.curTrace->flags |= SN_NEEDED;
+            Trace_Snap(vm);
+            vm->programInstruction = instruction;
+
+            if (branchDir)
+            {
+                Trace_Guard(vm, Flip(type));
+            }
+            else
+            {
+                Trace_Guard(vm, type);
+            }
+
+            if (vm->tt.curTrace->loop.active)
+            {
+                auto& loop = vm->tt.curTrace->loop;
+                auto& guard = loop.guards.emplace_back();
+                guard.pc = pc;
+                guard.node = vm->tt.curTrace->nodes[vm->tt.curTrace->ref - 1];
+            }
+        }
+    }
+    else if (vm->tracingPaused)
+    {
+        // Check if we are leaving the loop
+        if (branchDir)
+        {
+            // To be certain we need to check the pc is now beyond the
+            // end of the loop
+            auto& loop = vm->tt.curTrace->loop;
+            if (loop.active && vm->programCounter > loop.end)
+            {
+                // We need to promote the guard to a loop exit
+                TraceNode* guardNode = nullptr;
+                for (size_t i = 0; i < loop.guards.size(); i++)
+                {
+                    auto& guard = loop.guards[i];
+                    if (guard.pc == pc)
+                    {
+                        guardNode = guard.node;
+                        break;
+                    }
+                }
+
+                // Complete tracing the loop and start a new trace.
+                assert(guardNode);
+                Trace_LoopExit(vm, guardNode, vm->programCounter);
+                Trace_Start(vm);
+            }
+        }
+    }
+
+    if (offset > 0 && branchDir && !vm->tracing && !vm->tracingPaused && vm->loopTrace == -1)
+    {
+        // Tracing startpoint. This may be loop exit or an jump
+        // within an if. We are not interested in the later, but it doesn't
+        // harm creating a trace starting there.
+
+        vm->programInstruction = vm->programCounter;
+        Trace_Start(vm);
+    }
+}
+
+static void Op_Jump(VirtualMachine* vm)
+{
+    unsigned int pc = vm->programCounter;
+    const char type = Read_Byte(vm->program, &vm->programCounter);
+    const short offset = Read_Short(vm->program, &vm->programCounter);
+    bool branchDir = false;
+
+    switch (type)
+    {
+    case JUMP:
+        branchDir = true;
+        vm->programCounter += offset;
+        break;
+    case JUMP_E:
+        if (vm->comparer == 0)
+        {
+            branchDir = true;
+            vm->programCounter += offset;
+        }
+        break;
+    case JUMP_GE:
+        if (vm->comparer >= 0)
+        {
+            branchDir = true;
+            vm->programCounter += offset;
+        }
+        break;
+    case JUMP_LE:
+        if (vm->comparer <= 0)
+        {
+            branchDir = true;
+            vm->programCounter += offset;
+        }
+        break;
+    case JUMP_NE:
+        if (vm->comparer != 0)
+        {
+            branchDir = true;
+            vm->programCounter += offset;
+        }
+        break;
+    case JUMP_L:
+        if (vm->comparer < 0)
+        {
+            branchDir = true;
+            vm->programCounter += offset;
+        }
+        break;
+    case JUMP_G:
+        if (vm->comparer > 0)
+        {
+            branchDir = true;
+            vm->programCounter += offset;
+        }
+        break;
+    }
+
+    // Record branch stats
+    BranchCount& count = vm->branchCounts[pc - 1 - vm->programOffset];
+    if (branchDir)
+    {
+        count.taken++;
+    }
+    else
+    {
+        count.notTaken++;
+    }
+
+    // Record a loop
+    if (offset < 0)
+    {
+        MarkLoopStart(vm, vm->programCounter);
+
+        if (!vm->hot && vm->jit_instance && vm->frames.empty())
+        {
+            HotBackEdge(vm, vm->programCounter);
+        }
+    }
+
+    if (vm->hot)
+    {
+        HotLoop(vm, type, pc, offset, branchDir);
+    }
+}
+
+template<bool Verified>
+static void Op_Jump_Table(VirtualMachine* vm)
+{
+    const int id = Read_Byte(vm->program, &vm->programCounter) + vm->localBounds;
+    const int min = Read_Int(vm->program, &vm->programCounter);
+    const int count = static_cast<unsigned short>(Read_Short(vm->program, &vm->programCounter));
+
+    if (!Verified && vm->locals.size() <= id)
+    {
+        vm->running = false;
+        vm->statusCode = VM_ERROR;
+        return;
+    }
+
+    void* value = vm->locals[id];
+    if (vm->mm.GetType(value) != TY_INT)
+    {
+        vm->running = false;
+        vm->statusCode = VM_ERROR;
+        return;
+    }
+
+    // The default offset comes first followed by the offset of each case.
+    const int key = *reinterpret_cast<int*>(value);
+    const int64_t index = int64_t(key) - min;
+    unsigned int entry = vm->programCounter + (index >= 0 && index < count ? 2 + 2 * unsigned(index) : 0);
+    const short offset = Read_Short(vm->program, &entry);
+    vm->programCounter = entry + offset;
+
+    if (vm->tracing)
+    {
+        // Keys off the table are kept to the side they are on.
+        if (index < 0) { Trace_Switch(vm, id, min, JUMP_GE); }
+        else if (index >= count) { Trace_Switch(vm, id, min + count - 1, JUMP_LE); }
+        else { Trace_Switch(vm, id, key, JUMP_NE); }
+    }
+}
+
+template<bool Verified>
+static void Op_Jump_Search(VirtualMachine* vm)
+{
+    const int id = Read_Byte(vm->program, &vm->programCounter) + vm->localBounds;
+    const int count = static_cast<unsigned short>(Read_Short(vm->program, &vm->programCounter));
+
+    if (!Verified && vm->locals.size() <= id)
+    {
+        vm->running = false;
+        vm->statusCode = VM_ERROR;
+        return;
+    }
+
+    void* value = vm->locals[id];
+    if (vm->mm.GetType(value) != TY_INT)
+    {
+        vm->running = false;
+        vm->statusCode = VM_ERROR;
+        return;
+    }
+
+    // The default offset is followed by the sorted keys each with the offset of their case.
+    const int key = *reinterpret_cast<int*>(value);
+    const unsigned int cases = vm->programCounter + 2;
+    unsigned int entry = vm->programCounter;
+    int lo = 0;
+    int hi = count;
+    while (lo < hi)
+    {
+        const int mid = (lo + hi) / 2;
+        unsigned int pc = cases + 6 * mid;
+        const int caseKey = Read_Int(vm->program, &pc);
+        if (caseKey == key)
+        {
+            entry = pc;
+            break;
+        }
+        else if (caseKey < key) { lo = mid + 1; }
+        else { hi = mid; }
+    }
+
+    const short offset = Read_Short(vm->program, &entry);
+    vm->programCounter = entry + offset;
+
+    // The default is only taken for this key again, but that avoids guarding every case.
+    if (vm->tracing) { Trace_Switch(vm, id, key, JUMP_NE); }
+}
+
+static int Compare_Real(real left, real right)
+{
+    const real cmp = left - right;
+    if (cmp == 0.0 || std::isnan(cmp))
+    {
+        return 0;
+    }
+    else if (cmp < 0)
+    {
+        return -1;
+    }
+    else if (cmp > 0)
+    {
+        return 1;
+    }
+
+    abort();
+}
+
+template<bool Verified>
+static void Op_Compare(VirtualMachine* vm)
+{
+    if (!CheckStack<Verified>(vm, 2))
+    {
+        return;
+    }
+
+    void* item1 = vm->stack.top();
+    vm->stack.pop();
+
+    void* item2 = vm->stack.top();
+    vm->stack.pop();
+
+    if (vm->mm.GetType(item1) == TY_INT && vm->mm.GetType(item2) == TY_INT)
+    {
+        vm->comparer = *reinterpret_cast<int*>(item2) - *reinterpret_cast<int*>(item1);
+        if (vm->tracing) { Trace_Cmp_Int(vm); }
+    }
+    else if (vm->mm.GetType(item1) == TY_STRING && vm->mm.GetType(item2) == TY_STRING)
+    {
+        vm->comparer = strcmp(reinterpret_cast<char*>(item2), reinterpret_cast<char*>(item1));
+        if (vm->tracing) { Trace_Cmp_String(vm); }
+    }
+    else if (vm->mm.GetType(item1) == TY_REAL && vm->mm.GetType(item2) == TY_REAL)
+    {
+        vm->comparer = Compare_Real(*reinterpret_cast<real*>(item2), *reinterpret_cast<real*>(item1));
+
+        if (vm->tracing) { Trace_Cmp_Real(vm); }
+    }
+    else if (vm->mm.GetType(item1) == TY_TABLE && vm->mm.GetType(item2) == TY_TABLE)
+    {
+        vm->comparer = int(reinterpret_cast<char*>(item2) - reinterpret_cast<char*>(item1));
+
+        if (vm->tracing) { Trace_Cmp_Table(vm); }
+    }
+    else
+    {
+        vm->running = false;
+        vm->statusCode = VM_ERROR;
+    }
+}
+
+static void Op_TableNew(VirtualMachine* vm)
+{
+    void* table = vm->mm.New(sizeof(Table), TY_TABLE);
+    void* ptr = new(table) Table;
+    vm->stack.push(ptr);
+
+    if (vm->tracing) {
+        Trace_TableNew(vm);
+    }
+}
+
+static void Table_AGet(VirtualMachine* vm, Table* tbl, void* identifier)
+{
+    const int key = *(int*)identifier;
+    if (key < 0 || key >= tbl->_array.size())
+    {
+        vm->running = false;
+        vm->statusCode = VM_ERROR;
+        return;
+    }
+
+    void* value = tbl->_array[key];
+    vm->stack.push(value);
+
+    if (vm->tracing) {
+        Trace_TableAGet(vm, vm->mm.GetType(value));
+    }
+}
+
+static void Table_HGet(VirtualMachine* vm, Table* tbl, void* identifier)
+{
+    char* name = (char*)identifier;
+    const auto& it = tbl->_map.find(name);
+    if (it == tbl->_map.end())
+    {
+        vm->running = false;
+        vm->statusCode = VM_ERROR;
+        return;
+    }
+
+    vm->stack.push(it->second);
+
+    if (vm->tracing) {
+        Trace_TableHGet(vm, vm->mm.GetType(it->second));
+    }
+}
+
+template<bool Verified>
+static void Op_TableGet(VirtualMachine* vm)
+{
+    if (!CheckStack<Verified>(vm, 3))
+    {
+        return;
+    }
+
+    void* type = vm->stack.top();
+    vm->stack.pop();
+    if (vm->mm.GetType(type) != TY_INT)
+    {
+        vm->running = false;
+        vm->statusCode = VM_ERROR;
+        return;
+    }
+
+    void* identifier = vm->stack.top();
+    vm->stack.pop();
+
+    void* top = vm->stack.top();
+    vm->stack.pop();
+
+    if (vm->mm.GetType(top) != TY_TABLE)
+    {
+        vm->running = false;
+        vm->statusCode = VM_ERROR;
+        return;
+    }
+
+    Table* tbl = reinterpret_cast<Table*>(top);
+    switch (*(int*)type)
+    {
+    case TY_INT:
+        Table_AGet(vm, tbl, identifier);
+        break;
+    case TY_STRING:
+        Table_HGet(vm, tbl, identifier);
+        break;
+    default:
+        vm->running = false;
+        vm->statusCode = VM_ERROR;
+        break;
+    }
+}
+
+static void* CopyToTable(VirtualMachine* vm, void* data)
+{
+    void* copy = nullptr;
+    const int type = vm->mm.GetType(data);
+    switch (type)
+    {
+        case TY_INT:
+            copy = vm->mm.New(sizeof(int), TY_INT);
+            *(int*)copy = *(int*)data;
+            break;
+        case TY_REAL:
+            copy = vm->mm.New(sizeof(real), TY_REAL);
+            *(real*)copy = *(real*)data;
+            break;
+        default:
+            copy = data; // pass by value
+            break;
+    }
+
+    return copy;
+}
+
+static void Table_HSet(VirtualMachine* vm, Table* tbl, void* identifier, void* next)
+{
+    const char* name = (char*)identifier;
+    tbl->_map[name] = CopyToTable(vm, next);
+
+    if (vm->tracing) {
+        Trace_TableHSet(vm, vm->mm.GetType(next));
     }
 }
 
-static void HotLoop(VirtualMachine* vm, int type, int pc, int offset, bool branchDir)
+static void Table_ASet(VirtualMachine* vm, Table* tbl, void* identifier, void* next)
 {
-    if (vm->tracing)
+    const int key = *(int*)identifier;
+    if (key >= tbl->_array.size())
     {
-        if (offset < 0)
-        {
-            auto& loop = vm->tt.curTrace->loop;
-            if (loop.active)
-            {
-                loop.endRef = vm->tt.curTrace->nodes[vm->tt.curTrace->ref - 1];
-                loop.end = pc;
+        tbl->_array.resize(key + 1);
+    }
+    tbl->_array[key] = CopyToTable(vm, next);
 
-                Trace_LoopBack(vm, type, loop.startRef->ref - vm->tt.curTrace->ref);
+    if (vm->tracing) {
+        Trace_TableASet(vm, vm->mm.GetType(next));
+    }
+}
 
-                // Record the last used instance of variables.
-                for (size_t i = 0; i < loop.locals.size(); i++)
-                {
-                    loop.locals[i].maxRef = vm->tt.curTrace->locals[i];
-                }
+template<bool Verified>
+static void Op_TableSet(VirtualMachine* vm)
+{
+    if (!CheckStack<Verified>(vm, 4))
+    {
+        return;
+    }
 
-                ComputePhis(vm, loop);
+    void* type = vm->stack.top();
+    vm->stack.pop();
+    if (vm->mm.GetType(type) != TY_INT)
+    {
+        vm->running = false;
+        vm->statusCode = VM_ERROR;
+        return;
+    }
 
-                // Pause the tracing for the duration of the loop.
-                vm->tracing = false;
-                vm->tracingPaused = true;
-            }
-            else
-            {
-                Trace_Abort(vm);
+    void* identifier = vm->stack.top();
+    vm->stack.pop();
 
-            }
-        }
-        else if (type != JUMP)
-        {
-            Trace_Snap(vm);
+    void* top = vm->stack.top();
+    vm->stack.pop();
 
-            if (branchDir)
-            {
-                Trace_Guard(vm, Flip(type));
-            }
-            else
-            {
-                Trace_Guard(vm, type);
-            }
+    void* next = vm->stack.top();
+    vm->stack.pop();
 
-            if (vm->tt.curTrace->loop.active)
-            {
-                auto& loop = vm->tt.curTrace->loop;
-                auto& guard = loop.guards.emplace_back();
-                guard.pc = pc;
-                guard.node = vm->tt.curTrace->nodes[vm->tt.curTrace->ref - 1];
-            }
-        }
+    if (vm->mm.GetType(top) != TY_TABLE)
+    {
+        vm->running = false;
+        vm->statusCode = VM_ERROR;
+        return;
     }
-    else if (vm->tracingPaused)
+    
+    Table* tbl = reinterpret_cast<Table*>(top);
+    switch (*(int*)type)
     {
-        // Check if we are leaving the loop
-        if (branchDir)
-        {
-            // To be certain we need to check the pc is now beyond the
-            // end of the loop
-            auto& loop = vm->tt.curTrace->loop;
-            if (loop.active && vm->programCounter > loop.end)
-            {
-                // We need to promote the guard to a loop exit
-                TraceNode* guardNode = nullptr;
-                for (size_t i = 0; i < loop.guards.size(); i++)
-                {
-                    auto& guard = loop.guards[i];
-                    if (guard.pc == pc)
-                    {
-                        guardNode = guard.node;
-                        break;
-                    }
-                }
+    case TY_STRING:
+        Table_HSet(vm, tbl, identifier, next);
+        break;
+    case TY_INT:
+        Table_ASet(vm, tbl, identifier, next);
+        break;
+    default:
+        vm->running = false;
+        vm->statusCode = VM_ERROR;
+        break;
+    }
+}
 
-                // Disable the loop now it is done.
-                loop.active = false;
+static void** Table_Ref(Table* tbl, void* type, void* identifier)
+{
+    switch (*(int*)type)
+    {
+    case TY_INT:
+    {
+        const int key = *(int*)identifier;
+        return key < 0 || key >= tbl->_array.size() ? nullptr : &tbl->_array[key];
+    }
+    case TY_STRING:
+    {
+        const auto& it = tbl->_map.find((char*)identifier);
+        return it == tbl->_map.end() ? nullptr : &it->second;
+    }
+    }
 
-                const int exitRef = loop.endRef->ref + 1;
-                assert(guardNode);
-                Trace_PromoteGuard(vm, guardNode, vm->tt.curTrace->nodes[exitRef]);
-                vm->tt.curTrace->flags = SN_NEEDED;
+    return nullptr;
+}
 
-                // Complete tracing the loop and start a new trace.
-                vm->programInstruction = vm->programCounter;
-                Trace_Snap(vm);
-                Trace_Finalize(vm);
-                Trace_Start(vm);
-            }
-        }
-    }
+template<bool Verified>
+static void Op_TableUpdate(VirtualMachine* vm)
+{
+    // Applies an operator to an element of a table in place, looking the element up once.
+    const unsigned char op = vm->program[vm->programCounter++];
 
-    if (offset > 0 && branchDir && !vm->tracing && !vm->tracingPaused)
+    if (!CheckStack<Verified>(vm, 4))
     {
-        // Tracing startpoint. This may be loop exit or an jump
-        // within an if. We are not interested in the later, but it doesn't
-        // harm creating a trace starting there.
+        return;
+    }
 
-        vm->programInstruction = vm->programCounter;
-        Trace_Start(vm);
+    void* type = vm->stack.pop();
+    void* identifier = vm->stack.pop();
+    void* top = vm->stack.pop();
+    void* value = vm->stack.pop();
+
+    if (vm->mm.GetType(type) != TY_INT || vm->mm.GetType(top) != TY_TABLE)
+    {
+        vm->running = false;
+        vm->statusCode = VM_ERROR;
+        return;
     }
-}
 
-static void Op_Jump(VirtualMachine* vm)
-{
-    unsigned int pc = vm->programCounter;
-    const char type = Read_Byte(vm->program, &vm->programCounter);
-    const short offset = Read_Short(vm->program, &vm->programCounter);
-    bool branchDir = false;
+    void** slot = Table_Ref(reinterpret_cast<Table*>(top), type, identifier);
+    if (!slot)
+    {
+        vm->running = false;
+        vm->statusCode = VM_ERROR;
+        return;
+    }
 
-    switch (type)
+    const bool array = *(int*)type == TY_INT;
+    TraceNode* table = nullptr;
+    TraceNode* id = nullptr;
+    if (vm->tracing)
     {
-    case JUMP:
-        branchDir = true;
-        vm->programCounter += offset;
-        break;
-    case JUMP_E:
-        if (vm->comparer == 0)
-        {
-            branchDir = true;
-            vm->programCounter += offset;
-        }
-        break;
-    case JUMP_GE:
-        if (vm->comparer >= 0)
-        {
-            branchDir = true;
-            vm->programCounter += offset;
-        }
-        break;
-    case JUMP_LE:
-        if (vm->comparer <= 0)
-        {
-            branchDir = true;
-            vm->programCounter += offset;
-        }
-        break;
-    case JUMP_NE:
-        if (vm->comparer != 0)
-        {
-            branchDir = true;
-            vm->programCounter += offset;
-        }
-        break;
-    case JUMP_L:
-        if (vm->comparer < 0)
+        // Traced as a get, the operator and a set of the same reference.
+        // The get is traced with the value still below its operands.
+        const auto& refs = vm->tt.curTrace->refs;
+        id = refs.at(refs.size() - 2);
+        table = refs.at(refs.size() - 3);
+        if (array)
         {
-            branchDir = true;
-            vm->programCounter += offset;
+            Trace_TableAGet(vm, vm->mm.GetType(*slot));
         }
-        break;
-    case JUMP_G:
-        if (vm->comparer > 0)
+        else
         {
-            branchDir = true;
-            vm->programCounter += offset;
+            Trace_TableHGet(vm, vm->mm.GetType(*slot));
         }
-        break;
+
+        TraceNode* element = TTOP(vm);
+        TraceNode* rhs = TNEXT(vm);
+        TPOP2(vm);
+        TPUSH(vm, element);
+        TPUSH(vm, rhs);
     }
 
-    // Record branch stats
-    if (vm->frames.size() > 0)
+    vm->stack.push(*slot);
+    vm->stack.push(value);
+    Op_Operator<Verified>(op, vm);
+    if (vm->statusCode != VM_OK)
     {
-        const auto& frame = vm->frames[vm->frames.size()-1];
-#if DEBUG
-        RecordBranch(frame.func, pc, branchDir);
-#endif
+        return;
+    }
 
-        // Record a loop
-        if (offset < 0)
+    void* result = vm->stack.pop();
+    *slot = CopyToTable(vm, result);
+
+    if (vm->tracing)
+    {
+        Trace_TableRef(vm, table, id);
+        if (array)
         {
-#if DEBUG
-            RecordLoop(frame.func, vm->programCounter, offset);
-#endif
-            vm->program[vm->programCounter] |= MK_LOOPSTART;
+            Trace_TableASet(vm, vm->mm.GetType(result));
         }
-    }
-    else
-    {
-#if DEBUG
-        RecordBranch(vm->main, pc, branchDir);
-#endif
-
-        // Record a loop
-        if (offset < 0)
+        else
         {
-#if DEBUG
-            RecordLoop(vm->main, vm->programCounter, offset);
-#endif
-            vm->program[vm->programCounter] |= MK_LOOPSTART;
+            Trace_TableHSet(vm, vm->mm.GetType(result));
         }
     }
+}
 
-    if (vm->hot)
-    {
-        HotLoop(vm, type, pc, offset, branchDir);
-    }
+//===================
+// Math intrinsics
+//===================
+
+static constexpr std::array<unsigned char, MATH_COUNT> mathIntIR = {
+    IR_NOP, IR_NOP, IR_NOP, IR_ABS_INT, IR_NOP, IR_MIN_INT, IR_MAX_INT
+};
+
+static constexpr std::array<unsigned char, MATH_COUNT> mathRealIR = {
+    IR_SQRT_REAL, IR_SIN_REAL, IR_COS_REAL, IR_ABS_REAL, IR_FLOOR_REAL, IR_MIN_REAL, IR_MAX_REAL
+};
+
+static real Math_Number(void* data, unsigned char type)
+{
+    return type == TY_INT ? real(*reinterpret_cast<int*>(data)) : *reinterpret_cast<real*>(data);
 }
 
-static void Op_Compare(VirtualMachine* vm)
+template<bool Verified>
+static void Op_Math(VirtualMachine* vm)
 {
-    if (vm->stack.size() < 2)
+    // Built-in math functions, run without the overhead of calling out to a handler.
+    const unsigned char fn = vm->program[vm->programCounter++];
+    const int numArgs = MathArgCount(fn);
+
+    if (!CheckStack<Verified>(vm, numArgs))
     {
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
         return;
     }
 
-    void* item1 = vm->stack.top();
-    vm->stack.pop();
+    void* first = vm->stack.pop();
+    void* second = numArgs == 2 ? vm->stack.pop() : nullptr;
 
-    void* item2 = vm->stack.top();
-    vm->stack.pop();
+    const unsigned char firstType = vm->mm.GetType(first);
+    const unsigned char secondType = second ? vm->mm.GetType(second) : TY_VOID;
+    const unsigned char type = MathResultType(fn, firstType, secondType);
 
-    if (vm->mm.GetType(item1) == TY_INT && vm->mm.GetType(item2) == TY_INT)
-    {
-        vm->comparer = *reinterpret_cast<int*>(item2) - *reinterpret_cast<int*>(item1);
-        if (vm->tracing) { Trace_Cmp_Int(vm); }
-    }
-    else if (vm->mm.GetType(item1) == TY_STRING && vm->mm.GetType(item2) == TY_STRING)
-    {
-        vm->comparer = strcmp(reinterpret_cast<char*>(item2), reinterpret_cast<char*>(item1));
-        if (vm->tracing) { Trace_Cmp_String(vm); }
-    }
-    else if (vm->mm.GetType(item1) == TY_REAL && vm->mm.GetType(item2) == TY_REAL)
+    if (type == TY_INT)
     {
-        real cmp = *reinterpret_cast<real*>(item2) - *reinterpret_cast<real*>(item1);
-        if (cmp == 0.0 || std::isnan(cmp))
-        {
-            vm->comparer = 0;
-        }
-        else if (cmp < 0)
-        {
-            vm->comparer = -1;
-        }
-        else if (cmp > 0)
-        {
-            vm->comparer = 1;
-        }
-        else
+        const int a = *reinterpret_cast<int*>(first);
+        const int b = second ? *reinterpret_cast<int*>(second) : 0;
+
+        int result = a;
+        switch (fn)
         {
-            abort();
+        case MATH_ABS: result = a < 0 ? -a : a; break;
+        case MATH_MIN: result = a < b ? a : b; break;
+        case MATH_MAX: result = a > b ? a : b; break;
         }
 
-        if (vm->tracing) { Trace_Cmp_Real(vm); }
+        // Flooring an integer leaves the traced value as it is.
+        if (vm->tracing && mathIntIR[fn] != IR_NOP) { Trace_Math(vm, TY_INT, mathIntIR[fn], numArgs); }
+        Push_Int(vm, result);
     }
-    else if (vm->mm.GetType(item1) == TY_TABLE && vm->mm.GetType(item2) == TY_TABLE)
+    else if (type == TY_REAL)
     {
-        vm->comparer = int(reinterpret_cast<char*>(item2) - reinterpret_cast<char*>(item1));
+        const real a = Math_Number(first, firstType);
+        const real b = second ? Math_Number(second, secondType) : 0;
 
-        if (vm->tracing) { Trace_Cmp_Table(vm); }
+        real result = a;
+        switch (fn)
+        {
+        case MATH_SQRT: result = std::sqrt(a); break;
+        case MATH_SIN: result = std::sin(a); break;
+        case MATH_COS: result = std::cos(a); break;
+        case MATH_ABS: result = std::fabs(a); break;
+        case MATH_FLOOR: result = std::floor(a); break;
+        case MATH_MIN: result = a < b ? a : b; break;
+        case MATH_MAX: result = a > b ? a : b; break;
+        }
+
+        if (vm->tracing)
+        {
+            if (firstType == TY_INT) { Trace_Conv_Int_To_Real(vm, -1); }
+            if (secondType == TY_INT) { Trace_Conv_Int_To_Real(vm, -2); }
+            Trace_Math(vm, TY_REAL, mathRealIR[fn], numArgs);
+        }
+        Push_Real(vm, result);
     }
     else
     {
@@ -3002,190 +4580,187 @@ static void Op_Compare(VirtualMachine* vm)
     }
 }
 
-static void Op_TableNew(VirtualMachine* vm)
+//===================
+// Quickening
+//===================
+
+// Each arithmetic, compare and table instruction records the types of its operands
+// the first time it runs, in a side array indexed by pc so the program is never modified.
+// While the types stay the same the instruction runs a specialised form guarded on them,
+// otherwise it reverts to the generic handler for good.
+
+static unsigned char QuickOperands(VirtualMachine* vm, void* var1, void* var2)
 {
-    void* table = vm->mm.New(sizeof(Table), TY_TABLE);
-    void* ptr = new(table) Table;
-    vm->stack.push(ptr);
+    const unsigned char type = vm->mm.GetType(var1);
+    if (type == vm->mm.GetType(var2))
+    {
+        switch (type)
+        {
+        case TY_INT:
+            return QK_INT_INT;
+        case TY_REAL:
+            return QK_REAL_REAL;
+        }
+    }
 
-    if (vm->tracing) {
-        Trace_TableNew(vm);
+    return QK_GENERIC;
+}
+
+static unsigned char QuickTable(VirtualMachine* vm, void* type, void* table)
+{
+    if (vm->mm.GetType(type) == TY_INT && vm->mm.GetType(table) == TY_TABLE)
+    {
+        switch (*(int*)type)
+        {
+        case TY_INT:
+            return QK_ARRAY;
+        case TY_STRING:
+            return QK_HASH;
+        }
     }
+
+    return QK_GENERIC;
 }
 
-static void Op_TableGet(VirtualMachine* vm)
+static bool Quicken(VirtualMachine* vm, unsigned char form)
 {
-    if (vm->stack.size() < 3)
+    unsigned char& site = vm->quickened[vm->programInstruction];
+    if (site == QK_NONE)
     {
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
+        site = form;
+    }
+    else if (site != form)
+    {
+        site = QK_GENERIC;
+    }
+
+    return site == form && form != QK_GENERIC;
+}
+
+template<bool Verified>
+static void Op_Quick_Operator(unsigned char op, VirtualMachine* vm)
+{
+    if (vm->quickened[vm->programInstruction] == QK_GENERIC || (!Verified && vm->stack.size() < 2))
+    {
+        Op_Operator<Verified>(op, vm);
         return;
     }
 
-    void* type = vm->stack.top();
-    vm->stack.pop();
-    if (vm->mm.GetType(type) != TY_INT)
+    void* var1 = vm->stack.top();
+    void* var2 = vm->stack.peek(1);
+    const unsigned char form = QuickOperands(vm, var1, var2);
+    if (!Quicken(vm, form))
     {
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
+        Op_Operator<Verified>(op, vm);
         return;
     }
 
-    void* identifier = vm->stack.top();
     vm->stack.pop();
-
-    void* top = vm->stack.top();
     vm->stack.pop();
 
-    if (vm->mm.GetType(top) != TY_TABLE)
+    const unsigned char type = form == QK_INT_INT ? TY_INT : TY_REAL;
+    binaryHandlers[BinaryOperatorIndex(op)][type * NUM_OPERAND_TYPES + type](vm, var2, var1);
+}
+
+template<bool Verified>
+static void Op_Quick_Compare(VirtualMachine* vm)
+{
+    if (vm->quickened[vm->programInstruction] == QK_GENERIC || (!Verified && vm->stack.size() < 2))
     {
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
+        Op_Compare<Verified>(vm);
         return;
     }
 
-    Table* tbl = reinterpret_cast<Table*>(top);
-    switch (*(int*)type)
-    {
-    case TY_INT:
+    void* item1 = vm->stack.top();
+    void* item2 = vm->stack.peek(1);
+    const unsigned char form = QuickOperands(vm, item1, item2);
+    if (!Quicken(vm, form))
     {
-        const int key = *(int*)identifier;
-        if (key < 0 || key >= tbl->_array.size())
-        {
-            vm->running = false;
-            vm->statusCode = VM_ERROR;
-            return;
-        }
-
-        void* value = tbl->_array[key];
-        vm->stack.push(value);
-
-        if (vm->tracing) {
-            Trace_TableAGet(vm, vm->mm.GetType(value));
-        }
+        Op_Compare<Verified>(vm);
+        return;
     }
-        break;
-    case TY_STRING:
-    {
-        char* name = (char*)identifier;
-        const auto& it = tbl->_map.find(name);
-        if (it == tbl->_map.end())
-        {
-            vm->running = false;
-            vm->statusCode = VM_ERROR;
-            return;
-        }
 
-        vm->stack.push(it->second);
+    vm->stack.pop();
+    vm->stack.pop();
 
-        if (vm->tracing) {
-            Trace_TableHGet(vm, vm->mm.GetType(it->second));
-        }
-    }
-        break;
-    default:
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
-        break;
+    if (form == QK_INT_INT)
+    {
+        vm->comparer = *reinterpret_cast<int*>(item2) - *reinterpret_cast<int*>(item1);
+        if (vm->tracing) { Trace_Cmp_Int(vm); }
     }
-}
-
-static void* CopyToTable(VirtualMachine* vm, void* data)
-{
-    void* copy = nullptr;
-    const int type = vm->mm.GetType(data);
-    switch (type)
+    else
     {
-        case TY_INT:
-            copy = vm->mm.New(sizeof(int), TY_INT);
-            *(int*)copy = *(int*)data;
-            break;
-        case TY_REAL:
-            copy = vm->mm.New(sizeof(real), TY_REAL);
-            *(real*)copy = *(real*)data;
-            break;
-        default:
-            copy = data; // pass by value
-            break;
+        vm->comparer = Compare_Real(*reinterpret_cast<real*>(item2), *reinterpret_cast<real*>(item1));
+        if (vm->tracing) { Trace_Cmp_Real(vm); }
     }
-
-    return copy;
 }
 
-static void Op_TableSet(VirtualMachine* vm)
+template<bool Verified>
+static void Op_Quick_TableGet(VirtualMachine* vm)
 {
-    if (vm->stack.size() < 4)
+    if (vm->quickened[vm->programInstruction] == QK_GENERIC || (!Verified && vm->stack.size() < 3))
     {
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
+        Op_TableGet<Verified>(vm);
         return;
     }
 
-    void* type = vm->stack.top();
-    vm->stack.pop();
-    if (vm->mm.GetType(type) != TY_INT)
+    const unsigned char form = QuickTable(vm, vm->stack.top(), vm->stack.peek(2));
+    if (!Quicken(vm, form))
     {
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
+        Op_TableGet<Verified>(vm);
         return;
     }
 
-    void* identifier = vm->stack.top();
-    vm->stack.pop();
-
-    void* top = vm->stack.top();
     vm->stack.pop();
+    void* identifier = vm->stack.pop();
+    Table* tbl = reinterpret_cast<Table*>(vm->stack.pop());
 
-    void* next = vm->stack.top();
-    vm->stack.pop();
+    if (form == QK_ARRAY)
+    {
+        Table_AGet(vm, tbl, identifier);
+    }
+    else
+    {
+        Table_HGet(vm, tbl, identifier);
+    }
+}
 
-    if (vm->mm.GetType(top) != TY_TABLE)
+template<bool Verified>
+static void Op_Quick_TableSet(VirtualMachine* vm)
+{
+    if (vm->quickened[vm->programInstruction] == QK_GENERIC || (!Verified && vm->stack.size() < 4))
     {
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
+        Op_TableSet<Verified>(vm);
         return;
     }
-    
-    Table* tbl = reinterpret_cast<Table*>(top);
-    switch (*(int*)type)
-    {
-    case TY_STRING:
+
+    const unsigned char form = QuickTable(vm, vm->stack.top(), vm->stack.peek(2));
+    if (!Quicken(vm, form))
     {
-        const char* name = (char*)identifier;
-        tbl->_map[name] = CopyToTable(vm, next);
-    
-        if (vm->tracing) {
-            Trace_TableHSet(vm, vm->mm.GetType(next));
-        }
+        Op_TableSet<Verified>(vm);
+        return;
     }
-        break;
-    case TY_INT:
+
+    vm->stack.pop();
+    void* identifier = vm->stack.pop();
+    Table* tbl = reinterpret_cast<Table*>(vm->stack.pop());
+    void* next = vm->stack.pop();
+
+    if (form == QK_ARRAY)
     {
-        const int key = *(int*)identifier;
-        if (key >= tbl->_array.size())
-        {
-            tbl->_array.resize(key + 1);
-        }
-        tbl->_array[key] = CopyToTable(vm, next);
-    
-        if (vm->tracing) {
-            Trace_TableASet(vm, vm->mm.GetType(next));
-        }
+        Table_ASet(vm, tbl, identifier, next);
     }
-        break;
-    default:
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
-        break;
+    else
+    {
+        Table_HSet(vm, tbl, identifier, next);
     }
 }
 
+template<bool Verified>
 static void Op_Dup(VirtualMachine* vm)
 {
-    if (vm->stack.size() < 1)
+    if (!CheckStack<Verified>(vm, 1))
     {
-        vm->running = false;
-        vm->statusCode = VM_ERROR;
         return;
     }
 
@@ -3213,6 +4788,18 @@ static void Op_Push_Func(VirtualMachine* vm)
 
 static void ResetVM(VirtualMachine* vm)
 {
+    if (vm->loopTrace != -1 && vm->tracing)
+    {
+        // The last run ended while a hot loop was being traced.
+        Trace_Abort(vm);
+        HotLoopCool(vm, vm->loopTrace);
+    }
+    else if (SideTracing(vm))
+    {
+        // The last run ended before the side trace got back to the loop.
+        SideTraceAbort(vm);
+    }
+
     vm->mm.Reset();
     vm->programCounter = 0;
     vm->tracing = false;
@@ -3228,6 +4815,48 @@ static void ResetVM(VirtualMachine* vm)
     while (!vm->stack.empty()) { vm->stack.pop(); }
     vm->frames.clear();
     vm->locals.clear();
+    vm->loopCounters.clear();
+    vm->loopHeader = -1;
+    vm->loopTrace = -1;
+    for (auto& blk : vm->blocks) { blk.info.calls = 0; }
+}
+
+static void LoadConstants(VirtualMachine* vm, unsigned char* program)
+{
+    // Each constant is boxed once and pinned, so it survives the memory being reset between runs
+    // and every execution of OP_PUSH_CONST can push the same value.
+    vm->constants.clear();
+    const int numConstants = Read_Int(program, &vm->programCounter);
+    for (int i = 0; i < numConstants; i++)
+    {
+        void* data = nullptr;
+        switch (program[vm->programCounter++])
+        {
+        case TY_INT:
+            data = vm->mm.New(sizeof(int), TY_INT);
+            *reinterpret_cast<int*>(data) = Read_Int(program, &vm->programCounter);
+            break;
+        case TY_REAL:
+            data = vm->mm.New(sizeof(real), TY_REAL);
+            *reinterpret_cast<real*>(data) = Read_Real(program, &vm->programCounter);
+            break;
+        case TY_STRING:
+        {
+            const char* str = Read_String(program, &vm->programCounter);
+            data = vm->mm.New(strlen(str) + 1, TY_STRING);
+            std::memcpy(data, str, strlen(str) + 1);
+        }
+            break;
+        }
+
+        if (!data)
+        {
+            break;
+        }
+        vm->constants.push_back(data);
+    }
+
+    vm->mm.Pin();
 }
 
 static void ScanFunctions(VirtualMachine* vm, unsigned char* program)
@@ -3279,30 +4908,184 @@ static void ScanFunctions(VirtualMachine* vm, unsigned char* program)
         entry.name = name;
     }
 
-    vm->programOffset = vm->programCounter;
+    vm->constantsOffset = vm->programCounter;
+    LoadConstants(vm, program);
+
+    vm->programOffset = vm->programCounter;
+}
+
+static void ScanDebugData(VirtualMachine* vm, unsigned char* debugData)
+{
+    if (debugData)
+    {
+        unsigned int size = 0;
+        for (auto& function : vm->blocks)
+        {
+            size += function.info.size;
+        }
+
+        vm->debugLines = new int[size];
+        std::memset(vm->debugLines, 0, size);
+
+        unsigned int pos = 0;
+        const int numLines = Read_Int(debugData, &pos);
+        for (int i = 0; i < numLines; i++)
+        {
+            const int pc = Read_Int(debugData, &pos);
+            const int line = Read_Int(debugData, &pos);
+            vm->debugLines[pc] = line;
+        }
+
+        const int numSites = Read_Int(debugData, &pos);
+        for (int i = 0; i < numSites; i++)
+        {
+            BranchSite& site = vm->branchSites.emplace_back();
+            site.pc = Read_Int(debugData, &pos);
+            site.site = Read_Int(debugData, &pos);
+            site.sense = Read_Byte(debugData, &pos) != 0;
+        }
+    }
+}
+
+static int InstructionSize(const unsigned char* data, int dataSize, int pos)
+{
+    const auto stringSize = [data, dataSize](int start) -> int
+    {
+        for (int i = start; i < dataSize; i++)
+        {
+            if (data[i] == 0) { return i - start + 1; }
+        }
+        return -1;
+    };
+
+    const auto valueSize = [&data, &stringSize](int start) -> int
+    {
+        switch (data[start])
+        {
+        case TY_INT:
+            return 1 + int(sizeof(int));
+        case TY_REAL:
+            return 1 + SUN_REAL_SIZE;
+        case TY_STRING:
+        {
+            const int size = stringSize(start + 1);
+            return size == -1 ? -1 : size + 1;
+        }
+        }
+        return -1;
+    };
+
+    int size = -1;
+    switch (data[pos] & ~MK_LOOPSTART)
+    {
+    case OP_PUSH:
+        size = pos + 1 < dataSize ? valueSize(pos + 1) + 1 : -1;
+        break;
+    case OP_SET:
+        size = pos + 2 < dataSize ? valueSize(pos + 1) + 2 : -1;
+        break;
+    case OP_POP:
+    case OP_PUSH_LOCAL:
+    case OP_CALLO:
+    case OP_CALLM:
+    case OP_TABLE_UPDATE:
+    case OP_MATH:
+        size = 2;
+        break;
+    case OP_JUMP:
+        size = 4;
+        break;
+    case OP_JUMP_TABLE:
+        size = pos + 7 < dataSize ? 10 + 2 * (data[pos + 6] | (data[pos + 7] << 8)) : -1;
+        break;
+    case OP_JUMP_SEARCH:
+        size = pos + 3 < dataSize ? 6 + 6 * (data[pos + 2] | (data[pos + 3] << 8)) : -1;
+        break;
+    case OP_PUSH_FUNC:
+    case OP_PUSH_CONST:
+        size = 5;
+        break;
+    case OP_CALL:
+    case OP_CALLD:
+    case OP_TAILCALL:
+    case OP_YIELD:
+        size = 6;
+        break;
+    case OP_DONE:
+    case OP_RETURN:
+    case OP_TABLE_NEW:
+    case OP_TABLE_GET:
+    case OP_TABLE_SET:
+    case OP_UNARY_MINUS:
+    case OP_INCREMENT:
+    case OP_DECREMENT:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_DUP:
+    case OP_FORMAT:
+    case OP_CMP:
+    case OP_ADD_II:
+    case OP_ADD_RR:
+    case OP_CMP_II:
+    case OP_INC_I:
+        size = 1;
+        break;
+    }
+
+    return size > 0 && pos + size <= dataSize ? size : -1;
 }
 
-static void ScanDebugData(VirtualMachine* vm, unsigned char* debugData)
+static void HashFunctions(VirtualMachine* vm)
 {
-    if (debugData)
+    // FNV-1a over the bytecode and the signature of each function.
+    // Constants are hashed by value as their index in the pool depends on the rest of the program.
+    for (auto& blk : vm->blocks)
     {
-        unsigned int size = 0;
-        for (auto& function : vm->blocks)
+        uint64_t hash = 14695981039346656037ULL;
+        const auto mix = [&hash](const void* data, size_t size)
         {
-            size += function.info.size;
-        }
-
-        vm->debugLines = new int[size];
-        std::memset(vm->debugLines, 0, size);
+            const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+            for (size_t i = 0; i < size; i++)
+            {
+                hash = (hash ^ bytes[i]) * 1099511628211ULL;
+            }
+        };
 
-        unsigned int pos = 0;
-        const int numLines = Read_Int(debugData, &pos);
-        for (int i = 0; i < numLines; i++)
+        const unsigned char* code = vm->program + vm->programOffset + blk.info.pc;
+        const int size = int(blk.info.size);
+        int pos = 0;
+        while (pos < size)
         {
-            const int pc = Read_Int(debugData, &pos);
-            const int line = Read_Int(debugData, &pos);
-            vm->debugLines[pc] = line;
+            const int insSize = InstructionSize(code, size, pos);
+            if (insSize == -1)
+            {
+                mix(code + pos, size - pos);
+                break;
+            }
+
+            unsigned int index = pos + 1;
+            const int id = code[pos] == OP_PUSH_CONST ? Read_Int(const_cast<unsigned char*>(code), &index) : -1;
+            if (id >= 0 && id < int(vm->constants.size()))
+            {
+                void* value = vm->constants[id];
+                const char type = vm->mm.GetType(value);
+                mix(&code[pos], 1);
+                mix(&type, 1);
+                mix(value, type == TY_STRING ? strlen(reinterpret_cast<char*>(value)) + 1 : type == TY_INT ? sizeof(int) : sizeof(real));
+            }
+            else
+            {
+                mix(code + pos, insSize);
+            }
+            pos += insSize;
         }
+        mix(&blk.numArgs, sizeof(blk.numArgs));
+        for (auto& param : blk.info.parameters) { mix(param.c_str(), param.size() + 1); }
+        for (auto& local : blk.info.locals) { mix(local.c_str(), local.size() + 1); }
+
+        blk.info.hash = hash;
     }
 }
 
@@ -3331,7 +5114,29 @@ inline static void CheckForTimeout(VirtualMachine* vm)
 
 static void LoopStart(VirtualMachine* vm)
 {
-    if (vm->tracing)
+    if (SideTracing(vm))
+    {
+        if (int(vm->programInstruction) != vm->tt.curTrace->outer)
+        {
+            // A loop on the path is traced on its own.
+            SideTraceAbort(vm);
+        }
+        return;
+    }
+
+    if (!vm->tracing && !vm->hot && vm->loopTrace == int(vm->programInstruction))
+    {
+        // The loop became hot during this run, trace it from here.
+        vm->hot = true;
+        Trace_Start(vm);
+        if (!vm->tracing)
+        {
+            Trace_Abort(vm);
+            HotLoopCool(vm, int(vm->programInstruction));
+            return;
+        }
+    }
+    else if (vm->tracing)
     {
         if (vm->tt.curTrace->loop.active)
         {
@@ -3347,7 +5152,10 @@ static void LoopStart(VirtualMachine* vm)
             Trace_Finalize(vm);
             Trace_Start(vm);
         }
+    }
 
+    if (vm->tracing)
+    {
         Trace_LoopStart(vm);
 
         auto& pt = vm->tt.curTrace->loop;
@@ -3367,26 +5175,62 @@ static void LoopStart(VirtualMachine* vm)
     }
 }
 
-static void ExecuteTrace(VirtualMachine* vm)
+static bool ExecuteTrace(VirtualMachine* vm)
 {
-    for (int i = 0; i < vm->tt.numTraces; i++)
+    const int slot = vm->tt.entries[vm->programInstruction];
+    if (slot == -1)
     {
-        Trace* trace = &vm->tt.traces[i];
-        if (trace->pc == vm->programInstruction)
-        {
-            ActivationRecord record(int(vm->locals.size()), &vm->mm);
-            for (size_t i = 0; i < vm->locals.size(); i++)
-            {
-                record.Add(int(i), vm->mm.GetTypeUnsafe(vm->locals[i]), vm->locals[i]);
-            }
-            unsigned char* buffer = record.GetBuffer();
+        return false;
+    }
 
-            vm->tt.curTrace = trace;
+    Trace* trace = vm->tt.traces[slot].get();
+    if (int(vm->frames.size()) != trace->depth || vm->localBounds != trace->localBounds ||
+        int(vm->stack.size()) != trace->stackSize)
+    {
+        // The trace started in a function called from somewhere else, its locals and frames are elsewhere.
+        return false;
+    }
 
-            const int state = vm->jit.jit_execute(vm->jit_instance, trace->jit_trace, buffer);
-            break;
-        }
+    if (SideTracing(vm) && slot == vm->tt.curTrace->parent)
+    {
+        // The path went around the enclosing loop and runs the loop again.
+        SideTraceClose(vm);
+    }
+    else if (SideTracing(vm))
+    {
+        // The path runs into another trace.
+        SideTraceAbort(vm);
+    }
+    else if (vm->tracing)
+    {
+        // The trace being recorded follows the path through the instructions instead.
+        return false;
+    }
+
+    trace->lastUsed = ++vm->tt.clock;
+
+    ActivationRecord record(int(vm->locals.size()), &vm->mm);
+    for (size_t i = 0; i < vm->locals.size(); i++)
+    {
+        record.Add(int(i), vm->mm.GetTypeUnsafe(vm->locals[i]), vm->locals[i]);
+    }
+    unsigned char* buffer = record.GetBuffer();
+
+    vm->tt.curTrace = trace;
+    vm->tt.record = buffer;
+    vm->tt.recordSize = int(vm->locals.size());
+    vm->tt.linked = false;
+
+    const int state = vm->jit.jit_execute(vm->jit_instance, trace->jit_trace, buffer);
+
+    vm->tt.record = nullptr;
+    vm->tt.linked = false;
+    if (vm->tt.sideExit != -1)
+    {
+        SideTraceStart(vm);
     }
+
+    return true;
 }
 
 static void CheckBuildFlags(VirtualMachine* vm)
@@ -3406,11 +5250,36 @@ static void CheckBuildFlags(VirtualMachine* vm)
 #endif
 }
 
-static int ResumeScript2(VirtualMachine* vm)
+static bool DepthVerified(VirtualMachine* vm)
 {
-    StartVM(vm);
-    CheckBuildFlags(vm);
+    // Checks the stack holds at least as many values as the verifier assumed for the current
+    // instruction, and for each caller once the function it called has returned.
+    const auto& depths = vm->stackDepths;
+    if (vm->programCounter >= depths.size() ||
+        int(vm->stack.size()) - vm->stackBounds < depths[vm->programCounter])
+    {
+        return false;
+    }
+
+    int bounds = vm->stackBounds;
+    bool discard = vm->discard;
+    for (auto it = vm->frames.rbegin(); it != vm->frames.rend(); ++it)
+    {
+        const int returned = !discard && it->func->returnsValue ? 1 : 0;
+        if (size_t(it->returnAddress) >= depths.size() || bounds - it->stackBounds + returned < depths[it->returnAddress])
+        {
+            return false;
+        }
+        bounds = it->stackBounds;
+        discard = it->discard;
+    }
 
+    return true;
+}
+
+template<bool Verified>
+static void Interpret(VirtualMachine* vm)
+{
     while (vm->running)
     {
         //const auto& lineIt = vm->debugLines.find(vm->programCounter - vm->programOffset);
@@ -3432,31 +5301,42 @@ static int ResumeScript2(VirtualMachine* vm)
             Op_Push(vm);
             break;
         case OP_PUSH_LOCAL:
-            Op_Push_Local(vm);
+            Op_Push_Local<Verified>(vm);
+            break;
+        case OP_PUSH_CONST:
+            Op_Push_Const<Verified>(vm);
             break;
         case OP_SET:
             Op_Set(vm);
             break;
         case OP_DUP:
-            Op_Dup(vm);
+            Op_Dup<Verified>(vm);
             break;
         case OP_POP:
-            Op_Pop(vm);
+            Op_Pop<Verified>(vm);
             break;
         case OP_PUSH_FUNC:
             Op_Push_Func(vm);
             break;
         case OP_CALL:
-            Op_Call(vm, false);
+            Op_Call<Verified>(vm, false);
             break;
         case OP_CALLD:
-            OP_CallD(vm);
+            OP_CallD<Verified>(vm);
             break;
         case OP_CALLO:
-            OP_CallO(vm, false);
+            OP_CallO<Verified>(vm, false);
+            if (Verified && !DepthVerified(vm))
+            {
+                // The function called doesn't return a value on every path.
+                return;
+            }
             break;
         case OP_CALLM:
-            OP_CallO(vm, true);
+            OP_CallO<Verified>(vm, true);
+            break;
+        case OP_TAILCALL:
+            Op_TailCall<Verified>(vm);
             break;
         case OP_DONE:
             if (vm->statusCode == VM_OK)
@@ -3473,28 +5353,40 @@ static int ResumeScript2(VirtualMachine* vm)
             Op_Yield(vm);
             break;
         case OP_CMP:
-            Op_Compare(vm);
+            Op_Quick_Compare<Verified>(vm);
             break;
         case OP_JUMP:
             Op_Jump(vm);
             break;
+        case OP_JUMP_TABLE:
+            Op_Jump_Table<Verified>(vm);
+            break;
+        case OP_JUMP_SEARCH:
+            Op_Jump_Search<Verified>(vm);
+            break;
         case OP_TABLE_NEW:
             Op_TableNew(vm);
             break;
         case OP_TABLE_GET:
-            Op_TableGet(vm);
+            Op_Quick_TableGet<Verified>(vm);
             break;
         case OP_TABLE_SET:
-            Op_TableSet(vm);
+            Op_Quick_TableSet<Verified>(vm);
+            break;
+        case OP_TABLE_UPDATE:
+            Op_TableUpdate<Verified>(vm);
+            break;
+        case OP_MATH:
+            Op_Math<Verified>(vm);
             break;
         case OP_ADD:
         case OP_SUB:
         case OP_MUL:
         case OP_DIV:
-            Op_Operator(op, vm);
+            Op_Quick_Operator<Verified>(op, vm);
             break;
         case OP_UNARY_MINUS:
-            Op_Unary_Minus(vm);
+            Op_Unary_Minus<Verified>(vm);
             break;
         //case OP_FORMAT:
         //    Op_Format(vm);
@@ -3503,56 +5395,455 @@ static int ResumeScript2(VirtualMachine* vm)
             Op_Return(vm);
             break;
         case OP_INCREMENT:
-            Op_Increment(vm);
+            Op_Increment<Verified>(vm);
             break;
         case OP_DECREMENT:
-            Op_Decrement(vm);
+            Op_Decrement<Verified>(vm);
+            break;
+        case OP_ADD_II:
+            Op_Add_II(vm);
+            break;
+        case OP_ADD_RR:
+            Op_Add_RR(vm);
+            break;
+        case OP_CMP_II:
+            Op_Compare_II(vm);
+            break;
+        case OP_INC_I:
+            Op_Increment_I(vm);
             break;
         case OP_LSADD:
         case OP_LSSUB:
         case OP_LSMUL:
         case OP_LSDIV:
             LoopStart(vm);
-            Op_Operator(op, vm);
+            Op_Quick_Operator<Verified>(op & ~MK_LOOPSTART, vm);
             break;
         case OP_LSCALL:
             LoopStart(vm);
-            Op_Call(vm, false);
+            Op_Call<Verified>(vm, false);
             break;
         case OP_LSSET:
             LoopStart(vm);
             Op_Set(vm);
             break;
-        case OP_LSPOP:
-            LoopStart(vm);
-            Op_Pop(vm);
+        case OP_LSPOP:
+            LoopStart(vm);
+            Op_Pop<Verified>(vm);
+            break;
+        case OP_LSPUSH:
+            LoopStart(vm);
+            Op_Push(vm);
+            break;
+        case OP_LSPUSH_LOCAL:
+            LoopStart(vm);
+            Op_Push_Local<Verified>(vm);
+            break;
+        case OP_LSPUSH_CONST:
+            LoopStart(vm);
+            Op_Push_Const<Verified>(vm);
+            break;
+        case OP_LSYIELD:
+            LoopStart(vm);
+            Op_Yield(vm);
+            break;
+        case OP_TRPUSH:
+        case OP_TRPUSH_LOCAL:
+        case OP_TRPUSH_CONST:
+        case OP_TRTABLE_NEW:
+            if (!ExecuteTrace(vm))
+            {
+                // Run the instruction the trace's entry replaced.
+                switch (op)
+                {
+                case OP_TRPUSH: Op_Push(vm); break;
+                case OP_TRPUSH_LOCAL: Op_Push_Local<Verified>(vm); break;
+                case OP_TRPUSH_CONST: Op_Push_Const<Verified>(vm); break;
+                case OP_TRTABLE_NEW: Op_TableNew(vm); break;
+                }
+            }
+            else if (Verified && !DepthVerified(vm))
+            {
+                // The trace exited somewhere the verified depths don't hold.
+                return;
+            }
+            break;
+        default:
+            abort();
+        }
+
+        vm->instructionsExecuted++;
+        CheckForTimeout(vm);
+    }
+}
+
+static int ResumeScript2(VirtualMachine* vm)
+{
+    StartVM(vm);
+    CheckBuildFlags(vm);
+
+    if (vm->verified && DepthVerified(vm))
+    {
+        Interpret<true>(vm);
+    }
+    Interpret<false>(vm);
+
+    return vm->statusCode;
+}
+
+//===================
+// Verifier
+//===================
+
+// Each block is checked once when the program is loaded. Malformed code, such as an operand out of
+// range or a jump into the middle of an instruction, fails the load. Then the least stack depth at each
+// instruction is found, and if every instruction is proven to have its operands the interpreter runs
+// without its stack and index checks. Types are only known at run time so they are still checked.
+
+static bool VerifyBlock(VirtualMachine* vm, int index, const std::vector<bool>& returnsValue, bool* returns, bool* verified)
+{
+    const Block& blk = vm->blocks[index];
+    const unsigned int start = vm->programOffset + blk.info.pc;
+    const int size = int(blk.info.size);
+    unsigned char* code = vm->program + start;
+    const int numLocals = blk.numArgs + int(blk.info.locals.size());
+    const int numFunctions = int(vm->functions.size());
+
+    const auto readInt = [code](int pos) -> int
+    {
+        unsigned int pc = pos;
+        return Read_Int(code, &pc);
+    };
+
+    const auto jumpTarget = [code](int pos) -> int
+    {
+        unsigned int pc = pos + 2;
+        return pos + 4 + Read_Short(code, &pc);
+    };
+
+    const auto tableTarget = [code](int entry) -> int
+    {
+        unsigned int pc = entry;
+        return entry + 2 + Read_Short(code, &pc);
+    };
+
+    // Decode the instructions and check their operands.
+    std::vector<bool> boundary(size, false);
+    std::vector<int> targets;
+    int pos = 0;
+    while (pos < size)
+    {
+        const int insSize = InstructionSize(code, size, pos);
+        if (insSize == -1 || (code[pos] & (MK_LOOPSTART | MK_TRACESTART)))
+        {
+            return false;
+        }
+
+        boundary[pos] = true;
+
+        switch (code[pos])
+        {
+        case OP_FORMAT:
+            return false;
+        case OP_PUSH_LOCAL:
+        case OP_POP:
+            if (code[pos + 1] >= numLocals) { return false; }
+            break;
+        case OP_SET:
+            if (code[pos + 2] >= numLocals) { return false; }
+            break;
+        case OP_TABLE_UPDATE:
+            if (code[pos + 1] != OP_ADD && code[pos + 1] != OP_SUB &&
+                code[pos + 1] != OP_MUL && code[pos + 1] != OP_DIV) { return false; }
+            break;
+        case OP_MATH:
+            if (code[pos + 1] >= MATH_COUNT) { return false; }
+            break;
+        case OP_PUSH_CONST:
+        {
+            const int id = readInt(pos + 1);
+            if (id < 0 || id >= int(vm->constants.size())) { return false; }
+        }
+            break;
+        case OP_PUSH_FUNC:
+        {
+            const int id = readInt(pos + 1);
+            if (id < 0 || id >= numFunctions) { return false; }
+        }
+            break;
+        case OP_CALL:
+        case OP_CALLD:
+        case OP_TAILCALL:
+        case OP_YIELD:
+        {
+            const int id = readInt(pos + 2);
+            if (id < 0 || id >= numFunctions) { return false; }
+        }
+            break;
+        case OP_JUMP:
+            if (code[pos + 1] > JUMP_G) { return false; }
+            targets.push_back(jumpTarget(pos));
+            break;
+        case OP_JUMP_TABLE:
+            if (code[pos + 1] >= numLocals) { return false; }
+            for (int entry = pos + 8; entry < pos + insSize; entry += 2)
+            {
+                targets.push_back(tableTarget(entry));
+            }
+            break;
+        case OP_JUMP_SEARCH:
+            if (code[pos + 1] >= numLocals) { return false; }
+            targets.push_back(tableTarget(pos + 4));
+            for (int entry = pos + 10; entry < pos + insSize; entry += 6)
+            {
+                // The keys must be sorted for the search.
+                if (entry > pos + 10 && readInt(entry - 10) >= readInt(entry - 4)) { return false; }
+                targets.push_back(tableTarget(entry));
+            }
+            break;
+        }
+
+        pos += insSize;
+    }
+
+    for (const int target : targets)
+    {
+        if (target < 0 || target >= size || !boundary[target])
+        {
+            return false;
+        }
+    }
+
+    // Find the least stack depth at each instruction, merging the paths which meet.
+    std::vector<int> depths(size, -1);
+    std::vector<int> work;
+    const auto flow = [&depths, &work](int target, int depth)
+    {
+        if (depths[target] == -1 || depth < depths[target])
+        {
+            depths[target] = depth;
+            work.push_back(target);
+        }
+    };
+
+    if (size > 0)
+    {
+        flow(0, blk.numArgs);
+    }
+    else
+    {
+        *verified = false;
+    }
+
+    while (!work.empty() && *verified)
+    {
+        pos = work.back();
+        work.pop_back();
+
+        int pops = 0;
+        int pushes = 0;
+        bool next = true;
+        switch (code[pos])
+        {
+        case OP_PUSH:
+        case OP_PUSH_LOCAL:
+        case OP_PUSH_CONST:
+        case OP_PUSH_FUNC:
+        case OP_SET:
+        case OP_TABLE_NEW:
+            pushes = 1;
+            break;
+        case OP_POP:
+            pops = 1;
+            break;
+        case OP_DUP:
+            pops = 1;
+            pushes = 2;
+            break;
+        case OP_UNARY_MINUS:
+        case OP_INCREMENT:
+        case OP_DECREMENT:
+        case OP_INC_I:
+            pops = 1;
+            pushes = 1;
+            break;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_ADD_II:
+        case OP_ADD_RR:
+            pops = 2;
+            pushes = 1;
+            break;
+        case OP_CMP:
+        case OP_CMP_II:
+            pops = 2;
+            break;
+        case OP_TABLE_GET:
+            pops = 3;
+            pushes = 1;
+            break;
+        case OP_TABLE_SET:
+        case OP_TABLE_UPDATE:
+            pops = 4;
+            break;
+        case OP_MATH:
+            pops = MathArgCount(code[pos + 1]);
+            pushes = 1;
+            break;
+        case OP_CALL:
+        case OP_CALLD:
+        case OP_TAILCALL:
+        case OP_YIELD:
+        {
+            const Function& func = vm->functions[readInt(pos + 2)];
+            const bool script = func.blk != -1 && code[pos] != OP_YIELD;
+            if (script && vm->blocks[func.blk].numArgs != code[pos + 1])
+            {
+                *verified = false;
+            }
+
+            // Handlers always return a value, functions only when every path does.
+            const bool value = !script || returnsValue[func.blk];
+            pops = code[pos + 1];
+            pushes = code[pos] == OP_CALL && value ? 1 : 0;
+
+            if (code[pos] == OP_TAILCALL)
+            {
+                *returns = *returns && value;
+                next = false;
+            }
+        }
+            break;
+        case OP_CALLO:
+        case OP_CALLM:
+            // The function isn't known until it is called, so the interpreter checks it returns
+            // a value then instead.
+            pops = code[pos + 1] + 1;
+            pushes = code[pos] == OP_CALLO ? 1 : 0;
+            break;
+        case OP_JUMP:
+            next = code[pos + 1] != JUMP;
             break;
-        case OP_LSPUSH:
-            LoopStart(vm);
-            Op_Push(vm);
+        case OP_JUMP_TABLE:
+        case OP_JUMP_SEARCH:
+            next = false;
             break;
-        case OP_LSPUSH_LOCAL:
-            LoopStart(vm);
-            Op_Push_Local(vm);
+        case OP_RETURN:
+            *returns = *returns && depths[pos] >= 1;
+            next = false;
             break;
-        case OP_LSYIELD:
-            LoopStart(vm);
-            Op_Yield(vm);
+        case OP_DONE:
+            next = false;
             break;
-        case OP_TRPUSH:
-        case OP_TRPUSH_LOCAL:
-        case OP_TRTABLE_NEW:
-            ExecuteTrace(vm);
+        }
+
+        if (depths[pos] < pops)
+        {
+            *verified = false;
             break;
-        default:
-            abort();
         }
 
-        vm->instructionsExecuted++;
-        CheckForTimeout(vm);
+        const int depth = depths[pos] - pops + pushes;
+        if (code[pos] == OP_JUMP)
+        {
+            flow(jumpTarget(pos), depth);
+        }
+        else if (code[pos] == OP_JUMP_TABLE)
+        {
+            const int end = pos + InstructionSize(code, size, pos);
+            for (int entry = pos + 8; entry < end; entry += 2)
+            {
+                flow(tableTarget(entry), depth);
+            }
+        }
+        else if (code[pos] == OP_JUMP_SEARCH)
+        {
+            const int end = pos + InstructionSize(code, size, pos);
+            flow(tableTarget(pos + 4), depth);
+            for (int entry = pos + 10; entry < end; entry += 6)
+            {
+                flow(tableTarget(entry), depth);
+            }
+        }
+
+        if (next)
+        {
+            const int following = pos + InstructionSize(code, size, pos);
+            if (following >= size)
+            {
+                // Falls off the end of the block.
+                *verified = false;
+                break;
+            }
+            flow(following, depth);
+        }
     }
 
-    return vm->statusCode;
+    for (int i = 0; i < size; i++)
+    {
+        vm->stackDepths[start + i] = depths[i] == -1 ? std::numeric_limits<int>::max() : depths[i];
+    }
+
+    return true;
+}
+
+static bool VerifyProgram(VirtualMachine* vm, int programSize)
+{
+    vm->verified = false;
+    vm->stackDepths.assign(programSize, std::numeric_limits<int>::max());
+
+    for (const auto& func : vm->functions)
+    {
+        if (func.blk < -1 || func.blk >= int(vm->blocks.size()))
+        {
+            return false;
+        }
+    }
+
+    for (const auto& blk : vm->blocks)
+    {
+        if (blk.numArgs < 0 || uint64_t(vm->programOffset) + blk.info.pc + blk.info.size > uint64_t(programSize))
+        {
+            return false;
+        }
+    }
+
+    // Whether each function returns a value depends on the functions it tail calls,
+    // so start by assuming they all do and repeat until nothing changes.
+    std::vector<bool> returnsValue(vm->blocks.size(), true);
+    bool changed = true;
+    bool verified = true;
+    while (changed)
+    {
+        changed = false;
+        verified = true;
+        for (int i = 0; i < int(vm->blocks.size()); i++)
+        {
+            bool returns = true;
+            if (!VerifyBlock(vm, i, returnsValue, &returns, &verified))
+            {
+                return false;
+            }
+
+            if (returnsValue[i] && !returns)
+            {
+                returnsValue[i] = false;
+                changed = true;
+            }
+        }
+
+        changed = changed && verified;
+    }
+
+    for (size_t i = 0; i < vm->blocks.size(); i++)
+    {
+        vm->blocks[i].info.returnsValue = returnsValue[i];
+    }
+
+    vm->verified = verified;
+    return true;
 }
 
 int SunScript::RunScript(VirtualMachine* vm)
@@ -3562,15 +5853,26 @@ int SunScript::RunScript(VirtualMachine* vm)
 
 int SunScript::LoadProgram(VirtualMachine* vm, unsigned char* program, unsigned char* debugData, int programSize)
 {
+    Compiler_Drain(vm);
     delete[] vm->program;
 
     vm->program = new unsigned char[programSize];
     std::memcpy(vm->program, program, programSize);
+    vm->quickened.assign(programSize, QK_NONE);
     vm->blocks.clear();
     vm->functions.clear();
+    vm->mm.Unpin();
+    vm->mm.Reset();
     delete[] vm->debugLines;
+    vm->branchSites.clear();
+    vm->programCounter = 0;
     ScanFunctions(vm, program);
     ScanDebugData(vm, debugData);
+    HashFunctions(vm);
+    vm->branchCounts.assign(programSize - vm->programOffset, BranchCount());
+    vm->coldLoops.clear();
+    vm->tt.entries.assign(programSize, -1);
+    Trace_ReleaseAll(vm);
 
     FunctionInfo* info = nullptr;
     for (int i = 0; i < vm->blocks.size(); i++)
@@ -3582,7 +5884,7 @@ int SunScript::LoadProgram(VirtualMachine* vm, unsigned char* program, unsigned
         }
     }
 
-    if (!info)
+    if (!info || !VerifyProgram(vm, programSize))
     {
         return VM_ERROR;
     }
@@ -3597,16 +5899,336 @@ int SunScript::LoadProgram(VirtualMachine* vm, unsigned char* program, int size)
     return LoadProgram(vm, program, nullptr, size);
 }
 
+int SunScript::GetBranchProfile(VirtualMachine* vm, std::vector<BranchProfile>* profile)
+{
+    if (!vm->program)
+    {
+        return VM_ERROR;
+    }
+
+    for (const BranchSite& site : vm->branchSites)
+    {
+        const auto& block = std::find_if(vm->blocks.begin(), vm->blocks.end(), [&site](const Block& blk)
+            {
+                return unsigned(site.pc) >= blk.info.pc && unsigned(site.pc) < blk.info.pc + blk.info.size;
+            });
+        if (block == vm->blocks.end() || unsigned(site.pc) >= vm->branchCounts.size())
+        {
+            continue;
+        }
+
+        const BranchCount& count = vm->branchCounts[site.pc];
+        BranchProfile& branch = profile->emplace_back();
+        branch.function = block->info.name;
+        branch.site = site.site;
+        branch.trueCount = site.sense ? count.taken : count.notTaken;
+        branch.falseCount = site.sense ? count.notTaken : count.taken;
+    }
+
+    return VM_OK;
+}
+
+int SunScript::SaveBranchProfile(const std::string& filepath, const std::vector<BranchProfile>& profile)
+{
+    std::ofstream stream(filepath, std::ios::trunc);
+    if (!stream.good())
+    {
+        return VM_ERROR;
+    }
+
+    // One branch per line, the function name is last as it may contain spaces.
+    for (const BranchProfile& branch : profile)
+    {
+        stream << branch.site << " " << branch.trueCount << " " << branch.falseCount << " " << branch.function << std::endl;
+    }
+
+    return stream.good() ? VM_OK : VM_ERROR;
+}
+
+int SunScript::LoadBranchProfile(const std::string& filepath, std::vector<BranchProfile>* profile)
+{
+    std::ifstream stream(filepath);
+    if (!stream.good())
+    {
+        return VM_ERROR;
+    }
+
+    std::string line;
+    while (std::getline(stream, line))
+    {
+        std::stringstream ss(line);
+        BranchProfile branch;
+        if (!(ss >> branch.site >> branch.trueCount >> branch.falseCount))
+        {
+            return VM_ERROR;
+        }
+
+        ss >> std::ws;
+        std::getline(ss, branch.function);
+        profile->push_back(branch);
+    }
+
+    return VM_OK;
+}
+
+static bool RelocateTrace(VirtualMachine* vm, Trace* trace, const std::vector<Block>& oldBlocks, unsigned int oldOffset, const std::vector<int>& mapping)
+{
+    // Maps a position in the old program to the same position in the new program.
+    const auto relocate = [&](unsigned int pc, unsigned int* newPc) -> bool
+    {
+        const unsigned int rel = pc - oldOffset;
+        for (size_t i = 0; i < oldBlocks.size(); i++)
+        {
+            const FunctionInfo& info = oldBlocks[i].info;
+            if (rel >= info.pc && rel < info.pc + info.size)
+            {
+                if (mapping[i] == -1)
+                {
+                    return false;
+                }
+
+                *newPc = rel - info.pc + vm->blocks[mapping[i]].info.pc + vm->programOffset;
+                return true;
+            }
+        }
+        return false;
+    };
+
+    const auto remap = [&](FunctionInfo* func) -> FunctionInfo*
+    {
+        for (size_t i = 0; i < oldBlocks.size(); i++)
+        {
+            if (&oldBlocks[i].info == func)
+            {
+                return mapping[i] == -1 ? nullptr : &vm->blocks[mapping[i]].info;
+            }
+        }
+        return nullptr;
+    };
+
+    // Check everything can be relocated before modifying the trace.
+    unsigned int pc = 0;
+    for (auto& func : trace->functions)
+    {
+        if (!remap(func)) { return false; }
+    }
+    if (!relocate(trace->pc, &pc)) { return false; }
+    for (auto& snap : trace->snaps)
+    {
+        if (!relocate(snap.pc, &pc)) { return false; }
+        for (auto& frame : snap.frames)
+        {
+            if (!remap(frame.func) || !relocate(frame.returnAddress, &pc)) { return false; }
+        }
+    }
+
+    for (auto& func : trace->functions)
+    {
+        func = remap(func);
+    }
+    relocate(trace->pc, &pc);
+    trace->pc = pc;
+    for (auto& snap : trace->snaps)
+    {
+        relocate(snap.pc, &snap.pc);
+        for (auto& frame : snap.frames)
+        {
+            frame.func = remap(frame.func);
+            relocate(frame.returnAddress, &pc);
+            frame.returnAddress = pc;
+        }
+    }
+    for (auto& node : trace->nodes)
+    {
+        if (relocate(node->pc, &pc)) { node->pc = pc; }
+    }
+    relocate(trace->loop.start, &trace->loop.start);
+    relocate(trace->loop.end, &trace->loop.end);
+    for (auto& guard : trace->loop.guards)
+    {
+        relocate(guard.pc, &guard.pc);
+    }
+
+    return true;
+}
+
+int SunScript::HotSwapProgram(VirtualMachine* vm, unsigned char* program, unsigned char* debugData, int programSize, int* numChanged)
+{
+    if (!vm->program || vm->running || vm->tracing || vm->statusCode == VM_YIELDED)
+    {
+        return VM_ERROR;
+    }
+
+    Compiler_Drain(vm);
+    unsigned char* oldProgram = vm->program;
+    const unsigned int oldOffset = vm->programOffset;
+    const unsigned int oldConstantsOffset = vm->constantsOffset;
+    const int oldBuildFlags = vm->buildFlags;
+    int* oldDebugLines = vm->debugLines;
+    std::vector<Block> oldBlocks = std::move(vm->blocks);
+    std::vector<Function> oldFunctions = std::move(vm->functions);
+    std::vector<int> oldStackDepths = std::move(vm->stackDepths);
+    const bool oldVerified = vm->verified;
+    std::vector<BranchCount> oldBranchCounts = std::move(vm->branchCounts);
+    std::vector<BranchSite> oldBranchSites = std::move(vm->branchSites);
+
+    vm->program = new unsigned char[programSize];
+    std::memcpy(vm->program, program, programSize);
+    vm->blocks.clear();
+    vm->functions.clear();
+    vm->debugLines = nullptr;
+    vm->branchSites.clear();
+    vm->programCounter = 0;
+    vm->mm.Unpin();
+    vm->mm.Reset();
+    ScanFunctions(vm, program);
+    ScanDebugData(vm, debugData);
+    HashFunctions(vm);
+
+    FunctionInfo* main = nullptr;
+    for (auto& blk : vm->blocks)
+    {
+        if (blk.info.name == "main")
+        {
+            main = &blk.info;
+            break;
+        }
+    }
+
+    if (!main || !VerifyProgram(vm, programSize))
+    {
+        // Keep running the previous program.
+        delete[] vm->program;
+        delete[] vm->debugLines;
+        vm->program = oldProgram;
+        vm->programOffset = oldOffset;
+        vm->buildFlags = oldBuildFlags;
+        vm->debugLines = oldDebugLines;
+        vm->blocks = std::move(oldBlocks);
+        vm->functions = std::move(oldFunctions);
+        vm->stackDepths = std::move(oldStackDepths);
+        vm->verified = oldVerified;
+        vm->branchCounts = std::move(oldBranchCounts);
+        vm->branchSites = std::move(oldBranchSites);
+        vm->constantsOffset = oldConstantsOffset;
+        vm->programCounter = oldConstantsOffset;
+        vm->mm.Unpin();
+        vm->mm.Reset();
+        LoadConstants(vm, oldProgram);
+        return VM_ERROR;
+    }
+
+    vm->main = main;
+    vm->quickened.assign(programSize, QK_NONE);
+
+    // Match the functions by name, a function is unchanged when its contents hash the same.
+    std::unordered_map<std::string, int> names;
+    for (int i = 0; i < int(vm->blocks.size()); i++)
+    {
+        names.insert(std::pair<std::string, int>(vm->blocks[i].info.name, i));
+    }
+
+    int changed = 0;
+    std::vector<int> mapping(oldBlocks.size(), -1);
+    for (size_t i = 0; i < oldBlocks.size(); i++)
+    {
+        const auto& it = names.find(oldBlocks[i].info.name);
+        if (it == names.end())
+        {
+            changed++; // removed
+        }
+        else if (vm->blocks[it->second].info.hash == oldBlocks[i].info.hash)
+        {
+            mapping[i] = it->second;
+            vm->blocks[it->second].info.counter = oldBlocks[i].info.counter;
+        }
+    }
+
+    // Unchanged functions keep their branch counts.
+    vm->branchCounts.assign(programSize - vm->programOffset, BranchCount());
+    for (size_t i = 0; i < oldBlocks.size(); i++)
+    {
+        if (mapping[i] != -1)
+        {
+            const auto& info = oldBlocks[i].info;
+            std::copy(oldBranchCounts.begin() + info.pc, oldBranchCounts.begin() + info.pc + info.size,
+                vm->branchCounts.begin() + vm->blocks[mapping[i]].info.pc);
+        }
+    }
+    for (size_t i = 0; i < vm->blocks.size(); i++)
+    {
+        if (std::find(mapping.begin(), mapping.end(), int(i)) == mapping.end())
+        {
+            changed++; // added or modified
+        }
+    }
+
+    // Traces refer to functions by id, if any of the ids now refer to
+    // a different function none of the traces can be kept.
+    bool keepTraces = oldFunctions.size() <= vm->functions.size();
+    for (size_t i = 0; keepTraces && i < oldFunctions.size(); i++)
+    {
+        keepTraces = oldFunctions[i].name == vm->functions[i].name;
+    }
+
+    // The entries refer to the old program, so dropped traces leave the new one untouched.
+    vm->tt.entries.assign(programSize, -1);
+
+    int numKept = 0;
+    for (auto& slot : vm->tt.traces)
+    {
+        Trace* trace = slot.get();
+        if (keepTraces && trace->jit_trace && trace->parent == -1 && RelocateTrace(vm, trace, oldBlocks, oldOffset, mapping))
+        {
+            Trace_Mark(vm, trace);
+            numKept++;
+            continue;
+        }
+
+        Trace_Release(vm, trace);
+    }
+
+    if (numKept == 0)
+    {
+        // Nothing survived, start again so the new program can be traced once it is hot.
+        vm->main->counter = 0;
+    }
+    else if (vm->main->counter < unsigned(vm->tuning.hotRuns))
+    {
+        // Traces are only recorded for the first hot run of the program.
+        vm->main->counter = vm->tuning.hotRuns;
+    }
+    vm->tt.curTrace = nullptr;
+    vm->coldLoops.clear();
+
+    delete[] oldProgram;
+    delete[] oldDebugLines;
+
+    if (numChanged)
+    {
+        *numChanged = changed;
+    }
+
+    return VM_OK;
+}
+
 int SunScript::RunScript(VirtualMachine* vm, std::chrono::duration<int, std::nano> timeout)
 {
     ResetVM(vm);
 
     // Convert timeout to nanoseconds (or whatever it may be specified in)
     vm->timeout = std::chrono::duration_cast<std::chrono::steady_clock::duration>(timeout).count();
+
+    // Traces compiled in the background since the last run can be entered from now on.
+    Compiler_Install(vm, true);
+
+    // Snapshots restore the locals of calls on top of the script's own.
+    vm->locals.resize(vm->main->locals.size() + vm->main->parameters.size());
     
-    if (vm->tt.numTraces > 0 && vm->tt.traces[0].jit_trace)
+    if (HasEntryTrace(vm))
     {
-        vm->tt.curTrace = &vm->tt.traces[0];
+        vm->tt.curTrace = vm->tt.traces[vm->tt.entry].get();
+        vm->tt.curTrace->lastUsed = ++vm->tt.clock;
 
         ActivationRecord record(int(vm->locals.size()), &vm->mm);
         for (size_t i = 0; i < vm->locals.size(); i++)
@@ -3615,7 +6237,14 @@ int SunScript::RunScript(VirtualMachine* vm, std::chrono::duration<int, std::nan
         }
         unsigned char* buffer = record.GetBuffer();
 
+        vm->tt.record = buffer;
+        vm->tt.recordSize = int(vm->locals.size());
+        vm->tt.linked = false;
+
         const int state = vm->jit.jit_execute(vm->jit_instance, vm->tt.curTrace->jit_trace, buffer);
+
+        vm->tt.record = nullptr;
+        vm->tt.linked = false;
         if (state == VM_YIELDED)
         {
             return state;
@@ -3626,20 +6255,24 @@ int SunScript::RunScript(VirtualMachine* vm, std::chrono::duration<int, std::nan
 
     vm->programCounter = vm->main->pc + vm->programOffset;
     vm->programInstruction = vm->programCounter;
-    vm->locals.resize(vm->main->locals.size() + vm->main->parameters.size());
     vm->main->counter++;
 
-    if (vm->main->counter == HOT_COUNT && vm->jit_instance)
+    // Loops traced during earlier runs already cover the hot parts of the script.
+    if (vm->main->counter == unsigned(vm->tuning.hotRuns) && vm->jit_instance && vm->tt.numTraces == 0)
     {
         // Run with trace
         vm->hot = true;
         Trace_Start(vm);
+        vm->tt.entry = vm->tt.curTrace->id;
         const int state = ResumeScript2(vm);
-        if (state == VM_OK && vm->tracing)
+        if (state == VM_OK)
         {
             // End tracing and JIT compile
-            Trace_Done(vm);
-            Trace_Finalize(vm);
+            if (vm->tracing)
+            {
+                Trace_Done(vm);
+                Trace_Finalize(vm);
+            }
             Trace_Compile(vm);
             vm->tracing = false;
         }
@@ -3651,7 +6284,7 @@ int SunScript::RunScript(VirtualMachine* vm, std::chrono::duration<int, std::nan
 
 int SunScript::ResumeScript(VirtualMachine* vm)
 {
-    if (vm->jit_instance && vm->tt.numTraces > 0 && vm->tt.traces[0].jit_trace)
+    if (vm->jit_instance && HasEntryTrace(vm))
     {
         const int state = vm->jit.jit_resume(vm->jit_instance);
         if (state == VM_YIELDED)
@@ -3663,7 +6296,11 @@ int SunScript::ResumeScript(VirtualMachine* vm)
     }
 
     const int state = ResumeScript2(vm);
-    if (state == VM_OK && vm->tracing)
+    if (state == VM_OK && SideTracing(vm))
+    {
+        SideTraceAbort(vm);
+    }
+    else if (state == VM_OK && vm->tracing)
     {
         // End tracing and JIT compile
         Trace_Done(vm);
@@ -3722,9 +6359,49 @@ void SunScript::SetTableHash(void* table, const std::string& key, void* value)
     reinterpret_cast<Table*>(table)->_map[key] = value;
 }
 
-MemoryManager* SunScript::GetMemoryManager(VirtualMachine* vm)
-{
-    return &vm->mm;
+MemoryManager* SunScript::GetMemoryManager(VirtualMachine* vm)
+{
+    return &vm->mm;
+}
+
+static void* Snapshot_Box(VirtualMachine* vm, int type, int64_t val)
+{
+    void* data = nullptr;
+    switch (type)
+    {
+    case TY_INT:
+        data = vm->mm.New(sizeof(int), TY_INT);
+        *reinterpret_cast<int*>(data) = int(val);
+        break;
+    case TY_FUNC:
+        data = vm->mm.New(sizeof(int), TY_FUNC);
+        *reinterpret_cast<int*>(data) = int(val);
+        break;
+    case TY_STRING:
+    case TY_TABLE:
+        data = reinterpret_cast<void*>(val); // boxed
+        break;
+    case TY_REAL:
+        data = vm->mm.New(sizeof(real), TY_REAL);
+        *reinterpret_cast<real*>(data) = *reinterpret_cast<real*>(&val);
+        break;
+    }
+
+    return data;
+}
+
+int SunScript::EnterTrace(VirtualMachine* vm, int id)
+{
+    if (id < 0 || id >= int(vm->tt.traces.size()))
+    {
+        return VM_ERROR;
+    }
+
+    // The trace was entered from an exit linked to it rather than by the VM.
+    vm->tt.curTrace = vm->tt.traces[id].get();
+    vm->tt.curTrace->lastUsed = ++vm->tt.clock;
+    vm->tt.linked = true;
+    return VM_OK;
 }
 
 int SunScript::RestoreSnapshot(VirtualMachine* vm, const Snapshot& snap, int number, int ref)
@@ -3739,19 +6416,41 @@ int SunScript::RestoreSnapshot(VirtualMachine* vm, const Snapshot& snap, int num
         return VM_ERROR;
     }
 
-    const auto& sn = vm->tt.curTrace->snaps[number];
+    auto& sn = vm->tt.curTrace->snaps[number];
     vm->programCounter = sn.pc;
-    size_t numLocals = vm->main->locals.size();
-    size_t lastFrameNumLocals = numLocals;
+    size_t numLocals = vm->locals.size();
+    size_t lastFrameNumLocals = 0;
     for (auto& fr : sn.frames)
     {
         vm->frames.emplace_back(fr);
+        fr.func->depth++; // the VM returns from the frame
         numLocals += fr.func->locals.size();
         lastFrameNumLocals = fr.func->locals.size();
     }
-    vm->localBounds = int(numLocals - lastFrameNumLocals);
     vm->locals.resize(numLocals);
-    vm->stackBounds = 0;
+    if (!sn.frames.empty())
+    {
+        // The trace exits inside calls it made.
+        vm->localBounds = int(numLocals - lastFrameNumLocals);
+        vm->stackBounds = sn.stackBounds;
+        vm->discard = sn.discard;
+    }
+
+    if (vm->tt.linked)
+    {
+        // The locals the trace loaded and left unchanged are in the record, the traces
+        // before it in the chain may have changed them since the VM built the record.
+        for (auto& local : sn.locals)
+        {
+            const auto& data = local.ref->data;
+            if (data.id >= IR_LOAD_INT_LOCAL && data.id <= IR_LOAD_TABLE_LOCAL &&
+                data.local == local.index && local.index < vm->tt.recordSize)
+            {
+                const int64_t val = *reinterpret_cast<int64_t*>(vm->tt.record + local.index * 16 + 8);
+                vm->locals[local.index] = Snapshot_Box(vm, local.ref->type, val);
+            }
+        }
+    }
 
     for (auto& local : sn.locals)
     {
@@ -3766,28 +6465,10 @@ int SunScript::RestoreSnapshot(VirtualMachine* vm, const Snapshot& snap, int num
 
             if (local.ref->ref == ref)
             {
-                void* data;
-                switch (type)
+                void* data = Snapshot_Box(vm, type, val);
+                if (data)
                 {
-                case TY_INT:
-                    data = vm->mm.New(sizeof(int), TY_INT);
-                    *reinterpret_cast<int*>(data) = int(val);
-                    vm->locals[local.index] = data;
-                    break;
-                case TY_FUNC:
-                    data = vm->mm.New(sizeof(int), TY_FUNC);
-                    *reinterpret_cast<int*>(data) = int(val);
-                    vm->locals[local.index] = data;
-                    break;
-                case TY_STRING:
-                case TY_TABLE:
-                    vm->locals[local.index] = reinterpret_cast<void*>(val); // boxed
-                    break;
-                case TY_REAL:
-                    data = vm->mm.New(sizeof(real), TY_REAL);
-                    *reinterpret_cast<real*>(data) = *reinterpret_cast<real*>(&val);
                     vm->locals[local.index] = data;
-                    break;
                 }
 
                 break;
@@ -3795,6 +6476,43 @@ int SunScript::RestoreSnapshot(VirtualMachine* vm, const Snapshot& snap, int num
         }
     }
 
+    for (TraceNode* value : sn.stack)
+    {
+        void* data = nullptr;
+        for (int i = 0; i < snap.Count() && !data; i++)
+        {
+            int ref;
+            int64_t val;
+
+            snap.Get(i, &ref, &val);
+            if (value->ref == ref)
+            {
+                data = Snapshot_Box(vm, vm->tt.curTrace->nodes[ref]->type, val);
+            }
+        }
+
+        if (!data)
+        {
+            return VM_ERROR;
+        }
+
+        vm->stack.push(data);
+    }
+
+    // A guard which keeps leaving a loop's trace is given a side trace, recorded once
+    // the trace returns to the VM. The loop's exit is too if an enclosing loop keeps
+    // running it again.
+    if (++sn.exits == unsigned(vm->tuning.hotExits) &&
+        vm->jit.jit_link &&
+        vm->tt.curTrace->looping &&
+        vm->tt.curTrace->next == -1 &&
+        sn.frames.empty() &&
+        sn.stack.empty() &&
+        !vm->hot)
+    {
+        vm->tt.sideExit = number;
+    }
+
 
     /*for (int i = 0; i < snap.Count(); i++)
     {
@@ -3890,6 +6608,15 @@ void SunScript::PushReturnValue(VirtualMachine* vm, int value)
     }
 }
 
+void SunScript::PushReturnValue(VirtualMachine* vm, real value)
+{
+    if (vm->statusCode == VM_OK)
+    {
+        Push_Real(vm, value);
+        if (vm->tracing) { Trace_ReturnValue(vm, TY_REAL); }
+    }
+}
+
 int SunScript::GetCallNumArgs(VirtualMachine* vm, int* numArgs)
 {
     *numArgs = vm->callNumArgs;
@@ -4076,7 +6803,10 @@ void SunScript::ResetProgram(Program* program)
 {
     program->data.clear();
     program->functions.clear();
+    program->constants.clear();
+    program->constantIds.clear();
     program->debug.clear();
+    program->branches.clear();
     program->blocks.clear();
     program->numLines = 0;
     program->numFunctions = 0;
@@ -4085,7 +6815,8 @@ void SunScript::ResetProgram(Program* program)
 
 int SunScript::GetProgram(Program* program, unsigned char** programData)
 {
-    const int size = int(program->data.size() + program->functions.size() + program->entries.size() + sizeof(std::int32_t) * 3);
+    const int size = int(program->data.size() + program->functions.size() + program->entries.size() +
+        program->constants.size() + sizeof(std::int32_t) * 4);
     *programData = new unsigned char[size];
 
     const size_t numBlocks = program->blocks.size();
@@ -4110,20 +6841,49 @@ int SunScript::GetProgram(Program* program, unsigned char** programData)
 
     std::memcpy(*programData + offset, program->functions.data(), program->functions.size());
     std::memcpy(*programData + program->functions.size() + offset, program->entries.data(), program->entries.size());
-    std::memcpy(*programData + program->functions.size() + program->entries.size() + offset, program->data.data(), program->data.size());
+
+    // The constant pool follows the entries.
+    unsigned char* constants = *programData + program->functions.size() + program->entries.size() + offset;
+    const int numConstants = int(program->constantIds.size());
+    constants[0] = (unsigned char)(numConstants & 0xFF);
+    constants[1] = (unsigned char)((numConstants >> 8) & 0xFF);
+    constants[2] = (unsigned char)((numConstants >> 16) & 0xFF);
+    constants[3] = (unsigned char)((numConstants >> 24) & 0xFF);
+    std::memcpy(constants + sizeof(std::int32_t), program->constants.data(), program->constants.size());
+
+    std::memcpy(constants + sizeof(std::int32_t) + program->constants.size(), program->data.data(), program->data.size());
     return size;
 }
 
 int SunScript::GetDebugData(Program* program, unsigned char** debug)
 {
-    *debug = new unsigned char[program->debug.size() + 4];
-    const int numItems = program->numLines;
-    (*debug)[0] = (unsigned char)(numItems & 0xFF);
-    (*debug)[1] = (unsigned char)((numItems >> 8) & 0xFF);
-    (*debug)[2] = (unsigned char)((numItems >> 16) & 0xFF);
-    (*debug)[3] = (unsigned char)((numItems >> 24) & 0xFF);
-    std::memcpy(&(*debug)[4], program->debug.data(), program->debug.size());
-    return int(program->debug.size() + 4);
+    // The lines are followed by the branch sites.
+    const size_t size = program->debug.size() + 8 + program->branches.size() * 9;
+    *debug = new unsigned char[size];
+
+    unsigned char* data = *debug;
+    const auto writeInt = [&data](int value)
+    {
+        data[0] = (unsigned char)(value & 0xFF);
+        data[1] = (unsigned char)((value >> 8) & 0xFF);
+        data[2] = (unsigned char)((value >> 16) & 0xFF);
+        data[3] = (unsigned char)((value >> 24) & 0xFF);
+        data += 4;
+    };
+
+    writeInt(program->numLines);
+    std::memcpy(data, program->debug.data(), program->debug.size());
+    data += program->debug.size();
+
+    writeInt(int(program->branches.size()));
+    for (const BranchSite& site : program->branches)
+    {
+        writeInt(site.pc);
+        writeInt(site.site);
+        *data++ = site.sense ? 1 : 0;
+    }
+
+    return int(size);
 }
 
 void SunScript::ReleaseProgram(Program* program)
@@ -4131,6 +6891,22 @@ void SunScript::ReleaseProgram(Program* program)
     delete program;
 }
 
+static void PrintConstant(std::stringstream& ss, VirtualMachine* vm, void* value)
+{
+    switch (vm->mm.GetType(value))
+    {
+    case TY_INT:
+        ss << *reinterpret_cast<int*>(value);
+        break;
+    case TY_REAL:
+        ss << *reinterpret_cast<real*>(value) << "D";
+        break;
+    case TY_STRING:
+        ss << "\"" << reinterpret_cast<char*>(value) << "\"";
+        break;
+    }
+}
+
 void SunScript::Disassemble(std::stringstream& ss, unsigned char* programData, unsigned char* debugData)
 {
     VirtualMachine* vm = CreateVirtualMachine();
@@ -4175,6 +6951,23 @@ void SunScript::Disassemble(std::stringstream& ss, unsigned char* programData, u
         ss << "No functions" << std::endl;
     }
 
+    ss << "======================" << std::endl;
+    ss << "Constants" << std::endl;
+    ss << "======================" << std::endl;
+    if (vm->constants.size() > 0)
+    {
+        for (size_t i = 0; i < vm->constants.size(); i++)
+        {
+            ss << i << " ";
+            PrintConstant(ss, vm, vm->constants[i]);
+            ss << std::endl;
+        }
+    }
+    else
+    {
+        ss << "No constants" << std::endl;
+    }
+
     ss << "======================" << std::endl;
     ss << "Program" << std::endl;
     ss << "======================" << std::endl;
@@ -4216,12 +7009,55 @@ void SunScript::Disassemble(std::stringstream& ss, unsigned char* programData, u
         case OP_TABLE_SET:
             ss << "OP_TABLE_SET " << std::endl;
             break;
+        case OP_TABLE_UPDATE:
+            ss << "OP_TABLE_UPDATE " << int(Read_Byte(programData, &vm->programCounter)) << std::endl;
+            break;
+        case OP_MATH:
+            ss << "OP_MATH " << int(Read_Byte(programData, &vm->programCounter)) << std::endl;
+            break;
         case OP_CMP:
             ss << "OP_CMP" << std::endl;
             break;
+        case OP_ADD_II:
+            ss << "OP_ADD_II" << std::endl;
+            break;
+        case OP_ADD_RR:
+            ss << "OP_ADD_RR" << std::endl;
+            break;
+        case OP_CMP_II:
+            ss << "OP_CMP_II" << std::endl;
+            break;
+        case OP_INC_I:
+            ss << "OP_INC_I" << std::endl;
+            break;
         case OP_JUMP:
             ss << "OP_JUMP " << int(Read_Byte(programData, &vm->programCounter)) << " " << int(Read_Short(programData, &vm->programCounter)) << std::endl;
             break;
+        case OP_JUMP_TABLE:
+        {
+            ss << "OP_JUMP_TABLE " << int(Read_Byte(programData, &vm->programCounter));
+            ss << " " << Read_Int(programData, &vm->programCounter);
+            const int count = static_cast<unsigned short>(Read_Short(programData, &vm->programCounter));
+            for (int i = 0; i <= count; i++)
+            {
+                ss << " " << int(Read_Short(programData, &vm->programCounter));
+            }
+            ss << std::endl;
+        }
+            break;
+        case OP_JUMP_SEARCH:
+        {
+            ss << "OP_JUMP_SEARCH " << int(Read_Byte(programData, &vm->programCounter));
+            const int count = static_cast<unsigned short>(Read_Short(programData, &vm->programCounter));
+            ss << " " << int(Read_Short(programData, &vm->programCounter));
+            for (int i = 0; i < count; i++)
+            {
+                ss << " " << Read_Int(programData, &vm->programCounter);
+                ss << ":" << int(Read_Short(programData, &vm->programCounter));
+            }
+            ss << std::endl;
+        }
+            break;
         case OP_POP:
             ss << "OP_POP " << int(Read_Byte(programData, &vm->programCounter)) << std::endl;
             break;
@@ -4245,6 +7081,18 @@ void SunScript::Disassemble(std::stringstream& ss, unsigned char* programData, u
         case OP_PUSH_LOCAL:
             ss << "OP_PUSH_LOCAL " << int(Read_Byte(programData, &vm->programCounter)) << std::endl;
             break;
+        case OP_PUSH_CONST:
+        {
+            const int index = Read_Int(programData, &vm->programCounter);
+            ss << "OP_PUSH_CONST " << index;
+            if (index >= 0 && index < int(vm->constants.size()))
+            {
+                ss << " ";
+                PrintConstant(ss, vm, vm->constants[index]);
+            }
+            ss << std::endl;
+        }
+            break;
         case OP_RETURN:
             ss << "OP_RETURN" << std::endl;
             break;
@@ -4282,6 +7130,9 @@ void SunScript::Disassemble(std::stringstream& ss, unsigned char* programData, u
         case OP_CALLM:
             ss << "OP_CALLM " << int(Read_Byte(programData, &vm->programCounter)) << std::endl;
             break;
+        case OP_TAILCALL:
+            ss << "OP_TAILCALL " << int(Read_Byte(programData, &vm->programCounter)) << " " << Read_Int(programData, &vm->programCounter) << std::endl;
+            break;
         case OP_DONE:
             ss << "OP_DONE" << std::endl;
             vm->running = false;
@@ -4365,8 +7216,44 @@ void SunScript::FlushBlocks(Program* program)
         }
 
         program->data.insert(program->data.end(), block->data.begin(), block->data.end());
+
+        // Renumber the constants of the block into the program's pool, sharing any duplicates.
+        for (int pos = 0; pos < size;)
+        {
+            const int insSize = GetInstructionSize(block, pos);
+            if (insSize == -1)
+            {
+                break;
+            }
+
+            if (block->data[pos] == OP_PUSH_CONST)
+            {
+                unsigned int index = pos + 1;
+                const std::string& constant = block->constants[Read_Int(block->data.data(), &index)];
+                auto it = program->constantIds.find(constant);
+                if (it == program->constantIds.end())
+                {
+                    it = program->constantIds.insert(std::pair<std::string, int>(constant, int(program->constantIds.size()))).first;
+                    program->constants.insert(program->constants.end(), constant.begin(), constant.end());
+                }
+
+                unsigned char* ins = &program->data[offset + pos];
+                ins[1] = it->second & 0xFF;
+                ins[2] = (it->second >> 8) & 0xFF;
+                ins[3] = (it->second >> 16) & 0xFF;
+                ins[4] = (it->second >> 24) & 0xFF;
+            }
+            pos += insSize;
+        }
+
         program->debug.insert(program->debug.end(), block->debug.begin(), block->debug.end());
         program->numLines += block->numLines;
+
+        for (BranchSite site : block->branches)
+        {
+            site.pc += offset;
+            program->branches.push_back(site);
+        }
     }
 }
 
@@ -4413,25 +7300,46 @@ void SunScript::EmitPushLocal(ProgramBlock* program, unsigned char local)
     program->data.push_back(local);
 }
 
+static int AddConstant(ProgramBlock* program, const std::string& constant)
+{
+    const auto& it = program->constantIds.find(constant);
+    if (it != program->constantIds.end())
+    {
+        return it->second;
+    }
+
+    const int id = int(program->constants.size());
+    program->constants.push_back(constant);
+    program->constantIds.insert(std::pair<std::string, int>(constant, id));
+    return id;
+}
+
+static void EmitPushConstant(ProgramBlock* program, const std::vector<unsigned char>& constant)
+{
+    // Constants are numbered per block here, FlushBlocks renumbers them into the program's pool.
+    program->data.push_back(OP_PUSH_CONST);
+    EmitInt(program->data, AddConstant(program, std::string(constant.begin(), constant.end())));
+}
+
 void SunScript::EmitPush(ProgramBlock* program, int value)
 {
-    program->data.push_back(OP_PUSH);
-    program->data.push_back(TY_INT);
-    EmitInt(program->data, value);
+    std::vector<unsigned char> constant = { TY_INT };
+    EmitInt(constant, value);
+    EmitPushConstant(program, constant);
 }
 
 void SunScript::EmitPush(ProgramBlock* program, real value)
 {
-    program->data.push_back(OP_PUSH);
-    program->data.push_back(TY_REAL);
-    EmitReal(program->data, value);
+    std::vector<unsigned char> constant = { TY_REAL };
+    EmitReal(constant, value);
+    EmitPushConstant(program, constant);
 }
 
 void SunScript::EmitPush(ProgramBlock* program, const std::string& value)
 {
-    program->data.push_back(OP_PUSH);
-    program->data.push_back(TY_STRING);
-    EmitString(program->data, value);
+    std::vector<unsigned char> constant = { TY_STRING };
+    EmitString(constant, value);
+    EmitPushConstant(program, constant);
 }
 
 void SunScript::EmitPop(ProgramBlock* program, unsigned char local)
@@ -4467,6 +7375,125 @@ void SunScript::EmitCall(ProgramBlock* program, int func, unsigned char numArgs)
     EmitInt(program->data, func);
 }
 
+void SunScript::EmitTailCall(ProgramBlock* program, int func, unsigned char numArgs)
+{
+    program->data.push_back(OP_TAILCALL);
+    program->data.push_back(numArgs);
+    EmitInt(program->data, func);
+}
+
+int SunScript::GetProgramBlockSize(ProgramBlock* program)
+{
+    return int(program->data.size());
+}
+
+void SunScript::PatchFunction(ProgramBlock* program, int pos, int func)
+{
+    program->data[pos] = func & 0xFF;
+    program->data[pos + 1] = (func >> 8) & 0xFF;
+    program->data[pos + 2] = (func >> 16) & 0xFF;
+    program->data[pos + 3] = (func >> 24) & 0xFF;
+}
+
+int SunScript::GetInstructionSize(ProgramBlock* program, int pos)
+{
+    return InstructionSize(program->data.data(), int(program->data.size()), pos);
+}
+
+bool SunScript::CanInlineBlock(ProgramBlock* program, int maxSize)
+{
+    // The block must be small and leave only by the return at its end.
+    const int size = int(program->data.size());
+    if (size == 0 || size > maxSize || program->data[size - 1] != OP_RETURN)
+    {
+        return false;
+    }
+
+    int pos = 0;
+    while (pos < size - 1)
+    {
+        const unsigned char op = program->data[pos];
+        const int insSize = GetInstructionSize(program, pos);
+        if (insSize == -1 || op == OP_RETURN || op == OP_DONE || op == OP_YIELD)
+        {
+            return false;
+        }
+
+        // Loops are not inlined, the tracer expects an empty stack at the start of a loop.
+        if (op == OP_JUMP && short(program->data[pos + 2] | (program->data[pos + 3] << 8)) < 0)
+        {
+            return false;
+        }
+        pos += insSize;
+    }
+
+    return pos == size - 1;
+}
+
+bool SunScript::EmitInlineBlock(ProgramBlock* program, ProgramBlock* callee, int numArgs)
+{
+    // The locals of the callee are placed after the locals of the caller.
+    const int localBase = int(program->fields.size());
+    if (callee->numArgs != numArgs || localBase + callee->fields.size() > 256)
+    {
+        return false;
+    }
+
+    for (auto& field : callee->fields)
+    {
+        program->fields.push_back(callee->name + "::" + field);
+    }
+
+    const int offset = int(program->data.size());
+    const int size = int(callee->data.size()) - 1; // without the return
+
+    for (size_t i = 0; i + 8 <= callee->debug.size(); i += 8)
+    {
+        unsigned int debugPos = unsigned(i);
+        const int pos = Read_Int(callee->debug.data(), &debugPos);
+        const int line = Read_Int(callee->debug.data(), &debugPos);
+        if (pos < size)
+        {
+            EmitInt(program->debug, pos + offset);
+            EmitInt(program->debug, line);
+            program->numLines++;
+        }
+    }
+
+    program->data.insert(program->data.end(), callee->data.begin(), callee->data.begin() + size);
+
+    int pos = 0;
+    while (pos < size)
+    {
+        unsigned char* ins = &program->data[offset + pos];
+        switch (*ins)
+        {
+        case OP_POP:
+        case OP_PUSH_LOCAL:
+        case OP_JUMP_TABLE:
+        case OP_JUMP_SEARCH:
+            ins[1] += localBase;
+            break;
+        case OP_SET:
+            ins[2] += localBase;
+            break;
+        case OP_PUSH_CONST:
+        {
+            unsigned int index = 1;
+            const int id = AddConstant(program, callee->constants[Read_Int(ins, &index)]);
+            ins[1] = id & 0xFF;
+            ins[2] = (id >> 8) & 0xFF;
+            ins[3] = (id >> 16) & 0xFF;
+            ins[4] = (id >> 24) & 0xFF;
+        }
+            break;
+        }
+        pos += GetInstructionSize(callee, pos);
+    }
+
+    return true;
+}
+
 void SunScript::EmitCallO(ProgramBlock* program, unsigned char numArgs)
 {
     program->data.push_back(OP_CALLO);
@@ -4484,6 +7511,16 @@ void SunScript::EmitAdd(ProgramBlock* program)
     program->data.push_back(OP_ADD);
 }
 
+void SunScript::EmitAddInt(ProgramBlock* program)
+{
+    program->data.push_back(OP_ADD_II);
+}
+
+void SunScript::EmitAddReal(ProgramBlock* program)
+{
+    program->data.push_back(OP_ADD_RR);
+}
+
 void SunScript::EmitSub(ProgramBlock* program)
 {
     program->data.push_back(OP_SUB);
@@ -4514,6 +7551,11 @@ void SunScript::EmitIncrement(ProgramBlock* program)
     program->data.push_back(OP_INCREMENT);
 }
 
+void SunScript::EmitIncrementInt(ProgramBlock* program)
+{
+    program->data.push_back(OP_INC_I);
+}
+
 void SunScript::EmitDecrement(ProgramBlock* program)
 {
     program->data.push_back(OP_DECREMENT);
@@ -4549,6 +7591,11 @@ void SunScript::EmitCompare(ProgramBlock* program)
     program->data.push_back(OP_CMP);
 }
 
+void SunScript::EmitCompareInt(ProgramBlock* program)
+{
+    program->data.push_back(OP_CMP_II);
+}
+
 void SunScript::EmitJump(ProgramBlock* program, char type, Label* label)
 {
     program->data.push_back(OP_JUMP);
@@ -4561,6 +7608,98 @@ void SunScript::EmitJump(ProgramBlock* program, char type, Label* label)
     label->jumps.push_back(int(program->data.size()) - 2);
 }
 
+void SunScript::EmitBranchSite(ProgramBlock* program, int site, bool sense)
+{
+    // Refers to the conditional jump just emitted.
+    BranchSite& branch = program->branches.emplace_back();
+    branch.pc = int(program->data.size()) - 4;
+    branch.site = site;
+    branch.sense = sense;
+}
+
+void SunScript::MoveCode(ProgramBlock* program, int start, ProgramBlock* dst)
+{
+    // Jumps are relative so the code is still valid, except for jumps which leave it.
+    const int offset = int(dst->data.size()) - start;
+    dst->data.insert(dst->data.end(), program->data.begin() + start, program->data.end());
+    program->data.resize(start);
+
+    std::vector<unsigned char> debug;
+    for (size_t i = 0; i + 8 <= program->debug.size(); i += 8)
+    {
+        unsigned int debugPos = unsigned(i);
+        const int pos = Read_Int(program->debug.data(), &debugPos);
+        const int line = Read_Int(program->debug.data(), &debugPos);
+        if (pos >= start)
+        {
+            EmitInt(dst->debug, pos + offset);
+            EmitInt(dst->debug, line);
+            dst->numLines++;
+            program->numLines--;
+        }
+        else
+        {
+            EmitInt(debug, pos);
+            EmitInt(debug, line);
+        }
+    }
+    program->debug = std::move(debug);
+
+    const auto moved = std::stable_partition(program->branches.begin(), program->branches.end(), [start](const BranchSite& site)
+        {
+            return site.pc < start;
+        });
+    for (auto it = moved; it != program->branches.end(); it++)
+    {
+        BranchSite site = *it;
+        site.pc += offset;
+        dst->branches.push_back(site);
+    }
+    program->branches.erase(moved, program->branches.end());
+}
+
+void SunScript::EmitJumpTable(ProgramBlock* program, unsigned char local, int min, const std::vector<Label*>& cases, Label* defaultLabel)
+{
+    program->data.push_back(OP_JUMP_TABLE);
+    program->data.push_back(local);
+    EmitInt(program->data, min);
+    program->data.push_back(cases.size() & 0xFF);
+    program->data.push_back((cases.size() >> 8) & 0xFF);
+
+    // Reserve 16 bits for the offset of the default then each case.
+    program->data.push_back(0);
+    program->data.push_back(0);
+    defaultLabel->jumps.push_back(int(program->data.size()) - 2);
+
+    for (Label* label : cases)
+    {
+        program->data.push_back(0);
+        program->data.push_back(0);
+        (label ? label : defaultLabel)->jumps.push_back(int(program->data.size()) - 2);
+    }
+}
+
+void SunScript::EmitJumpSearch(ProgramBlock* program, unsigned char local, const std::vector<std::pair<int, Label*>>& cases, Label* defaultLabel)
+{
+    program->data.push_back(OP_JUMP_SEARCH);
+    program->data.push_back(local);
+    program->data.push_back(cases.size() & 0xFF);
+    program->data.push_back((cases.size() >> 8) & 0xFF);
+
+    // Reserve 16 bits for the offset of the default then each case after its key.
+    program->data.push_back(0);
+    program->data.push_back(0);
+    defaultLabel->jumps.push_back(int(program->data.size()) - 2);
+
+    for (const auto& entry : cases)
+    {
+        EmitInt(program->data, entry.first);
+        program->data.push_back(0);
+        program->data.push_back(0);
+        entry.second->jumps.push_back(int(program->data.size()) - 2);
+    }
+}
+
 void SunScript::EmitTableNew(ProgramBlock* program)
 {
     program->data.push_back(OP_TABLE_NEW);
@@ -4576,6 +7715,18 @@ void SunScript::EmitTableSet(ProgramBlock* program)
     program->data.push_back(OP_TABLE_SET);
 }
 
+void SunScript::EmitTableUpdate(ProgramBlock* program, unsigned char op)
+{
+    program->data.push_back(OP_TABLE_UPDATE);
+    program->data.push_back(op);
+}
+
+void SunScript::EmitMath(ProgramBlock* program, unsigned char fn)
+{
+    program->data.push_back(OP_MATH);
+    program->data.push_back(fn);
+}
+
 void SunScript::EmitDup(ProgramBlock* program)
 {
     program->data.push_back(OP_DUP);
@@ -37,6 +37,16 @@ namespace SunScript
     constexpr unsigned char OP_RETURN = 0x25;
     constexpr unsigned char OP_CALLO = 0x26;
     constexpr unsigned char OP_CALLM = 0x27;
+    constexpr unsigned char OP_TAILCALL = 0x28;
+    constexpr unsigned char OP_ADD_II = 0x29;
+    constexpr unsigned char OP_ADD_RR = 0x2a;
+    constexpr unsigned char OP_CMP_II = 0x2b;
+    constexpr unsigned char OP_INC_I = 0x2c;
+    constexpr unsigned char OP_PUSH_CONST = 0x2d;
+    constexpr unsigned char OP_JUMP_TABLE = 0x2e;
+    constexpr unsigned char OP_JUMP_SEARCH = 0x2f;
+    constexpr unsigned char OP_TABLE_UPDATE = 0x30;
+    constexpr unsigned char OP_MATH = 0x31;
 
     constexpr unsigned char OP_LSPUSH = OP_PUSH | MK_LOOPSTART;
     constexpr unsigned char OP_LSPOP = OP_POP | MK_LOOPSTART;
@@ -48,10 +58,12 @@ namespace SunScript
     constexpr unsigned char OP_LSSUB = OP_SUB | MK_LOOPSTART;
     constexpr unsigned char OP_LSMUL = OP_MUL | MK_LOOPSTART;
     constexpr unsigned char OP_LSDIV = OP_DIV | MK_LOOPSTART;
+    constexpr unsigned char OP_LSPUSH_CONST = OP_PUSH_CONST | MK_LOOPSTART;
 
     constexpr unsigned char OP_TRPUSH = OP_PUSH | MK_TRACESTART;
     constexpr unsigned char OP_TRPUSH_LOCAL = OP_PUSH_LOCAL | MK_TRACESTART;
     constexpr unsigned char OP_TRTABLE_NEW = OP_TABLE_NEW | MK_TRACESTART;
+    constexpr unsigned char OP_TRPUSH_CONST = OP_PUSH_CONST | MK_TRACESTART;
 
     constexpr unsigned char TY_VOID = 0x0;
     constexpr unsigned char TY_INT = 0x1;
@@ -61,6 +73,80 @@ namespace SunScript
     constexpr unsigned char TY_FUNC = 0x5;
     constexpr unsigned char TY_TABLE = 0x6;
 
+    /*
+    * The type produced by a binary arithmetic operator for the given operand types.
+    * Returns TY_VOID if the operator is not defined for them.
+    * Shared by the compiler, the interpreter and the tracer so they all agree.
+    */
+    constexpr unsigned char BinaryResultType(unsigned char op, unsigned char left, unsigned char right)
+    {
+        const bool leftNumber = left == TY_INT || left == TY_REAL;
+        const bool rightNumber = right == TY_INT || right == TY_REAL;
+
+        if (left == TY_INT && right == TY_INT)
+        {
+            return TY_INT;
+        }
+        else if (leftNumber && rightNumber)
+        {
+            return TY_REAL;
+        }
+        else if (op == OP_ADD &&
+            (left == TY_STRING || right == TY_STRING) &&
+            (leftNumber || left == TY_STRING) &&
+            (rightNumber || right == TY_STRING))
+        {
+            return TY_STRING;
+        }
+
+        return TY_VOID;
+    }
+
+    constexpr unsigned char MATH_SQRT = 0x0;
+    constexpr unsigned char MATH_SIN = 0x1;
+    constexpr unsigned char MATH_COS = 0x2;
+    constexpr unsigned char MATH_ABS = 0x3;
+    constexpr unsigned char MATH_FLOOR = 0x4;
+    constexpr unsigned char MATH_MIN = 0x5;
+    constexpr unsigned char MATH_MAX = 0x6;
+    constexpr unsigned char MATH_COUNT = 0x7;
+
+    /*
+    * The number of arguments taken by a math intrinsic.
+    */
+    constexpr int MathArgCount(unsigned char fn)
+    {
+        return fn == MATH_MIN || fn == MATH_MAX ? 2 : 1;
+    }
+
+    /*
+    * The type produced by a math intrinsic for the given argument types.
+    * Pass TY_VOID as the second type for intrinsics taking one argument.
+    * Returns TY_VOID if the intrinsic is not defined for them.
+    */
+    constexpr unsigned char MathResultType(unsigned char fn, unsigned char first, unsigned char second)
+    {
+        const bool firstNumber = first == TY_INT || first == TY_REAL;
+        const bool secondNumber = second == TY_INT || second == TY_REAL;
+
+        switch (fn)
+        {
+        case MATH_SQRT:
+        case MATH_SIN:
+        case MATH_COS:
+            return firstNumber ? TY_REAL : TY_VOID;
+        case MATH_ABS:
+        case MATH_FLOOR:
+            return firstNumber ? first : TY_VOID;
+        case MATH_MIN:
+        case MATH_MAX:
+            return first == TY_INT && second == TY_INT ? TY_INT :
+                firstNumber && secondNumber ? TY_REAL : TY_VOID;
+        }
+
+        return TY_VOID;
+    }
+
     constexpr unsigned char JUMP = 0x0;
     constexpr unsigned char JUMP_E = 0x1;
     constexpr unsigned char JUMP_NE = 0x2;
@@ -123,6 +209,16 @@ namespace SunScript
     constexpr unsigned char IR_TABLE_ASET = 0x84;
     constexpr unsigned char IR_TABLE_AREF = 0x85;
     constexpr unsigned char IR_TABLE_HREF = 0x86;
+    constexpr unsigned char IR_SQRT_REAL = 0x90;
+    constexpr unsigned char IR_SIN_REAL = 0x91;
+    constexpr unsigned char IR_COS_REAL = 0x92;
+    constexpr unsigned char IR_ABS_INT = 0x93;
+    constexpr unsigned char IR_ABS_REAL = 0x94;
+    constexpr unsigned char IR_FLOOR_REAL = 0x95;
+    constexpr unsigned char IR_MIN_INT = 0x96;
+    constexpr unsigned char IR_MAX_INT = 0x97;
+    constexpr unsigned char IR_MIN_REAL = 0x98;
+    constexpr unsigned char IR_MAX_REAL = 0x99;
 
     constexpr int BUILD_FLAG_SINGLE = 0x1;
     constexpr int BUILD_FLAG_DOUBLE = 0x2;
@@ -169,6 +265,8 @@ namespace SunScript
         void Release(void* mem);
         char GetType(void* mem) const;
         void Reset();
+        void Pin();
+        void Unpin();
         uint64_t TotalMemory();
         uint64_t UsedMemory();
         static char GetTypeUnsafe(void* mem);
@@ -176,6 +274,8 @@ namespace SunScript
 
     private:
         std::vector<Segment> _segments;
+        size_t _pinnedSegments;     // the number of segments holding pinned memory
+        uint64_t _pinnedPos;        // the end of the pinned memory in the last of them
     };
 
     /*
@@ -232,6 +332,89 @@ namespace SunScript
         Callstack* next = nullptr;
     };
 
+    /*
+    * How often a branch of the program went each way.
+    * A branch is identified by its function and the order the compiler met it in,
+    * so a profile from one build can be given to the compiler for the next.
+    */
+    struct BranchProfile
+    {
+        std::string function;
+        int site;
+        unsigned int trueCount;
+        unsigned int falseCount;
+    };
+
+    /*
+    * The thresholds which decide when the JIT compiler records a trace.
+    * A script is traced as a whole once it has been run hotRuns times. A loop in the
+    * script's main body is traced from its header, during the run, once it has jumped back
+    * hotLoops times or a function it calls has been called hotCalls times in that run.
+    * Once maxTraces traces are held, the trace entered least recently is evicted to make
+    * room for a new one.
+    * Traces are compiled on a background thread, at most maxPendingCompiles at once, and
+    * entered once the script reaches a point where they can be installed. If maxPendingCompiles
+    * is 0 traces are compiled as soon as they are recorded.
+    * Once a loop's trace has been left by the same guard hotExits times, a side trace is
+    * recorded from there to the loop header and the guard jumps straight to it. An inner
+    * loop's exit is treated the same, its side trace runs the enclosing loop's body.
+    * If chainTraces is set, a trace which ends where another starts jumps straight into it
+    * rather than returning to the VM, so adjacent loops run without leaving compiled code.
+    * Recursive calls are unrolled into the trace while the function has fewer than
+    * maxRecursion calls active, deeper calls abort the trace.
+    */
+    struct TraceTuning
+    {
+        int hotRuns = 100;          // the number of runs of the script to consider it 'hot'
+        int hotLoops = 2000;        // the number of back edges in a run to consider a loop 'hot'
+        int hotCalls = 1000;        // the number of calls in a run to consider a function 'hot'
+        int minTraceSize = 12;      // the minimum size of a trace to compile it
+        int maxTraceSize = 200;     // the maximum size of a loop trace
+        int maxTraces = 128;        // the number of traces held before evicting
+        int maxPendingCompiles = 4; // the number of traces compiling in the background at once
+        int hotExits = 100;         // the number of exits by a guard to consider it 'hot'
+        bool chainTraces = true;    // whether the end of a trace jumps into the trace it stops at
+        int maxRecursion = 8;       // the number of active calls of a function a trace can unroll
+    };
+
+    /*
+    * How much of the JIT compiler's code cache is in use.
+    * Traces are placed in large executable regions which are mapped as they are needed
+    * and unmapped once the traces in them have been freed.
+    */
+    struct JitStats
+    {
+        int regions = 0;            // the number of regions mapped
+        size_t reserved = 0;        // the bytes mapped for the regions
+        size_t code = 0;            // the bytes of code in use
+        size_t constants = 0;       // the bytes of constants in use
+        int traces = 0;             // the number of traces placed in the regions
+    };
+
+    /*
+    * What the trace optimizer has done to the traces it has optimized.
+    * Each trace is optimized as a whole by a series of passes over it, each counting the
+    * instructions it removed and the time it took. Constant folding replaces instructions
+    * with constants, simplification and common subexpression elimination replace them with
+    * a value computed before, guard elimination removes the guards which can't fail and
+    * dead code elimination removes the instructions whose results aren't used.
+    */
+    struct OptimizerPass
+    {
+        int removed = 0;                                // the instructions removed or replaced with a constant
+        std::chrono::steady_clock::duration time{};     // the time spent in the pass
+    };
+
+    struct OptimizerStats
+    {
+        int traces = 0;             // the number of traces optimized
+        OptimizerPass fold;         // constant folding and propagation
+        OptimizerPass simplify;     // algebraic simplification
+        OptimizerPass cse;          // common subexpression elimination
+        OptimizerPass guards;       // guard elimination
+        OptimizerPass dead;         // dead code elimination
+    };
+
     struct Jit
     {
         void* (*jit_initialize) (void);
@@ -239,6 +422,10 @@ namespace SunScript
         int (*jit_execute) (void* instance, void* data, unsigned char* record);
         int (*jit_resume) (void* instance);
         void (*jit_shutdown) (void* instance);
+        void (*jit_free) (void* data);
+        void (*jit_install) (void* instance, void* data);
+        void (*jit_link) (void* instance, void* data, int snap, void* target);
+        void (*jit_stats) (void* instance, JitStats* stats);
     };
 
     constexpr int VM_OK = 0;
@@ -272,6 +459,28 @@ namespace SunScript
     */
     void SetOptimizationLevel(VirtualMachine* vm, int level);
 
+    /*
+    * Gets what the trace optimizer has done since the virtual machine was created.
+    * Traces are optimized if the optimization level is 1 or more.
+    */
+    void GetOptimizerStats(VirtualMachine* vm, OptimizerStats* stats);
+
+    /*
+    * Sets the thresholds which decide when traces are recorded.
+    */
+    void SetTraceTuning(VirtualMachine* vm, const TraceTuning& tuning);
+
+    /*
+    * Gets the thresholds which decide when traces are recorded.
+    */
+    void GetTraceTuning(VirtualMachine* vm, TraceTuning* tuning);
+
+    /*
+    * Gets how much of the JIT compiler's code cache is in use.
+    * Returns VM_ERROR if no JIT compiler has been set.
+    */
+    int GetJitStats(VirtualMachine* vm, JitStats* stats);
+
     /*
     * Sets a handler function which will handle functions
     * defined by the host program.
@@ -314,6 +523,28 @@ namespace SunScript
     /* Loads a program into the virtual machine. */
     int LoadProgram(VirtualMachine* vm, unsigned char* program, unsigned char* debugData, int programSize);
 
+    /*
+    * Replaces the program of the virtual machine with a recompiled version of it.
+    * Functions are matched by name, functions whose contents are unchanged keep their
+    * JIT compiled traces and statistics, traces covering a changed function are discarded.
+    * The virtual machine must not be running or yielded.
+    * numChanged receives the number of functions which were added, changed or removed.
+    */
+    int HotSwapProgram(VirtualMachine* vm, unsigned char* program, unsigned char* debugData, int programSize, int* numChanged);
+
+    /*
+    * Gets the branch profile recorded while running the loaded program.
+    * The program must have been loaded with its debug data, which records where the branches are.
+    * Branches run by JIT compiled traces are not counted.
+    */
+    int GetBranchProfile(VirtualMachine* vm, std::vector<BranchProfile>* profile);
+
+    /* Writes a branch profile to a file so it can be used by a later build. */
+    int SaveBranchProfile(const std::string& filepath, const std::vector<BranchProfile>& profile);
+
+    /* Reads a branch profile written by SaveBranchProfile. */
+    int LoadBranchProfile(const std::string& filepath, std::vector<BranchProfile>* profile);
+
     int RunScript(VirtualMachine* vm);
 
     int RunScript(VirtualMachine* vm, std::chrono::duration<int, std::nano> timeout);
@@ -334,10 +565,14 @@ namespace SunScript
 
     int RestoreSnapshot(VirtualMachine* vm, const Snapshot& snap, int number, int ref);
 
+    int EnterTrace(VirtualMachine* vm, int id);
+
     void PushReturnValue(VirtualMachine* vm, const std::string& value);
     
     void PushReturnValue(VirtualMachine* vm, int value);
 
+    void PushReturnValue(VirtualMachine* vm, real value);
+
     int GetCallNumArgs(VirtualMachine* vm, int* numArgs);
 
     int GetCallName(VirtualMachine* vm, std::string* name);
@@ -422,8 +657,24 @@ namespace SunScript
 
     void EmitCall(ProgramBlock* program, int func, unsigned char numArgs);
 
+    void EmitTailCall(ProgramBlock* program, int func, unsigned char numArgs);
+
+    int GetProgramBlockSize(ProgramBlock* program);
+
+    void PatchFunction(ProgramBlock* program, int pos, int func);
+
+    int GetInstructionSize(ProgramBlock* program, int pos);
+
+    bool CanInlineBlock(ProgramBlock* program, int maxSize);
+
+    bool EmitInlineBlock(ProgramBlock* program, ProgramBlock* callee, int numArgs);
+
     void EmitAdd(ProgramBlock* program);
 
+    void EmitAddInt(ProgramBlock* program);
+
+    void EmitAddReal(ProgramBlock* program);
+
     void EmitSub(ProgramBlock* program);
 
     void EmitDiv(ProgramBlock* program);
@@ -436,6 +687,8 @@ namespace SunScript
 
     void EmitIncrement(ProgramBlock* program);
 
+    void EmitIncrementInt(ProgramBlock* program);
+
     void EmitDecrement(ProgramBlock* program);
 
     void MarkLabel(ProgramBlock* program, Label* label);
@@ -446,14 +699,28 @@ namespace SunScript
 
     void EmitCompare(ProgramBlock* program);
 
+    void EmitCompareInt(ProgramBlock* program);
+
     void EmitJump(ProgramBlock* program, char type, Label* label);
 
+    void EmitBranchSite(ProgramBlock* program, int site, bool sense);
+
+    void MoveCode(ProgramBlock* program, int start, ProgramBlock* dst);
+
+    void EmitJumpTable(ProgramBlock* program, unsigned char local, int min, const std::vector<Label*>& cases, Label* defaultLabel);
+
+    void EmitJumpSearch(ProgramBlock* program, unsigned char local, const std::vector<std::pair<int, Label*>>& cases, Label* defaultLabel);
+
     void EmitTableNew(ProgramBlock* program);
 
     void EmitTableGet(ProgramBlock* program);
 
     void EmitTableSet(ProgramBlock* program);
 
+    void EmitTableUpdate(ProgramBlock* program, unsigned char op);
+
+    void EmitMath(ProgramBlock* program, unsigned char fn);
+
     void EmitDup(ProgramBlock* program);
 
     void EmitDone(ProgramBlock* program);
@@ -7,6 +7,7 @@
 #include <sstream>
 #include <filesystem>
 #include <chrono>
+#include <algorithm>
 
 using namespace SunScript;
 
@@ -215,7 +216,25 @@ static int RunTest(SunTestSuite* suite, SunTest* test)
     int programSize;
     int debugSize;
     std::string compile;
-    CompileFile(test->_filename, &program, &debug, &programSize, &debugSize, &compile);
+    if (std::filesystem::is_directory(test->_filename))
+    {
+        // Each file in the directory is a module linked into the one program
+        std::vector<std::string> modules;
+        for (auto& entry : std::filesystem::directory_iterator(test->_filename))
+        {
+            if (entry.is_regular_file() && entry.path().extension() == ".txt")
+            {
+                modules.push_back(entry.path().string());
+            }
+        }
+        std::sort(modules.begin(), modules.end());
+
+        CompileFiles(modules, 0, &program, &debug, &programSize, &debugSize, &compile);
+    }
+    else
+    {
+        CompileFile(test->_filename, &program, &debug, &programSize, &debugSize, &compile);
+    }
 
     std::chrono::steady_clock clock;
     auto startTime = clock.now().time_since_epoch();
@@ -318,6 +337,10 @@ void SunScript::RunTestSuite(const std::string& path, int opts)
             {
                 suite->AddTest(entry.path().string());
             }
+            else if (entry.is_directory())
+            {
+                suite->AddTest(entry.path().string());
+            }
         }
     }
     else